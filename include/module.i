@@ -12,6 +12,13 @@
 #include "framefifo.h"
 #include "decoderthread.h"
 #include "nvthread.h"
+#include "nvmultithread.h"
+#include "nvhandoff.h"
+#include "nvreverse.h"
+#include "nvbatch.h"
+#include "nvindex.h"
+#include "nvcapture.h"
+#include "nvload.h"
 
 // https://docs.scipy.org/doc/numpy/reference/c-api.array.html#importing-the-api
 // https://github.com/numpy/numpy/issues/9309#issuecomment-311320497
@@ -219,11 +226,154 @@ public: // API <pyapi>
     void decodingOffCall();  ///< API method: pause decoding         // <pyapi>
     void requestStopCall();  ///< API method: Like Thread::stopCall() but does not block. // <pyapi>
 }; // <pyapi>
+ 
+class NVBatchDecoder { // <pyapi>
+public: // <pyapi>
+    NVBatchDecoder(const char* name, FrameFilter& outfilter, int n_sessions = 0, int gpu_index = -1); // <pyapi>
+    virtual ~NVBatchDecoder(); ///< Calls stopCall // <pyapi>
+public: // <pyapi>
+    int addFile(const char* filename); // <pyapi>
+    void startCall();                   ///< Start the sessions // <pyapi>
+    void stopCall();                    ///< Stop the sessions, leaving the rest of the queue undecoded // <pyapi>
+    bool wait(long timeout_ms = 0); // <pyapi>
+    void setCompletionWorkers(int n_workers); // <pyapi>
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+ 
+class NVCaptureFrameFilter : public FrameFilter { // <pyapi>
+public: // <pyapi>
+    NVCaptureFrameFilter(const char* name, const char* filename, FrameFilter* next = NULL); // <pyapi>
+    virtual ~NVCaptureFrameFilter(); ///< Calls close // <pyapi>
+public: // <pyapi>
+    bool isOk();                        ///< The file is open & writes have not failed // <pyapi>
+    void close();                       ///< Finish the file.  Frames after this are not recorded // <pyapi>
+    uint64_t getRecords(); // <pyapi>
+    uint64_t getBytes();                ///< Payload bytes recorded // <pyapi>
+}; // <pyapi>
+ 
+class NVCaptureReplay { // <pyapi>
+public: // <pyapi>
+    NVCaptureReplay(const char* name, FrameFilter& outfilter); // <pyapi>
+    virtual ~NVCaptureReplay(); ///< Calls close // <pyapi>
+public: // <pyapi>
+    bool open(const char* filename);            ///< Map a capture file.  Returns false if it's missing or not a capture // <pyapi>
+    void close(); // <pyapi>
+    size_t getRecords();                        ///< Records in the capture // <pyapi>
+    int getMaxSlot(); // <pyapi>
+    void play(double speed = 1.0, int n_copies = 1); // <pyapi>
+    void stop(); // <pyapi>
+    bool isPlaying();                           ///< False when stopped or at the end of the capture // <pyapi>
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+ 
+class NVHandoffFilter : public FrameFilter { // <pyapi>
+public: // <pyapi>
+    NVHandoffFilter(const char* name, int max_frames = 10, FrameFilter* next = NULL); // <pyapi>
+    virtual ~NVHandoffFilter(); // <pyapi>
+public: // <pyapi>
+    PyObject* readFrame(long timeout_ms = 0); // <pyapi>
+    void setCopy(bool copy);            ///< Copy the frames instead of passing references // <pyapi>
+    size_t size();                      ///< Queued frames // <pyapi>
+    uint64_t getDropped();              // <pyapi>
+    void clear();                       ///< Drop the queued frames // <pyapi>
+}; // <pyapi>
+ 
+class NVKeyframeIndexer { // <pyapi>
+public: // <pyapi>
+    NVKeyframeIndexer(const char* name, int thumb_width = 160, int thumb_height = 90, int gpu_index = 0); // <pyapi>
+    virtual ~NVKeyframeIndexer(); // <pyapi>
+public: // <pyapi>
+    bool build(const char* filename, const char* index_filename); // <pyapi>
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+ 
+class NVKeyframeIndex { // <pyapi>
+public: // <pyapi>
+    NVKeyframeIndex(); // <pyapi>
+    virtual ~NVKeyframeIndex(); ///< Calls close // <pyapi>
+public: // <pyapi>
+    bool open(const char* filename);                    ///< Returns false if the file is missing or not an index // <pyapi>
+    void close(); // <pyapi>
+    long size();                                        ///< Keyframes in the index // <pyapi>
+    long find(long mstimestamp);                        ///< Latest keyframe at or before the timestamp.  -1: none // <pyapi>
+    long getTimestamp(long i); // <pyapi>
+    unsigned long long getOffset(long i);               ///< See NVIndexEntry::offset // <pyapi>
+    int getThumbnailWidth(); // <pyapi>
+    int getThumbnailHeight(); // <pyapi>
+    PyObject* getThumbnail(long i);                     ///< Planar YUV420P as bytes.  None if there is none // <pyapi>
+}; // <pyapi>
+ 
+class NVLoadGenerator { // <pyapi>
+public: // <pyapi>
+    NVLoadGenerator(const char* name, int gpu_index = 0); // <pyapi>
+    virtual ~NVLoadGenerator(); // <pyapi>
+public: // <pyapi>
+    bool addClip(const char* filename); // <pyapi>
+    void setSeed(unsigned int seed);                ///< For repeatable phases & shifts // <pyapi>
+    void setTimestampShift(long max_shift_ms);      ///< Shift slots' timestamps by up to +- this.  0 (default): none // <pyapi>
+    void setThresholds(double max_latency_ms, double max_drop_ratio); // <pyapi>
+    bool run(int n_slots, long duration_ms = 10000, long warmup_ms = 2000); // <pyapi>
+    int sweep(int n_start = 1, int n_step = 1, int n_max = 256, long step_ms = 10000, long warmup_ms = 2000); // <pyapi>
+    void stop();                                    ///< Stop a run or sweep, from another thread // <pyapi>
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+ 
+class NVMultiThread { // <pyapi>
+public: // <pyapi>
+    NVMultiThread(const char* name, FrameFilter& outfilter, int gpu_index = 0, FrameFifoContext fifo_ctx=FrameFifoContext()); // <pyapi>
+    virtual ~NVMultiThread(); ///< Default destructor.  Calls stopCall // <pyapi>
+public: // <pyapi>
+    FifoFrameFilter& getFrameFilter();  ///< Write packets of all slots here // <pyapi>
+    void startCall();                   // <pyapi>
+    void stopCall();                    // <pyapi>
+    void decodingOnCall();              // <pyapi>
+    void decodingOffCall();             // <pyapi>
+    void setQuantum(int packets);       ///< Max packets per slot per scheduling round.  Default 4 // <pyapi>
+    PyObject* getStats();               ///< As NVThread::getStats // <pyapi>
+    void setParameterSets(SlotNumber n_slot, PyObject* parameter_sets); ///< As NVThread::setParameterSets // <pyapi>
+    void setMaxLatency(SlotNumber n_slot, long max_latency_ms);         ///< As NVThread::setMaxLatency, per slot // <pyapi>
+    void setOutputSuspended(SlotNumber n_slot, bool suspended);         ///< As NVThread::setOutputSuspended, per slot // <pyapi>
+}; // <pyapi>
+ 
+class NVReversePlayer { // <pyapi>
+public: // <pyapi>
+    NVReversePlayer(const char* name, FrameFilter& outfilter, int gpu_index = 0, int max_frames = 60); // <pyapi>
+    virtual ~NVReversePlayer(); // <pyapi>
+public: // <pyapi>
+    bool open(const char* filename); // <pyapi>
+    void play(long mstimestamp = 0, double speed = 1.0); // <pyapi>
+    void stop();                    ///< Stop playing & drop the decoded frames // <pyapi>
+    bool isPlaying();               ///< False when stopped or at the start of the recording // <pyapi>
+    size_t getGops();               ///< GOPs in memory // <pyapi>
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
 bool NVcuInit(); // <pyapi>
 PyObject* NVgetDevices(); // <pyapi>
+PyObject* NVgetDeviceLoads(); // <pyapi>
+void NVsetAdmission(double max_utilisation = 0.9, double mbps_per_engine = 4000000.0); // <pyapi>
+void NVsetDecoderPool(int max_idle = 4, long max_idle_ms = 60000); // <pyapi>
+PyObject* NVgetDecoderPool(); // <pyapi>
+void NVsetFramePool(long max_mb = 0, int max_idle = 4); // <pyapi>
+PyObject* NVgetFramePool(); // <pyapi>
+void NVsetConversionWorkers(int n_workers = 0); // <pyapi>
+void NVsetHugePages(bool enable = false); // <pyapi>
+void NVsetStreamingStores(bool enable = false); // <pyapi>
  
-class NVThread : public DecoderThread { // <pyapi>
+class NVThread : private NVThreadOutput, public DecoderThread { // <pyapi>
 public: // <pyapi>
     NVThread(const char* name, FrameFilter& outfilter, int gpu_index = 0, FrameFifoContext fifo_ctx=FrameFifoContext());   // <pyapi>
     virtual ~NVThread(); ///< Default destructor.  Calls AVThread::stopCall                             // <pyapi>
+public: // <pyapi>
+    PyObject* getStats(); // <pyapi>
+    void setMaxDecodeSize(unsigned width, unsigned height); // <pyapi>
+    void setParameterSets(SlotNumber n_slot, PyObject* parameter_sets); // <pyapi>
+    void setCompletionWorkers(int n_workers); // <pyapi>
+    void decodingOnCall(); // <pyapi>
+    void decodingOffCall(); // <pyapi>
+    void setGopJoin(bool enable); // <pyapi>
+    void setMaxLatency(long max_latency_ms); // <pyapi>
+    void setOutputSuspended(bool suspended); // <pyapi>
+    void setResidentFrames(int n_frames); // <pyapi>
+    bool fetchFrame(long mstimestamp, FrameFilter& filter); // <pyapi>
+    void setPlaybackSpeed(double speed); // <pyapi>
 }; // <pyapi>
@@ -0,0 +1,140 @@
+#ifndef nvbatch_HEADER_GUARD
+#define nvbatch_HEADER_GUARD
+/*
+ * nvbatch.h : Decodes lists of files offline, on all GPUs
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvbatch.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decodes lists of files offline, on all GPUs
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include "nvhandoff.h"
+#include <thread>
+#include <condition_variable>
+
+class NVPacketReader;
+
+
+/** Decodes H264 files as fast as the GPUs go
+ *
+ * Files are queued with addFile & decoded by n_sessions threads, each with its own NVDecoder.  Sessions are spread
+ * round-robin over the GPUs.  A session reads its file with NVFileReader & feeds the decoder back-to-back,
+ * without the fifos & pacing of live streams, then goes on with the next file in the queue, reusing its decoder.
+ *
+ * Frames are written to outfilter from all session threads, so outfilter must be thread safe.  The frames of a
+ * file have the slot number of the file, i.e. its place in the order of addFile calls, starting from 1.
+ * The stream is ended after each file, so that its last picture comes out with its own slot number.
+ */
+class NVBatchDecoder { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the engine
+    * @param outfilter     Decoded frames of all files are written here
+    * @param n_sessions    Decoding sessions.  0: two per NVDEC engine of all GPUs
+    * @param gpu_index     GPU to use.  -1: all of them
+    */
+    NVBatchDecoder(const char* name, FrameFilter& outfilter, int n_sessions = 0, int gpu_index = -1); // <pyapi>
+    /** Constructor with custom decoders & packet sources, e.g. for testing
+    *
+    * @param name          Name of the engine
+    * @param outfilter     Decoded frames of all files are written here
+    * @param factory       Creates the decoder of a session.  Called for its first file & when the decoder fails
+    * @param reader        Opens a file: reads its packets with the given slot number
+    * @param n_sessions    Decoding sessions
+    */
+    NVBatchDecoder(const char* name, FrameFilter& outfilter, std::function<Decoder*()> factory,
+                   std::function<NVPacketReader*(const char* filename, int n_slot)> reader, int n_sessions = 1);
+    virtual ~NVBatchDecoder(); ///< Calls stopCall // <pyapi>
+
+private:
+    struct Session {
+        Session() : decoder(NULL), gpu_index(-1) {}
+        std::thread                     thread;
+        Decoder*                        decoder;
+        int                             gpu_index;
+        std::shared_ptr<NVSlotStats>    stats;
+    };
+    struct Job {
+        std::string filename;
+        int         n_slot;
+    };
+
+private:
+    std::string                 name;
+    FrameFilter&                outfilter;
+    NVSerialFilter              serial_outfilter;   ///< outfilter, written by all sessions & their completion workers
+    int                         n_sessions;
+    int                         gpu_index;
+    std::function<Decoder*()>   factory;            ///< NULL: NVDecoders
+    std::function<NVPacketReader*(const char*, int)>
+                                reader;
+    std::atomic<int>            completion_workers; ///< see setCompletionWorkers
+    NVStatsRegistry             stats;
+    std::vector<std::unique_ptr<Session>> sessions; ///< a Session is the owner of its decoder in NVDeviceRegistry
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::deque<Job>             jobs;
+    int                         next_slot;
+    int                         busy;               ///< sessions decoding a file, until all its frames are written
+    bool                        running;
+    NVClock::time_point         start_time;
+    uint64_t                    files_done, files_failed;
+
+private:
+    Decoder* newDecoder(Session& session);
+    bool decodeFile(Session& session, const Job& job);  ///< Returns false if the file could not be decoded to the end
+    bool emit(Decoder* decoder);                        ///< Write out the decoder's output, if any.  Returns true if there was one
+    void loop(Session* session);
+
+public: // <pyapi>
+    /** Queue a file
+    *
+    * @return the slot number of the file's frames
+    */
+    int addFile(const char* filename); // <pyapi>
+    void startCall();                   ///< Start the sessions // <pyapi>
+    void stopCall();                    ///< Stop the sessions, leaving the rest of the queue undecoded // <pyapi>
+    /** Wait until all queued files are decoded
+    *
+    * The GIL is released meanwhile, so that other python threads, e.g. one calling stopCall, go on
+    *
+    * @param timeout_ms    Wait at most this long.  0: don't wait
+    * @return true if all are done
+    */
+    bool wait(long timeout_ms = 0); // <pyapi>
+    bool waitAll(long timeout_ms = 0);  ///< As wait, from C++: the GIL is not touched
+    /** Download & convert in separate threads, as NVThread::setCompletionWorkers, per session
+    *
+    * Applies to decoders created after the call, i.e. call before startCall.  Not with custom decoders
+    */
+    void setCompletionWorkers(int n_workers); // <pyapi>
+    /** Statistics as a python dict
+    *
+    * Decoder statistics as in NVThread::getStats, with "sessions", "files_queued", "files_done", "files_failed",
+    * "elapsed_s" & "fps": frames per second of all sessions together since startCall
+    */
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+
+#endif
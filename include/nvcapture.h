@@ -0,0 +1,162 @@
+#ifndef nvcapture_HEADER_GUARD
+#define nvcapture_HEADER_GUARD
+/*
+ * nvcapture.h : Records packet streams & replays them
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvcapture.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Records packet streams & replays them
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include <fstream>
+#include <thread>
+#include <condition_variable>
+
+
+/** Start of a capture file
+ *
+ * The header is followed by the records, in arrival order: an NVCaptureRecord & its payload, padded to 8 bytes.
+ * A capture cut short, e.g. by a crash, ends at its last complete record
+ */
+struct NVCaptureHeader {
+    char        magic[4];       ///< "NVPC"
+    uint32_t    version;
+    int64_t     start_ms;       ///< wall time when the capture started
+};
+
+/** A packet or stream setup in the capture file */
+struct NVCaptureRecord {
+    int64_t     mstimestamp;    ///< of the frame
+    int64_t     capture_us;     ///< arrival time since the start of the capture
+    uint32_t    payload_bytes;
+    uint32_t    codec_id;       ///< AVCodecID
+    uint16_t    n_slot;
+    uint8_t     subsession_index;
+    uint8_t     media_type;     ///< MediaType
+    uint16_t    flags;          ///< nv_capture_setup, nv_capture_keyframe
+    uint16_t    reserved;
+};
+
+static const uint16_t nv_capture_setup = 1;     ///< a stream_init SetupFrame, without payload
+static const uint16_t nv_capture_keyframe = 2;  ///< an H264 keyframe slice
+
+
+/** Records the packets going through into a capture file, with their arrival times
+ *
+ * Place in front of the input filter of NVThread or NVMultiThread, e.g. as the filter given to LiveThread.
+ * BasicFrames & stream_init SetupFrames are recorded, other frames just go on to next
+ */
+class NVCaptureFrameFilter : public FrameFilter { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the filter
+    * @param filename      Capture file, overwritten
+    * @param next          Next filter.  May be NULL
+    */
+    NVCaptureFrameFilter(const char* name, const char* filename, FrameFilter* next = NULL); // <pyapi>
+    virtual ~NVCaptureFrameFilter(); ///< Calls close // <pyapi>
+
+protected:
+    std::mutex              mutex;
+    std::ofstream           file;
+    NVClock::time_point     start_time;
+    std::atomic<uint64_t>   records, bytes;
+
+protected:
+    void go(Frame* frame);
+
+public: // <pyapi>
+    bool isOk();                        ///< The file is open & writes have not failed // <pyapi>
+    void close();                       ///< Finish the file.  Frames after this are not recorded // <pyapi>
+    uint64_t getRecords(); // <pyapi>
+    uint64_t getBytes();                ///< Payload bytes recorded // <pyapi>
+}; // <pyapi>
+
+
+/** Replays a capture file into a filter, e.g. the input filter of NVThread or NVMultiThread
+ *
+ * The file is mapped into memory.  Packets are written with the capture's timing, scaled by the speed, or as fast
+ * as possible.  Timestamps are shifted by the time between the capture & the replay, so that they look live.
+ *
+ * With fan-out, each packet is written n_copies times: copy k has the slot number n_slot + k * (max_slot + 1), where
+ * max_slot is the largest slot number in the capture.  So one camera becomes n_copies cameras of the same load.
+ *
+ * At full speed a FifoFrameFilter drops what the decoder can't take: use a blocking fifo filter to measure throughput
+ */
+class NVCaptureReplay { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the replay
+    * @param outfilter     Gets the frames, in the replaying thread
+    */
+    NVCaptureReplay(const char* name, FrameFilter& outfilter); // <pyapi>
+    virtual ~NVCaptureReplay(); ///< Calls close // <pyapi>
+
+private:
+    std::string                 name;
+    FrameFilter&                outfilter;
+    uint8_t*                    map;
+    size_t                      map_bytes;
+    const NVCaptureHeader*      header;
+    std::vector<size_t>         records;        ///< offsets
+    int                         max_slot;
+    std::thread                 thread;
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::atomic<bool>           running;
+    std::atomic<bool>           playing;
+    NVClock::time_point         start_time;
+
+public: // counters, see getStats
+    std::atomic<uint64_t>       frames, bytes;
+    std::atomic<uint64_t>       late_us;        ///< how much behind the capture's timing the latest frame was written
+
+private:
+    const NVCaptureRecord* record(size_t i);
+    bool sleepUntil(NVClock::time_point t);    ///< Returns false if stopped meanwhile
+    void loop(double speed, int n_copies);
+
+public: // <pyapi>
+    bool open(const char* filename);            ///< Map a capture file.  Returns false if it's missing or not a capture // <pyapi>
+    void close(); // <pyapi>
+    size_t getRecords();                        ///< Records in the capture // <pyapi>
+    int getMaxSlot(); // <pyapi>
+    /** Start replaying
+    *
+    * @param speed         Times the capture's speed.  0: as fast as possible
+    * @param n_copies      Fan-out, see the class description
+    */
+    void play(double speed = 1.0, int n_copies = 1); // <pyapi>
+    void stop(); // <pyapi>
+    bool isPlaying();                           ///< False when stopped or at the end of the capture // <pyapi>
+    /** Statistics as a python dict
+    *
+    * "records", "frames" & "bytes" written (all copies), "elapsed_s" since play & "late_ms"
+    */
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+
+#endif
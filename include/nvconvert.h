@@ -0,0 +1,81 @@
+#ifndef nvconvert_HEADER_GUARD
+#define nvconvert_HEADER_GUARD
+/*
+ * nvconvert.h : Host side conversion of downloaded frames
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvconvert.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Host side conversion of downloaded frames
+ */
+
+#include "valkkanv_common.h"
+
+
+/** Write the output planes with non-temporal (streaming) stores
+ *
+ * A converted frame is not read again by the converting thread, so streaming it past the CPU caches keeps
+ * the caches for others, e.g. analysis threads.  Only aligned rows are streamed (see NVFramePlanes).  Default: off
+ */
+void NVConvertStreaming(bool enable);
+bool NVConvertStreaming();
+
+/** NV12 interleaved chroma to YUV420P planes, rows row0 .. row1 - 1
+ *
+ * @param src       interleaved UV rows
+ * @param src_pitch bytes per src row
+ * @param u, v      planar output
+ * @param width     chroma samples per row (i.e. half the luma width)
+ * @param streaming use non-temporal stores
+ *
+ * Vectorized with SSE2.  With rows padded to 16 bytes (see NVFramePlanes), there's no scalar tail & the
+ * stores are aligned if the rows are
+ */
+void NVDeinterleaveRows(const uint8_t* src, unsigned src_pitch, uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+    int width, int row0, int row1, bool streaming = false);
+
+/** NV12 interleaved chroma to YUV420P planes
+ *
+ * Large frames are split into row bands over NVWorkerPool
+ */
+void NVDeinterleave(const uint8_t* src, unsigned src_pitch, uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+    int width, int height, bool streaming = false);
+
+/** Copy rows row0 .. row1 - 1 of a plane, e.g. luma
+ *
+ * @param width     bytes per row
+ * @param streaming use non-temporal stores
+ */
+void NVCopyRows(const uint8_t* src, unsigned src_pitch, uint8_t* dst, int dst_linesize, int width, int row0, int row1,
+    bool streaming = false);
+
+/** Overlaps the copies of a frame's bands with their conversion
+ *
+ * Copies of all bands are queued first.  Band k is converted as soon as its copy is done, while the later
+ * bands are still being copied, so that a frame takes about max(copy, convert) + one band instead of copy + convert.
+ *
+ * @param copy      Queue the asynchronous copy of a band.  Returns false on error
+ * @param wait      Wait until the copy of a band is done.  Returns false on error
+ * @param convert   Convert a band
+ * @return false if a copy failed.  Copies queued before the failure are waited for
+ */
+bool NVPipelineBands(int n_bands, const std::function<bool(int)>& copy, const std::function<bool(int)>& wait,
+    const std::function<void(int)>& convert);
+
+#endif
@@ -41,7 +41,15 @@
 
 #include "valkkanv_common.h"
 #include "semaring.h"
+#include "nvstats.h"
+#include "nvdevices.h"
+#include "nvqueue.h"
+#include "nvframepool.h"
+#include "nvfallback.h"
+#include "nvresident.h"
 #include <cuda.h>
+#include <thread>
+#include <condition_variable>
 #include "NvDecoder.h"
 #include "NvCodecUtils.h"
 #include "FFmpegDemuxer.h"
@@ -55,19 +63,97 @@ int CUDAAPI NVDecoder__sequenceCallback(void *obj, CUVIDEOFORMAT* pVideoFormat);
 int CUDAAPI NVDecoder__decodePicture(void* obj, CUVIDPICPARAMS* pPicParams);
 int CUDAAPI NVDecoder__displayPicture(void* obj, CUVIDPARSERDISPINFO* pDispInfo);
 
+/** H264 holds back at most this many pictures for display (the DPB): at the end of stream, all of them come out at once.
+ *  Decoders that end streams without completion workers need a ring this large (n_buf) */
+static const int nv_max_held_pictures = 16;
 
-class NVDecoder : public Decoder {
+
+/** Properties of an NVDEC session that must match when reusing it for another stream */
+struct NVSessionKey {
+    int         gpu_index;
+    AVCodecID   codec_id;
+    int         chroma_format;      ///< cudaVideoChromaFormat
+    int         bit_depth_minus8;
+    unsigned    max_width, max_height;
+    bool        shared_context;     ///< in the primary context of the GPU (see NVDecoder::setStream)
+};
+
+
+/** A decoder whose NVDEC session can be parked in NVDecoderPool & reused for another stream */
+class NVPooledSession {
 
 public:
-    NVDecoder(AVCodecID av_codec_id, int gpu_index=0, int n_buf=5);
+    virtual ~NVPooledSession() {}
+    virtual bool getSessionKey(NVSessionKey& key) = 0;  ///< Returns false if there is no working session
+    virtual bool park(const void* holder) = 0;          ///< Drop the stream, keep the session.  Returns false if not worth keeping
+    virtual void reuse(const void* owner) = 0;          ///< Start serving a new stream
+};
+
+
+/** A decoded surface, handed from the parser callbacks to the completion stage */
+struct NVPicture {
+    int             picture_index;
+    CUVIDPROCPARAMS params;
+    SlotNumber      n_slot;
+    int             subsession_index;
+    long int        mstimestamp;
+    unsigned        width, height;      ///< output size at the time of decoding
+    int             surface_height;
+    int             bit_depth_minus8;
+    unsigned        pitch;              ///< of the mapped surface.  Set by NVDecoder::download
+    uint64_t        bytes;              ///< downloaded.  Set by NVDecoder::download
+    uint64_t        copy_us;            ///< waiting for the copies.  Set by NVDecoder::download
+    uint64_t        convert_us;         ///< Set by NVDecoder::download
+    uint64_t        sequence;           ///< display order
+};
+
+
+/** Host side copy of a mapped NV12 surface, one per frame being downloaded
+ *
+ * Page-locked if possible, so that the copies are asynchronous & can overlap with the conversion.
+ * Each band of the surface has an event that tells when its copy is done
+ */
+struct NVStaging {
+    NVStaging() : data(NULL), pinned(false), pitch(0), height(0) {}
+    uint8_t*            data;           ///< luma rows followed by the interleaved chroma rows
+    bool                pinned;         ///< data from cuMemAllocHost, otherwise malloc
+    unsigned int        pitch, height;  ///< of the surface data was allocated for
+    std::vector<CUevent> events;        ///< one per band
+};
+
+
+/** Host side buffers & cuda stream of a completion worker */
+struct NVCompletionWorker {
+    std::thread     thread;
+    NVStaging       staging;
+    CUstream        stream;
+};
+
+
+class NVDecoder : public Decoder, public NVOutputSkipper, public NVOutputNotifier, public NVPooledSession {
+
+public:
+    /** Default constructor
+    *
+    * @param av_codec_id   FFmpeg codec id
+    * @param gpu_index     GPU to use.  -1 lets NVDeviceRegistry choose
+    * @param n_buf         Number of output frames
+    * @param owner         Identifies the stream in NVDeviceRegistry over reconnects.  NULL: this decoder
+    * @param shared_context    Use the primary context of the GPU instead of creating a context for this decoder
+    */
+    NVDecoder(AVCodecID av_codec_id, int gpu_index=0, int n_buf=5, const void* owner=NULL, bool shared_context=false);
     virtual ~NVDecoder();
 
 public:
     AVCodecID av_codec_id;  ///< FFmpeg AVCodecId, identifying the codec
+    bool      refused;      ///< NVDeviceRegistry admission control refused this session
 
 protected:
     bool        active;
     int         nGpu, iGpu;
+    long        session_id;     ///< NVDeviceRegistry session
+    bool        readmit;        ///< reused session: run admission control at the next sequence
+    bool        shared_context; ///< m_cuContext is the primary context of the GPU
     CUdevice    cuDevice;
     char        szDeviceName[80];
     // NvDecoder   *nv_dec;
@@ -79,11 +165,15 @@ public: // so that static callback methods can access them..
     CUcontext       cuContext;
     SemaRingBuffer  semaring;
     std::mutex      mutex;
-    std::vector<AVBitmapFrame*>  
-                    out_frame_rb;
-    uint8_t*        aux_plane;
-    unsigned int    current_pitch, current_height;
+    std::vector<std::shared_ptr<AVBitmapFrame>>
+                    out_frame_rb;   ///< leased from NVFramePool while in the ring
+    NVStaging       staging;
     unsigned long   first_timestamp;
+    bool            skip_output;    ///< see skipOutput.  Parser thread only
+    std::shared_ptr<NVResidentFrames>
+                    resident;       ///< see setResidentFrames
+    std::shared_ptr<NVSlotStats>
+                    stats;          ///< runtime statistics.  Updated without locking
 
 protected:
     CUcontext m_cuContext = NULL;
@@ -127,6 +217,18 @@ protected:
     // aux variable
     void* dstFrame = NULL;
 
+protected: // completion stage, see setCompletionWorkers
+    std::vector<NVCompletionWorker*>    workers;
+    std::unique_ptr<NVBoundedQueue<NVPicture>>
+                                        completion_queue;
+    FrameFilter*                        completion_filter;
+    std::atomic<bool>                   completion_running;
+    std::atomic<bool>                   in_flight[32];  ///< surface is queued or mapped by a worker: the parser must not decode into it
+    std::mutex                          surface_mutex;  ///< wakes up idle workers & the parser waiting for a surface
+    std::condition_variable             surface_cond;
+    NVEmitOrder                         emit_order;     ///< workers take turns in display order
+    std::function<void()>               on_emit;        ///< see setOnEmit.  Under emit_order.mutex
+
 public:
     int sequenceCallback(CUVIDEOFORMAT* pVideoFormat);
     int decodePicture(CUVIDPICPARAMS* pPicParams);
@@ -134,6 +236,29 @@ public:
 
 protected:
     int ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat);
+    bool DestroyDecoder();  ///< Destroy m_hDecoder, so that the next sequenceCallback creates a new one
+    bool CreateParser();
+    void releaseSession();  ///< Destroy the parser & cuvid decoder & close the NVDeviceRegistry session, e.g. when refused
+    void releaseFrames();   ///< Return the ring's frames to NVFramePool.  Call with the mutex held
+    int  numSurfaces(int nDecodeSurface);   ///< Decode surfaces, with extra surfaces for the completion queue
+    /** Map a decoded surface, copy it to the host, convert it into f & unmap
+    *
+    * The surface is copied into staging in bands & each band is converted as soon as it has arrived
+    * (see NVPipelineBands).  Sets pic.pitch, pic.bytes & the timings.
+    * @return cuvidDecodeStatus of the picture, -1 on a cuda error
+    */
+    int  download(NVPicture& pic, AVBitmapFrame* f, NVStaging& staging, CUstream stream);
+    /** Map a decoded surface, copy it into the resident frames & unmap
+    *
+    * @return cuvidDecodeStatus of the picture, -1 on a cuda error
+    */
+    int  keep(NVPicture& pic);
+    bool reserveStaging(NVStaging& staging, unsigned int pitch, unsigned int height);  ///< (Re)allocate for a surface.  Call with m_cuContext current
+    void freeStaging(NVStaging& staging);
+    void countStatus(int status);           ///< Count decode errors
+    void waitSurface(int picture_index);    ///< Wait until the completion stage is done with a surface
+    void completionLoop(NVCompletionWorker* worker);
+    void stopCompletion();                  ///< Stop the workers & drop the queued pictures
 
 private:
     // parameters that have to be passed somehow
@@ -145,11 +270,67 @@ private:
 public:
     virtual Frame *output();
     virtual void flush();
+    /** Decode in_frame
+    *
+    * An empty in_frame ends the stream: the parser gives out the pictures it holds back for display & with completion
+    * workers, returns once they have written out all pictures.  Without workers, they are all in the ring at once:
+    * output returns the oldest, so pull the empty in_frame again until it returns false.  Decoding can then go on with
+    * a new stream, e.g. the next file
+    */
     virtual bool pull();
     virtual void releaseOutput();
     virtual bool isOk();
     void deactivate(const char* err);
     bool CudaCall(CUresult res);
+    void setStats(std::shared_ptr<NVSlotStats> stats); ///< Share runtime statistics with NVThread.  Call before decoding
+    /** Maximum coded size that cuvidReconfigureDecoder can handle without recreating the decoder
+    *
+    * Call before decoding.  By default, the max size is the size of the first sequence.  Larger sizes reserve more device memory.
+    * Clamped to the GPU's capabilities.
+    */
+    void setMaxSize(unsigned int max_width, unsigned int max_height);
+    /** Scale the pictures to this size with the decoder's hardware scaler, e.g. for thumbnails
+    *
+    * Call before decoding.  Sizes are rounded down to even.  0, 0 (default): no scaling
+    */
+    void setResize(unsigned int width, unsigned int height);
+    virtual bool getSessionKey(NVSessionKey& key);  ///< Returns false if there is no working cuvid decoder
+    /** Prepare an idle decoder for reuse: drops the parser & pending output, keeps the context & cuvid decoder
+    *
+    * @param holder    New owner of the NVDeviceRegistry session (e.g. the pool)
+    * @return false if the decoder is not worth keeping
+    */
+    virtual bool park(const void* holder);
+    virtual void reuse(const void* owner);  ///< Start serving a new stream.  Call setStats after this
+    /** Do device to host copies in this stream instead of the default stream
+    *
+    * The stream must belong to the primary context of the GPU, so this works only with shared_context.
+    * Returns false (and the default stream stays) otherwise.  Reset when parked
+    */
+    bool setStream(CUstream stream);
+    int getGpuIndex();              ///< GPU in use.  -1 if none
+    /** Split decoding into a submit & a completion stage
+    *
+    * The parser callbacks (submit stage, in the thread calling pull) only queue the decoded surfaces.
+    * n_workers threads map, download & convert them & write the frames into outfilter, in display order.
+    * pull then never returns a frame.  0 (default) does everything in pull, as usual.
+    * If other threads write into outfilter too (e.g. setup & audio frames), serialize them with NVSerialFilter.
+    * Call before decoding.  Stopped when parked
+    */
+    void setCompletionWorkers(int n_workers, FrameFilter* outfilter);
+    /** Decode without mapping or downloading the pictures, e.g. for older pictures of a burst of cached packets
+    * or while nobody needs the output.  Counted as skipped_frames
+    *
+    * Call from the thread calling pull
+    */
+    virtual void skipOutput(bool skip);
+    virtual void discardOutput();   ///< As releaseOutput, without counting the frame as emitted
+    virtual void setOnEmit(std::function<void()> on_emit);  ///< Called by the completion workers after each frame
+    /** Keep the decoded pictures on the GPU instead of downloading them, while resident is enabled
+    *
+    * Frames are then downloaded only when fetched (NVResidentFrames::fetch) & none are passed on.  Call before decoding
+    */
+    void setResidentFrames(std::shared_ptr<NVResidentFrames> resident);
 };
 
 #endif
@@ -0,0 +1,140 @@
+#ifndef nvdevices_HEADER_GUARD
+#define nvdevices_HEADER_GUARD
+/*
+ * nvdevices.h : Process-wide registry of the decoding load on each GPU
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvdevices.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide registry of the decoding load on each GPU
+ */
+
+#include "valkkanv_common.h"
+#include "nvdriver.h"
+
+
+/** Macroblocks per second of a stream.  Unknown frame rate defaults to 25 fps */
+double NVMacroblockRate(unsigned coded_width, unsigned coded_height, unsigned fps_numerator, unsigned fps_denominator);
+
+/** Max coded size to create a decoder with: max_width x max_height (see NVDecoder::setMaxSize) grown to the sequence
+ * & kept within the GPU's caps.  If its macroblock count is still beyond the caps, the size of the sequence
+ */
+void NVDecoderMaxSize(const CUVIDDECODECAPS& caps, unsigned coded_width, unsigned coded_height, unsigned& max_width, unsigned& max_height);
+
+/** A sequence of this size can be decoded by reconfiguring a decoder created with this max size.  Otherwise, it's recreated */
+bool NVReconfigurable(unsigned coded_width, unsigned coded_height, unsigned max_width, unsigned max_height);
+
+
+/** Decoding load of a single GPU */
+struct NVDeviceLoad {
+    NVDeviceLoad(int gpu_index = 0, size_t total_bytes = 0);
+    int     gpu_index;
+    int     sessions;       ///< number of active NVDEC sessions
+    double  mbps;           ///< committed macroblocks per second
+    size_t  free_bytes;     ///< last known free device memory
+    size_t  total_bytes;    ///< total device memory
+    int     engines;        ///< number of NVDEC engines, as reported by cuvidGetDecoderCaps
+    double  budget;         ///< estimated decoding capacity in macroblocks per second.  0 = unknown
+    long    admitted;       ///< sessions admitted by admission control
+    long    refused;        ///< sessions refused by admission control
+};
+
+
+/** Keeps track of the NVDEC sessions on each GPU & places new sessions
+ *
+ * Every NVDecoder registers its session here, whether its GPU was given explicitly or not.
+ * With gpu_index = -1 the least loaded device is chosen.
+ *
+ * The load of a session is reported from NVDecoder::sequenceCallback, once the coded size and
+ * frame rate are known.  The last known load is remembered per owner (i.e. per NVThread),
+ * so that a reconnecting stream is placed with its real weight.
+ *
+ * Admission control: the decoding capacity of a device is estimated as the number of NVDEC engines
+ * times a nominal per-engine throughput.  A new session that would push the committed load of its device
+ * beyond max_utilisation times the capacity is refused (see admit).
+ *
+ * Free memory is reported by the decoders when they create their sessions & close them, and queried again when a session
+ * is released.
+ */
+class NVDeviceRegistry {
+
+public:
+    NVDeviceRegistry(NVDriver* driver = NULL);     ///< NULL: use NVDriver::get()
+    ~NVDeviceRegistry();
+
+public:
+    static NVDeviceRegistry& instance();            ///< The process-wide registry
+
+private:
+    struct Session {
+        int         gpu_index;
+        const void* owner;
+        double      mbps;
+    };
+
+private:
+    NVDriver*                       driver;
+    std::mutex                      mutex;
+    bool                            probed;
+    std::vector<NVDeviceLoad>       devices;
+    std::map<long, Session>         sessions;
+    std::map<const void*, double>   history;        ///< last known load per owner
+    long                            next_id;
+    double                          max_utilisation;    ///< admission limit as a fraction of the device budget.  <= 0 disables admission control
+    double                          mbps_per_engine;    ///< nominal throughput of one NVDEC engine
+
+private:
+    void probe();                           ///< Query the devices, if not done yet.  Call with the mutex held
+    double lastLoad(const void* owner);     ///< Last known load of an owner.  Call with the mutex held
+
+public:
+    /** Register a new session
+     *
+     * @param owner       Identifies the stream over reconnects (NVThread uses itself)
+     * @param gpu_index   GPU to use.  -1 chooses one automatically
+     * @param session_id  Set to the id of the new session
+     *
+     * @return the GPU index of the session or -1 if there are no devices
+     */
+    int  acquire(const void* owner, int gpu_index, long& session_id);
+    /** Admission control for a new session with a load of mbps macroblocks / second
+    *
+    * If admitted, the load is committed as with update.  Decisions are logged & counted per device
+    *
+    * @return true if the session may create an NVDEC decoder
+    */
+    bool admit(long session_id, double mbps);
+    void update(long session_id, double mbps);              ///< Report the load of a session
+    void reassign(long session_id, const void* owner);      ///< Hand an open session over to another owner, with zero load
+    void release(long session_id);                          ///< Session is closed.  Refreshes the free memory of its device
+    int  place(const void* owner);                          ///< The GPU that acquire would choose for owner.  -1 if there are no devices
+    void forget(const void* owner);                         ///< Drop the load history of an owner
+    void updateMemory(int gpu_index, size_t free_bytes);    ///< Report free memory, as seen by cuMemGetInfo
+    std::vector<NVDeviceLoad> getLoads();                   ///< A copy of the current loads
+    PyObject* getPyLoads();                                 ///< The current loads as a python list of dicts
+    void setAdmission(double max_utilisation, double mbps_per_engine);  ///< Configure admission control
+
+    /** Choose the device for a new session with an estimated load of mbps macroblocks / second
+     *
+     * @return index into loads or -1 if loads is empty
+     */
+    static int choose(const std::vector<NVDeviceLoad>& loads, double mbps);
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef nvdriver_HEADER_GUARD
+#define nvdriver_HEADER_GUARD
+/*
+ * nvdriver.h : Thin layer over the cuda driver queries used for resource management
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvdriver.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Thin layer over the cuda driver queries used for resource management
+ */
+
+#include "valkkanv_common.h"
+#include <cuda.h>
+#include "nvcuvid.h"
+
+
+/** Device queries used by the process-wide resource management & device memory of resident frames
+ *
+ * The default implementation talks to the cuda driver.  Tests subclass this
+ * in order to simulate a set of devices, see test/simtest.cpp
+ */
+class NVDriver {
+
+public:
+    NVDriver();
+    virtual ~NVDriver();
+
+public:
+    virtual int     getDeviceCount();                   ///< Number of cuda devices
+    virtual size_t  getTotalMemory(int gpu_index);      ///< Total memory of a device in bytes
+    virtual bool    getFreeMemory(int gpu_index, size_t& free_bytes);  ///< Free memory of a device in bytes, as cuMemGetInfo.  false if the device has no primary context
+    /** Decoder capabilities of a device
+    *
+    * caps.eCodecType, caps.eChromaFormat and caps.nBitDepthMinus8 must be set by the caller
+    */
+    virtual bool    getDecoderCaps(int gpu_index, CUVIDDECODECAPS& caps);
+
+public: // device memory, see NVResidentFrames.  A context must be current
+    virtual bool    pushContext(CUcontext context);
+    virtual void    popContext();
+    virtual bool    allocPitch(size_t width_bytes, size_t height, CUdeviceptr& ptr, size_t& pitch);
+    virtual void    freeDevice(CUdeviceptr ptr);
+    virtual bool    copy2D(const CUDA_MEMCPY2D& m, CUstream stream);    ///< Asynchronous in stream
+    virtual bool    synchronize(CUstream stream);
+
+public:
+    static NVDriver* get();                 ///< The driver in use
+    static void set(NVDriver* driver);      ///< Replace the driver with a stand-in.  NULL restores the cuda driver.  Not owned
+};
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef nvfallback_HEADER_GUARD
+#define nvfallback_HEADER_GUARD
+/*
+ * nvfallback.h : Decoder that switches from the GPU to the CPU when needed
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvfallback.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decoder that switches from the GPU to the CPU when needed
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+
+class NVResidentFrames;
+
+
+/** H264 parameter sets (SPS & PPS) per slot, kept over decoder sessions
+ *
+ * Filled by the user (e.g. from the sprop-parameter-sets of an SDP) or by NVFallbackDecoder at the end of a session.
+ * Parameter sets are in Annex B format, i.e. NAL units with start codes
+ */
+class NVParameterCache {
+
+public:
+    NVParameterCache();
+    ~NVParameterCache();
+
+private:
+    std::mutex                                  mutex;
+    std::map<int, std::vector<uint8_t>>         parameter_sets;
+
+public:
+    void set(int n_slot, const std::vector<uint8_t>& ps);      ///< Store parameter sets of a slot
+    bool get(int n_slot, std::vector<uint8_t>& ps);            ///< Parameter sets of a slot.  Returns false if there are none
+    bool getOnly(int& n_slot, std::vector<uint8_t>& ps);       ///< If there's a single slot, returns true & its parameter sets
+    void clear(int n_slot);
+    bool setPy(int n_slot, PyObject* ps);                      ///< Store a python bytes object.  None clears
+
+    /** Split Annex B data into NAL units
+    *
+    * @return start & end offsets of each NAL unit, start code included
+    */
+    static std::vector<std::pair<size_t, size_t>> split(const std::vector<uint8_t>& data);
+};
+
+
+/** Decoders that can decode pictures without producing output
+ *
+ * Used when a burst of cached packets is fed to a decoder, so that only the newest picture is downloaded
+ */
+class NVOutputSkipper {
+
+public:
+    virtual ~NVOutputSkipper() {}
+    virtual void skipOutput(bool skip) = 0;     ///< While set, decoded pictures are not passed on
+    virtual void discardOutput() = 0;           ///< As Decoder::releaseOutput, for an output that is not passed on
+};
+
+
+/** Decoders that pass frames on by themselves, from other threads
+ *
+ * E.g. NVDecoder with completion workers: its frames don't come through Decoder::releaseOutput
+ */
+class NVOutputNotifier {
+
+public:
+    virtual ~NVOutputNotifier() {}
+    virtual void setOnEmit(std::function<void()> on_emit) = 0; ///< Called after each frame passed on, from any thread.  Empty: none
+};
+
+
+/** H264 parameter sets & the packets since the latest keyframe of a stream
+ *
+ * Owned by NVFallbackDecoder or, to survive the decoder, by the decoding thread (NVThread, NVMultiThread per slot).
+ * Touched by the decoding thread only
+ */
+class NVGopCache {
+
+public:
+    /** Default constructor
+    *
+    * @param max_cached    Maximum number of packets cached since the latest keyframe
+    */
+    NVGopCache(int max_cached = 500);
+    ~NVGopCache();
+
+public:
+    BasicFrame*                 sps;
+    BasicFrame*                 pps;
+
+protected:
+    std::deque<BasicFrame*>     gop;            ///< packets since the latest keyframe
+    std::vector<BasicFrame*>    stock;          ///< recycled packets
+    bool                        gop_ok;         ///< gop starts with a keyframe
+    size_t                      max_cached;
+
+public:
+    BasicFrame* getFrame();                     ///< Packet from the stock
+    void recycle(BasicFrame* f);                ///< Packet back to stock
+    void clear();                               ///< Drop the cached packets.  Parameter sets are kept
+    void cache(BasicFrame* f);                  ///< Cache a packet
+    bool hasGop();                              ///< Is there a keyframe in the cache
+    bool isKeyframe(BasicFrame* f);             ///< f starts the cached GOP
+    void packets(std::vector<BasicFrame*>& packets);   ///< Parameter sets & cached packets, in decoding order
+};
+
+
+/** Decodes with a GPU decoder & switches to a CPU decoder if the GPU decoder goes bad
+ *
+ * The GPU decoder goes bad e.g. when admission control refuses the session (see NVDeviceRegistry::admit)
+ * or when a cuda call fails.  The failed GPU decoder is deleted, so that its NVDEC session & cuda context are released.
+ * The CPU decoder is created lazily with the fallback function (NVThread::fallbackVideoDecoder).
+ *
+ * The latest H264 parameter sets and the packets since the latest keyframe are cached (NVGopCache).  When switching,
+ * the CPU decoder is primed with them, suppressing the output of all but the newest packet.
+ *
+ * With a standby function, packets are only cached while it returns true.  When it returns false again, or at the
+ * first packet of a new NVFallbackDecoder sharing the cache of a previous one (setGopCache), the decoder is primed
+ * with the cached GOP, so that a frame comes out right away instead of at the next keyframe.
+ *
+ * With a maximum latency, packets that arrive too far behind the stream's normal pace (e.g. after a GPU hiccup,
+ * when the input fifo has backed up) are not decoded: beyond half the maximum, non-reference pictures are skipped.
+ * Beyond the maximum, all packets up to the next keyframe are dropped.  The normal latency is the smallest difference
+ * of the wall clock & the packet timestamps seen, so the camera's clock needn't be in sync.
+ *
+ * While the suspended function returns true, packets are decoded, so that the decoder stays in sync, but no frames
+ * are passed on.  Decoders that can (NVOutputSkipper) don't even download the pictures.
+ *
+ * With a playback speed (recorded footage, fed faster than real time), the cheapest way of decoding is chosen for the
+ * speed: all pictures, reference pictures only or keyframes only.  When decoding can't keep up with the packet
+ * timestamps at that speed, the next cheaper way is taken.  Ways that decode less are switched to right away, the others
+ * at the next keyframe.  Pictures fed ahead of the pace are not passed on: they are decoded for reference only, if at
+ * all.  The decoding thread never waits for the pace: the feeder is to be paced, e.g. a player reading the file
+ *
+ * With NVResidentFrames enabled, the pictures decoded on the CPU are kept in it instead of passed on, as NVDecoder
+ * keeps its pictures on the GPU, so that fetches work on either.
+ *
+ * While on the CPU, a new GPU decoder is tried at the first keyframe after every retry_ms milliseconds.
+ * It is primed with the parameter sets & the keyframe: if it stays ok, decoding continues on the GPU.
+ *
+ * With an NVParameterCache, parameter sets from a previous session or the SDP are injected ahead of the first packet,
+ * so that the NVDEC decoder is created before the first keyframe arrives.  When the cache has a single slot, this happens
+ * already in setParameterCache, i.e. when the stream is set up.  At the end of a session, the latest parameter sets
+ * are stored back into the cache.
+ */
+class NVFallbackDecoder : public Decoder {
+
+public:
+    /** Default constructor
+    *
+    * @param primary       Creates the GPU decoder.  Called at construction & when retrying.  May return NULL
+    * @param fallback      Creates the CPU decoder
+    * @param stats         Switches & CPU decoded frames are counted here
+    * @param max_cached    Maximum number of packets cached since the latest keyframe
+    * @param retry_ms      Interval of trying to get back to the GPU.  < 0 never retries
+    */
+    NVFallbackDecoder(std::function<Decoder*()> primary, std::function<Decoder*()> fallback, std::shared_ptr<NVSlotStats> stats, int max_cached = 500, long retry_ms = 10000);
+    virtual ~NVFallbackDecoder();
+
+protected:
+    Decoder*                    gpu_decoder;
+    Decoder*                    cpu_decoder;
+    Decoder*                    current;        ///< the decoder in use
+    std::function<Decoder*()>   primary;
+    std::function<Decoder*()>   fallback;
+    std::shared_ptr<NVSlotStats> stats;
+    long                        retry_ms;
+    NVClock::time_point         failed_time;    ///< when the GPU decoder last failed
+    NVClock::time_point         created_time;
+    std::atomic<bool>           first_frame;    ///< a frame has been emitted
+    std::shared_ptr<NVParameterCache> params;
+    std::function<void(Decoder*)> dispose;      ///< Disposes GPU decoders.  Default: delete
+    int                         n_slot;         ///< slot of the latest packet
+    int                         preloaded_slot; ///< parameter sets of this slot have been injected.  -1 = none
+    std::shared_ptr<NVGopCache> gop;
+    std::function<bool()>       standby;        ///< while true, packets are only cached.  Default: never
+    bool                        joined;         ///< decoding since the latest standby or since construction
+    std::atomic<bool>           joining;        ///< primed with the cached GOP & waiting for the first frame
+    std::atomic<NVClock::time_point> join_time;
+    std::function<long()>       max_latency;    ///< milliseconds behind the normal latency before catching up.  <= 0: never
+    bool                        catching_up;    ///< dropping packets up to the next keyframe
+    bool                        lag_ok;         ///< lag_base is valid
+    long                        lag_base;       ///< the normal latency, in milliseconds
+    long                        catchup_lag;    ///< latency beyond lag_base when the catch-up started
+    std::function<bool()>       suspended;      ///< while true, no output.  Default: never
+    bool                        skipping;       ///< output suspended
+    bool                        skip_output;    ///< output of in_frame not passed on: suspended or ahead of the pace
+    std::function<double()>     speed;          ///< playback speed.  <= 0: no pacing, all pictures decoded
+    int                         scrub_mode;     ///< pictures decoded: all, reference or keyframes (see nvfallback.cpp)
+    int                         scrub_floor;    ///< cheapest mode taken as decoding couldn't keep up.  Reset when the speed changes
+    double                      pace_speed;     ///< speed of the pacing base
+    bool                        pace_ok;        ///< pace_ts & pace_time are valid
+    long                        pace_ts;        ///< packet timestamp at pace_time
+    NVClock::time_point         pace_time;
+    long                        pass_ts;        ///< timestamp of the previous picture paced
+    NVClock::time_point         pass_time;      ///< when a picture was last passed on at the pace
+    bool                        early;          ///< in_frame is ahead of the pace: decoded for reference only
+    std::function<NVClock::time_point()> pace_clock;   ///< see setPaceClock
+    std::shared_ptr<NVResidentFrames> resident; ///< pictures decoded on the CPU go here instead, while enabled
+
+protected:
+    void preload(int slot);                     ///< Inject parameter sets of a slot from the NVParameterCache
+    bool prime(Decoder* decoder);               ///< Feed the cached packets to a decoder.  Returns the pull of the last packet
+    bool join();                                ///< Prime the current decoder after standby.  Returns the pull of the last packet
+    bool catchUp();                             ///< Leave in_frame undecoded to get back to real time
+    void suspend();                             ///< Follow the suspended function
+    bool scrub();                               ///< Pace in_frame to the playback speed.  Returns true if it's not to be decoded at that speed or pace
+    bool suppress(Decoder* decoder, bool got);  ///< Drop the output while suspended or resident.  Returns got, false if dropped
+    void newGpu();                              ///< Create the GPU decoder with the primary function
+    void emitted();                             ///< A frame has been passed on.  From any thread
+    void dropGpu(bool failed);                  ///< Delete the GPU decoder.  Only a decoder that has not failed goes to the disposer
+    void discard(Decoder* decoder);             ///< Release an output that is not passed on
+    bool switchToFallback(const char* reason);  ///< Returns the pull of the last cached packet
+    bool retryGpu(bool& got);                   ///< At a keyframe: try a new GPU decoder.  got is the pull of the keyframe
+
+public:
+    virtual Frame* output();
+    virtual void flush();
+    virtual bool pull();
+    virtual void releaseOutput();
+    virtual bool isOk();
+    bool onGPU();                               ///< Is the GPU decoder in use
+    void setParameterCache(std::shared_ptr<NVParameterCache> params);  ///< Use & update cached parameter sets.  Call before decoding
+    void setDisposer(std::function<void(Decoder*)> dispose);           ///< Dispose GPU decoders e.g. into NVDecoderPool instead of deleting them
+    void setGopCache(std::shared_ptr<NVGopCache> gop);                 ///< Use a cache that outlives this decoder.  Call before decoding
+    void setStandby(std::function<bool()> standby);                    ///< Cache packets without decoding while standby returns true
+    void setMaxLatency(std::function<long()> max_latency_ms);          ///< Catch up when packets are further behind than this
+    void setSuspended(std::function<bool()> suspended);                ///< Decode without output while suspended returns true
+    void setPlaybackSpeed(std::function<double()> speed);              ///< Pace & thin out decoding for playback at this speed
+    void setPaceClock(std::function<NVClock::time_point()> now);      ///< Pace to another clock than NVClock, e.g. a simulated one in tests
+    void setResidentFrames(std::shared_ptr<NVResidentFrames> resident); ///< Keep the pictures decoded on the CPU there while enabled.  The GPU decoder has its own
+};
+
+
+/** Passes packets on to another decoder, except while standby returns true
+ *
+ * E.g. the audio decoder of NVThread: the base class keeps feeding its decoders while video packets are cached for
+ * a GOP join, but nothing is decoded nor passed on until decodingOnCall.  The decoder is owned
+ */
+class NVStandbyDecoder : public Decoder {
+
+public:
+    NVStandbyDecoder(Decoder* decoder, std::function<bool()> standby);
+    virtual ~NVStandbyDecoder();
+
+private:
+    Decoder*                decoder;
+    std::function<bool()>   standby;
+
+public:
+    virtual Frame* output();
+    virtual void flush();
+    virtual bool pull();
+    virtual void releaseOutput();
+    virtual bool isOk();
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef nvfile_HEADER_GUARD
+#define nvfile_HEADER_GUARD
+/*
+ * nvfile.h : Reads the H264 packets of local files
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvfile.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Reads the H264 packets of local files
+ */
+
+#include "valkkanv_common.h"
+#include "FFmpegDemuxer.h"
+
+
+/** A source of H264 packets, e.g. a file */
+class NVPacketReader {
+
+public:
+    virtual ~NVPacketReader() {}
+    virtual bool isOk() = 0;                ///< Packets can be read
+    virtual bool read(BasicFrame& f) = 0;   ///< Next packet.  false at the end
+};
+
+
+/** Reads an H264 file with the SDK's FFmpegDemuxer & splits its access units into NAL units
+ *
+ * The NAL units come as BasicFrames, one by one, as from LiveThread.  Timestamps are the presentation timestamps of
+ * the file, in milliseconds
+ */
+class NVFileReader : public NVPacketReader {
+
+public:
+    /** Default constructor
+    *
+    * @param filename      File to read
+    * @param n_slot        Slot number of the packets
+    */
+    NVFileReader(const char* filename, int n_slot = 1);
+    virtual ~NVFileReader();
+
+protected:
+    FFmpegDemuxer*                          demuxer;    ///< NULL if the file could not be opened
+    int                                     n_slot;
+    std::vector<uint8_t>                    au;         ///< the current access unit
+    std::vector<std::pair<size_t, size_t>>  nals;       ///< of au
+    size_t                                  next_nal;
+    int64_t                                 pts;
+    uint64_t                                offset;     ///< of au in the elementary stream
+    uint64_t                                bytes;      ///< elementary stream read so far
+
+public:
+    virtual bool isOk();            ///< The file is open & it's H264
+    /** Next NAL unit
+    *
+    * @param f     Gets the NAL unit, with the timestamp of its access unit & the H264 parameters filled in
+    * @return false at the end of the file
+    */
+    virtual bool read(BasicFrame& f);
+    uint64_t getOffset();           ///< Byte offset of the latest NAL unit's access unit in the elementary stream
+    int getWidth();                 ///< Coded size.  0 if not ok
+    int getHeight();
+};
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef nvframepool_HEADER_GUARD
+#define nvframepool_HEADER_GUARD
+/*
+ * nvframepool.h : Output frames shared by all decoders
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvframepool.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Output frames shared by all decoders
+ */
+
+#include "valkkanv_common.h"
+#include "nvplanes.h"
+#include "nvstats.h"
+
+
+/** A frame of NVFramePool
+ *
+ * Knows its own lease, so that a filter downstream can keep the frame by reference instead of copying it
+ * (see NVHandoffFilter)
+ */
+class NVPooledFrame : public AVBitmapFrame {
+
+public:
+    NVPooledFrame();
+    virtual ~NVPooledFrame();
+
+public:
+    std::weak_ptr<AVBitmapFrame>    self;   ///< the current lease
+    std::shared_ptr<NVSlotStats>    stats;  ///< of the decoder that leased the frame.  May be empty
+
+public:
+    std::shared_ptr<AVBitmapFrame> share(); ///< Another reference to the current lease.  Empty if there's none
+};
+
+
+/** Decoded frames leased to the decoders for the time they're in use
+ *
+ * A decoder leases a frame when a picture is downloaded & the lease ends when the frame has been
+ * passed on (NVDecoder::releaseOutput or the completion worker).  Frames come back to their size class
+ * (frame width & height) & are leased again to any decoder, so that memory follows the frames actually in use
+ * instead of every decoder's worst case.
+ *
+ * Leases are shared pointers: the frame returns to the pool when the last copy is gone.
+ *
+ * All frames, leased & idle, count against max_bytes.  Over the cap, idle frames of other size classes are
+ * freed first, then the lease is refused & the picture dropped.  At most max_idle frames per class are kept idle.
+ */
+class NVFramePool {
+
+public:
+    NVFramePool();
+    ~NVFramePool();
+
+public:
+    static NVFramePool& instance();     ///< The process-wide pool
+
+private:
+    struct Entry {
+        NVPooledFrame   frame;
+        NVFramePlanes   planes;
+    };
+    struct SizeClass {
+        SizeClass() : frame_bytes(0), leased(0), high_water(0), leases(0), refused(0) {}
+        size_t              frame_bytes;
+        std::vector<Entry*> idle;
+        int                 leased;
+        int                 high_water;     ///< max. leased at a time
+        uint64_t            leases;
+        uint64_t            refused;        ///< leases refused by the cap
+    };
+    typedef std::pair<int, int> Key;        ///< width, height
+
+private:
+    std::mutex                  mutex;
+    std::map<Key, SizeClass>    classes;
+    size_t                      max_bytes;  ///< 0: no cap
+    int                         max_idle;   ///< per size class
+    size_t                      total_bytes;///< leased & idle
+    size_t                      peak_bytes;
+
+private:
+    void giveBack(Entry* entry, Key key);
+    /** Pick idle frames to free until bytes fit under the cap.  Call with the mutex held
+    *
+    * @return false if they don't fit even then
+    */
+    bool makeRoom(size_t bytes, std::vector<Entry*>& freed);
+
+public:
+    /** Lease a frame for a picture of width x height
+    *
+    * @param stats     Stats of the leasing decoder, for counting downstream savings
+    * @return the frame, or an empty pointer if the cap doesn't allow for one
+    */
+    std::shared_ptr<AVBitmapFrame> lease(int width, int height, std::shared_ptr<NVSlotStats> stats = nullptr);
+    /** Copy a frame into a pooled frame, e.g. to keep the output of a decoder that isn't pooled
+    *
+    * @return the copy, or an empty pointer if the cap doesn't allow for one
+    */
+    std::shared_ptr<AVBitmapFrame> copy(AVBitmapFrame* frame);
+    void configure(size_t max_bytes, int max_idle);
+    void clear();                                   ///< Free all idle frames
+    size_t getBytes();                              ///< Leased & idle
+    PyObject* getPyStats();                         ///< Totals & per size class counters as a python dict
+};
+
+#endif
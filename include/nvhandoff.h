@@ -0,0 +1,116 @@
+#ifndef nvhandoff_HEADER_GUARD
+#define nvhandoff_HEADER_GUARD
+/*
+ * nvhandoff.h : Passes decoded frames downstream by reference
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvhandoff.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Passes decoded frames downstream by reference
+ */
+
+#include "valkkanv_common.h"
+#include "nvframepool.h"
+#include <condition_variable>
+
+
+/** Passes frames on one at a time
+ *
+ * For a filter written by several threads, e.g. by a decoding thread (setup & audio frames) & the completion workers
+ * of its NVDecoders (see NVDecoder::setCompletionWorkers).  The next filter & the ones after it needn't be thread safe
+ */
+class NVSerialFilter : public FrameFilter {
+
+public:
+    NVSerialFilter(const char* name, FrameFilter* next = NULL);
+    virtual ~NVSerialFilter();
+
+protected:
+    std::mutex  mutex;
+
+protected:
+    void go(Frame* frame);
+
+public:
+    void run(Frame* frame);
+};
+
+
+/** Queue of decoded frames for a consumer thread, without copying the frames
+ *
+ * A FifoFrameFilter copies each frame into its fifo, so that every decoded pixel is written twice.  Frames of
+ * NVFramePool (i.e. from NVDecoder) are instead queued here as a reference to their lease: the consumer reads
+ * the lease & the frame goes back to the pool when the consumer drops it.  The saved bytes are counted
+ * per slot ("handoff_frames" & "copy_bytes_saved" in getStats).
+ *
+ * Other frames, e.g. from the CPU decoder, are copied into a pooled frame.  So are all frames with setCopy(true),
+ * for consumers that keep frames for long & would starve the decoders.
+ *
+ * Use as the outfilter of NVThread or NVMultiThread.  The next filter, if any, gets every frame as usual, so it
+ * should lead elsewhere (e.g. to a recorder) than to the consumer reading the queue.  When the queue is full,
+ * the oldest frame is dropped.
+ */
+class NVHandoffFilter : public FrameFilter { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the filter
+    * @param max_frames    Frames queued at most
+    * @param next          Next filter, for the frames to go on as usual.  May be NULL
+    */
+    NVHandoffFilter(const char* name, int max_frames = 10, FrameFilter* next = NULL); // <pyapi>
+    virtual ~NVHandoffFilter(); // <pyapi>
+
+protected:
+    std::mutex                                  mutex;
+    std::condition_variable                     condition;
+    std::deque<std::shared_ptr<AVBitmapFrame>>  queue;
+    size_t                                      max_frames;
+    std::atomic<bool>                           copy;       ///< copy all frames
+    std::atomic<uint64_t>                       dropped;    ///< frames dropped as the queue was full
+
+protected:
+    void go(Frame* frame);
+
+public:
+    /** Oldest queued frame, for C++ consumers.  The frame goes back to the pool when the returned pointer & its copies are gone
+    *
+    * @param timeout_ms    Wait at most this long.  0: don't wait
+    * @return the frame or an empty pointer if there was none
+    */
+    std::shared_ptr<AVBitmapFrame> read(long timeout_ms = 0);
+
+public: // <pyapi>
+    /** Oldest queued frame, for python consumers
+    *
+    * @param timeout_ms    Wait at most this long.  0: don't wait
+    * @return a dict with the YUV420 planes as bytes objects ("y", "u", "v", without line padding), "width", "height",
+    * "mstimestamp" & "n_slot", or None if there was no frame.  The planes are copies: the frame goes back to the pool at once.
+    * NULL with a python exception set if they could not be allocated
+    */
+    PyObject* readFrame(long timeout_ms = 0); // <pyapi>
+
+    void setCopy(bool copy);            ///< Copy the frames instead of passing references // <pyapi>
+    size_t size();                      ///< Queued frames // <pyapi>
+    uint64_t getDropped();              // <pyapi>
+    void clear();                       ///< Drop the queued frames // <pyapi>
+}; // <pyapi>
+
+#endif
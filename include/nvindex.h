@@ -0,0 +1,166 @@
+#ifndef nvindex_HEADER_GUARD
+#define nvindex_HEADER_GUARD
+/*
+ * nvindex.h : Keyframe index & thumbnails of recordings
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvindex.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Keyframe index & thumbnails of recordings
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include <fstream>
+
+
+/** Start of a keyframe index file
+ *
+ * The header is followed by one record per keyframe, in timestamp order: an NVIndexEntry & the thumbnail, as
+ * planar YUV420P.  Records are record_bytes apart, so the file can be mapped & searched in place
+ */
+struct NVIndexHeader {
+    char        magic[4];       ///< "NVKI"
+    uint32_t    version;
+    uint64_t    entries;
+    uint32_t    thumb_width, thumb_height;
+    uint32_t    record_bytes;
+    uint32_t    reserved;
+};
+
+/** A keyframe in the index file */
+struct NVIndexEntry {
+    int64_t     mstimestamp;
+    uint64_t    offset;         ///< of the keyframe's access unit in the elementary stream, see NVFileReader::getOffset
+    uint32_t    flags;          ///< nv_index_thumbnail if the thumbnail was decoded
+    uint32_t    reserved;
+};
+
+static const uint32_t nv_index_thumbnail = 1;
+
+
+/** Writes the keyframe index of a recording
+ *
+ * Only the keyframes & parameter sets go to the decoder, the rest of the packets is just demuxed.  NVDecoder scales the
+ * pictures to the thumbnail size with its hardware scaler.  Pictures of another size, e.g. from a CPU decoder, are
+ * scaled down by sampling.
+ *
+ * Records are written as the pictures come out of the decoder, so memory use doesn't grow with the recording
+ */
+class NVKeyframeIndexer { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the indexer
+    * @param thumb_width   Thumbnail size, rounded down to even
+    * @param thumb_height
+    * @param gpu_index     GPU to decode on
+    */
+    NVKeyframeIndexer(const char* name, int thumb_width = 160, int thumb_height = 90, int gpu_index = 0); // <pyapi>
+    virtual ~NVKeyframeIndexer(); // <pyapi>
+
+public:
+    /** Constructor with another decoder, e.g. a CPU decoder
+    *
+    * @param factory       Creates the decoder.  Called for the first keyframe & when the decoder fails
+    */
+    NVKeyframeIndexer(const char* name, std::function<Decoder*()> factory, int thumb_width = 160, int thumb_height = 90);
+
+private:
+    std::string                 name;
+    std::function<Decoder*()>   factory;
+    Decoder*                    decoder;
+    int                         thumb_width, thumb_height;
+    size_t                      record_bytes;
+    NVStatsRegistry             stats;
+    std::shared_ptr<NVSlotStats> slot_stats;
+    std::ofstream               file;
+    std::vector<uint8_t>        record;         ///< being written
+    std::deque<NVIndexEntry>    pending;        ///< keyframes decoding, waiting for their picture
+    uint64_t                    entries;        ///< written
+    long                        key_ts;         ///< of the latest keyframe
+    BasicFrame                  sps;            ///< latest
+    bool                        has_sps;
+
+public: // counters, see getStats
+    std::atomic<uint64_t>       packets, skipped_packets, keyframes, thumbnails;
+
+private:
+    void init(int thumb_width, int thumb_height);
+    bool ready();                                       ///< Create the decoder if needed.  Returns false if it fails
+    void decode(BasicFrame* f);                         ///< Decode & write the records that are done
+    void write(NVIndexEntry entry, AVBitmapFrame* f);   ///< Write a record.  f: the thumbnail or NULL
+    void scale(AVBitmapFrame* f, uint8_t* dst);         ///< Sample f into a thumbnail
+
+public:
+    bool begin(const char* index_filename);             ///< Start an index file.  Returns false if it can't be written
+    /** Add a packet of the recording, in decoding order
+    *
+    * @param offset        Of the packet's access unit
+    */
+    void addPacket(BasicFrame* f, uint64_t offset);
+    bool end();                                         ///< Write the rest of the index & close the file.  Returns false if writing failed
+
+public: // <pyapi>
+    /** Index an H264 file
+    *
+    * @return false if the file could not be read or the index written
+    */
+    bool build(const char* filename, const char* index_filename); // <pyapi>
+    /** Statistics as a python dict
+    *
+    * Decoder statistics as in NVThread::getStats, with "packets", "skipped_packets" (not decoded), "keyframes" &
+    * "thumbnails"
+    */
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+
+
+/** Reads a keyframe index file, mapped into memory */
+class NVKeyframeIndex { // <pyapi>
+
+public: // <pyapi>
+    NVKeyframeIndex(); // <pyapi>
+    virtual ~NVKeyframeIndex(); ///< Calls close // <pyapi>
+
+private:
+    uint8_t*                    map;
+    size_t                      map_bytes;
+    const NVIndexHeader*        header;
+
+private:
+    const NVIndexEntry* entry(long i);                  ///< NULL if out of range
+
+public:
+    const uint8_t* getThumbnailData(long i);            ///< Planar YUV420P.  NULL if there is none
+
+public: // <pyapi>
+    bool open(const char* filename);                    ///< Returns false if the file is missing or not an index // <pyapi>
+    void close(); // <pyapi>
+    long size();                                        ///< Keyframes in the index // <pyapi>
+    long find(long mstimestamp);                        ///< Latest keyframe at or before the timestamp.  -1: none // <pyapi>
+    long getTimestamp(long i); // <pyapi>
+    unsigned long long getOffset(long i);               ///< See NVIndexEntry::offset // <pyapi>
+    int getThumbnailWidth(); // <pyapi>
+    int getThumbnailHeight(); // <pyapi>
+    PyObject* getThumbnail(long i);                     ///< Planar YUV420P as bytes.  None if there is none // <pyapi>
+}; // <pyapi>
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef nvload_HEADER_GUARD
+#define nvload_HEADER_GUARD
+/*
+ * nvload.h : Synthetic camera load from recorded clips
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvload.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Synthetic camera load from recorded clips
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include <random>
+#include <condition_variable>
+
+
+/** A decoder under load, getting the packets of one slot */
+class NVLoadTarget {
+
+public:
+    virtual ~NVLoadTarget() {}
+    virtual FrameFilter& getFrameFilter() = 0;
+};
+
+
+/** Result of a load run */
+struct NVLoadResult {
+    int     n_slots;
+    double  input_fps;          ///< pictures fed per second, all slots
+    double  output_fps;         ///< frames decoded per second, all slots
+    double  drop_ratio;         ///< of the pictures fed, not decoded
+    double  mean_latency_ms;    ///< from feeding a picture to its frame coming out
+    double  max_latency_ms;
+    bool    ok;                 ///< within the thresholds
+};
+
+
+/** Plays clips as N cameras into decoders, to find how many cameras a machine can take
+ *
+ * Each slot gets its own decoder (an NVThread by default) & plays a clip in a loop, in real time.  With several clips,
+ * e.g. transcoded to other bitrates & resolutions, slot i plays clip i % clips.  Slots start from a random parameter
+ * set of the clip & after a random delay, so that their keyframes are not aligned.  Timestamps are rewritten to the
+ * time of feeding, optionally shifted by a random amount per slot, as from cameras with unsynchronized clocks.
+ *
+ * Latency is measured from feeding a picture to its frame coming out of the decoder & drops as the pictures fed
+ * but not decoded, after a warm-up.  sweep increases the number of slots until either goes over its threshold.
+ */
+class NVLoadGenerator { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the generator
+    * @param gpu_index     GPU of the NVThreads
+    */
+    NVLoadGenerator(const char* name, int gpu_index = 0); // <pyapi>
+    virtual ~NVLoadGenerator(); // <pyapi>
+
+public:
+    /** Constructor with other decoders
+    *
+    * @param factory       Creates the decoder of a slot, writing frames to outfilter.  Deleted at the end of each run
+    */
+    NVLoadGenerator(const char* name, std::function<NVLoadTarget*(int n_slot, FrameFilter& outfilter)> factory);
+
+private:
+    struct Clip {
+        ~Clip();
+        std::vector<BasicFrame*>    packets;    ///< timestamp & slot are rewritten as they are fed
+        std::vector<long>           times;      ///< of the packets, since the first.  Never backwards
+        std::vector<bool>           pictures;   ///< packet starts a picture
+        std::vector<size_t>         starts;     ///< packets a slot can start from: SPS
+        long                        n_pictures;
+        long                        last_slice; ///< timestamp of the latest slice.  -1: none
+        long                        duration_ms;
+    };
+    struct Slot {
+        int                     n_slot;
+        Clip*                   clip;
+        size_t                  pos;        ///< next packet
+        long                    rel_ms;     ///< time of the next packet, since the slot started
+        long                    loop_ms;    ///< clip time of the loops played
+        long                    start_ms;   ///< clip time of the first packet played
+        NVClock::time_point     start_time;
+        long                    shift_ms;
+        NVLoadTarget*           target;
+    };
+    class Meter;
+
+private:
+    std::string                 name;
+    std::function<NVLoadTarget*(int, FrameFilter&)> factory;
+    std::vector<std::unique_ptr<Clip>> clips;
+    std::mt19937                random;
+    long                        max_shift_ms;
+    double                      max_latency_ms, max_drop_ratio;
+    std::vector<NVLoadResult>   results;        ///< since the latest sweep
+    int                         max_slots;      ///< of the latest sweep.  -1: none
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::atomic<bool>           running;
+
+private:
+    void init();
+    void schedule(Slot& slot);      ///< Advance to the next packet & its time
+    NVLoadResult measure(int n_slots, long duration_ms, long warmup_ms);
+
+public:
+    int newClip();                                  ///< An empty clip.  Returns its index
+    void addPacket(int clip, BasicFrame* f);        ///< Add a packet to a clip, in decoding order.  The clip starts from the first SPS
+    std::vector<NVLoadResult> getResults();         ///< Of the runs since the latest sweep
+
+public: // <pyapi>
+    /** Add a clip from an H264 file
+    *
+    * @return false if the file could not be read, has no parameter sets or is too short
+    */
+    bool addClip(const char* filename); // <pyapi>
+    void setSeed(unsigned int seed);                ///< For repeatable phases & shifts // <pyapi>
+    void setTimestampShift(long max_shift_ms);      ///< Shift slots' timestamps by up to +- this.  0 (default): none // <pyapi>
+    /** When is a run ok
+    *
+    * @param max_latency_ms    Mean latency at most.  Default 500
+    * @param max_drop_ratio    Pictures not decoded at most.  Default 0.01
+    */
+    void setThresholds(double max_latency_ms, double max_drop_ratio); // <pyapi>
+    /** Feed n_slots slots for duration_ms
+    *
+    * The GIL is released meanwhile, so that another python thread can call stop
+    *
+    * @return true if within the thresholds
+    */
+    bool run(int n_slots, long duration_ms = 10000, long warmup_ms = 2000); // <pyapi>
+    /** Run with n_start, n_start + n_step, .. slots until the thresholds are crossed or n_max is reached
+    *
+    * The GIL is released meanwhile, as in run
+    *
+    * @return the most slots within the thresholds.  0: not even n_start
+    */
+    int sweep(int n_start = 1, int n_step = 1, int n_max = 256, long step_ms = 10000, long warmup_ms = 2000); // <pyapi>
+    bool runLoad(int n_slots, long duration_ms = 10000, long warmup_ms = 2000);    ///< As run, from C++: the GIL is not touched
+    int sweepLoad(int n_start = 1, int n_step = 1, int n_max = 256, long step_ms = 10000, long warmup_ms = 2000);  ///< As sweep, from C++
+    void stop();                                    ///< Stop a run or sweep, from another thread // <pyapi>
+    /** Results as a python dict
+    *
+    * "max_slots" & "runs": a list of dicts with "n_slots", "input_fps", "output_fps", "drop_ratio", "mean_latency_ms",
+    * "max_latency_ms" & "ok", of the runs since the latest sweep
+    */
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef nvmultithread_HEADER_GUARD
+#define nvmultithread_HEADER_GUARD
+/*
+ * nvmultithread.h : Cuda accelerated decoder thread serving many slots
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvmultithread.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Cuda accelerated decoder thread serving many slots
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include "nvfallback.h"
+#include <cuda.h>
+
+
+/** A single decoding thread for many streams
+ *
+ * Where NVThread decodes one stream, NVMultiThread multiplexes all the slots written into its FrameFifo.
+ * Decoders use the primary context of their GPU & copy frames to the host in one cuda stream per GPU,
+ * instead of a context per decoder & the default stream.
+ *
+ * Incoming packets are queued per slot.  The slots are served in rounds, each slot decoding at most
+ * quantum packets per round, so that a busy stream can't starve the others.  Within its turn, a slot's
+ * packets go to cuvidParseVideoData back-to-back.  When the queue of a slot is full, its packets are dropped
+ * up to the next keyframe (counted as "overflows" & "overflow_packets" in getStats).
+ *
+ * As with NVThread, H264 is decoded with NVDEC (with CPU fallback) & decoded frames are written into outfilter.
+ * While decoding is off, packets are cached per slot, so that decodingOnCall joins each stream at its cached GOP.
+ */
+class NVMultiThread { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name              Name of the thread
+    * @param outfilter         Outgoing frames of all slots are written here
+    * @param gpu_index         GPU to use.  -1 places each stream automatically
+    * @param fifo_ctx          Parametrization of the internal FrameFifo.  Should be sized for all the slots
+    */
+    NVMultiThread(const char* name, FrameFilter& outfilter, int gpu_index = 0, FrameFifoContext fifo_ctx=FrameFifoContext()); // <pyapi>
+    virtual ~NVMultiThread(); ///< Default destructor.  Calls stopCall // <pyapi>
+
+private:
+    struct SlotSettings {
+        SlotSettings() : max_latency(0), suspended(false) {}
+        long    max_latency;    ///< see setMaxLatency
+        bool    suspended;      ///< see setOutputSuspended
+    };
+
+    struct Slot {
+        Slot() : n_slot(0), decoder(NULL), overflow(false) {}
+        int                             n_slot;
+        Decoder*                        decoder;
+        std::deque<BasicFrame*>         queue;      ///< packets waiting for decoding
+        bool                            overflow;   ///< queue was full: packets are dropped up to the next keyframe
+        std::shared_ptr<NVSlotStats>    stats;
+        std::shared_ptr<NVGopCache>     gop;        ///< of the slot's current stream
+        SlotSettings                    settings;   ///< copy of the settings of the slot
+    };
+
+    struct GpuStream {
+        CUdevice    device;
+        CUcontext   context;    ///< primary context
+        CUstream    stream;     ///< device to host copies
+    };
+
+private:
+    std::string                 name;
+    FrameFilter&                outfilter;
+    int                         gpu_index;
+    FrameFifo                   infifo;
+    FifoFrameFilter             infilter;
+    std::thread                 thread;
+    std::atomic<bool>           running;
+    std::atomic<bool>           decoding;
+    std::atomic<int>            quantum;        ///< max packets per slot per round
+    size_t                      max_queue;      ///< max packets queued per slot
+    NVStatsRegistry             stats;
+    std::shared_ptr<NVParameterCache> parameter_sets;
+    std::mutex                  settings_mutex;
+    std::map<int, SlotSettings> settings;       ///< set from python
+    std::atomic<uint64_t>       settings_version;   ///< bumped at each change of settings
+
+private: // touched by the worker only
+    uint64_t                    settings_applied;   ///< settings_version copied to the slots
+    std::map<int, Slot>         slots;          ///< nodes are stable: a Slot is the owner of its sessions in NVDeviceRegistry
+    std::map<int, GpuStream>    streams;
+    std::vector<BasicFrame*>    stock;
+
+private:
+    void run();
+    void dispatch(Frame* f);                    ///< Route a frame from the fifo
+    void setup(int n_slot, AVCodecID codec_id); ///< (Re)create the decoder of a slot
+    void close(Slot& slot);                     ///< Delete the decoder & queued packets of a slot
+    void applySettings();                       ///< Copy settings to the slots
+    int  serve();                               ///< One round over the slots.  Returns the number of packets decoded
+    CUstream getStream(int gpu);                ///< Download stream of a GPU, created on demand
+    void releaseStreams();
+
+public: // <pyapi>
+    FifoFrameFilter& getFrameFilter();  ///< Write packets of all slots here // <pyapi>
+    void startCall();                   // <pyapi>
+    void stopCall();                    // <pyapi>
+    void decodingOnCall();              // <pyapi>
+    void decodingOffCall();             // <pyapi>
+    void setQuantum(int packets);       ///< Max packets per slot per scheduling round.  Default 4 // <pyapi>
+    PyObject* getStats();               ///< As NVThread::getStats // <pyapi>
+    void setParameterSets(SlotNumber n_slot, PyObject* parameter_sets); ///< As NVThread::setParameterSets // <pyapi>
+    void setMaxLatency(SlotNumber n_slot, long max_latency_ms);         ///< As NVThread::setMaxLatency, per slot // <pyapi>
+    void setOutputSuspended(SlotNumber n_slot, bool suspended);         ///< As NVThread::setOutputSuspended, per slot // <pyapi>
+}; // <pyapi>
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef nvplanes_HEADER_GUARD
+#define nvplanes_HEADER_GUARD
+/*
+ * nvplanes.h : Aligned plane memory for decoded frames
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvplanes.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Aligned plane memory for decoded frames
+ */
+
+#include "valkkanv_common.h"
+
+
+/** YUV420P planes of an AVBitmapFrame in one aligned block
+ *
+ * Replaces AVBitmapFrame::reserve for the frames written by NVDecoder.  Each plane starts at a
+ * plane_align byte boundary & each row is padded to a multiple of plane_align bytes, so that row kernels
+ * can use aligned vector stores all the way to the end of a row.  The padding is never read.
+ *
+ * With huge pages enabled (see NVsetHugePages), blocks of 2 MB or more are mmap'ed & advised as
+ * transparent huge pages, which saves TLB misses when a 4K frame is written.
+ *
+ * The block belongs to this object, not to the frame: the frame's AVFrame gets no buffer references, so that
+ * deleting the frame doesn't free the planes.  Keep this object alive as long as the frame is used.
+ */
+class NVFramePlanes {
+
+public:
+    NVFramePlanes();
+    ~NVFramePlanes();
+    NVFramePlanes(const NVFramePlanes&) = delete;
+    NVFramePlanes& operator=(const NVFramePlanes&) = delete;
+
+public:
+    static const int plane_align = 64;                  ///< cache line & widest vector register
+    static void setHugePages(bool enable);              ///< For blocks reserved from now on
+    static bool getHugePages();
+    static int  linesize(int width);                    ///< Row width in bytes padded to plane_align
+    static size_t bytes(int width, int height);         ///< Block size for a frame, before rounding to pages
+
+private:
+    static std::atomic<bool>    huge_pages;
+
+private:
+    uint8_t*        data;
+    size_t          size;
+    bool            mapped;         ///< mmap'ed, not posix_memalign'ed
+    int             width;
+    int             height;
+
+private:
+    bool allocate(size_t size);
+
+public:
+    /** Reserve the planes & set up the frame's payload pointers, linesizes & BitmapPars
+    *
+    * The block is kept if the frame size doesn't change
+    */
+    bool reserve(AVBitmapFrame* f, int width, int height);
+    void release();                                     ///< Free the block.  Frames using it must not be touched anymore
+    bool isHuge();                                      ///< Block is mmap'ed for huge pages
+    size_t getSize();
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef nvpool_HEADER_GUARD
+#define nvpool_HEADER_GUARD
+/*
+ * nvpool.h : Process-wide pool of idle NVDEC decoder sessions
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvpool.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide pool of idle NVDEC decoder sessions
+ */
+
+#include "valkkanv_common.h"
+#include "nvdecoder.h"
+
+
+/** Keeps decoders of closed streams alive for reuse
+ *
+ * Creating an NVDecoder costs a cuda context, a cuvid decoder & its surfaces.  When a camera reconnects,
+ * the decoder of the old connection is parked here & leased to the new one, that reconfigures it
+ * for its stream.
+ *
+ * Sessions are matched by GPU, codec, chroma format, bit depth, max size & kind of context (see NVSessionKey).
+ * Idle sessions are evicted after max_idle_ms or when there are more than max_idle of them.
+ * Parked sessions hold device memory but no load in NVDeviceRegistry.
+ */
+class NVDecoderPool {
+
+public:
+    NVDecoderPool(NVDeviceRegistry* registry = NULL);   ///< NULL: use NVDeviceRegistry::instance()
+    ~NVDecoderPool();
+
+public:
+    static NVDecoderPool& instance();   ///< The process-wide pool
+
+private:
+    struct Entry {
+        NVSessionKey        key;
+        Decoder*            decoder;
+        NVClock::time_point parked;
+    };
+
+private:
+    NVDeviceRegistry*       registry;
+    std::mutex              mutex;
+    std::deque<Entry>       idle;           ///< oldest first
+    int                     max_idle;       ///< 0 disables the pool
+    long                    max_idle_ms;
+    uint64_t                hits, misses, evictions;
+
+private:
+    void evict(std::vector<Decoder*>& evicted);    ///< Pick expired & excess sessions.  Call with the mutex held
+
+public:
+    /** Lease an idle decoder
+    *
+    * @param codec_id      Codec of the new stream
+    * @param gpu_index     GPU to use.  -1: the GPU that NVDeviceRegistry would choose
+    * @param max_width     Minimum max size of the session.  0: any
+    * @param max_height    Minimum max size of the session.  0: any
+    * @param shared_context    Session in the primary context of the GPU (NVMultiThread) or in a context of its own (NVThread)
+    * @param owner         New owner of the session in NVDeviceRegistry
+    *
+    * @return a decoder ready for setStats & decoding or NULL if there's no match.  Of the type given back, i.e. an NVDecoder
+    */
+    Decoder* lease(AVCodecID codec_id, int gpu_index, unsigned max_width, unsigned max_height, bool shared_context, const void* owner);
+    void giveBack(Decoder* decoder);                ///< Park a decoder (an NVPooledSession) or delete it if it's of no use
+    void configure(int max_idle, long max_idle_ms);
+    void clear();                                   ///< Delete all idle decoders
+    PyObject* getPyStats();                         ///< Pool counters as a python dict
+};
+
+#endif
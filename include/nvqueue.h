@@ -0,0 +1,193 @@
+#ifndef nvqueue_HEADER_GUARD
+#define nvqueue_HEADER_GUARD
+/*
+ * nvqueue.h : Bounded lock-free queue between decoding stages
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvqueue.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Bounded lock-free queue between decoding stages
+ */
+
+#include "valkkanv_common.h"
+#include <condition_variable>
+
+
+/** Bounded multi-producer multi-consumer queue
+ *
+ * Each cell carries a sequence number telling whether it's free for the producer or full for the consumer
+ * of the current lap, so that push & pop are a single compare-and-swap.  Never blocks: push fails when full
+ * and pop when empty.  Waiting, if any, is up to the caller.  The capacity is rounded up to a power of two
+ */
+template <typename T>
+class NVBoundedQueue {
+
+public:
+    NVBoundedQueue(size_t capacity) : head(0), tail(0) {
+        size_t n = 2;
+        while (n < capacity) {
+            n *= 2;
+        }
+        mask = n - 1;
+        cells = std::vector<Cell>(n);
+        for (size_t i = 0; i < n; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct Cell {
+        Cell() : sequence(0) {}
+        Cell(const Cell& other) : sequence(other.sequence.load()), value(other.value) {}
+        std::atomic<size_t> sequence;
+        T                   value;
+    };
+    std::vector<Cell>       cells;
+    size_t                  mask;
+    // producers & consumers on separate cache lines (padding: aligned new is c++17)
+    char                    pad0[64];
+    std::atomic<size_t>     head;           ///< next cell to write
+    char                    pad1[64];
+    std::atomic<size_t>     tail;           ///< next cell to read
+    char                    pad2[64];
+
+public:
+    bool push(const T& value) {  ///< Returns false if the queue is full
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(T& value) {  ///< Returns false if the queue is empty
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    size_t size() {  ///< Approximate while others push & pop
+        size_t h = head.load(std::memory_order_relaxed);
+        size_t t = tail.load(std::memory_order_relaxed);
+        return (h > t) ? h - t : 0;
+    }
+
+    size_t capacity() {
+        return mask + 1;
+    }
+};
+
+
+/** Turns of the threads passing on queued pictures, in the order the pictures were queued
+ *
+ * The queueing thread numbers each picture with next & counts it with submit once it's queued.  A worker waits for the
+ * turn of its picture with turn & ends it with done.  drain waits until all queued pictures are done, e.g. before
+ * the surfaces they use go away.  stop ends all waiting
+ */
+class NVEmitOrder {
+
+public:
+    NVEmitOrder() : submitted(0), next_emit(0), stopped(false) {}
+
+public:
+    std::mutex                  mutex;          ///< held during a turn
+    std::condition_variable     cond;
+
+private:
+    uint64_t                    submitted;      ///< pictures queued.  Queueing thread only
+    uint64_t                    next_emit;      ///< the picture whose turn it is.  Under mutex
+    bool                        stopped;        ///< under mutex
+
+public:
+    void reset() {  ///< Start over.  No workers must be running
+        std::unique_lock<std::mutex> lk(mutex);
+        submitted = 0;
+        next_emit = 0;
+        stopped = false;
+    }
+
+    uint64_t next() {  ///< Number of the picture to queue next.  Queueing thread only
+        return submitted;
+    }
+
+    void submit() {  ///< The picture is queued.  Queueing thread only
+        submitted++;
+    }
+
+    /** Wait for the turn of a picture
+    *
+    * @return the lock held for the turn: pass it to done.  If stopped, the turn never comes & the lock is held all the same
+    */
+    std::unique_lock<std::mutex> turn(uint64_t sequence) {
+        std::unique_lock<std::mutex> lk(mutex);
+        cond.wait(lk, [this, sequence]() { return next_emit == sequence || stopped; });
+        return lk;
+    }
+
+    void done(std::unique_lock<std::mutex>& lk) {  ///< End the turn taken with turn
+        next_emit++;
+        lk.unlock();
+        cond.notify_all();
+    }
+
+    void drain() {  ///< Wait until all queued pictures are done.  Queueing thread only
+        std::unique_lock<std::mutex> lk(mutex);
+        cond.wait(lk, [this]() { return next_emit == submitted || stopped; });
+    }
+
+    void stop() {
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+            stopped = true;
+        }
+        cond.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef nvresident_HEADER_GUARD
+#define nvresident_HEADER_GUARD
+/*
+ * nvresident.h : Decoded pictures kept on the GPU until asked for
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvresident.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decoded pictures kept on the GPU until asked for
+ */
+
+#include "valkkanv_common.h"
+#include "nvdriver.h"
+#include "nvframepool.h"
+#include <cuda.h>
+
+
+/** The latest decoded pictures of a stream, kept as device side copies & downloaded only when asked for
+ *
+ * NVDecoder copies each decoded surface (NV12) into the oldest of n_frames device buffers instead of
+ * downloading it.  A consumer fetches the picture closest to a timestamp: only then is it copied to the host
+ * & converted, into a frame of NVFramePool.  PCIe traffic & host memory follow the demand instead of the frame rate.
+ *
+ * Device memory belongs to the decoder's context: the decoder calls release before the context goes.
+ * Device memory is used through NVDriver, so that tests can use a stand-in.
+ *
+ * Pictures decoded on the CPU (NVFallbackDecoder) are on the host already: the latest n_frames of them are kept
+ * as pooled frames (keep) & fetched as such.
+ */
+class NVResidentFrames {
+
+public:
+    /** Default constructor
+    *
+    * @param n_frames  Pictures kept.  0: off, i.e. the decoder downloads every picture as usual
+    */
+    NVResidentFrames(int n_frames = 0);
+    ~NVResidentFrames();
+
+private:
+    struct Entry {
+        Entry() : ptr(0), pitch(0), alloc_width(0), alloc_height(0), width(0), height(0),
+            mstimestamp(0), n_slot(0), subsession_index(0), valid(false) {}
+        CUdeviceptr ptr;
+        size_t      pitch;
+        unsigned    alloc_width, alloc_height;  ///< bytes per row & rows (luma & chroma) of ptr
+        unsigned    width, height;              ///< of the picture
+        long        mstimestamp;
+        SlotNumber  n_slot;
+        int         subsession_index;
+        bool        valid;
+    };
+
+private:
+    std::mutex              mutex;
+    std::vector<Entry>      entries;
+    size_t                  next;       ///< the oldest entry, overwritten next
+    CUcontext               context;    ///< of the device memory
+    std::vector<uint8_t>    staging;    ///< host copy of a fetched picture
+    std::atomic<int>        n_frames;
+    std::deque<std::shared_ptr<AVBitmapFrame>> host_frames;    ///< pictures decoded on the CPU, newest last
+
+public:
+    std::atomic<uint64_t>   fetched;    ///< frames fetched
+    std::atomic<uint64_t>   misses;     ///< fetches with no picture
+    std::atomic<uint64_t>   fetch_bytes;///< bytes copied to the host by the fetches
+
+private:
+    void freeAll();                     ///< Free the device memory.  Call with the mutex held & the context current
+
+public:
+    bool enabled();
+    void configure(int n_frames);       ///< Resized at the next store or keep.  0: off
+    /** Copy a decoded surface into the ring.  Call with the context current
+    *
+    * @param src               mapped NV12 surface
+    * @param surface_height    luma rows of the surface, i.e. where the chroma rows start
+    */
+    bool store(CUcontext context, CUdeviceptr src, unsigned src_pitch, unsigned width, unsigned height, unsigned surface_height,
+        long mstimestamp, SlotNumber n_slot, int subsession_index, CUstream stream);
+    /** Download the picture closest to a timestamp
+    *
+    * @param mstimestamp   0: the newest picture
+    * @return the frame or an empty pointer if there's no picture (or no pooled frame)
+    */
+    std::shared_ptr<AVBitmapFrame> fetch(long mstimestamp);
+    bool keep(AVBitmapFrame* frame);    ///< Keep a copy of a picture decoded on the CPU.  Returns false if off (or no pooled frame)
+    void release(CUcontext context);    ///< Free the device memory of a context that's going away
+    int size();                         ///< Pictures kept, on the GPU & on the host
+};
+
+#endif
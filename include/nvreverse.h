@@ -0,0 +1,143 @@
+#ifndef nvreverse_HEADER_GUARD
+#define nvreverse_HEADER_GUARD
+/*
+ * nvreverse.h : Plays recordings backwards
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvreverse.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Plays recordings backwards
+ */
+
+#include "valkkanv_common.h"
+#include "nvstats.h"
+#include <thread>
+#include <condition_variable>
+
+
+/** Plays an H264 recording backwards
+ *
+ * The packets of the recording are kept in memory, compressed & indexed by GOP.  Going backwards from the wanted
+ * position, each GOP is decoded forward & its pictures are written to outfilter in reverse order.  A decoding thread
+ * prefetches the previous GOP while the current one is played.
+ *
+ * At most max_frames decoded frames are held at a time: a third is being played, a third waits & a third is being
+ * decoded.  A GOP longer than that is played in chunks: the GOP is decoded again for each chunk, from the keyframe on,
+ * & only the pictures of the chunk are kept.  The frames come from NVFramePool: decoders' output frames are kept by
+ * reference, without copying.
+ *
+ * Output is paced to the frame timestamps at the playback speed.  Frames keep their timestamps, i.e. these decrease
+ */
+class NVReversePlayer { // <pyapi>
+
+public: // <pyapi>
+    /** Default constructor
+    *
+    * @param name          Name of the player
+    * @param outfilter     Gets the frames, in the emitting thread
+    * @param gpu_index     GPU to decode on
+    * @param max_frames    Decoded frames held at most
+    */
+    NVReversePlayer(const char* name, FrameFilter& outfilter, int gpu_index = 0, int max_frames = 60); // <pyapi>
+    virtual ~NVReversePlayer(); // <pyapi>
+
+public:
+    /** Constructor with another decoder, e.g. a CPU decoder
+    *
+    * @param factory       Creates the decoder.  Called when playing starts & when the decoder fails
+    */
+    NVReversePlayer(const char* name, FrameFilter& outfilter, std::function<Decoder*()> factory, int max_frames = 60);
+
+private:
+    struct Gop {
+        size_t  begin, end;     ///< packets, from the keyframe on
+        long    sps, pps;       ///< latest parameter sets before the keyframe.  -1: none
+        long    mstimestamp;    ///< of the keyframe
+    };
+    typedef std::vector<std::shared_ptr<AVBitmapFrame>> Chunk;
+
+private:
+    std::string                 name;
+    FrameFilter&                outfilter;
+    std::function<Decoder*()>   factory;
+    Decoder*                    decoder;        ///< decoding thread only
+    size_t                      chunk_frames;   ///< frames decoded & played at a time
+    NVStatsRegistry             stats;
+    std::shared_ptr<NVSlotStats> slot_stats;
+    std::vector<BasicFrame*>    packets;
+    std::vector<Gop>            gops;
+    long                        last_sps, last_pps;
+    std::thread                 decode_thread, emit_thread;
+    std::mutex                  mutex;
+    std::condition_variable     condition;
+    std::deque<Chunk>           chunks;         ///< decoded, waiting to be played.  Empty chunk: the end
+    std::atomic<bool>           running;
+    std::atomic<bool>           playing;
+
+public: // counters, see getStats
+    std::atomic<long>           held;           ///< decoded frames in memory
+    std::atomic<long>           peak_frames;
+    std::atomic<uint64_t>       gop_passes, decoded_frames, redecoded_frames, played_frames;
+
+private:
+    void init(int max_frames);
+    bool ready();                                                   ///< Create the decoder if needed.  Returns false if it fails
+    void hold(long n);                                              ///< Count frames in or out of memory
+    /** Count a decoded picture of index n & keep it if it's in the chunk
+    *
+    * @return false if it's not counted: not a picture or after to_ms
+    */
+    bool collect(Frame* out, long to_ms, size_t n, size_t lo, bool window, std::deque<std::shared_ptr<AVBitmapFrame>>& kept);
+    /** Decode a GOP, keeping the pictures of index lo up to hi.  Pictures after to_ms are not counted
+    *
+    * @param hi            Keep the last chunk_frames pictures if SIZE_MAX
+    * @return pictures counted
+    */
+    size_t decodeGop(const Gop& gop, long to_ms, size_t lo, size_t hi, std::deque<std::shared_ptr<AVBitmapFrame>>& kept);
+    bool push(Chunk& chunk);                                        ///< Wait for room & queue a chunk.  False if stopped
+    void decodeLoop(size_t gop_index, long to_ms);
+    void emitLoop(double speed);
+
+public:
+    void addPacket(BasicFrame* f);  ///< Add a packet of the recording, in decoding order.  Not while playing
+
+public: // <pyapi>
+    /** Read the H264 packets of a file into memory, in place of the previous recording
+    *
+    * @return false if the file could not be read or it's not H264
+    */
+    bool open(const char* filename); // <pyapi>
+    /** Start playing backwards
+    *
+    * @param mstimestamp   From this timestamp.  0: from the end
+    * @param speed         Times real time.  0: as fast as possible
+    */
+    void play(long mstimestamp = 0, double speed = 1.0); // <pyapi>
+    void stop();                    ///< Stop playing & drop the decoded frames // <pyapi>
+    bool isPlaying();               ///< False when stopped or at the start of the recording // <pyapi>
+    size_t getGops();               ///< GOPs in memory // <pyapi>
+    /** Statistics as a python dict
+    *
+    * Decoder statistics as in NVThread::getStats, with "gop_passes", "decoded_frames", "redecoded_frames" (decoded but
+    * not kept, as outside the chunk), "played_frames", "held_frames" & "peak_frames"
+    */
+    PyObject* getStats(); // <pyapi>
+}; // <pyapi>
+
+#endif
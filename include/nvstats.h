@@ -0,0 +1,174 @@
+#ifndef nvstats_HEADER_GUARD
+#define nvstats_HEADER_GUARD
+/*
+ * nvstats.h : Runtime statistics for the cuda accelerated decoders
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvstats.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Runtime statistics for the cuda accelerated decoders
+ */
+
+#include "valkkanv_common.h"
+
+typedef std::chrono::steady_clock NVClock;
+
+/** Microseconds elapsed since t0 */
+inline uint64_t NVusSince(NVClock::time_point t0) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(NVClock::now() - t0).count();
+}
+
+/** Wall clock in milliseconds, as in the timestamps of frames */
+inline long NVmsNow() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+/** Accumulated timing of one processing stage
+ *
+ * There is a single writer (the decoding thread), so relaxed loads & stores
+ * are enough and no read-modify-write is needed on the hot path
+ */
+struct NVStageTime {
+    NVStageTime() : count(0), total_us(0), max_us(0) {}
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_us;
+    std::atomic<uint64_t> max_us;
+
+    void add(uint64_t us) {
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        total_us.store(total_us.load(std::memory_order_relaxed) + us, std::memory_order_relaxed);
+        if (us > max_us.load(std::memory_order_relaxed)) {
+            max_us.store(us, std::memory_order_relaxed);
+        }
+    }
+};
+
+
+/** Counters of one decoder slot
+ *
+ * Owned by NVThread and shared with the NVDecoder instance(s) decoding that slot.
+ * Counters are written by the decoding thread only & read by getStats, except for dropped_frames, decode_errors &
+ * decode_concealed, which the completion workers (see NVDecoder::setCompletionWorkers) write too: see incShared
+ */
+struct NVSlotStats {
+    NVSlotStats() : n_slot(-1), input_packets(0), input_bytes(0), decoded_pictures(0),
+        emitted_frames(0), dropped_frames(0), decode_errors(0), decode_concealed(0),
+        bytes_downloaded(0), fallback_switches(0), gpu_recoveries(0), first_frame_us(0),
+        submit_queue(0), completion_queue(0), handoff_frames(0), copy_bytes_saved(0),
+        gop_joins(0), join_packets(0), join_us(0), catchups(0), catchup_packets(0), catchup_recovered_us(0), latency_us(0), skipped_frames(0), resident_frames(0),
+        scrub_packets(0), pace_drops(0), overflows(0), overflow_packets(0) {}
+
+    std::atomic<int>        n_slot;             ///< slot number.  -1 until the first packet arrives
+    std::atomic<uint64_t>   input_packets;      ///< packets fed into cuvidParseVideoData
+    std::atomic<uint64_t>   input_bytes;        ///< bytes fed into cuvidParseVideoData
+    std::atomic<uint64_t>   decoded_pictures;   ///< pictures submitted with cuvidDecodePicture
+    std::atomic<uint64_t>   emitted_frames;     ///< frames passed downstream
+    std::atomic<uint64_t>   dropped_frames;     ///< decoded frames that never made it downstream
+    std::atomic<uint64_t>   decode_errors;      ///< cuvidGetDecodeStatus reported an error
+    std::atomic<uint64_t>   decode_concealed;   ///< cuvidGetDecodeStatus reported a concealed error
+    std::atomic<uint64_t>   bytes_downloaded;   ///< bytes copied from device to host
+    std::atomic<uint64_t>   fallback_switches;  ///< switches from GPU to CPU decoding
+    std::atomic<uint64_t>   gpu_recoveries;     ///< switches from CPU back to GPU decoding
+    std::atomic<uint64_t>   first_frame_us;     ///< from decoder creation to the first emitted frame.  0 = no frames yet
+    std::atomic<uint64_t>   submit_queue;       ///< gauge: packets waiting for the decoder (NVMultiThread)
+    std::atomic<uint64_t>   completion_queue;   ///< gauge: decoded pictures waiting for the completion workers (see NVDecoder::setCompletionWorkers)
+    std::atomic<uint64_t>   handoff_frames;     ///< frames passed downstream by reference (see NVHandoffFilter)
+    std::atomic<uint64_t>   copy_bytes_saved;   ///< pixel bytes of those frames, i.e. not copied
+    std::atomic<uint64_t>   gop_joins;          ///< decoders primed with the cached GOP (see NVFallbackDecoder::setStandby)
+    std::atomic<uint64_t>   join_packets;       ///< packets fed in those bursts
+    std::atomic<uint64_t>   join_us;            ///< from the latest burst to its frame.  0 = none yet
+    std::atomic<uint64_t>   catchups;           ///< times packets were dropped up to a keyframe to get back to real time
+    std::atomic<uint64_t>   catchup_packets;    ///< packets not decoded to catch up, non-reference pictures included
+    std::atomic<uint64_t>   catchup_recovered_us;   ///< latency got rid of by those catch-ups
+    std::atomic<uint64_t>   latency_us;         ///< gauge: packets are this far behind the stream's normal latency
+    std::atomic<uint64_t>   skipped_frames;     ///< decoded pictures not downloaded, as the output was suspended or older pictures of a GOP join
+    std::atomic<uint64_t>   resident_frames;    ///< decoded pictures kept on the GPU instead of downloaded (see NVResidentFrames)
+    std::atomic<uint64_t>   scrub_packets;      ///< packets not decoded at the playback speed (see NVFallbackDecoder::setPlaybackSpeed)
+    std::atomic<uint64_t>   pace_drops;         ///< pictures fed ahead of the playback speed, not passed on
+    std::atomic<uint64_t>   overflows;          ///< times the submit queue was full & packets were dropped up to the next keyframe (NVMultiThread)
+    std::atomic<uint64_t>   overflow_packets;   ///< packets dropped so
+    NVStageTime             parse_time;         ///< cuvidParseVideoData, including the decode & display callbacks
+    NVStageTime             copy_time;          ///< device to host copy, including stream synchronization
+    NVStageTime             convert_time;       ///< NV12 to YUV420P deinterleave
+
+    /** Increment a counter.  Single writer, so no atomic read-modify-write */
+    static void inc(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    /** Increment a counter with several writers */
+    static void incShared(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+};
+
+
+/** A plain copy of NVSlotStats, used for bookkeeping at the reader side */
+struct NVSlotSnapshot {
+    NVSlotSnapshot();
+    int         n_slot;
+    uint64_t    input_packets, input_bytes, decoded_pictures, emitted_frames, dropped_frames;
+    uint64_t    decode_errors, decode_concealed, bytes_downloaded, fallback_switches, gpu_recoveries;
+    uint64_t    first_frame_us;     ///< of the latest decoder
+    uint64_t    submit_queue, completion_queue;
+    uint64_t    handoff_frames, copy_bytes_saved;
+    uint64_t    gop_joins, join_packets;
+    uint64_t    join_us;            ///< of the latest join
+    uint64_t    catchups, catchup_packets, catchup_recovered_us;
+    uint64_t    latency_us;         ///< the worst
+    uint64_t    skipped_frames, resident_frames;
+    uint64_t    scrub_packets, pace_drops;
+    uint64_t    overflows, overflow_packets;
+    uint64_t    parse_count, parse_us, parse_max_us;
+    uint64_t    copy_count, copy_us, copy_max_us;
+    uint64_t    convert_count, convert_us, convert_max_us;
+
+    void add(const NVSlotStats& stats);
+    void add(const NVSlotSnapshot& other);
+};
+
+
+/** Collects the NVSlotStats of a single NVThread
+ *
+ * Creating slots and reading the statistics is mutex protected.  Neither happens on the hot path.
+ * Rates are averaged over the interval between two consecutive calls to getStats
+ */
+class NVStatsRegistry {
+
+public:
+    NVStatsRegistry();
+    ~NVStatsRegistry();
+
+private:
+    std::mutex mutex;
+    std::vector<std::shared_ptr<NVSlotStats>>   slots;      ///< stats in use by decoders
+    std::map<int, NVSlotSnapshot>               retired;    ///< accumulated counters of decoders that have been deleted.  Gauges are left out
+    std::map<int, NVSlotSnapshot>               previous;   ///< values at the previous getStats call
+    NVClock::time_point                         previous_time;
+
+public:
+    std::atomic<uint64_t>   decoders_created;   ///< number of NVDecoder instances created
+    std::atomic<uint64_t>   decoders_fallback;  ///< number of times an H264 stream fell back to the CPU decoder
+
+public:
+    std::shared_ptr<NVSlotStats> newSlot();     ///< Create stats for a new decoder
+    PyObject* getStats();                       ///< Python dict with per-slot and per-thread statistics.  Requires the GIL
+};
+
+#endif
@@ -26,18 +26,80 @@
  */ 
 
 #include "valkkanv_common.h"
+#include "nvstats.h"
+#include "nvfallback.h"
+#include "nvresident.h"
+#include "nvhandoff.h"
 
 bool NVcuInit(); // <pyapi>
 
 PyObject* NVgetDevices(); // <pyapi>
 
-class NVThread : public DecoderThread { // <pyapi>
+PyObject* NVgetDeviceLoads(); // <pyapi>
+
+/** Configure admission control of new NVDEC sessions
+*
+* @param max_utilisation   Refuse sessions beyond this fraction of a GPU's decoding budget.  0 disables admission control
+* @param mbps_per_engine   Nominal throughput of one NVDEC engine in macroblocks per second
+*/
+void NVsetAdmission(double max_utilisation = 0.9, double mbps_per_engine = 4000000.0); // <pyapi>
+
+/** Configure the pool of idle decoder sessions, kept for reconnecting streams
+*
+* @param max_idle      Maximum number of idle sessions.  0 disables the pool
+* @param max_idle_ms   Idle sessions are deleted after this many milliseconds
+*/
+void NVsetDecoderPool(int max_idle = 4, long max_idle_ms = 60000); // <pyapi>
+
+PyObject* NVgetDecoderPool(); // <pyapi>
+
+/** Configure the pool of decoded frames shared by all decoders
+*
+* @param max_mb        Memory cap of all frames, in use & idle, in megabytes.  0: no cap.  Over the cap, frames are dropped
+* @param max_idle      Idle frames kept per frame size
+*/
+void NVsetFramePool(long max_mb = 0, int max_idle = 4); // <pyapi>
+
+PyObject* NVgetFramePool(); // <pyapi>
+
+/** Threads shared by all decoders for converting large frames in row bands
+*
+* @param n_workers     Number of threads besides the decoding thread.  0 (default) converts in the decoding thread
+*
+* Frames are split only if they're large enough (e.g. 4K) to benefit
+*/
+void NVsetConversionWorkers(int n_workers = 0); // <pyapi>
+
+/** Back output frames of 2 MB or more (e.g. 1080p & up) with transparent huge pages
+*
+* Applies to frames reserved after the call, i.e. to new streams & size changes
+*/
+void NVsetHugePages(bool enable = false); // <pyapi>
+
+/** Write decoded frames with non-temporal stores, bypassing the CPU caches
+*
+* Keeps the last level cache for other work when many streams are decoded.  Frames read right after decoding
+* come then from memory
+*/
+void NVsetStreamingStores(bool enable = false); // <pyapi>
+
+/** Outfilter of NVThread, written by the decoding thread & the completion workers of its decoders
+*
+* A base of NVThread, so that it's constructed before & destroyed after DecoderThread, which writes into it
+*/
+struct NVThreadOutput {
+    NVThreadOutput(FrameFilter& outfilter) : serial_outfilter("serial_outfilter", &outfilter) {}
+    NVSerialFilter serial_outfilter;
+};
+
+class NVThread : private NVThreadOutput, public DecoderThread { // <pyapi>
   
 public: // <pyapi>
     /** Default constructor
     * 
     * @param name              Name of the thread
     * @param outfilter         Outgoing frames are written here.  Outgoing frames may be of type FrameType::avframe
+    * @param gpu_index         GPU to use.  -1 places the stream automatically on the least loaded GPU (re-evaluated at each reconnect)
     * @param fifo_ctx          Parametrization of the internal FrameFifo
     * 
     */
@@ -46,6 +108,108 @@ public: // <pyapi>
 
 private:
     int gpu_index;
+    NVStatsRegistry stats;
+    std::atomic<unsigned> max_width, max_height;   ///< see setMaxDecodeSize
+    std::atomic<int>    completion_workers;         ///< see setCompletionWorkers
+    std::shared_ptr<NVParameterCache> parameter_sets;
+    std::atomic<bool>   decoding;                   ///< see decodingOnCall
+    std::atomic<bool>   gop_join;                   ///< see setGopJoin
+    std::shared_ptr<NVGopCache> gop_cache;          ///< of the current stream.  Decoding thread only
+    std::atomic<long>   max_latency;                ///< see setMaxLatency
+    std::atomic<bool>   suspended;                  ///< see setOutputSuspended
+    std::shared_ptr<NVResidentFrames> resident;     ///< see setResidentFrames
+    std::atomic<double> speed;                      ///< see setPlaybackSpeed
+    void feed();                                    ///< DecoderThread's decoders get packets while decoding or caching
+
+public: // <pyapi>
+    /** Runtime statistics as a python dict
+    *
+    * Per-thread totals at the top level, per-slot statistics under key "slots".
+    * Rates are averaged over the interval since the previous call
+    */
+    PyObject* getStats(); // <pyapi>
+    /** Reserve decoders for streams up to this coded size
+    *
+    * Streams that change resolution (e.g. main/substream switching) are then reconfigured in-place.
+    * Beyond the max size, the decoder is recreated.  0, 0 (default) uses the size of the first sequence.
+    * Applies to decoders created after the call
+    */
+    void setMaxDecodeSize(unsigned width, unsigned height); // <pyapi>
+    /** H264 parameter sets of a slot, used to create the decoder before the first keyframe arrives
+    *
+    * @param n_slot            Slot number
+    * @param parameter_sets    SPS & PPS as a bytes object, in Annex B format (with start codes).  None clears
+    *
+    * Parameter sets seen during a session are remembered automatically for the next session of the same slot
+    */
+    void setParameterSets(SlotNumber n_slot, PyObject* parameter_sets); // <pyapi>
+    /** Download & convert decoded frames in separate worker threads
+    *
+    * The thread then only parses & submits packets to NVDEC, while the workers map, copy & convert the decoded
+    * surfaces & write the frames to the outfilter, in order.  Queue depths are in getStats ("completion_queue").
+    * 0 (default) does everything in this thread.  Applies to decoders created after the call
+    */
+    void setCompletionWorkers(int n_workers); // <pyapi>
+    /** Start decoding
+    *
+    * With setGopJoin (default), the decoder is primed with the packets cached since the latest keyframe,
+    * so that the first frame doesn't wait for the next keyframe
+    */
+    void decodingOnCall(); // <pyapi>
+    /** Stop decoding, audio included
+    *
+    * No frames are passed on until decodingOnCall.  With setGopJoin, video packets are cached meanwhile
+    */
+    void decodingOffCall(); // <pyapi>
+    /** Cache the packets since the latest keyframe while decoding is off
+    *
+    * At each decodingOnCall or when the decoder switches between the GPU & the CPU, the cached GOP is fed to the decoder
+    * in a burst.  Only the newest picture is downloaded & passed on.  Joins are counted in getStats ("gop_joins",
+    * "join_ms").  The cache starts over with each new stream.  When disabled, packets are dropped while decoding is off,
+    * as with DecoderThread.  Default: true
+    */
+    void setGopJoin(bool enable); // <pyapi>
+    /** Get back to real time when decoding falls behind
+    *
+    * When packets arrive more than max_latency_ms behind the stream's normal latency (e.g. the input fifo has backed up
+    * after a GPU hiccup), packets are dropped up to the next keyframe.  From half of that on, non-reference pictures are
+    * skipped.  Counted in getStats ("catchups", "catchup_packets", "catchup_recovered_ms", "latency_ms").
+    * 0 (default) never drops
+    */
+    void setMaxLatency(long max_latency_ms); // <pyapi>
+    /** Keep decoding but pass no frames on, e.g. while the stream is not on screen nor analyzed
+    *
+    * The decoded pictures are not downloaded nor converted.  The decoder stays in sync with the stream,
+    * so frames come out right away when resumed.  Counted in getStats ("skipped_frames").  Cheap to toggle
+    */
+    void setOutputSuspended(bool suspended); // <pyapi>
+    /** Keep the latest decoded pictures on the GPU & download only the ones asked for with fetchFrame
+    *
+    * @param n_frames  Pictures kept on the GPU.  0 (default): every picture is downloaded & passed on as usual
+    *
+    * While on, no frames are written to outfilter.  When decoding falls back to the CPU, the latest pictures are kept
+    * in host memory instead.  Counted in getStats ("resident_frames", "fetched_frames", "fetch_misses")
+    */
+    void setResidentFrames(int n_frames); // <pyapi>
+    /** Download the kept picture closest to a timestamp & write it into a filter, in the calling thread
+    *
+    * @param mstimestamp   Wanted timestamp.  0: the latest picture
+    * @param filter        Gets the frame
+    * @return false if there was no picture
+    */
+    bool fetchFrame(long mstimestamp, FrameFilter& filter); // <pyapi>
+    /** Play recorded footage at a speed, e.g. for scrubbing at 8x - 32x
+    *
+    * The input, e.g. packets read from a file, is fed at this speed.  The cheapest way of decoding is chosen for the
+    * speed: all pictures up to 2x, reference pictures only up to 8x & keyframes only beyond.  When decoding falls
+    * behind the packet timestamps at this speed, the next cheaper way is taken.  Pictures fed faster than the speed
+    * are dropped: the decoder doesn't wait for the pace.  Counted in getStats ("scrub_packets", "pace_drops").
+    * 0 (default) decodes everything as it comes, as for live streams
+    */
+    void setPlaybackSpeed(double speed); // <pyapi>
+
+public:
+    std::shared_ptr<AVBitmapFrame> fetch(long mstimestamp);    ///< As fetchFrame.  Empty if there was no picture
 
 protected:
     virtual Decoder* chooseAudioDecoder(AVCodecID codec_id);
@@ -0,0 +1,94 @@
+#ifndef nvworkers_HEADER_GUARD
+#define nvworkers_HEADER_GUARD
+/*
+ * nvworkers.h : Process-wide pool of worker threads for splitting frame conversions
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvworkers.h
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide pool of worker threads for splitting frame conversions
+ */
+
+#include "valkkanv_common.h"
+#include <thread>
+#include <condition_variable>
+#include <shared_mutex>
+
+
+/** Worker threads shared by all decoders, for splitting a frame's work into row bands
+ *
+ * Each worker has its own task deque.  run distributes the bands over the deques & works on them itself,
+ * too.  Idle workers steal from the others' deques, so that a worker delayed by one decoder's bands
+ * doesn't hold back another decoder's.
+ *
+ * With 0 workers (default) everything runs in the calling thread.
+ */
+class NVWorkerPool {
+
+public:
+    NVWorkerPool();
+    ~NVWorkerPool();
+
+public:
+    static NVWorkerPool& instance();    ///< The process-wide pool
+
+private:
+    struct Task {
+        const std::function<void(int)>*  fn;
+        int                             band;
+        std::atomic<int>*               remaining;  ///< bands of this run not yet done
+    };
+    struct Queue {
+        std::mutex          mutex;
+        std::deque<Task>    tasks;
+    };
+
+private:
+    std::shared_timed_mutex         config_mutex;   ///< run: shared, configure: exclusive
+    std::vector<std::unique_ptr<Queue>> queues;     ///< one per worker
+    std::vector<std::thread>        threads;
+    std::mutex                      mutex;          ///< for sleeping workers
+    std::condition_variable         condition;
+    std::atomic<int>                pending;        ///< tasks in the queues
+    std::atomic<unsigned>           next_queue;     ///< round-robin start of the next run
+    bool                            running;        ///< under mutex
+
+private:
+    bool take(int index, Task& task);   ///< From queue index (own end) or any other queue (other end).  index -1: any
+    void execute(Task& task);
+    void loop(int index);
+    void stop();
+
+public:
+    void configure(int n_workers);      ///< Restart with n_workers threads.  0: no threads
+    int  getWorkers();
+    /** Number of row bands for splitting rows x row_bytes of work
+    *
+    * Bands are at least min_band_bytes each, so that small frames are not split at all.
+    * Never more than workers + 1, the calling thread included
+    */
+    int  bands(int rows, size_t row_bytes);
+    /** Call fn(band) for band = 0 .. n_bands - 1 & return when all are done
+    *
+    * The calling thread does its share.  Concurrent calls from several threads are ok
+    */
+    void run(int n_bands, const std::function<void(int)>& fn);
+};
+
+#endif
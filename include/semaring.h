@@ -22,6 +22,7 @@ public:
     void reset();
     int write();
     int read();
+    int peek();         ///< index the next read returns, -1 if there's nothing to read
     int getIndex();
     bool isEmpty();
 };
@@ -36,7 +36,12 @@
 #include <assert.h>
 #include <stdint.h>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
+#include <map>
+#include <deque>
+#include <functional>
 #include <string>
 #include <sstream>
 #include <string.h>
@@ -0,0 +1,260 @@
+/*
+ * nvbatch.cpp : Decodes lists of files offline, on all GPUs
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvbatch.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decodes lists of files offline, on all GPUs
+ */
+
+#include "nvbatch.h"
+#include "nvdecoder.h"
+#include "nvdevices.h"
+#include "nvfile.h"
+
+
+NVBatchDecoder::NVBatchDecoder(const char* name, FrameFilter& outfilter, int n_sessions, int gpu_index) :
+    name(name), outfilter(outfilter), serial_outfilter("serial_outfilter", &outfilter), n_sessions(n_sessions), gpu_index(gpu_index), completion_workers(0),
+    next_slot(1), busy(0), running(false), start_time(NVClock::now()), files_done(0), files_failed(0) {
+}
+
+
+NVBatchDecoder::NVBatchDecoder(const char* name, FrameFilter& outfilter, std::function<Decoder*()> factory,
+                               std::function<NVPacketReader*(const char*, int)> reader, int n_sessions) :
+    name(name), outfilter(outfilter), serial_outfilter("serial_outfilter", &outfilter), n_sessions(std::max(1, n_sessions)), gpu_index(-1),
+    factory(factory), reader(reader), completion_workers(0),
+    next_slot(1), busy(0), running(false), start_time(NVClock::now()), files_done(0), files_failed(0) {
+}
+
+
+NVBatchDecoder::~NVBatchDecoder() {
+    stopCall();
+}
+
+
+Decoder* NVBatchDecoder::newDecoder(Session& session) {
+    if (factory) {
+        stats.decoders_created++;
+        return factory();
+    }
+    // the ring holds one less than its size
+    NVDecoder* decoder = new NVDecoder(AV_CODEC_ID_H264, session.gpu_index, nv_max_held_pictures + 2, &session);
+    decoder->setStats(session.stats);
+    decoder->setCompletionWorkers(completion_workers, &serial_outfilter);
+    stats.decoders_created++;
+    return decoder;
+}
+
+
+bool NVBatchDecoder::emit(Decoder* decoder) {
+    if (!decoder->pull()) {
+        return false;
+    }
+    Frame* out = decoder->output();
+    if (out) {
+        serial_outfilter.run(out);
+    }
+    decoder->releaseOutput();
+    return true;
+}
+
+
+bool NVBatchDecoder::decodeFile(Session& session, const Job& job) {
+    std::unique_ptr<NVPacketReader> packets(reader ? reader(job.filename.c_str(), job.n_slot) : new NVFileReader(job.filename.c_str(), job.n_slot));
+    if (!packets || !packets->isOk()) {
+        return false;
+    }
+    if (session.decoder && !session.decoder->isOk()) {
+        delete session.decoder;
+        session.decoder = NULL;
+    }
+    if (!session.decoder) {
+        session.decoder = newDecoder(session);
+    }
+    Decoder* decoder = session.decoder;
+    decoder->flush(); // output left over from a file given up midway
+    BasicFrame f;
+    while (packets->read(f)) {
+        {// PROTECTED
+            std::unique_lock<std::mutex> lk(mutex);
+            if (!running) {
+                return false;
+            }
+        }
+        decoder->input(&f);
+        emit(decoder);
+        if (!decoder->isOk()) {
+            decoderlogger.log(LogLevel::normal) << "NVBatchDecoder: " << name << ": decoder failed on " << job.filename << std::endl;
+            return false;
+        }
+    }
+    // end of stream: the parser gives out the pictures held back for display (with the slot of the file) & the workers
+    // catch up.  They're all there after the first pull: the end of stream is pulled again until none is left
+    f.payload.clear();
+    f.n_slot = job.n_slot;
+    decoder->input(&f);
+    for (int i = 0; i <= nv_max_held_pictures && emit(decoder); i++) {
+    }
+    return decoder->isOk();
+}
+
+
+void NVBatchDecoder::loop(Session* session) {
+    while (true) {
+        Job job;
+        {// PROTECTED
+            std::unique_lock<std::mutex> lk(mutex);
+            condition.wait(lk, [this]() { return !jobs.empty() || !running; });
+            if (!running) {
+                break;
+            }
+            job = jobs.front();
+            jobs.pop_front();
+            busy++;
+        }
+        bool ok = decodeFile(*session, job);
+        decoderlogger.log(LogLevel::debug) << "NVBatchDecoder: " << name << ": " << job.filename << (ok ? " done" : " failed") << std::endl;
+        {// PROTECTED
+            std::unique_lock<std::mutex> lk(mutex);
+            busy--;
+            if (ok) {
+                files_done++;
+            }
+            else {
+                files_failed++;
+            }
+            condition.notify_all();
+        }
+    }
+    if (session->decoder) {
+        delete session->decoder;
+        session->decoder = NULL;
+    }
+}
+
+
+int NVBatchDecoder::addFile(const char* filename) {
+    std::unique_lock<std::mutex> lk(mutex);
+    Job job;
+    job.filename = filename;
+    job.n_slot = next_slot++;
+    jobs.push_back(job);
+    condition.notify_all();
+    return job.n_slot;
+}
+
+
+void NVBatchDecoder::startCall() {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        if (running) {
+            return;
+        }
+        running = true;
+        start_time = NVClock::now();
+    }
+    std::vector<NVDeviceLoad> loads = NVDeviceRegistry::instance().getLoads();
+    int n = n_sessions;
+    if (n <= 0) {
+        for (auto it = loads.begin(); it != loads.end(); ++it) {
+            n += 2 * std::max(1, it->engines);
+        }
+    }
+    n = std::max(1, n);
+    for (int i = 0; i < n; i++) {
+        Session* session = new Session();
+        // spread explicitly: a new session has no load yet, so automatic placement would stack them on one GPU
+        session->gpu_index = (gpu_index >= 0 || loads.empty()) ? gpu_index : loads[i % loads.size()].gpu_index;
+        session->stats = stats.newSlot();
+        sessions.push_back(std::unique_ptr<Session>(session));
+    }
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        (*it)->thread = std::thread(&NVBatchDecoder::loop, this, it->get());
+    }
+    decoderlogger.log(LogLevel::debug) << "NVBatchDecoder: " << name << ": " << n << " sessions" << std::endl;
+}
+
+
+void NVBatchDecoder::stopCall() {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        running = false;
+        condition.notify_all();
+    }
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        if ((*it)->thread.joinable()) {
+            (*it)->thread.join();
+        }
+        NVDeviceRegistry::instance().forget(it->get());
+    }
+    sessions.clear();
+}
+
+
+bool NVBatchDecoder::wait(long timeout_ms) {
+    bool done;
+    Py_BEGIN_ALLOW_THREADS // other python threads, e.g. the outfilter's, go on meanwhile
+    done = waitAll(timeout_ms);
+    Py_END_ALLOW_THREADS
+    return done;
+}
+
+
+bool NVBatchDecoder::waitAll(long timeout_ms) {
+    std::unique_lock<std::mutex> lk(mutex);
+    auto done = [this]() { return jobs.empty() && busy == 0; };
+    if (timeout_ms > 0) {
+        return condition.wait_for(lk, std::chrono::milliseconds(timeout_ms), done);
+    }
+    return done();
+}
+
+
+void NVBatchDecoder::setCompletionWorkers(int n_workers) {
+    completion_workers = std::max(0, n_workers);
+}
+
+
+PyObject* NVBatchDecoder::getStats() {
+    PyObject* dic = stats.getStats();
+    PyObject* value;
+    uint64_t frames = 0;
+    int n;
+    size_t queued;
+    uint64_t done, failed;
+    double elapsed;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+            frames += (*it)->stats->emitted_frames.load(std::memory_order_relaxed);
+        }
+        n = (int)sessions.size();
+        queued = jobs.size();
+        done = files_done;
+        failed = files_failed;
+        elapsed = NVusSince(start_time) / 1e6;
+    }
+    value = PyLong_FromLong(n);                         PyDict_SetItemString(dic, "sessions", value);      Py_DECREF(value);
+    value = PyLong_FromSize_t(queued);                  PyDict_SetItemString(dic, "files_queued", value);  Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(done);          PyDict_SetItemString(dic, "files_done", value);    Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(failed);        PyDict_SetItemString(dic, "files_failed", value);  Py_DECREF(value);
+    value = PyFloat_FromDouble(elapsed);                PyDict_SetItemString(dic, "elapsed_s", value);     Py_DECREF(value);
+    value = PyFloat_FromDouble(elapsed > 0 ? frames / elapsed : 0.);  PyDict_SetItemString(dic, "fps", value);  Py_DECREF(value);
+    return dic;
+}
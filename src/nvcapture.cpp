@@ -0,0 +1,301 @@
+/*
+ * nvcapture.cpp : Records packet streams & replays them
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvcapture.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Records packet streams & replays them
+ */
+
+#include "nvcapture.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char     capture_magic[4] = {'N', 'V', 'P', 'C'};
+static const uint32_t capture_version = 1;
+
+static size_t padded(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+
+NVCaptureFrameFilter::NVCaptureFrameFilter(const char* name, const char* filename, FrameFilter* next) :
+    FrameFilter(name, next), start_time(NVClock::now()), records(0), bytes(0) {
+    file.open(filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        decoderlogger.log(LogLevel::normal) << "NVCaptureFrameFilter: can't write " << filename << std::endl;
+        return;
+    }
+    NVCaptureHeader header = {};
+    memcpy(header.magic, capture_magic, sizeof(capture_magic));
+    header.version = capture_version;
+    header.start_ms = NVmsNow();
+    file.write((const char*)&header, sizeof(header));
+}
+
+
+NVCaptureFrameFilter::~NVCaptureFrameFilter() {
+    close();
+}
+
+
+void NVCaptureFrameFilter::go(Frame* frame) {
+    NVCaptureRecord r = {};
+    const uint8_t* payload = NULL;
+    if (frame->getFrameType() == FrameType::basicframe) {
+        BasicFrame* f = static_cast<BasicFrame*>(frame);
+        r.payload_bytes = (uint32_t)f->payload.size();
+        r.codec_id = (uint32_t)f->codec_id;
+        r.media_type = (uint8_t)f->media_type;
+        if (f->codec_id == AV_CODEC_ID_H264 && f->h264_pars.slice_type == H264SliceType::i) {
+            r.flags |= nv_capture_keyframe;
+        }
+        payload = f->payload.data();
+    }
+    else if (frame->getFrameType() == FrameType::setupframe) {
+        SetupFrame* f = static_cast<SetupFrame*>(frame);
+        if (f->sub_type != SetupFrameType::stream_init) {
+            return;
+        }
+        r.codec_id = (uint32_t)f->codec_id;
+        r.media_type = (uint8_t)f->media_type;
+        r.flags |= nv_capture_setup;
+    }
+    else {
+        return;
+    }
+    r.mstimestamp = frame->mstimestamp;
+    r.n_slot = (uint16_t)frame->n_slot;
+    r.subsession_index = (uint8_t)frame->subsession_index;
+    static const char zeros[8] = {0};
+    std::unique_lock<std::mutex> lk(mutex);
+    if (!file.is_open()) {
+        return;
+    }
+    r.capture_us = (int64_t)NVusSince(start_time);
+    file.write((const char*)&r, sizeof(r));
+    if (r.payload_bytes > 0) {
+        file.write((const char*)payload, r.payload_bytes);
+        file.write(zeros, padded(r.payload_bytes) - r.payload_bytes);
+    }
+    records++;
+    bytes += r.payload_bytes;
+}
+
+
+bool NVCaptureFrameFilter::isOk() {
+    std::unique_lock<std::mutex> lk(mutex);
+    return file.is_open() && file.good();
+}
+
+
+void NVCaptureFrameFilter::close() {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (file.is_open()) {
+        file.close();
+    }
+}
+
+
+uint64_t NVCaptureFrameFilter::getRecords() {
+    return records;
+}
+
+
+uint64_t NVCaptureFrameFilter::getBytes() {
+    return bytes;
+}
+
+
+NVCaptureReplay::NVCaptureReplay(const char* name, FrameFilter& outfilter) :
+    name(name), outfilter(outfilter), map(NULL), map_bytes(0), header(NULL), max_slot(0),
+    running(false), playing(false), start_time(NVClock::now()), frames(0), bytes(0), late_us(0) {
+}
+
+
+NVCaptureReplay::~NVCaptureReplay() {
+    close();
+}
+
+
+bool NVCaptureReplay::open(const char* filename) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NVCaptureHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping stays
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    map = (uint8_t*)p;
+    map_bytes = st.st_size;
+    header = (const NVCaptureHeader*)map;
+    if (memcmp(header->magic, capture_magic, sizeof(capture_magic)) != 0 || header->version != capture_version) {
+        decoderlogger.log(LogLevel::normal) << "NVCaptureReplay: open: " << filename << " is not a capture" << std::endl;
+        close();
+        return false;
+    }
+    size_t pos = sizeof(NVCaptureHeader);
+    while (pos + sizeof(NVCaptureRecord) <= map_bytes) {
+        const NVCaptureRecord* r = (const NVCaptureRecord*)(map + pos);
+        if (pos + sizeof(NVCaptureRecord) + r->payload_bytes > map_bytes) { // cut short
+            break;
+        }
+        records.push_back(pos);
+        max_slot = std::max(max_slot, (int)r->n_slot);
+        pos += sizeof(NVCaptureRecord) + padded(r->payload_bytes);
+    }
+    decoderlogger.log(LogLevel::debug) << "NVCaptureReplay: open: " << records.size() << " records, slots up to " << max_slot << std::endl;
+    return true;
+}
+
+
+void NVCaptureReplay::close() {
+    stop();
+    if (map) {
+        munmap(map, map_bytes);
+    }
+    map = NULL;
+    map_bytes = 0;
+    header = NULL;
+    records.clear();
+    max_slot = 0;
+}
+
+
+const NVCaptureRecord* NVCaptureReplay::record(size_t i) {
+    return (const NVCaptureRecord*)(map + records[i]);
+}
+
+
+bool NVCaptureReplay::sleepUntil(NVClock::time_point t) {
+    std::unique_lock<std::mutex> lk(mutex);
+    condition.wait_until(lk, t, [this]() { return !running; });
+    return running;
+}
+
+
+void NVCaptureReplay::loop(double speed, int n_copies) {
+    int64_t first_us = record(0)->capture_us;
+    // as if the first record arrived now
+    long shift_ms = NVmsNow() - (long)(header->start_ms + first_us / 1000);
+    BasicFrame f;
+    SetupFrame setup;
+    setup.sub_type = SetupFrameType::stream_init;
+    for (size_t i = 0; i < records.size() && running; i++) {
+        const NVCaptureRecord* r = record(i);
+        if (speed > 0) {
+            NVClock::time_point due = start_time + std::chrono::microseconds((int64_t)((r->capture_us - first_us) / speed));
+            NVClock::time_point now = NVClock::now();
+            if (due > now && !sleepUntil(due)) {
+                break;
+            }
+            late_us = (due < now) ? std::chrono::duration_cast<std::chrono::microseconds>(now - due).count() : 0;
+        }
+        Frame* out;
+        if (r->flags & nv_capture_setup) {
+            setup.media_type = (MediaType)r->media_type;
+            setup.codec_id = (AVCodecID)r->codec_id;
+            out = &setup;
+        }
+        else {
+            const uint8_t* payload = (const uint8_t*)(r + 1);
+            f.payload.assign(payload, payload + r->payload_bytes);
+            f.media_type = (MediaType)r->media_type;
+            f.codec_id = (AVCodecID)r->codec_id;
+            if (f.codec_id == AV_CODEC_ID_H264) {
+                f.fillH264Pars();
+            }
+            out = &f;
+        }
+        out->subsession_index = r->subsession_index;
+        out->mstimestamp = (long)r->mstimestamp + shift_ms;
+        for (int k = 0; k < n_copies && running; k++) {
+            out->n_slot = (SlotNumber)(r->n_slot + k * (max_slot + 1)); // slot 0 included: copies don't overlap
+            outfilter.run(out);
+            frames++;
+            bytes += r->payload_bytes;
+        }
+    }
+    playing = false;
+}
+
+
+size_t NVCaptureReplay::getRecords() {
+    return records.size();
+}
+
+
+int NVCaptureReplay::getMaxSlot() {
+    return max_slot;
+}
+
+
+void NVCaptureReplay::play(double speed, int n_copies) {
+    stop();
+    if (records.empty()) {
+        return;
+    }
+    frames = 0;
+    bytes = 0;
+    late_us = 0;
+    start_time = NVClock::now();
+    running = true;
+    playing = true;
+    thread = std::thread(&NVCaptureReplay::loop, this, std::max(0., speed), std::max(1, n_copies));
+}
+
+
+void NVCaptureReplay::stop() {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        running = false;
+        condition.notify_all();
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+    playing = false;
+}
+
+
+bool NVCaptureReplay::isPlaying() {
+    return playing;
+}
+
+
+PyObject* NVCaptureReplay::getStats() {
+    PyObject* dic = PyDict_New();
+    PyObject* value;
+    value = PyLong_FromSize_t(records.size());              PyDict_SetItemString(dic, "records", value);    Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(frames);            PyDict_SetItemString(dic, "frames", value);     Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(bytes);             PyDict_SetItemString(dic, "bytes", value);      Py_DECREF(value);
+    value = PyFloat_FromDouble(NVusSince(start_time) / 1e6); PyDict_SetItemString(dic, "elapsed_s", value); Py_DECREF(value);
+    value = PyFloat_FromDouble(late_us / 1000.);            PyDict_SetItemString(dic, "late_ms", value);    Py_DECREF(value);
+    return dic;
+}
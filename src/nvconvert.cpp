@@ -0,0 +1,168 @@
+/*
+ * nvconvert.cpp : Host side conversion of downloaded frames
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvconvert.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Host side conversion of downloaded frames
+ */
+
+#include "nvconvert.h"
+#include "nvworkers.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+static std::atomic<bool> streaming_stores(false);
+
+
+void NVConvertStreaming(bool enable) {
+    streaming_stores = enable;
+}
+
+
+bool NVConvertStreaming() {
+    return streaming_stores;
+}
+
+
+void NVDeinterleaveRows(const uint8_t* src, unsigned src_pitch, uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+    int width, int row0, int row1, bool streaming) {
+    int i, j;
+    int vec_width = 0;
+    #ifdef __SSE2__
+    vec_width = width & ~15;
+    // rows padded by NVFramePlanes: the last vector may run over width, into the padding
+    int padded = (width + 15) & ~15;
+    if (padded <= u_linesize && padded <= v_linesize && (unsigned)padded * 2 <= src_pitch) {
+        vec_width = padded;
+    }
+    const __m128i mask = _mm_set1_epi16(0x00ff);
+    #endif
+    for (i = row0; i < row1; i++) {
+        const uint8_t* s = src + (size_t)i * src_pitch;
+        uint8_t* ur = u + (size_t)i * u_linesize;
+        uint8_t* vr = v + (size_t)i * v_linesize;
+        j = 0;
+        #ifdef __SSE2__
+        bool aligned = ((((uintptr_t)ur) | ((uintptr_t)vr)) & 15) == 0;
+        for (; j < vec_width; j += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(s + j*2));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + j*2 + 16));
+            __m128i uu = _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask));
+            __m128i vv = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+            if (aligned && streaming) {
+                _mm_stream_si128((__m128i*)(ur + j), uu);
+                _mm_stream_si128((__m128i*)(vr + j), vv);
+            }
+            else if (aligned) {
+                _mm_store_si128((__m128i*)(ur + j), uu);
+                _mm_store_si128((__m128i*)(vr + j), vv);
+            }
+            else {
+                _mm_storeu_si128((__m128i*)(ur + j), uu);
+                _mm_storeu_si128((__m128i*)(vr + j), vv);
+            }
+        }
+        #endif
+        for (; j < width; j++) {
+            ur[j] = s[j*2];
+            vr[j] = s[j*2 + 1];
+        }
+    }
+    #ifdef __SSE2__
+    if (streaming) { // streamed rows visible to whoever gets the frame next
+        _mm_sfence();
+    }
+    #endif
+}
+
+
+void NVDeinterleave(const uint8_t* src, unsigned src_pitch, uint8_t* u, int u_linesize, uint8_t* v, int v_linesize,
+    int width, int height, bool streaming) {
+    NVWorkerPool& pool = NVWorkerPool::instance();
+    int n_bands = pool.bands(height, (size_t)width * 2);
+    if (n_bands <= 1) {
+        NVDeinterleaveRows(src, src_pitch, u, u_linesize, v, v_linesize, width, 0, height, streaming);
+        return;
+    }
+    pool.run(n_bands, [=](int band) {
+        NVDeinterleaveRows(src, src_pitch, u, u_linesize, v, v_linesize, width,
+            (height * band) / n_bands, (height * (band + 1)) / n_bands, streaming);
+    });
+}
+
+
+void NVCopyRows(const uint8_t* src, unsigned src_pitch, uint8_t* dst, int dst_linesize, int width, int row0, int row1,
+    bool streaming) {
+    int i, j;
+    #ifdef __SSE2__
+    if (streaming) {
+        int vec_width = width & ~15;
+        int padded = (width + 15) & ~15;
+        if (padded <= dst_linesize && (unsigned)padded <= src_pitch) {
+            vec_width = padded;
+        }
+        for (i = row0; i < row1; i++) {
+            const uint8_t* s = src + (size_t)i * src_pitch;
+            uint8_t* d = dst + (size_t)i * dst_linesize;
+            if (((uintptr_t)d & 15) != 0) {
+                memcpy(d, s, width);
+                continue;
+            }
+            for (j = 0; j < vec_width; j += 16) {
+                _mm_stream_si128((__m128i*)(d + j), _mm_loadu_si128((const __m128i*)(s + j)));
+            }
+            if (j < width) {
+                memcpy(d + j, s + j, width - j);
+            }
+        }
+        _mm_sfence();
+        return;
+    }
+    #endif
+    for (i = row0; i < row1; i++) {
+        memcpy(dst + (size_t)i * dst_linesize, src + (size_t)i * src_pitch, width);
+    }
+}
+
+
+bool NVPipelineBands(int n_bands, const std::function<bool(int)>& copy, const std::function<bool(int)>& wait,
+    const std::function<void(int)>& convert) {
+    int queued = 0;
+    bool ok = true;
+    while (queued < n_bands) {
+        if (!copy(queued)) {
+            ok = false;
+            break;
+        }
+        queued++;
+    }
+    for (int band = 0; band < queued; band++) {
+        if (!wait(band)) {
+            ok = false;
+        }
+        else if (ok) {
+            convert(band);
+        }
+    }
+    return ok;
+}
@@ -24,6 +24,7 @@
  */ 
 
 #include "nvdecoder.h"
+#include "nvconvert.h"
 
 /*
 legal stuff: https://developer.nvidia.com/nvidia-video-codec-sdk-license-agreement
@@ -207,18 +208,21 @@ bool NVDecoder::CudaCall(CUresult res) {
 /*
 * Code in the following cpp class has been adapted from "video-sdk-samples/Samples/NvCodec/NvDecoder/NvDecoder.cpp"
 */
-NVDecoder::NVDecoder(AVCodecID av_codec_id, int gpu_index, int n_buf) : Decoder(), 
-    av_codec_id(av_codec_id), active(true), semaring(n_buf), 
-    m_hParser(NULL), m_hDecoder(NULL), aux_plane(NULL), current_pitch(0), current_height(0),
-    first_timestamp(0), n_slot_aux(0), subsession_index_aux(-1) {
+NVDecoder::NVDecoder(AVCodecID av_codec_id, int gpu_index, int n_buf, const void* owner, bool shared_context) : Decoder(), 
+    av_codec_id(av_codec_id), refused(false), active(true), session_id(-1), readmit(false), shared_context(shared_context), semaring(n_buf), 
+    m_hParser(NULL), m_hDecoder(NULL),
+    first_timestamp(0), skip_output(false), stats(std::make_shared<NVSlotStats>()), completion_filter(NULL), completion_running(false),
+    n_slot_aux(0), subsession_index_aux(-1) {
     // ck definition: Utils/NvCodecUtils.h
     int i;
-    for(i=0; i<=n_buf; i++) {
-        out_frame_rb.push_back(new AVBitmapFrame());
+    out_frame_rb.resize(n_buf+1); // leased when a picture is downloaded
+    for(i=0; i<32; i++) {
+        in_flight[i] = false;
     }
 
     //iGpu = 0;
-    iGpu = gpu_index;
+    // register the session & let the registry choose the GPU if gpu_index < 0
+    iGpu = NVDeviceRegistry::instance().acquire(owner ? owner : this, gpu_index, session_id);
 
     // DEVICE
     //ck(cuInit(iGpu)); // so nvidia doesn't know it's own api? ;D  the argument should be = 0 always
@@ -237,9 +241,21 @@ NVDecoder::NVDecoder(AVCodecID av_codec_id, int gpu_index, int n_buf) : Decoder(
 
     // CONTEXT // there seems to be no harm in creating a context per decoder..
     m_cuContext = NULL; // CUcontext
-    ck(cuCtxCreate(&m_cuContext, 0, cuDevice));
-    // enacpsulation: context[device[device_num]]
+    if (shared_context) { // one context per GPU
+        ck(cuDevicePrimaryCtxRetain(&m_cuContext, cuDevice));
+    }
+    else {
+        ck(cuCtxCreate(&m_cuContext, 0, cuDevice));
+        // enacpsulation: context[device[device_num]]
+        // cuCtxCreate makes the context current: don't leave it bound to this thread, it's pushed when needed
+        // (pooled decoders are used from other threads)
+        ck(cuCtxPopCurrent(NULL));
+    }
+    this->active = CreateParser();
+}
+
 
+bool NVDecoder::CreateParser() {
     // this is somewhat useful: http://codeofrob.com/entries/decoding-h264-with-nvidia.html
     //
     CUVIDPARSERPARAMS videoParserParameters = {};
@@ -256,25 +272,40 @@ NVDecoder::NVDecoder(AVCodecID av_codec_id, int gpu_index, int n_buf) : Decoder(
     videoParserParameters.pfnDecodePicture = NVDecoder__decodePicture;
     videoParserParameters.pfnDisplayPicture = NVDecoder__displayPicture;
     // cuCtxPushCurrent(m_cuContext);
-    this->active = CUDA_CALL(cuvidCreateVideoParser(&m_hParser, &videoParserParameters));
+    return CUDA_CALL(cuvidCreateVideoParser(&m_hParser, &videoParserParameters));
 }
 
 
 NVDecoder::~NVDecoder() {
     //delete this->nv_dec;
-    std::unique_lock<std::mutex> lk(mutex);
-    if (m_hDecoder) {
-        cuvidDestroyDecoder(m_hDecoder);
+    stopCompletion(); // workers use the cuvid decoder
+    freeStaging(staging);
+    if (resident && m_cuContext) { // device memory of this context
+        resident->release(m_cuContext);
     }
+    std::unique_lock<std::mutex> lk(mutex);
     if (m_hParser) {
         cuvidDestroyVideoParser(m_hParser);
     }
-    for (auto it=out_frame_rb.begin(); it!=out_frame_rb.end(); ++it) {
-        delete *it;
-    }
-    if (aux_plane) {
-        free(aux_plane);
+    if (m_cuContext) {
+        if (m_hDecoder && cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS) {
+            cuvidDestroyDecoder(m_hDecoder);
+            // report the memory while there's a context to ask
+            size_t free_bytes = 0, total = 0;
+            if (cuMemGetInfo(&free_bytes, &total) == CUDA_SUCCESS) {
+                NVDeviceRegistry::instance().updateMemory(iGpu, free_bytes);
+            }
+            cuCtxPopCurrent(NULL);
+        }
+        if (shared_context) {
+            cuDevicePrimaryCtxRelease(cuDevice);
+        }
+        else {
+            cuCtxDestroy(m_cuContext);
+        }
     }
+    out_frame_rb.clear(); // back to the pool
+    NVDeviceRegistry::instance().release(session_id);
 }
 
 void NVDecoder::deactivate(const char* err) {
@@ -288,6 +319,251 @@ bool NVDecoder::isOk() {
     return this->active;
 }
 
+void NVDecoder::setStats(std::shared_ptr<NVSlotStats> stats) {
+    this->stats = stats;
+}
+
+void NVDecoder::setMaxSize(unsigned int max_width, unsigned int max_height) {
+    m_nMaxWidth = max_width;
+    m_nMaxHeight = max_height;
+}
+
+void NVDecoder::setResize(unsigned int width, unsigned int height) {
+    m_resizeDim.w = (int)(width & ~1u); // 4:2:0
+    m_resizeDim.h = (int)(height & ~1u);
+}
+
+bool NVDecoder::getSessionKey(NVSessionKey& key) {
+    if (!active || !m_hDecoder) {
+        return false;
+    }
+    key.gpu_index = iGpu;
+    key.codec_id = av_codec_id;
+    key.chroma_format = m_eChromaFormat;
+    key.bit_depth_minus8 = m_nBitDepthMinus8;
+    key.max_width = m_nMaxWidth;
+    key.max_height = m_nMaxHeight;
+    key.shared_context = shared_context;
+    return true;
+}
+
+bool NVDecoder::park(const void* holder) {
+    NVSessionKey key;
+    if (!getSessionKey(key) || (m_resizeDim.w && m_resizeDim.h)) { // scaled output is of no use to others
+        return false;
+    }
+    stopCompletion(); // workers write to the previous user's filter
+    setOnEmit(std::function<void()>());
+    if (resident) {
+        resident->release(m_cuContext);
+        resident.reset();
+    }
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        semaring.reset();
+        releaseFrames();
+    }
+    // a fresh parser forgets the previous stream.  The cuvid decoder & its surfaces stay
+    if (m_hParser) {
+        cuvidDestroyVideoParser(m_hParser);
+        m_hParser = NULL;
+    }
+    if (!CreateParser()) {
+        return false;
+    }
+    first_timestamp = 0;
+    skip_output = false;
+    m_cuvidStream = 0; // the stream belongs to the previous user
+    NVDeviceRegistry::instance().reassign(session_id, holder);
+    return true;
+}
+
+void NVDecoder::reuse(const void* owner) {
+    NVDeviceRegistry::instance().reassign(session_id, owner);
+    readmit = true;                 // admission control is done again when the load of the new stream is known
+    m_bReconfigExtPPChange = true;  // full reconfigure for the new stream, output size included
+    refused = false;
+    stats = std::make_shared<NVSlotStats>();
+}
+
+void NVDecoder::skipOutput(bool skip) {
+    skip_output = skip;
+}
+
+void NVDecoder::setOnEmit(std::function<void()> on_emit) {
+    std::unique_lock<std::mutex> lk(emit_order.mutex);
+    this->on_emit = on_emit;
+}
+
+void NVDecoder::setResidentFrames(std::shared_ptr<NVResidentFrames> resident) {
+    this->resident = resident;
+}
+
+bool NVDecoder::setStream(CUstream stream) {
+    if (!shared_context) {
+        return false;
+    }
+    m_cuvidStream = stream;
+    return true;
+}
+
+int NVDecoder::getGpuIndex() {
+    return iGpu;
+}
+
+// decoded pictures in the queue between the submit & completion stages
+static const size_t completion_queue_size = 8;
+
+void NVDecoder::setCompletionWorkers(int n_workers, FrameFilter* outfilter) {
+    stopCompletion();
+    if (n_workers <= 0 || !outfilter || !active) {
+        return;
+    }
+    completion_filter = outfilter;
+    completion_queue.reset(new NVBoundedQueue<NVPicture>(completion_queue_size));
+    emit_order.reset();
+    completion_running = true;
+    for (int i = 0; i < n_workers; i++) {
+        NVCompletionWorker* worker = new NVCompletionWorker();
+        worker->stream = 0;
+        // own stream, so that the workers' copies don't serialize
+        if (cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS) {
+            if (cuStreamCreate(&worker->stream, CU_STREAM_NON_BLOCKING) != CUDA_SUCCESS) {
+                worker->stream = 0;
+            }
+            cuCtxPopCurrent(NULL);
+        }
+        worker->thread = std::thread(&NVDecoder::completionLoop, this, worker);
+        workers.push_back(worker);
+    }
+    decoderlogger.log(LogLevel::debug) << "NVDecoder: " << n_workers << " completion workers" << std::endl;
+}
+
+void NVDecoder::stopCompletion() {
+    if (workers.empty()) {
+        return;
+    }
+    completion_running = false;
+    {
+        std::unique_lock<std::mutex> lk(surface_mutex);
+    }
+    surface_cond.notify_all();
+    emit_order.stop();
+    for (auto it = workers.begin(); it != workers.end(); ++it) {
+        NVCompletionWorker* worker = *it;
+        worker->thread.join();
+        if (worker->stream && cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS) {
+            cuStreamDestroy(worker->stream);
+            cuCtxPopCurrent(NULL);
+        }
+        freeStaging(worker->staging);
+        delete worker;
+    }
+    workers.clear();
+    NVPicture pic;
+    while (completion_queue->pop(pic)) {
+        NVSlotStats::incShared(stats->dropped_frames);
+    }
+    for (int i = 0; i < 32; i++) {
+        in_flight[i] = false;
+    }
+    completion_queue.reset();
+    completion_filter = NULL;
+    stats->completion_queue.store(0, std::memory_order_relaxed);
+}
+
+void NVDecoder::waitSurface(int picture_index) {
+    if (picture_index < 0 || picture_index >= 32 || !in_flight[picture_index]) {
+        return;
+    }
+    std::unique_lock<std::mutex> lk(surface_mutex);
+    surface_cond.wait(lk, [this, picture_index]() { return !in_flight[picture_index] || !completion_running; });
+}
+
+void NVDecoder::completionLoop(NVCompletionWorker* worker) {
+    NVPicture pic;
+    while (completion_running) {
+        if (!completion_queue->pop(pic)) {
+            std::unique_lock<std::mutex> lk(surface_mutex);
+            surface_cond.wait(lk, [this]() { return completion_queue->size() > 0 || !completion_running; });
+            continue;
+        }
+        stats->completion_queue.store(completion_queue->size(), std::memory_order_relaxed);
+        std::shared_ptr<AVBitmapFrame> f = NVFramePool::instance().lease(pic.width, pic.height, stats);
+        // no frame: the surface is just released
+        int status = f ? download(pic, f.get(), worker->staging, worker->stream) : -1;
+        // the parser may decode into the surface again
+        in_flight[pic.picture_index] = false;
+        {
+            std::unique_lock<std::mutex> lk(surface_mutex);
+        }
+        surface_cond.notify_all();
+
+        {// PROTECTED: one worker at a time, in display order.  This also keeps the stats single-writer among the workers
+            std::unique_lock<std::mutex> lk = emit_order.turn(pic.sequence);
+            if (!completion_running) {
+                break;
+            }
+            if (status >= 0) {
+                stats->copy_time.add(pic.copy_us);
+                stats->convert_time.add(pic.convert_us);
+                NVSlotStats::inc(stats->bytes_downloaded, pic.bytes);
+                countStatus(status);
+                completion_filter->run(f.get());
+                NVSlotStats::inc(stats->emitted_frames);
+                if (on_emit) {
+                    on_emit();
+                }
+            }
+            else if (!f) {
+                NVSlotStats::incShared(stats->dropped_frames);
+            }
+            emit_order.done(lk);
+        }
+    }
+}
+
+int NVDecoder::numSurfaces(int nDecodeSurface) {
+    if (workers.empty()) {
+        return nDecodeSurface;
+    }
+    // queued & mapped surfaces are out of the parser's use
+    return std::min<int>(32, nDecodeSurface + completion_queue->capacity() + workers.size());
+}
+
+void NVDecoder::releaseFrames() {
+    for (auto it=out_frame_rb.begin(); it!=out_frame_rb.end(); ++it) {
+        it->reset();
+    }
+}
+
+bool NVDecoder::DestroyDecoder() {
+    if (!m_hDecoder) {return true;}
+    if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return false;}
+    CUresult res = cuvidDestroyDecoder(m_hDecoder);
+    if (!CudaCall(cuCtxPopCurrent(NULL))) {return false;}
+    m_hDecoder = NULL;
+    m_nWidth = 0;
+    m_nHeight = 0;
+    return CudaCall(res);
+}
+
+void NVDecoder::releaseSession() {
+    stopCompletion();
+    // not from sequenceCallback: the parser can't be destroyed in its own callback
+    if (m_hParser) {
+        cuvidDestroyVideoParser(m_hParser);
+        m_hParser = NULL;
+    }
+    if (m_hDecoder && cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS) { // a pooled session
+        cuvidDestroyDecoder(m_hDecoder);
+        cuCtxPopCurrent(NULL);
+    }
+    m_hDecoder = NULL;
+    NVDeviceRegistry::instance().release(session_id);
+    session_id = -1;
+}
+
 int NVDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
 {
     if (!active) {return -1;}
@@ -305,7 +581,8 @@ int NVDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     bool bDisplayRectChange = !(pVideoFormat->display_area.bottom == m_videoFormat.display_area.bottom && pVideoFormat->display_area.top == m_videoFormat.display_area.top \
         && pVideoFormat->display_area.left == m_videoFormat.display_area.left && pVideoFormat->display_area.right == m_videoFormat.display_area.right);
 
-    int nDecodeSurface = GetNumDecodeSurfaces(pVideoFormat->codec, pVideoFormat->coded_width, pVideoFormat->coded_height);
+    // as many surfaces as at creation, the ones for the completion queue included
+    int nDecodeSurface = numSurfaces(GetNumDecodeSurfaces(pVideoFormat->codec, pVideoFormat->coded_width, pVideoFormat->coded_height));
 
     if ((pVideoFormat->coded_width > m_nMaxWidth) || (pVideoFormat->coded_height > m_nMaxHeight)) {
         // For VP9, let driver  handle the change if new width/height > maxwidth/maxheight
@@ -334,7 +611,7 @@ int NVDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     reconfigParams.ulWidth = m_videoFormat.coded_width = pVideoFormat->coded_width;
     reconfigParams.ulHeight = m_videoFormat.coded_height = pVideoFormat->coded_height;
 
-    // Dont change display rect and get scaled output from m_hDecoder. This will help display app to present apps smoothly
+    // by default, display rect & target resolution stay (e.g. a change of the number of surfaces only)
     reconfigParams.display_area.bottom = m_displayRect.b;
     reconfigParams.display_area.top = m_displayRect.t;
     reconfigParams.display_area.left = m_displayRect.l;
@@ -342,10 +619,10 @@ int NVDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     reconfigParams.ulTargetWidth = m_nSurfaceWidth;
     reconfigParams.ulTargetHeight = m_nSurfaceHeight;
 
-    // If external reconfigure is called along with resolution change even if post processing params is not changed,
-    // do full reconfigure params update
-    if ((m_bReconfigExternal && bDecodeResChange) || m_bReconfigExtPPChange) {
-        // update display rect and target resolution if requested explicitely
+    // a new coded size within the max size (camera settings changed): the output follows it, so update
+    // display rect & target resolution as for an external reconfigure.  Output frames are leased & staging
+    // is reserved per picture, at m_nWidth x m_nHeight
+    if (bDecodeResChange || m_bReconfigExtPPChange) {
         m_bReconfigExternal = false;
         m_bReconfigExtPPChange = false;
         m_videoFormat = *pVideoFormat;
@@ -397,6 +674,10 @@ int NVDecoder::ReconfigureDecoder(CUVIDEOFORMAT *pVideoFormat)
     if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return -1;}
     if (!(CudaCall(cuvidReconfigureDecoder(m_hDecoder, &reconfigParams)))) {return -1;}
     if (!CudaCall(cuCtxPopCurrent(NULL))) {return -1;}
+    if (bDecodeResChange) {
+        decoderlogger.log(LogLevel::debug) << "NVDecoder: reconfigured to coded size " << pVideoFormat->coded_width << "x"
+            << pVideoFormat->coded_height << ", output " << m_nWidth << "x" << m_nHeight << std::endl;
+    }
     return nDecodeSurface;
 }
 
@@ -445,8 +726,8 @@ int NVDecoder::sequenceCallback(CUVIDEOFORMAT* pVideoFormat) {
         << "\tBit depth    : " << pVideoFormat->bit_depth_luma_minus8 + 8
         << std::endl;
 
-    int nDecodeSurface = GetNumDecodeSurfaces(
-        pVideoFormat->codec, pVideoFormat->coded_width, pVideoFormat->coded_height);
+    int nDecodeSurface = numSurfaces(GetNumDecodeSurfaces(
+        pVideoFormat->codec, pVideoFormat->coded_width, pVideoFormat->coded_height));
 
     CUVIDDECODECAPS decodecaps;
     memset(&decodecaps, 0, sizeof(decodecaps));
@@ -494,9 +775,50 @@ int NVDecoder::sequenceCallback(CUVIDEOFORMAT* pVideoFormat) {
         return nDecodeSurface;
     }
     
+    double mbps = NVMacroblockRate(
+        pVideoFormat->coded_width, pVideoFormat->coded_height,
+        pVideoFormat->frame_rate.numerator, pVideoFormat->frame_rate.denominator);
+
+    bool recreate = false;
     if (m_nWidth && m_nHeight) {
         // cuvidCreateDecoder() has been called before, and now there's possible config change
-        return ReconfigureDecoder(pVideoFormat);
+        if (readmit) { // a pooled session serving a new stream
+            readmit = false;
+            if (!NVDeviceRegistry::instance().admit(session_id, mbps)) {
+                decoderlogger.log(LogLevel::normal) << "NVDecoder: GPU " << iGpu << " is at capacity: pooled decoder not reused" << std::endl;
+                this->refused = true;
+                this->active = false;
+                return nDecodeSurface;
+            }
+        }
+        else {
+            NVDeviceRegistry::instance().update(session_id, mbps);
+        }
+        bool too_big = !NVReconfigurable(pVideoFormat->coded_width, pVideoFormat->coded_height, m_nMaxWidth, m_nMaxHeight);
+        bool format_change = (pVideoFormat->chroma_format != m_videoFormat.chroma_format) || 
+            (pVideoFormat->bit_depth_luma_minus8 != m_videoFormat.bit_depth_luma_minus8) ||
+            (pVideoFormat->bit_depth_chroma_minus8 != m_videoFormat.bit_depth_chroma_minus8);
+        // both change m_hDecoder under the completion workers, which may still be mapping its surfaces: let them finish first
+        emit_order.drain();
+        // for VP9, the driver handles the change (see ReconfigureDecoder)
+        if (!format_change && (!too_big || (m_eCodec == cudaVideoCodec_VP9 && !m_bReconfigExternal))) {
+            return ReconfigureDecoder(pVideoFormat);
+        }
+        // cuvidReconfigureDecoder can't go beyond the max size or format given at creation: create a new decoder
+        decoderlogger.log(LogLevel::normal) << "NVDecoder: coded size " << pVideoFormat->coded_width << "x" << pVideoFormat->coded_height
+            << (format_change ? " with a new format" : "") << " vs. max " << m_nMaxWidth << "x" << m_nMaxHeight << ": recreating the decoder" << std::endl;
+        if (!DestroyDecoder()) {
+            return -1;
+        }
+        recreate = true;
+    }
+
+    // a new session: check that the GPU has capacity left
+    if (!recreate && !NVDeviceRegistry::instance().admit(session_id, mbps)) {
+        decoderlogger.log(LogLevel::normal) << "NVDecoder: GPU " << iGpu << " is at capacity: decoder not created" << std::endl;
+        this->refused = true;
+        this->active = false;
+        return nDecodeSurface;
     }
 
     // eCodec has been set in the constructor (for m_hParser). Here it's set again for potential correction
@@ -521,10 +843,8 @@ int NVDecoder::sequenceCallback(CUVIDEOFORMAT* pVideoFormat) {
     videoDecodeCreateInfo.vidLock = NULL;
     videoDecodeCreateInfo.ulWidth = pVideoFormat->coded_width;
     videoDecodeCreateInfo.ulHeight = pVideoFormat->coded_height;
-    if (m_nMaxWidth < (int)pVideoFormat->coded_width)
-        m_nMaxWidth = pVideoFormat->coded_width;
-    if (m_nMaxHeight < (int)pVideoFormat->coded_height)
-        m_nMaxHeight = pVideoFormat->coded_height;
+    // max size from setMaxSize might be beyond the GPU's capabilities: then a larger size recreates the decoder
+    NVDecoderMaxSize(decodecaps, pVideoFormat->coded_width, pVideoFormat->coded_height, m_nMaxWidth, m_nMaxHeight);
     videoDecodeCreateInfo.ulMaxWidth = m_nMaxWidth;
     videoDecodeCreateInfo.ulMaxHeight = m_nMaxHeight;
 
@@ -578,6 +898,10 @@ int NVDecoder::sequenceCallback(CUVIDEOFORMAT* pVideoFormat) {
     */
     if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return nDecodeSurface;}
     if (!CudaCall(cuvidCreateDecoder(&m_hDecoder, &videoDecodeCreateInfo))) {return nDecodeSurface;}
+    size_t free_bytes = 0, total_bytes = 0;
+    if (cuMemGetInfo(&free_bytes, &total_bytes) == CUDA_SUCCESS) {
+        NVDeviceRegistry::instance().updateMemory(iGpu, free_bytes);
+    }
     if (!CudaCall(cuCtxPopCurrent(NULL))) {return nDecodeSurface;}
 
     // STOP_TIMER("Session Initialization Time: ");
@@ -602,9 +926,6 @@ int NVDecoder::sequenceCallback(CUVIDEOFORMAT* pVideoFormat) {
     */
 
     //std::cout << "(re)config decoder: w, h: " << m_nWidth << " " << m_nHeight << std::endl;
-    for (auto it=out_frame_rb.begin(); it!=out_frame_rb.end(); ++it) {
-        (*it)->reserve(m_nWidth, m_nHeight);
-    }
     return nDecodeSurface;
 }
 
@@ -621,6 +942,7 @@ int NVDecoder::decodePicture(CUVIDPICPARAMS* pPicParams) {
         deactivate("decodePicture: something went wrong: decoder not initialized");
         return -1;
     }
+    waitSurface(pPicParams->CurrPicIdx);
 
     /*
     cuCtxPushCurrent(m_cuContext);
@@ -638,6 +960,7 @@ int NVDecoder::decodePicture(CUVIDPICPARAMS* pPicParams) {
     if (!CudaCall(cuvidDecodePicture(m_hDecoder, pPicParams))) {
         return -1;
     }
+    NVSlotStats::inc(stats->decoded_pictures);
    return 1;
 }
 
@@ -645,175 +968,340 @@ int NVDecoder::displayPicture(CUVIDPARSERDISPINFO* pDispInfo) {
     // decoded frames callback
     //std::cout << "displayPicture" << std::endl;
     if (!active) {return -1;}
+    if (skip_output) { // the surface is free for decoding again as is
+        NVSlotStats::inc(stats->skipped_frames);
+        return 1;
+    }
 
-    CUVIDPROCPARAMS videoProcessingParameters = {};
-    videoProcessingParameters.progressive_frame = pDispInfo->progressive_frame;
-    videoProcessingParameters.second_field = pDispInfo->repeat_first_field + 1;
-    videoProcessingParameters.top_field_first = pDispInfo->top_field_first;
-    videoProcessingParameters.unpaired_field = pDispInfo->repeat_first_field < 0;
-    videoProcessingParameters.output_stream = m_cuvidStream;
-
-    CUdeviceptr dpSrcFrame = 0;
-    unsigned int nSrcPitch = 0;
-    NVDEC_API_CALL(cuvidMapVideoFrame(m_hDecoder, pDispInfo->picture_index, &dpSrcFrame,
-        &nSrcPitch, &videoProcessingParameters));
+    NVPicture pic;
+    pic.picture_index = pDispInfo->picture_index;
+    memset(&pic.params, 0, sizeof(pic.params));
+    pic.params.progressive_frame = pDispInfo->progressive_frame;
+    pic.params.second_field = pDispInfo->repeat_first_field + 1;
+    pic.params.top_field_first = pDispInfo->top_field_first;
+    pic.params.unpaired_field = pDispInfo->repeat_first_field < 0;
+    // f->copyMetaFrom(&in_frame);
+    pic.n_slot = n_slot_aux;
+    pic.subsession_index = subsession_index_aux;
+    /*
+    std::cout << "pDispInfo->timestamp: " << pDispInfo->timestamp << " " 
+        << pDispInfo->timestamp/10000 << std::endl;
+    */
+    pic.mstimestamp = (pDispInfo->timestamp/10000)+first_timestamp; // "10Mhz clock"
+    pic.width = m_nWidth;
+    pic.height = m_nHeight;
+    pic.surface_height = m_nSurfaceHeight;
+    pic.bit_depth_minus8 = m_nBitDepthMinus8;
+    pic.pitch = 0;
+    pic.bytes = 0;
+    pic.sequence = emit_order.next();
+
+    if (resident && resident->enabled()) { // downloaded only when fetched
+        int status = keep(pic);
+        if (status < 0) {return -1;}
+        countStatus(status);
+        NVSlotStats::inc(stats->resident_frames);
+        return 1;
+    }
 
-    CUVIDGETDECODESTATUS DecodeStatus;
-    memset(&DecodeStatus, 0, sizeof(DecodeStatus));
-    CUresult result = cuvidGetDecodeStatus(m_hDecoder, pDispInfo->picture_index, &DecodeStatus);
-    if (result == CUDA_SUCCESS && (DecodeStatus.decodeStatus == cuvidDecodeStatus_Error || DecodeStatus.decodeStatus == cuvidDecodeStatus_Error_Concealed))
-    {
-        //printf("Decode Error occurred for picture %d\n", m_nPicNumInDecodeOrder[pDispInfo->picture_index]);
-        decoderlogger.log(LogLevel::debug) << "NVDecoder: displayPicture: Decode Error occurred" << std::endl;
+    if (completion_queue) { // pipelined: the completion workers take it from here
+        in_flight[pic.picture_index] = true;
+        if (!completion_queue->push(pic)) {
+            in_flight[pic.picture_index] = false;
+            decoderlogger.log(LogLevel::debug) << "NVDecoder: displayPicture: completion queue full" << std::endl;
+            NVSlotStats::incShared(stats->dropped_frames);
+            return -1;
+        }
+        emit_order.submit();
+        stats->completion_queue.store(completion_queue->size(), std::memory_order_relaxed);
+        {
+            std::unique_lock<std::mutex> lk(surface_mutex);
+        }
+        surface_cond.notify_all();
+        return 1;
     }
 
+    // frames of the current size are shared with the other decoders
+    std::shared_ptr<AVBitmapFrame> lease = NVFramePool::instance().lease(pic.width, pic.height, stats);
+    if (!lease) {
+        decoderlogger.log(LogLevel::debug) << "NVDecoder: displayPicture: no frame from the frame pool" << std::endl;
+        NVSlotStats::incShared(stats->dropped_frames);
+        return -1;
+    }
+    // into the ring only once downloaded: output must not return a frame that was never filled
+    int status = download(pic, lease.get(), staging, m_cuvidStream);
+    if (status < 0) {
+        NVSlotStats::incShared(stats->dropped_frames);
+        return -1;
+    }
+    stats->copy_time.add(pic.copy_us);
+    stats->convert_time.add(pic.convert_us);
+    NVSlotStats::inc(stats->bytes_downloaded, pic.bytes);
+    countStatus(status);
     {// PROTECTED
         std::unique_lock<std::mutex> lk(mutex);
         int ind = semaring.write();
         if (ind < 0) {
             decoderlogger.log(LogLevel::normal) << "NVDecoder: handlePictureDisplay: overflow!" << std::endl;
+            NVSlotStats::incShared(stats->dropped_frames);
             return -1;
         }
         // std::cout << "NVDecoder: using out_frame " << ind << std::endl;
-        AVBitmapFrame *f = (AVBitmapFrame*)(out_frame_rb[ind]);
+        out_frame_rb[ind] = lease; // held until releaseOutput
+        //std::cout << *f << std::endl;
+        //std::cout << f->dumpPayload() << std::endl;
+    } // PROTECTED
+    return 1;
+}
 
-        CUDA_DRVAPI_CALL(cuCtxPushCurrent(m_cuContext));
-        CUDA_MEMCPY2D m = { 0 };
 
-        if (current_pitch!=nSrcPitch || current_height!=m_nHeight) {
-            //std::cout << "NVDecoder: dims changed" << std::endl;
-            current_pitch=nSrcPitch;
-            current_height=m_nHeight;
-            if (aux_plane) {
-                free(aux_plane);
-                aux_plane = NULL;
-            }
+// bands of a surface, copied & converted one after another
+static const int staging_bands = 4;
+
+bool NVDecoder::reserveStaging(NVStaging& staging, unsigned int pitch, unsigned int height) {
+    if (staging.data && staging.pitch == pitch && staging.height == height) {
+        return true;
+    }
+    if (staging.data) {
+        //std::cout << "NVDecoder: dims changed" << std::endl;
+        if (staging.pinned) {
+            cuMemFreeHost(staging.data);
         }
+        else {
+            free(staging.data);
+        }
+        staging.data = NULL;
+    }
+    size_t size = (size_t)pitch * (height + height / 2); // NV12: luma & half-height interleaved chroma
+    staging.pinned = (cuMemAllocHost((void**)&staging.data, size) == CUDA_SUCCESS);
+    if (!staging.pinned) { // copies are then synchronous, but still work
+        decoderlogger.log(LogLevel::debug) << "NVDecoder: reserveStaging: could not allocate page-locked memory" << std::endl;
+        staging.data = (uint8_t*)malloc(size);
+    }
+    staging.pitch = pitch;
+    staging.height = height;
+    while (staging.events.size() < staging_bands) {
+        CUevent event;
+        if (!CudaCall(cuEventCreate(&event, CU_EVENT_DISABLE_TIMING))) {
+            return false;
+        }
+        staging.events.push_back(event);
+    }
+    return (staging.data != NULL);
+}
 
-        // int byte_width = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
-        int byte_width = m_nWidth * (m_nBitDepthMinus8 ? 2 : 1); // TODO: assume 1
-        int byte_height = m_nHeight;
-        // .. those are image w, h (1920, 1080)
 
-        if (!aux_plane) {
-            aux_plane = (uint8_t*)malloc(nSrcPitch*byte_height);
+void NVDecoder::freeStaging(NVStaging& staging) {
+    if (!staging.data && staging.events.empty()) {
+        return;
+    }
+    // page-locked memory & events belong to the context
+    bool current = (m_cuContext && cuCtxPushCurrent(m_cuContext) == CUDA_SUCCESS);
+    if (staging.data) {
+        if (staging.pinned) {
+            if (current) {
+                cuMemFreeHost(staging.data);
+            }
         }
-        
-        //src
-        m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
-        m.srcDevice = dpSrcFrame;
-        m.srcPitch = nSrcPitch;
-
-        /*
-        //dst
-        if (!dstFrame) { // testing..
-            dstFrame = malloc(byte_width*byte_height);
+        else {
+            free(staging.data);
         }
-        */
+        staging.data = NULL;
+    }
+    if (current) {
+        for (auto it = staging.events.begin(); it != staging.events.end(); ++it) {
+            cuEventDestroy(*it);
+        }
+        cuCtxPopCurrent(NULL);
+    }
+    staging.events.clear();
+    staging.pitch = 0;
+    staging.height = 0;
+}
+
+
+int NVDecoder::keep(NVPicture& pic) {
+    CUdeviceptr dpSrcFrame = 0;
+    unsigned int nSrcPitch = 0;
+    pic.params.output_stream = m_cuvidStream;
+
+    if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return -1;}
+    if (!CudaCall(cuvidMapVideoFrame(m_hDecoder, pic.picture_index, &dpSrcFrame, &nSrcPitch, &pic.params))) {
+        cuCtxPopCurrent(NULL);
+        return -1;
+    }
+    int status = cuvidDecodeStatus_Success;
+    CUVIDGETDECODESTATUS DecodeStatus;
+    memset(&DecodeStatus, 0, sizeof(DecodeStatus));
+    if (cuvidGetDecodeStatus(m_hDecoder, pic.picture_index, &DecodeStatus) == CUDA_SUCCESS) {
+        status = DecodeStatus.decodeStatus;
+    }
+    bool ok = resident->store(m_cuContext, dpSrcFrame, nSrcPitch, pic.width, pic.height, pic.surface_height,
+        pic.mstimestamp, pic.n_slot, pic.subsession_index, m_cuvidStream);
+    // unmap in any case, so that the surface is not lost
+    ok = CudaCall(cuvidUnmapVideoFrame(m_hDecoder, dpSrcFrame)) && ok;
+    ok = CudaCall(cuCtxPopCurrent(NULL)) && ok;
+    pic.pitch = nSrcPitch;
+    return ok ? status : -1;
+}
+
+int NVDecoder::download(NVPicture& pic, AVBitmapFrame* f, NVStaging& staging, CUstream stream) {
+    CUdeviceptr dpSrcFrame = 0;
+    unsigned int nSrcPitch = 0;
+    pic.params.output_stream = stream;
+
+    if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return -1;}
+    if (!CudaCall(cuvidMapVideoFrame(m_hDecoder, pic.picture_index, &dpSrcFrame, &nSrcPitch, &pic.params))) {
+        cuCtxPopCurrent(NULL);
+        return -1;
+    }
 
+    int status = cuvidDecodeStatus_Success;
+    CUVIDGETDECODESTATUS DecodeStatus;
+    memset(&DecodeStatus, 0, sizeof(DecodeStatus));
+    if (cuvidGetDecodeStatus(m_hDecoder, pic.picture_index, &DecodeStatus) == CUDA_SUCCESS) {
+        status = DecodeStatus.decodeStatus;
+    }
+
+    // int byte_width = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
+    int byte_width = pic.width * (pic.bit_depth_minus8 ? 2 : 1); // TODO: assume 1
+    int byte_height = pic.height;
+    int chroma_height = pic.height / 2;
+    // .. those are image w, h (1920, 1080)
+
+    // AVBitmapFrame *f
+    // encapsulates ffmpeg API's AVFrame
+    // the surface is copied into staging, band by band.  From there,
+    // the luma rows are copied as they are into f->y_payload,
+    // while the interleaved chroma rows need some byte-sifting into
+    // f->u_payload & f->v_payload
+
+    /*
+    https://gist.github.com/Jim-Bar/3cbba684a71d1a9d468a6711a6eddbeb
+    https://github.com/FNNDSC/gpu/blob/master/shared/inc/cuvid/cuviddec.h#L35
+    nice reference:
+    https://www.cs.cmu.edu/afs/cs/academic/class/15668-s11/www/cuda-doc/html/group__CUDA__MEM_g4acf155faeb969d9d21f5433d3d0f274.html#g4acf155faeb969d9d21f5433d3d0f274
+    could do the byte-sifting on the GPU .. but it's not well suited for such tasks
+    https://developer.nvidia.com/npp
+    https://stackoverflow.com/questions/65121668/convert-nv12-to-bgr-by-nvidia-performance-primitives
+    opencv stuff at cuda..
+    https://stackoverflow.com/questions/46807238/how-can-i-obtain-the-yuv-components-from-the-gpu-device
+    */
+
+    bool ok = reserveStaging(staging, nSrcPitch, pic.height);
+    uint8_t* luma = staging.data;
+    uint8_t* chroma = staging.data + (size_t)nSrcPitch * byte_height;
+    int n_bands = ok ? std::min<int>(staging.events.size(), chroma_height) : 0;
+    uint64_t copy_us = 0, convert_us = 0;
+    bool streaming = NVConvertStreaming(); // the same for all bands
+
+    // rows of band k: luma [row(byte_height, k), row(byte_height, k+1)), chroma likewise
+    auto row = [n_bands](int rows, int band) { return (rows * band) / n_bands; };
+
+    auto copy = [&](int band) {
+        CUDA_MEMCPY2D m = { 0 };
+        m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+        m.srcPitch = nSrcPitch;
         m.dstMemoryType = CU_MEMORYTYPE_HOST;
-        // m.dstPitch = m_nDeviceFramePitch ? m_nDeviceFramePitch : m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
-        
-        // m.WidthInBytes = m_nWidth * (m_nBitDepthMinus8 ? 2 : 1);
-        // m.Height = m_nHeight;
+        m.dstPitch = nSrcPitch; // NOTE: same source (device) and target (host) pitch
         m.WidthInBytes = byte_width;
-        m.Height = byte_height;
-
-        // std::cout << "NVDecoder: displayPicture: w, h, pitch: " << byte_width << " " << byte_height << " " << nSrcPitch << std::endl;
-
-        // AVBitmapFrame *f
-        // encapsulates ffmpeg API's AVFrame
-        // so, now we need to copy the bytes in-place
-        // f->av_frame->data[0], data[1], data[2]
-        // copy the luma plane as is into correct plance
-        // chroma uv planes need some byte-sifting, so they
-        // are copied to an aux memory array first
-
-        // luma: directly in-place
-        m.srcDevice = dpSrcFrame;
-        m.dstPitch = f->bmpars.y_linesize;
-        m.dstHost = f->y_payload;
-        if (!CudaCall(cuMemcpy2DAsync(&m, m_cuvidStream))) {return -1;}
-
-        /*
-        https://gist.github.com/Jim-Bar/3cbba684a71d1a9d468a6711a6eddbeb
-        https://github.com/FNNDSC/gpu/blob/master/shared/inc/cuvid/cuviddec.h#L35
-        nice reference:
-        https://www.cs.cmu.edu/afs/cs/academic/class/15668-s11/www/cuda-doc/html/group__CUDA__MEM_g4acf155faeb969d9d21f5433d3d0f274.html#g4acf155faeb969d9d21f5433d3d0f274
-        could do the byte-sifting on the GPU .. but it's not well suited for such tasks
-        https://developer.nvidia.com/npp
-        https://stackoverflow.com/questions/65121668/convert-nv12-to-bgr-by-nvidia-performance-primitives
-        opencv stuff at cuda..
-        https://stackoverflow.com/questions/46807238/how-can-i-obtain-the-yuv-components-from-the-gpu-device
-        */
-
+        int r0 = row(byte_height, band), r1 = row(byte_height, band + 1);
+        m.srcDevice = dpSrcFrame + (CUdeviceptr)nSrcPitch * r0;
+        m.dstHost = luma + (size_t)nSrcPitch * r0;
+        m.Height = r1 - r0;
+        if (!CudaCall(cuMemcpy2DAsync(&m, stream))) {return false;}
         // interleaved UV planes
-        m.dstPitch = nSrcPitch; // NOTE: same source (device) and target (host) pitch
-        m.Height = m_nHeight / 2;
-        m.srcDevice = (CUdeviceptr)((uint8_t *)dpSrcFrame
-            + m.srcPitch * m_nSurfaceHeight);
-        m.dstHost = aux_plane;
-        if (!CudaCall(cuMemcpy2DAsync(&m, m_cuvidStream))) {return -1;}
-        if (!CudaCall(cuStreamSynchronize(m_cuvidStream))) {return -1;}
-        if (!CudaCall(cuCtxPopCurrent(NULL))) {return -1;}
+        r0 = row(chroma_height, band);
+        r1 = row(chroma_height, band + 1);
+        m.srcDevice = dpSrcFrame + (CUdeviceptr)nSrcPitch * (pic.surface_height + r0);
+        m.dstHost = chroma + (size_t)nSrcPitch * r0;
+        m.Height = r1 - r0;
+        if (!CudaCall(cuMemcpy2DAsync(&m, stream))) {return false;}
+        return CudaCall(cuEventRecord(staging.events[band], stream));
+    };
+
+    auto wait = [&](int band) {
+        NVClock::time_point t0 = NVClock::now();
+        bool res = CudaCall(cuEventSynchronize(staging.events[band]));
+        copy_us += NVusSince(t0);
+        return res;
+    };
 
+    auto convert = [&](int band) {
+        NVClock::time_point t0 = NVClock::now();
+        int r0 = row(byte_height, band), r1 = row(byte_height, band + 1);
+        NVCopyRows(luma, nSrcPitch, f->y_payload, f->bmpars.y_linesize, byte_width, r0, r1, streaming);
         // NV12 interleaved to YUV420 planar
-        int i,j;
-        for(i=0; i<m.Height; i++) {
-            for(j=0; j<(m.WidthInBytes/2)-1; j++) {
-                f->u_payload[i*(f->bmpars.u_linesize) + j] 
-                    = aux_plane[i*m.dstPitch + j*2];
-                f->v_payload[i*(f->bmpars.v_linesize) + j] 
-                    = aux_plane[i*m.dstPitch + j*2 + 1];
-            }
-        }
-        /*
-        // https://ffmpeg.org/doxygen/3.4/pixfmt_8h.html
-        // AV_PIX_FMT_NV12
-        height = sws_scale(sws_ctx, 
-            (const uint8_t * const*)aux_av_frame->data,  // srcSlice[]
-            aux_av_frame->linesize, // srcStride
-            0,  // srcSliceY
-            f->av_frame.height,  // srcSliceH
-            f->av_frame.data, // dst[] // written
-            f->av_frame.linesize); // dstStride[] // written
-        */
-
-        // f->copyMetaFrom(&in_frame);
-        f->n_slot = n_slot_aux;
-        f->subsession_index = subsession_index_aux;
-        /*
-        std::cout << "pDispInfo->timestamp: " << pDispInfo->timestamp << " " 
-            << pDispInfo->timestamp/10000 << std::endl;
-        */
-
-        f->mstimestamp=(pDispInfo->timestamp/10000)+first_timestamp; // "10Mhz clock"
-        //std::cout << *f << std::endl;
-        //std::cout << f->dumpPayload() << std::endl;
-    } // PROTECTED
-    if (!CudaCall(cuvidUnmapVideoFrame(m_hDecoder, dpSrcFrame))) {return -1;}
-    return 1;
+        r0 = row(chroma_height, band);
+        r1 = row(chroma_height, band + 1);
+        NVDeinterleave(chroma + (size_t)nSrcPitch * r0, nSrcPitch,
+            f->u_payload + (size_t)f->bmpars.u_linesize * r0, f->bmpars.u_linesize,
+            f->v_payload + (size_t)f->bmpars.v_linesize * r0, f->bmpars.v_linesize,
+            byte_width / 2, r1 - r0, streaming);
+        convert_us += NVusSince(t0);
+    };
+
+    ok = ok && NVPipelineBands(n_bands, copy, wait, convert);
+    if (!ok) { // nothing may be copying from the surface when it's unmapped
+        cuStreamSynchronize(stream);
+    }
+    // unmap in any case, so that the surface is not lost
+    ok = CudaCall(cuvidUnmapVideoFrame(m_hDecoder, dpSrcFrame)) && ok;
+    ok = CudaCall(cuCtxPopCurrent(NULL)) && ok;
+    pic.pitch = nSrcPitch;
+    pic.bytes = (uint64_t)byte_width * (byte_height + chroma_height);
+    pic.copy_us = copy_us;
+    pic.convert_us = convert_us;
+    /*
+    // https://ffmpeg.org/doxygen/3.4/pixfmt_8h.html
+    // AV_PIX_FMT_NV12
+    height = sws_scale(sws_ctx, 
+        (const uint8_t * const*)aux_av_frame->data,  // srcSlice[]
+        aux_av_frame->linesize, // srcStride
+        0,  // srcSliceY
+        f->av_frame.height,  // srcSliceH
+        f->av_frame.data, // dst[] // written
+        f->av_frame.linesize); // dstStride[] // written
+    */
+    f->n_slot = pic.n_slot;
+    f->subsession_index = pic.subsession_index;
+    f->mstimestamp = pic.mstimestamp;
+    return ok ? status : -1;
 }
 
 
+void NVDecoder::countStatus(int status) {
+    if (status == cuvidDecodeStatus_Error || status == cuvidDecodeStatus_Error_Concealed) {
+        //printf("Decode Error occurred for picture %d\n", m_nPicNumInDecodeOrder[pDispInfo->picture_index]);
+        decoderlogger.log(LogLevel::debug) << "NVDecoder: displayPicture: Decode Error occurred" << std::endl;
+        if (status == cuvidDecodeStatus_Error) {
+            NVSlotStats::incShared(stats->decode_errors);
+        }
+        else {
+            NVSlotStats::incShared(stats->decode_concealed);
+        }
+    }
+}
+
 void NVDecoder::flush() {
     if (!active) {return;}
     std::unique_lock<std::mutex> lk(this->mutex);
     semaring.reset();
+    releaseFrames();
 }
 
 
 Frame* NVDecoder::output() {
     if (!active) {return NULL;}
     std::unique_lock<std::mutex> lk(this->mutex);
-    int ind = semaring.getIndex();
+    int ind = semaring.peek(); // the oldest: at the end of stream, there may be several
     if (ind < 0) {
         return NULL;
     }
     #ifdef NVDECODER_VERBOSE
     std::cout << "NVDecoder: output: returning index " << ind << std::endl;
     #endif
-    return out_frame_rb[ind];
+    return out_frame_rb[ind].get();
 }
 
 
@@ -821,6 +1309,20 @@ void NVDecoder::releaseOutput() {
     if (!active) {return;}
     std::unique_lock<std::mutex> lk(this->mutex);
     int ind = semaring.read();
+    if (ind >= 0) {
+        out_frame_rb[ind].reset(); // back to the pool
+        NVSlotStats::inc(stats->emitted_frames);
+    }
+}
+
+
+void NVDecoder::discardOutput() {
+    if (!active) {return;}
+    std::unique_lock<std::mutex> lk(this->mutex);
+    int ind = semaring.read();
+    if (ind >= 0) {
+        out_frame_rb[ind].reset();
+    }
 }
 
 
@@ -837,6 +1339,10 @@ bool NVDecoder::pull() {
     }
 
     uint32_t flags = 0;
+    bool end = in_frame.payload.empty(); // end of stream: see the header
+    if (end) {
+        flags |= CUVID_PKT_ENDOFSTREAM;
+    }
     // m_nDecodedFrame = 0;
     CUVIDSOURCEDATAPACKET packet = {0};
     packet.payload = in_frame.payload.data();
@@ -863,7 +1369,26 @@ bool NVDecoder::pull() {
         n_slot_aux = in_frame.n_slot;
         subsession_index_aux = in_frame.subsession_index;
     }
+    if (stats->n_slot.load(std::memory_order_relaxed) != in_frame.n_slot) {
+        stats->n_slot.store(in_frame.n_slot, std::memory_order_relaxed);
+    }
+    if (!end) {
+        NVSlotStats::inc(stats->input_packets);
+        NVSlotStats::inc(stats->input_bytes, packet.payload_size);
+    }
+    NVClock::time_point t0 = NVClock::now();
+    // the callbacks run in this context
+    if (!CudaCall(cuCtxPushCurrent(m_cuContext))) {return false;}
     NVDEC_API_CALL(cuvidParseVideoData(m_hParser, &packet));
+    if (!CudaCall(cuCtxPopCurrent(NULL))) {return false;}
+    stats->parse_time.add(NVusSince(t0));
+    if (refused) { // by admission control in sequenceCallback: the session is of no use
+        releaseSession();
+        return false;
+    }
+    if (end && completion_queue) { // until the workers have caught up with the parser
+        emit_order.drain();
+    }
     //TODO: push stuff to the decoder from in_frame
     {
         // check if there is stuff in the ringbuffer
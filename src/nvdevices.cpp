@@ -0,0 +1,337 @@
+/*
+ * nvdevices.cpp : Process-wide registry of the decoding load on each GPU
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvdevices.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide registry of the decoding load on each GPU
+ */
+
+#include "nvdevices.h"
+
+// a device with less free memory than this is considered full
+static const size_t min_free_bytes = 256*1024*1024;
+// frame rate assumed when the bitstream does not tell
+static const double default_fps = 25.0;
+// nominal H264 throughput of one NVDEC engine: ~490 fps of 1080p
+static const double default_mbps_per_engine = 4000000.0;
+static const double default_max_utilisation = 0.9;
+
+
+double NVMacroblockRate(unsigned coded_width, unsigned coded_height, unsigned fps_numerator, unsigned fps_denominator) {
+    double fps = default_fps;
+    if (fps_numerator > 0 && fps_denominator > 0) {
+        fps = (double)fps_numerator / fps_denominator;
+    }
+    return ((coded_width + 15) / 16) * ((coded_height + 15) / 16) * fps;
+}
+
+
+void NVDecoderMaxSize(const CUVIDDECODECAPS& caps, unsigned coded_width, unsigned coded_height, unsigned& max_width, unsigned& max_height) {
+    max_width = std::min(std::max(max_width, coded_width), caps.nMaxWidth);
+    max_height = std::min(std::max(max_height, coded_height), caps.nMaxHeight);
+    if ((max_width >> 4) * (max_height >> 4) > caps.nMaxMBCount) {
+        max_width = coded_width;
+        max_height = coded_height;
+    }
+}
+
+
+bool NVReconfigurable(unsigned coded_width, unsigned coded_height, unsigned max_width, unsigned max_height) {
+    return (coded_width <= max_width) && (coded_height <= max_height) &&
+        ((coded_width >> 4) * (coded_height >> 4) <= (max_width >> 4) * (max_height >> 4));
+}
+
+
+NVDeviceLoad::NVDeviceLoad(int gpu_index, size_t total_bytes) :
+    gpu_index(gpu_index), sessions(0), mbps(0), free_bytes(total_bytes), total_bytes(total_bytes),
+    engines(0), budget(0), admitted(0), refused(0) {
+}
+
+
+NVDeviceRegistry::NVDeviceRegistry(NVDriver* driver) : driver(driver), probed(false), next_id(0),
+    max_utilisation(default_max_utilisation), mbps_per_engine(default_mbps_per_engine) {
+}
+
+
+NVDeviceRegistry::~NVDeviceRegistry() {
+}
+
+
+NVDeviceRegistry& NVDeviceRegistry::instance() {
+    static NVDeviceRegistry registry;
+    return registry;
+}
+
+
+void NVDeviceRegistry::probe() {
+    if (probed) {
+        return;
+    }
+    NVDriver* drv = driver ? driver : NVDriver::get();
+    int n = drv->getDeviceCount();
+    for (int i = 0; i < n; i++) {
+        NVDeviceLoad load(i, drv->getTotalMemory(i));
+        // the budget is estimated with H264 4:2:0 8 bit, the common case for IP cameras
+        CUVIDDECODECAPS caps;
+        memset(&caps, 0, sizeof(caps));
+        caps.eCodecType = cudaVideoCodec_H264;
+        caps.eChromaFormat = cudaVideoChromaFormat_420;
+        caps.nBitDepthMinus8 = 0;
+        if (drv->getDecoderCaps(i, caps) && caps.bIsSupported) {
+            load.engines = std::max(1, (int)caps.nNumNVDECs);
+            load.budget = load.engines * mbps_per_engine;
+        }
+        decoderlogger.log(LogLevel::debug) << "NVDeviceRegistry: GPU " << i << " : " << load.engines
+            << " NVDEC engines, budget " << load.budget << " macroblocks/s" << std::endl;
+        devices.push_back(load);
+    }
+    probed = (n > 0); // cuInit might not have been called yet, so try again later
+}
+
+
+int NVDeviceRegistry::choose(const std::vector<NVDeviceLoad>& loads, double mbps) {
+    int best = -1;
+    bool best_fits = false;
+    for (int i = 0; i < loads.size(); i++) {
+        const NVDeviceLoad& l = loads[i];
+        bool fits = (l.free_bytes >= min_free_bytes);
+        if (best < 0) {
+            best = i; best_fits = fits;
+            continue;
+        }
+        const NVDeviceLoad& b = loads[best];
+        // prefer devices with enough memory, then lowest utilisation of the decoding budget
+        // (or least committed macroblocks, if the budget is not known), then fewer sessions,
+        // then more free memory
+        if (fits != best_fits) {
+            if (fits) {
+                best = i; best_fits = fits;
+            }
+            continue;
+        }
+        double lu = (l.mbps + mbps) / (l.budget > 0 ? l.budget : 1.0);
+        double bu = (b.mbps + mbps) / (b.budget > 0 ? b.budget : 1.0);
+        if (lu != bu) {
+            if (lu < bu) {
+                best = i; best_fits = fits;
+            }
+            continue;
+        }
+        if (l.sessions != b.sessions) {
+            if (l.sessions < b.sessions) {
+                best = i; best_fits = fits;
+            }
+            continue;
+        }
+        if (l.free_bytes > b.free_bytes) {
+            best = i; best_fits = fits;
+        }
+    }
+    return best;
+}
+
+
+double NVDeviceRegistry::lastLoad(const void* owner) {
+    auto it = history.find(owner);
+    if (it != history.end()) {
+        return it->second;
+    }
+    return 0;
+}
+
+
+int NVDeviceRegistry::place(const void* owner) {
+    std::unique_lock<std::mutex> lk(mutex);
+    probe();
+    int i = choose(devices, lastLoad(owner));
+    return (i < 0) ? -1 : devices[i].gpu_index;
+}
+
+
+int NVDeviceRegistry::acquire(const void* owner, int gpu_index, long& session_id) {
+    std::unique_lock<std::mutex> lk(mutex);
+    probe();
+    double mbps = lastLoad(owner);
+
+    if (gpu_index < 0) {
+        int i = choose(devices, mbps);
+        if (i < 0) {
+            decoderlogger.log(LogLevel::fatal) << "NVDeviceRegistry: acquire: no cuda devices" << std::endl;
+            session_id = -1;
+            return -1;
+        }
+        gpu_index = devices[i].gpu_index;
+        decoderlogger.log(LogLevel::normal) << "NVDeviceRegistry: placing stream to GPU " << gpu_index
+            << " with " << devices[i].sessions << " sessions, " << devices[i].mbps << " macroblocks/s" << std::endl;
+    }
+
+    Session session;
+    session.gpu_index = gpu_index;
+    session.owner = owner;
+    session.mbps = mbps;
+    session_id = next_id++;
+    sessions[session_id] = session;
+    if (gpu_index < devices.size()) {
+        devices[gpu_index].sessions++;
+        devices[gpu_index].mbps += mbps;
+    }
+    return gpu_index;
+}
+
+
+bool NVDeviceRegistry::admit(long session_id, double mbps) {
+    std::unique_lock<std::mutex> lk(mutex);
+    auto it = sessions.find(session_id);
+    if (it == sessions.end()) {
+        return true; // not registered: nothing to check against
+    }
+    Session& session = it->second;
+    history[session.owner] = mbps;
+    if (session.gpu_index >= devices.size()) {
+        session.mbps = mbps;
+        return true;
+    }
+    NVDeviceLoad& l = devices[session.gpu_index];
+    double committed = l.mbps - session.mbps + mbps;
+    if (max_utilisation > 0 && l.budget > 0 && committed > max_utilisation * l.budget) {
+        l.refused++;
+        l.mbps = std::max(0.0, l.mbps - session.mbps); // refused session does not load the device
+        session.mbps = 0;
+        decoderlogger.log(LogLevel::normal) << "NVDeviceRegistry: GPU " << l.gpu_index << " refused a new session of "
+            << mbps << " macroblocks/s : committed " << l.mbps << " of budget " << l.budget << std::endl;
+        return false;
+    }
+    l.admitted++;
+    l.mbps = committed;
+    session.mbps = mbps;
+    decoderlogger.log(LogLevel::debug) << "NVDeviceRegistry: GPU " << l.gpu_index << " admitted a new session of "
+        << mbps << " macroblocks/s : committed " << l.mbps << " of budget " << l.budget << std::endl;
+    return true;
+}
+
+
+void NVDeviceRegistry::update(long session_id, double mbps) {
+    std::unique_lock<std::mutex> lk(mutex);
+    auto it = sessions.find(session_id);
+    if (it == sessions.end()) {
+        return;
+    }
+    Session& session = it->second;
+    if (session.gpu_index < devices.size()) {
+        devices[session.gpu_index].mbps += mbps - session.mbps;
+    }
+    session.mbps = mbps;
+    history[session.owner] = mbps;
+}
+
+
+void NVDeviceRegistry::reassign(long session_id, const void* owner) {
+    std::unique_lock<std::mutex> lk(mutex);
+    auto it = sessions.find(session_id);
+    if (it == sessions.end()) {
+        return;
+    }
+    Session& session = it->second;
+    if (session.gpu_index < devices.size()) {
+        NVDeviceLoad& l = devices[session.gpu_index];
+        l.mbps = std::max(0.0, l.mbps - session.mbps);
+    }
+    session.owner = owner;
+    session.mbps = 0;
+}
+
+
+void NVDeviceRegistry::release(long session_id) {
+    int gpu_index = -1;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        auto it = sessions.find(session_id);
+        if (it == sessions.end()) {
+            return;
+        }
+        Session& session = it->second;
+        if (session.gpu_index < devices.size()) {
+            NVDeviceLoad& l = devices[session.gpu_index];
+            l.sessions--;
+            l.mbps = std::max(0.0, l.mbps - session.mbps);
+            gpu_index = session.gpu_index;
+        }
+        sessions.erase(it);
+    }
+    // the decoder is gone by now, so its memory counts as free.  Asked without the mutex, so that acquire & place don't wait for the driver
+    NVDriver* drv = driver ? driver : NVDriver::get();
+    size_t free_bytes = 0;
+    if (gpu_index >= 0 && drv->getFreeMemory(gpu_index, free_bytes)) {
+        updateMemory(gpu_index, free_bytes);
+    }
+}
+
+
+void NVDeviceRegistry::forget(const void* owner) {
+    std::unique_lock<std::mutex> lk(mutex);
+    history.erase(owner);
+}
+
+
+void NVDeviceRegistry::updateMemory(int gpu_index, size_t free_bytes) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (gpu_index >= 0 && gpu_index < devices.size()) {
+        devices[gpu_index].free_bytes = free_bytes;
+    }
+}
+
+
+void NVDeviceRegistry::setAdmission(double max_utilisation, double mbps_per_engine) {
+    std::unique_lock<std::mutex> lk(mutex);
+    this->max_utilisation = max_utilisation;
+    this->mbps_per_engine = mbps_per_engine;
+    for (auto it = devices.begin(); it != devices.end(); ++it) {
+        it->budget = it->engines * mbps_per_engine;
+    }
+}
+
+
+std::vector<NVDeviceLoad> NVDeviceRegistry::getLoads() {
+    std::unique_lock<std::mutex> lk(mutex);
+    probe();
+    return devices;
+}
+
+
+PyObject* NVDeviceRegistry::getPyLoads() {
+    std::vector<NVDeviceLoad> loads = getLoads();
+    PyObject* pylist = PyList_New(0);
+    for (auto it = loads.begin(); it != loads.end(); ++it) {
+        PyObject* dic = PyDict_New();
+        PyObject* value;
+        value = PyLong_FromLong(it->gpu_index);     PyDict_SetItemString(dic, "gpu_index", value);     Py_DECREF(value);
+        value = PyLong_FromLong(it->sessions);      PyDict_SetItemString(dic, "sessions", value);      Py_DECREF(value);
+        value = PyFloat_FromDouble(it->mbps);       PyDict_SetItemString(dic, "mbps", value);          Py_DECREF(value);
+        value = PyLong_FromSize_t(it->free_bytes);  PyDict_SetItemString(dic, "free_bytes", value);    Py_DECREF(value);
+        value = PyLong_FromSize_t(it->total_bytes); PyDict_SetItemString(dic, "total_bytes", value);   Py_DECREF(value);
+        value = PyLong_FromLong(it->engines);       PyDict_SetItemString(dic, "engines", value);       Py_DECREF(value);
+        value = PyFloat_FromDouble(it->budget);     PyDict_SetItemString(dic, "budget", value);        Py_DECREF(value);
+        value = PyLong_FromLong(it->admitted);      PyDict_SetItemString(dic, "admitted", value);      Py_DECREF(value);
+        value = PyLong_FromLong(it->refused);       PyDict_SetItemString(dic, "refused", value);       Py_DECREF(value);
+        PyList_Append(pylist, dic);
+        Py_DECREF(dic);
+    }
+    return pylist;
+}
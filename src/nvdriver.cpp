@@ -0,0 +1,149 @@
+/*
+ * nvdriver.cpp : Thin layer over the cuda driver queries used for resource management
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvdriver.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Thin layer over the cuda driver queries used for resource management
+ */
+
+#include "nvdriver.h"
+
+static NVDriver cuda_driver;
+static std::atomic<NVDriver*> current_driver(&cuda_driver);
+
+
+NVDriver::NVDriver() {
+}
+
+
+NVDriver::~NVDriver() {
+}
+
+
+int NVDriver::getDeviceCount() {
+    int nGpu = 0;
+    if (cuDeviceGetCount(&nGpu) != CUDA_SUCCESS) {
+        return 0;
+    }
+    return nGpu;
+}
+
+
+size_t NVDriver::getTotalMemory(int gpu_index) {
+    CUdevice dev = 0;
+    size_t total = 0;
+    if (cuDeviceGet(&dev, gpu_index) != CUDA_SUCCESS) {
+        return 0;
+    }
+    if (cuDeviceTotalMem(&total, dev) != CUDA_SUCCESS) {
+        return 0;
+    }
+    return total;
+}
+
+
+bool NVDriver::getFreeMemory(int gpu_index, size_t& free_bytes) {
+    CUdevice dev = 0;
+    CUcontext ctx = NULL;
+    size_t total = 0;
+    unsigned int flags = 0;
+    int ctx_active = 0;
+    bool ok = false;
+    if (cuDeviceGet(&dev, gpu_index) != CUDA_SUCCESS) {
+        return false;
+    }
+    // in the primary context, only if it's there already: creating one would cost more than the query
+    if (cuDevicePrimaryCtxGetState(dev, &flags, &ctx_active) != CUDA_SUCCESS || !ctx_active) {
+        return false;
+    }
+    if (cuDevicePrimaryCtxRetain(&ctx, dev) != CUDA_SUCCESS) {
+        return false;
+    }
+    if (cuCtxPushCurrent(ctx) == CUDA_SUCCESS) {
+        ok = (cuMemGetInfo(&free_bytes, &total) == CUDA_SUCCESS);
+        cuCtxPopCurrent(NULL);
+    }
+    cuDevicePrimaryCtxRelease(dev);
+    return ok;
+}
+
+
+bool NVDriver::getDecoderCaps(int gpu_index, CUVIDDECODECAPS& caps) {
+    CUdevice dev = 0;
+    CUcontext ctx = NULL;
+    bool ok = false;
+    if (cuDeviceGet(&dev, gpu_index) != CUDA_SUCCESS) {
+        return false;
+    }
+    // cuvidGetDecoderCaps needs a context: use the primary one, so that no new context is created
+    if (cuDevicePrimaryCtxRetain(&ctx, dev) != CUDA_SUCCESS) {
+        return false;
+    }
+    if (cuCtxPushCurrent(ctx) == CUDA_SUCCESS) {
+        ok = (cuvidGetDecoderCaps(&caps) == CUDA_SUCCESS);
+        cuCtxPopCurrent(NULL);
+    }
+    cuDevicePrimaryCtxRelease(dev);
+    return ok;
+}
+
+
+bool NVDriver::pushContext(CUcontext context) {
+    return (cuCtxPushCurrent(context) == CUDA_SUCCESS);
+}
+
+
+void NVDriver::popContext() {
+    cuCtxPopCurrent(NULL);
+}
+
+
+bool NVDriver::allocPitch(size_t width_bytes, size_t height, CUdeviceptr& ptr, size_t& pitch) {
+    // 16: element size for the widest (128-bit) accesses
+    return (cuMemAllocPitch(&ptr, &pitch, width_bytes, height, 16) == CUDA_SUCCESS);
+}
+
+
+void NVDriver::freeDevice(CUdeviceptr ptr) {
+    cuMemFree(ptr);
+}
+
+
+bool NVDriver::copy2D(const CUDA_MEMCPY2D& m, CUstream stream) {
+    return (cuMemcpy2DAsync(&m, stream) == CUDA_SUCCESS);
+}
+
+
+bool NVDriver::synchronize(CUstream stream) {
+    return (cuStreamSynchronize(stream) == CUDA_SUCCESS);
+}
+
+
+NVDriver* NVDriver::get() {
+    return current_driver.load();
+}
+
+
+void NVDriver::set(NVDriver* driver) {
+    if (!driver) {
+        driver = &cuda_driver;
+    }
+    current_driver.store(driver);
+}
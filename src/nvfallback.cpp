@@ -0,0 +1,778 @@
+/*
+ * nvfallback.cpp : Decoder that switches from the GPU to the CPU when needed
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvfallback.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decoder that switches from the GPU to the CPU when needed
+ */
+
+#include "nvfallback.h"
+#include "nvresident.h"
+
+
+NVParameterCache::NVParameterCache() {
+}
+
+
+NVParameterCache::~NVParameterCache() {
+}
+
+
+void NVParameterCache::set(int n_slot, const std::vector<uint8_t>& ps) {
+    std::unique_lock<std::mutex> lk(mutex);
+    parameter_sets[n_slot] = ps;
+}
+
+
+bool NVParameterCache::get(int n_slot, std::vector<uint8_t>& ps) {
+    std::unique_lock<std::mutex> lk(mutex);
+    auto it = parameter_sets.find(n_slot);
+    if (it == parameter_sets.end()) {
+        return false;
+    }
+    ps = it->second;
+    return true;
+}
+
+
+bool NVParameterCache::getOnly(int& n_slot, std::vector<uint8_t>& ps) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (parameter_sets.size() != 1) {
+        return false;
+    }
+    n_slot = parameter_sets.begin()->first;
+    ps = parameter_sets.begin()->second;
+    return true;
+}
+
+
+bool NVParameterCache::setPy(int n_slot, PyObject* ps) {
+    if (!ps || ps == Py_None) {
+        clear(n_slot);
+        return true;
+    }
+    char* data;
+    Py_ssize_t size;
+    if (!PyBytes_Check(ps) || PyBytes_AsStringAndSize(ps, &data, &size) != 0) {
+        decoderlogger.log(LogLevel::fatal) << "NVParameterCache: setPy: expected bytes" << std::endl;
+        PyErr_Clear();
+        return false;
+    }
+    set(n_slot, std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + size));
+    return true;
+}
+
+
+void NVParameterCache::clear(int n_slot) {
+    std::unique_lock<std::mutex> lk(mutex);
+    parameter_sets.erase(n_slot);
+}
+
+
+std::vector<std::pair<size_t, size_t>> NVParameterCache::split(const std::vector<uint8_t>& data) {
+    std::vector<std::pair<size_t, size_t>> nals;
+    size_t n = data.size();
+    size_t start = n; // start of the current NAL unit, start code included
+    size_t i = 0;
+    while (i + 2 < n) {
+        if (data[i] == 0 && data[i+1] == 0 && data[i+2] == 1) {
+            size_t sc = (i > 0 && data[i-1] == 0) ? i - 1 : i; // 4-byte start code
+            if (start < sc) {
+                nals.push_back(std::make_pair(start, sc));
+            }
+            start = sc;
+            i += 3;
+        }
+        else {
+            i++;
+        }
+    }
+    if (start < n) {
+        nals.push_back(std::make_pair(start, n));
+    }
+    return nals;
+}
+
+
+NVGopCache::NVGopCache(int max_cached) : sps(NULL), pps(NULL), gop_ok(false), max_cached(std::max(1, max_cached)) {
+}
+
+
+NVGopCache::~NVGopCache() {
+    clear();
+    if (sps) {
+        delete sps;
+    }
+    if (pps) {
+        delete pps;
+    }
+    for (auto it = stock.begin(); it != stock.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+BasicFrame* NVGopCache::getFrame() {
+    if (stock.empty()) {
+        return new BasicFrame();
+    }
+    BasicFrame* f = stock.back();
+    stock.pop_back();
+    return f;
+}
+
+
+void NVGopCache::recycle(BasicFrame* f) {
+    stock.push_back(f);
+}
+
+
+void NVGopCache::clear() {
+    for (auto it = gop.begin(); it != gop.end(); ++it) {
+        recycle(*it);
+    }
+    gop.clear();
+    gop_ok = false;
+}
+
+
+void NVGopCache::cache(BasicFrame* in) {
+    if (in->codec_id != AV_CODEC_ID_H264) {
+        return;
+    }
+    BasicFrame* f;
+    switch (in->h264_pars.slice_type) {
+        case H264SliceType::sps:
+            // new sequence: packets before this are of no use
+            clear();
+            if (!sps) {
+                sps = new BasicFrame();
+            }
+            sps->copyFrom(in);
+            break;
+        case H264SliceType::pps:
+            if (!pps) {
+                pps = new BasicFrame();
+            }
+            pps->copyFrom(in);
+            break;
+        case H264SliceType::i:
+            clear();
+            gop_ok = true;
+            // fall through
+        default:
+            if (!gop_ok) {
+                break;
+            }
+            if (gop.size() >= max_cached) {
+                decoderlogger.log(LogLevel::debug) << "NVGopCache: cache: GOP longer than " << max_cached << " packets" << std::endl;
+                clear();
+                break;
+            }
+            f = getFrame();
+            f->copyFrom(in);
+            gop.push_back(f);
+            break;
+    }
+}
+
+
+bool NVGopCache::hasGop() {
+    return gop_ok && !gop.empty();
+}
+
+
+bool NVGopCache::isKeyframe(BasicFrame* f) {
+    return gop_ok && f->h264_pars.slice_type == H264SliceType::i;
+}
+
+
+void NVGopCache::packets(std::vector<BasicFrame*>& packets) {
+    packets.clear();
+    if (sps) {
+        packets.push_back(sps);
+    }
+    if (pps) {
+        packets.push_back(pps);
+    }
+    packets.insert(packets.end(), gop.begin(), gop.end());
+}
+
+
+NVFallbackDecoder::NVFallbackDecoder(std::function<Decoder*()> primary, std::function<Decoder*()> fallback, std::shared_ptr<NVSlotStats> stats, int max_cached, long retry_ms) :
+    Decoder(), gpu_decoder(NULL), cpu_decoder(NULL), current(NULL), primary(primary), fallback(fallback),
+    stats(stats), retry_ms(retry_ms), failed_time(NVClock::now()),
+    created_time(NVClock::now()), first_frame(false), n_slot(-1), preloaded_slot(-1),
+    gop(std::make_shared<NVGopCache>(max_cached)), joined(false), joining(false), join_time(NVClock::now()),
+    catching_up(false), lag_ok(false), lag_base(0), catchup_lag(0), skipping(false), skip_output(false),
+    scrub_mode(0), scrub_floor(0), pace_speed(0), pace_ok(false), pace_ts(0), pace_time(NVClock::now()),
+    pass_ts(0), pass_time(NVClock::now()), early(false),
+    pace_clock([]() { return NVClock::now(); }) {
+    newGpu();
+    current = gpu_decoder;
+    if (!gpu_decoder || !gpu_decoder->isOk()) {
+        switchToFallback("GPU decoder could not be initialized");
+    }
+}
+
+
+NVFallbackDecoder::~NVFallbackDecoder() {
+    if (params && gop->sps && gop->pps && n_slot >= 0) { // for the next session
+        std::vector<uint8_t> ps(gop->sps->payload);
+        ps.insert(ps.end(), gop->pps->payload.begin(), gop->pps->payload.end());
+        params->set(n_slot, ps);
+    }
+    stats->latency_us.store(0, std::memory_order_relaxed);
+    dropGpu(false);
+    if (cpu_decoder) {
+        delete cpu_decoder;
+    }
+}
+
+
+void NVFallbackDecoder::preload(int slot) {
+    std::vector<uint8_t> ps;
+    if (!params || !params->get(slot, ps)) {
+        return;
+    }
+    if (gop->hasGop()) { // from a previous decoder: priming at the first packet creates the NVDEC decoder
+        preloaded_slot = slot;
+        return;
+    }
+    decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: preload: injecting parameter sets of slot " << slot << std::endl;
+    preloaded_slot = slot;
+    std::vector<std::pair<size_t, size_t>> nals = NVParameterCache::split(ps);
+    for (auto it = nals.begin(); it != nals.end(); ++it) {
+        BasicFrame* f = gop->getFrame();
+        f->payload.assign(ps.begin() + it->first, ps.begin() + it->second);
+        f->media_type = MediaType::video;
+        f->codec_id = AV_CODEC_ID_H264;
+        f->n_slot = slot;
+        f->subsession_index = 0;
+        f->mstimestamp = 0;
+        f->fillH264Pars();
+        gop->cache(f);
+        if (current) { // parameter sets produce no output
+            current->input(f);
+            current->pull();
+        }
+        gop->recycle(f);
+    }
+}
+
+
+void NVFallbackDecoder::setParameterCache(std::shared_ptr<NVParameterCache> params) {
+    this->params = params;
+    int slot;
+    std::vector<uint8_t> ps;
+    if (params && params->getOnly(slot, ps)) {
+        preload(slot); // create the NVDEC decoder right away
+    }
+}
+
+
+void NVFallbackDecoder::setDisposer(std::function<void(Decoder*)> dispose) {
+    this->dispose = dispose;
+}
+
+
+void NVFallbackDecoder::setGopCache(std::shared_ptr<NVGopCache> gop) {
+    this->gop = gop;
+}
+
+
+void NVFallbackDecoder::setStandby(std::function<bool()> standby) {
+    this->standby = standby;
+}
+
+
+void NVFallbackDecoder::setMaxLatency(std::function<long()> max_latency_ms) {
+    this->max_latency = max_latency_ms;
+}
+
+
+void NVFallbackDecoder::setSuspended(std::function<bool()> suspended) {
+    this->suspended = suspended;
+}
+
+
+void NVFallbackDecoder::setPlaybackSpeed(std::function<double()> speed) {
+    this->speed = speed;
+}
+
+
+void NVFallbackDecoder::setPaceClock(std::function<NVClock::time_point()> now) {
+    pace_clock = now;
+}
+
+
+void NVFallbackDecoder::setResidentFrames(std::shared_ptr<NVResidentFrames> resident) {
+    this->resident = resident;
+}
+
+
+bool NVFallbackDecoder::prime(Decoder* decoder) {
+    std::vector<BasicFrame*> packets;
+    gop->packets(packets);
+
+    // decoders that can, don't even download the older pictures
+    NVOutputSkipper* skipper = dynamic_cast<NVOutputSkipper*>(decoder);
+    if (skipper) {
+        skipper->skipOutput(true);
+    }
+    bool got = false;
+    for (auto it = packets.begin(); it != packets.end(); ++it) {
+        if (got) { // output of an older packet: suppress
+            discard(decoder);
+        }
+        if (skipper && it + 1 == packets.end()) {
+            skipper->skipOutput(skip_output);
+        }
+        decoder->input(*it);
+        got = decoder->pull();
+    }
+    if (skipper) {
+        skipper->skipOutput(skip_output);
+    }
+    return suppress(decoder, got);
+}
+
+
+bool NVFallbackDecoder::suppress(Decoder* decoder, bool got) {
+    if (!got) {
+        return got;
+    }
+    if (skip_output) {
+        discard(decoder);
+        NVSlotStats::inc(stats->skipped_frames);
+        return false;
+    }
+    if (decoder == cpu_decoder && resident && resident->enabled()) { // as NVDecoder does on the GPU
+        Frame* f = decoder->output();
+        if (f->getFrameType() == FrameType::avbitmapframe && resident->keep(static_cast<AVBitmapFrame*>(f))) {
+            NVSlotStats::inc(stats->resident_frames);
+        }
+        else {
+            NVSlotStats::incShared(stats->dropped_frames);
+        }
+        discard(decoder);
+        return false;
+    }
+    return got;
+}
+
+
+void NVFallbackDecoder::discard(Decoder* decoder) {
+    // NVDecoder counts the outputs released as emitted
+    NVOutputSkipper* skipper = dynamic_cast<NVOutputSkipper*>(decoder);
+    if (skipper) {
+        skipper->discardOutput();
+    }
+    else {
+        decoder->releaseOutput();
+    }
+}
+
+
+void NVFallbackDecoder::suspend() {
+    bool suspend = (suspended && suspended());
+    if (suspend != skipping) {
+        skipping = suspend;
+        decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: output " << (skipping ? "suspended" : "resumed") << std::endl;
+    }
+    // pictures ahead of the playback pace are decoded for reference only, as while suspended
+    bool skip = skipping || early;
+    if (skip == skip_output) {
+        return;
+    }
+    skip_output = skip;
+    NVOutputSkipper* skipper = dynamic_cast<NVOutputSkipper*>(current);
+    if (skipper) {
+        skipper->skipOutput(skip_output);
+    }
+}
+
+
+// a jump of the timestamps beyond this is a new time base, not latency
+static const long max_lag_jump_ms = 60000;
+
+
+/** A slice that no other picture refers to: nal_ref_idc of its first NAL unit is 0 */
+static bool disposable(const BasicFrame& f) {
+    const std::vector<uint8_t>& p = f.payload;
+    for (size_t i = 0; i + 3 < p.size() && i < 4; i++) {
+        if (p[i] == 0 && p[i+1] == 0 && p[i+2] == 1) {
+            uint8_t nal = p[i+3];
+            return ((nal & 0x1f) == 1 && (nal & 0x60) == 0);
+        }
+    }
+    return false;
+}
+
+
+bool NVFallbackDecoder::catchUp() {
+    long max_ms = max_latency ? max_latency() : 0;
+    if (max_ms <= 0) {
+        catching_up = false;
+        return false;
+    }
+    unsigned slice_type = in_frame.h264_pars.slice_type;
+    if (slice_type == H264SliceType::sps || slice_type == H264SliceType::pps) {
+        return false;
+    }
+    long lag = NVmsNow() - in_frame.mstimestamp;
+    if (!lag_ok || lag < lag_base || lag - lag_base > max_lag_jump_ms) {
+        lag_base = lag;
+        lag_ok = true;
+    }
+    long excess = lag - lag_base;
+    stats->latency_us.store((uint64_t)excess * 1000, std::memory_order_relaxed);
+    bool keyframe = gop->isKeyframe(&in_frame);
+    if (catching_up) {
+        if (!keyframe) {
+            NVSlotStats::inc(stats->catchup_packets);
+            return true;
+        }
+        catching_up = false;
+        NVSlotStats::inc(stats->catchup_recovered_us, (uint64_t)std::max(0L, catchup_lag - excess) * 1000);
+        decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: catchUp: " << excess << " ms behind at the keyframe, was "
+            << catchup_lag << " ms" << std::endl;
+        return false;
+    }
+    if (excess > max_ms && !keyframe) { // a keyframe is decoded anyway: decoding goes on from there
+        catching_up = true;
+        catchup_lag = excess;
+        NVSlotStats::inc(stats->catchups);
+        NVSlotStats::inc(stats->catchup_packets);
+        decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: catchUp: " << excess << " ms behind, dropping packets up to the next keyframe" << std::endl;
+        return true;
+    }
+    if (excess > max_ms / 2 && disposable(in_frame)) {
+        NVSlotStats::inc(stats->catchup_packets);
+        return true;
+    }
+    return false;
+}
+
+
+// pictures decoded at a playback speed
+static const int scrub_all = 0;
+static const int scrub_reference = 1;
+static const int scrub_keyframes = 2;
+
+// speeds from which less is decoded to begin with
+static const double reference_only_speed = 2.0;
+static const double keyframe_only_speed = 8.0;
+
+// further ahead is a gap in the recording: the pace starts over
+static const long max_pace_ahead_ms = 1000;
+// pictures fed at most this much too early are passed on all the same, e.g. for the feeder's jitter
+static const long pace_slack_ms = 10;
+// decoding this late means it can't keep up
+static const long max_pace_lag_ms = 500;
+
+
+bool NVFallbackDecoder::scrub() {
+    early = false;
+    double s = speed ? speed() : 0;
+    unsigned slice_type = in_frame.h264_pars.slice_type;
+    if (slice_type == H264SliceType::sps || slice_type == H264SliceType::pps) {
+        return false;
+    }
+    if (s != pace_speed) {
+        pace_speed = s;
+        pace_ok = false;
+        scrub_floor = (s > keyframe_only_speed) ? scrub_keyframes : (s > reference_only_speed) ? scrub_reference : scrub_all;
+    }
+    // decoding less is fine right away, decoding more only from a keyframe on.  Also when the speed goes to 0
+    bool keyframe = gop->isKeyframe(&in_frame);
+    if (scrub_floor > scrub_mode || (scrub_floor < scrub_mode && keyframe)) {
+        decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: scrub: mode " << scrub_mode << " -> " << scrub_floor
+            << " at speed " << s << std::endl;
+        scrub_mode = scrub_floor;
+    }
+    if ((scrub_mode == scrub_keyframes && !keyframe) || (scrub_mode == scrub_reference && disposable(in_frame))) {
+        NVSlotStats::inc(stats->scrub_packets);
+        return true;
+    }
+    if (s <= 0) { // no pacing
+        return false;
+    }
+    long ts = in_frame.mstimestamp;
+    NVClock::time_point now = pace_clock();
+    if (!pace_ok || ts < pace_ts) {
+        pace_ok = true;
+        pace_ts = ts;
+        pace_time = now;
+        pass_ts = ts;
+        pass_time = now;
+        return false;
+    }
+    long ahead_ms = (long)((ts - pace_ts) / s) - (long)std::chrono::duration_cast<std::chrono::milliseconds>(now - pace_time).count();
+    if (ahead_ms > max_pace_ahead_ms) {
+        pace_ts = ts;
+        pace_time = now;
+    }
+    else if (-ahead_ms > max_pace_lag_ms) {
+        if (scrub_floor < scrub_keyframes) {
+            scrub_floor++;
+            scrub_mode = scrub_floor;
+            decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: scrub: " << -ahead_ms << " ms behind the pace, mode "
+                << scrub_mode << " at speed " << s << std::endl;
+        }
+        pace_ts = ts;
+        pace_time = now;
+    }
+    // fed faster than the speed: a picture per interval at the speed is passed on, the others are dropped.  No waiting
+    long early_ms = (long)((ts - pass_ts) / s) - (long)std::chrono::duration_cast<std::chrono::milliseconds>(now - pass_time).count();
+    pass_ts = ts;
+    if (early_ms > pace_slack_ms) {
+        NVSlotStats::inc(stats->pace_drops);
+        if (disposable(in_frame)) {
+            return true;
+        }
+        early = true;
+    }
+    else {
+        pass_time = now;
+    }
+    return false;
+}
+
+
+bool NVFallbackDecoder::join() {
+    joined = true;
+    if (!current || !gop->hasGop()) { // decoding starts at the next keyframe, as usual
+        return false;
+    }
+    NVClock::time_point t0 = NVClock::now();
+    std::vector<BasicFrame*> packets;
+    gop->packets(packets);
+    // completion workers may pass the frame on before prime returns
+    join_time = t0;
+    joining = true;
+    bool got = prime(current);
+    if (current == gpu_decoder && !gpu_decoder->isOk()) {
+        return switchToFallback("GPU decoder failed");
+    }
+    NVSlotStats::inc(stats->gop_joins);
+    NVSlotStats::inc(stats->join_packets, packets.size());
+    decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: join: " << packets.size() << " cached packets in "
+        << NVusSince(t0) << " us" << std::endl;
+    return got;
+}
+
+
+void NVFallbackDecoder::newGpu() {
+    gpu_decoder = primary();
+    // frames passed on by the GPU decoder's own threads
+    NVOutputNotifier* notifier = dynamic_cast<NVOutputNotifier*>(gpu_decoder);
+    if (notifier) {
+        notifier->setOnEmit([this]() { this->emitted(); });
+    }
+}
+
+
+void NVFallbackDecoder::emitted() {
+    if (!first_frame.exchange(true)) {
+        stats->first_frame_us.store(std::max<uint64_t>(1, NVusSince(created_time)), std::memory_order_relaxed); // 0 = no frames
+    }
+    if (joining.exchange(false)) {
+        stats->join_us.store(std::max<uint64_t>(1, NVusSince(join_time.load())), std::memory_order_relaxed);
+    }
+}
+
+
+void NVFallbackDecoder::dropGpu(bool failed) {
+    if (gpu_decoder) {
+        // a failed decoder is of no use to anybody: its session & context go right away
+        if (dispose && !failed) {
+            dispose(gpu_decoder);
+        }
+        else {
+            delete gpu_decoder;
+        }
+        gpu_decoder = NULL;
+    }
+    failed_time = NVClock::now();
+}
+
+
+bool NVFallbackDecoder::switchToFallback(const char* reason) {
+    decoderlogger.log(LogLevel::normal) << "NVFallbackDecoder: switching to CPU decoding: " << reason << std::endl;
+    dropGpu(true);
+    if (!cpu_decoder) {
+        cpu_decoder = fallback();
+    }
+    current = cpu_decoder;
+    if (!cpu_decoder) {
+        decoderlogger.log(LogLevel::fatal) << "NVFallbackDecoder: no CPU decoder available" << std::endl;
+        return false;
+    }
+    NVSlotStats::inc(stats->fallback_switches);
+    return prime(cpu_decoder);
+}
+
+
+bool NVFallbackDecoder::retryGpu(bool& got) {
+    got = false;
+    newGpu();
+    if (gpu_decoder && gpu_decoder->isOk()) {
+        // in_frame is the newest packet in the cache
+        got = prime(gpu_decoder);
+        if (gpu_decoder->isOk()) {
+            decoderlogger.log(LogLevel::normal) << "NVFallbackDecoder: back to GPU decoding" << std::endl;
+            NVSlotStats::inc(stats->gpu_recoveries);
+            current = gpu_decoder;
+            return true;
+        }
+    }
+    decoderlogger.log(LogLevel::debug) << "NVFallbackDecoder: GPU decoder still not available" << std::endl;
+    dropGpu(true);
+    return false;
+}
+
+
+Frame* NVFallbackDecoder::output() {
+    if (!current) {
+        return NULL;
+    }
+    return current->output();
+}
+
+
+void NVFallbackDecoder::flush() {
+    if (current) {
+        current->flush();
+    }
+}
+
+
+bool NVFallbackDecoder::pull() {
+    if (n_slot != in_frame.n_slot) {
+        n_slot = in_frame.n_slot;
+        if (n_slot != preloaded_slot && in_frame.h264_pars.slice_type != H264SliceType::sps) {
+            preload(n_slot);
+        }
+    }
+    gop->cache(&in_frame);
+    if (standby && standby()) {
+        joined = false;
+        return false;
+    }
+    if (!joined) {
+        // in_frame is the newest packet in the cache
+        if (gop->hasGop()) {
+            return join();
+        }
+        joined = true;
+    }
+    if (catchUp() || scrub()) {
+        return false;
+    }
+    suspend();
+    if (current && current == gpu_decoder) {
+        gpu_decoder->input(&in_frame);
+        bool got = gpu_decoder->pull();
+        if (gpu_decoder->isOk()) {
+            return got;
+        }
+        // the current packet is in the cache, so it's decoded when priming
+        return switchToFallback("GPU decoder failed");
+    }
+    bool keyframe = gop->isKeyframe(&in_frame);
+    if (keyframe && retry_ms >= 0 && NVusSince(failed_time) >= (uint64_t)retry_ms * 1000) {
+        bool got;
+        if (retryGpu(got)) {
+            return got;
+        }
+    }
+    if (!current) {
+        return false;
+    }
+    // NVDecoder counts its own
+    if (stats->n_slot.load(std::memory_order_relaxed) != in_frame.n_slot) {
+        stats->n_slot.store(in_frame.n_slot, std::memory_order_relaxed);
+    }
+    NVSlotStats::inc(stats->input_packets);
+    NVSlotStats::inc(stats->input_bytes, in_frame.payload.size());
+    current->input(&in_frame);
+    return suppress(current, current->pull());
+}
+
+
+void NVFallbackDecoder::releaseOutput() {
+    if (!current) {
+        return;
+    }
+    current->releaseOutput();
+    if (current == cpu_decoder) { // NVDecoder counts its own
+        NVSlotStats::inc(stats->emitted_frames);
+    }
+    emitted();
+}
+
+
+bool NVFallbackDecoder::isOk() {
+    return (current && current->isOk());
+}
+
+
+bool NVFallbackDecoder::onGPU() {
+    return (current && current == gpu_decoder);
+}
+
+
+NVStandbyDecoder::NVStandbyDecoder(Decoder* decoder, std::function<bool()> standby) : Decoder(), decoder(decoder), standby(standby) {
+}
+
+
+NVStandbyDecoder::~NVStandbyDecoder() {
+    delete decoder;
+}
+
+
+Frame* NVStandbyDecoder::output() {
+    return decoder->output();
+}
+
+
+void NVStandbyDecoder::flush() {
+    decoder->flush();
+}
+
+
+bool NVStandbyDecoder::pull() {
+    if (standby()) {
+        return false;
+    }
+    decoder->input(&in_frame);
+    return decoder->pull();
+}
+
+
+void NVStandbyDecoder::releaseOutput() {
+    decoder->releaseOutput();
+}
+
+
+bool NVStandbyDecoder::isOk() {
+    return decoder->isOk();
+}
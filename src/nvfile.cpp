@@ -0,0 +1,105 @@
+/*
+ * nvfile.cpp : Reads the H264 packets of local files
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvfile.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Reads the H264 packets of local files
+ */
+
+#include "nvfile.h"
+#include "nvfallback.h"
+#include <unistd.h>
+
+
+NVFileReader::NVFileReader(const char* filename, int n_slot) : demuxer(NULL), n_slot(n_slot), next_nal(0), pts(0), offset(0), bytes(0) {
+    // FFmpegDemuxer only logs a file it can't open & crashes later
+    if (access(filename, R_OK) != 0) {
+        decoderlogger.log(LogLevel::fatal) << "NVFileReader: can't read " << filename << std::endl;
+        return;
+    }
+    try {
+        demuxer = new FFmpegDemuxer(filename);
+    }
+    catch (...) {
+        decoderlogger.log(LogLevel::fatal) << "NVFileReader: can't demux " << filename << std::endl;
+        demuxer = NULL;
+        return;
+    }
+    if (demuxer->GetVideoCodec() != AV_CODEC_ID_H264) {
+        decoderlogger.log(LogLevel::fatal) << "NVFileReader: " << filename << " is not H264" << std::endl;
+        delete demuxer;
+        demuxer = NULL;
+    }
+}
+
+
+NVFileReader::~NVFileReader() {
+    if (demuxer) {
+        delete demuxer;
+    }
+}
+
+
+bool NVFileReader::isOk() {
+    return (demuxer != NULL);
+}
+
+
+bool NVFileReader::read(BasicFrame& f) {
+    if (!demuxer) {
+        return false;
+    }
+    while (next_nal >= nals.size()) {
+        uint8_t* data;
+        int size;
+        if (!demuxer->Demux(&data, &size, &pts) || size <= 0) {
+            return false;
+        }
+        au.assign(data, data + size);
+        nals = NVParameterCache::split(au);
+        next_nal = 0;
+        offset = bytes;
+        bytes += size;
+    }
+    const std::pair<size_t, size_t>& nal = nals[next_nal++];
+    f.payload.assign(au.begin() + nal.first, au.begin() + nal.second);
+    f.media_type = MediaType::video;
+    f.codec_id = AV_CODEC_ID_H264;
+    f.n_slot = n_slot;
+    f.subsession_index = 0;
+    f.mstimestamp = pts;
+    f.fillH264Pars();
+    return true;
+}
+
+
+uint64_t NVFileReader::getOffset() {
+    return offset;
+}
+
+
+int NVFileReader::getWidth() {
+    return demuxer ? demuxer->GetWidth() : 0;
+}
+
+
+int NVFileReader::getHeight() {
+    return demuxer ? demuxer->GetHeight() : 0;
+}
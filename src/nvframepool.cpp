@@ -0,0 +1,234 @@
+/*
+ * nvframepool.cpp : Output frames shared by all decoders
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvframepool.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Output frames shared by all decoders
+ */
+
+#include "nvframepool.h"
+
+static const int default_max_idle = 4;
+
+
+NVPooledFrame::NVPooledFrame() : AVBitmapFrame() {
+}
+
+
+NVPooledFrame::~NVPooledFrame() {
+}
+
+
+std::shared_ptr<AVBitmapFrame> NVPooledFrame::share() {
+    return self.lock();
+}
+
+
+NVFramePool::NVFramePool() : max_bytes(0), max_idle(default_max_idle), total_bytes(0), peak_bytes(0) {
+}
+
+
+NVFramePool::~NVFramePool() {
+    clear();
+}
+
+
+NVFramePool& NVFramePool::instance() {
+    static NVFramePool pool;
+    return pool;
+}
+
+
+bool NVFramePool::makeRoom(size_t bytes, std::vector<Entry*>& freed) {
+    if (max_bytes == 0) {
+        return true;
+    }
+    for (auto it = classes.begin(); it != classes.end() && total_bytes + bytes > max_bytes; ++it) {
+        SizeClass& sc = it->second;
+        while (!sc.idle.empty() && total_bytes + bytes > max_bytes) {
+            freed.push_back(sc.idle.back());
+            sc.idle.pop_back();
+            total_bytes -= sc.frame_bytes;
+        }
+    }
+    return (total_bytes + bytes <= max_bytes);
+}
+
+
+std::shared_ptr<AVBitmapFrame> NVFramePool::lease(int width, int height, std::shared_ptr<NVSlotStats> stats) {
+    Key key(width, height);
+    Entry* entry = NULL;
+    size_t frame_bytes = NVFramePlanes::bytes(width, height);
+    std::vector<Entry*> freed;
+    bool ok = true;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        SizeClass& sc = classes[key];
+        sc.frame_bytes = frame_bytes;
+        if (!sc.idle.empty()) {
+            entry = sc.idle.back();
+            sc.idle.pop_back();
+        }
+        else if (makeRoom(frame_bytes, freed)) {
+            total_bytes += frame_bytes; // allocated below, outside the mutex
+            peak_bytes = std::max(peak_bytes, total_bytes);
+        }
+        else {
+            sc.refused++;
+            ok = false;
+        }
+        if (ok) {
+            sc.leased++;
+            sc.leases++;
+            sc.high_water = std::max(sc.high_water, sc.leased);
+        }
+    }
+    for (auto it = freed.begin(); it != freed.end(); ++it) {
+        delete *it;
+    }
+    if (!ok) {
+        decoderlogger.log(LogLevel::debug) << "NVFramePool: lease: cap of " << max_bytes << " bytes reached" << std::endl;
+        return std::shared_ptr<AVBitmapFrame>();
+    }
+    if (!entry) {
+        entry = new Entry();
+        if (!entry->planes.reserve(&entry->frame, width, height)) {
+            delete entry;
+            std::unique_lock<std::mutex> lk(mutex);
+            SizeClass& sc = classes[key];
+            sc.leased--;
+            total_bytes -= frame_bytes;
+            return std::shared_ptr<AVBitmapFrame>();
+        }
+    }
+    std::shared_ptr<AVBitmapFrame> frame(&entry->frame, [this, entry, key](AVBitmapFrame*) { this->giveBack(entry, key); });
+    entry->frame.self = frame;
+    entry->frame.stats = stats;
+    return frame;
+}
+
+
+std::shared_ptr<AVBitmapFrame> NVFramePool::copy(AVBitmapFrame* frame) {
+    const BitmapPars& src = frame->bmpars;
+    std::shared_ptr<AVBitmapFrame> f = lease(src.width, src.height);
+    if (!f) {
+        return f;
+    }
+    const BitmapPars& dst = f->bmpars;
+    for (int i = 0; i < src.y_height; i++) {
+        memcpy(f->y_payload + (size_t)i * dst.y_linesize, frame->y_payload + (size_t)i * src.y_linesize, src.y_width);
+    }
+    for (int i = 0; i < src.u_height; i++) {
+        memcpy(f->u_payload + (size_t)i * dst.u_linesize, frame->u_payload + (size_t)i * src.u_linesize, src.u_width);
+        memcpy(f->v_payload + (size_t)i * dst.v_linesize, frame->v_payload + (size_t)i * src.v_linesize, src.v_width);
+    }
+    f->copyMetaFrom(frame);
+    return f;
+}
+
+
+void NVFramePool::giveBack(Entry* entry, Key key) {
+    entry->frame.stats.reset();
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        SizeClass& sc = classes[key];
+        sc.leased--;
+        if (sc.idle.size() < (size_t)max_idle && (max_bytes == 0 || total_bytes <= max_bytes)) {
+            sc.idle.push_back(entry);
+            return;
+        }
+        total_bytes -= sc.frame_bytes;
+    }
+    delete entry;
+}
+
+
+void NVFramePool::configure(size_t max_bytes, int max_idle) {
+    std::vector<Entry*> freed;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        this->max_bytes = max_bytes;
+        this->max_idle = std::max(0, max_idle);
+        for (auto it = classes.begin(); it != classes.end(); ++it) {
+            SizeClass& sc = it->second;
+            while (sc.idle.size() > (size_t)this->max_idle) {
+                freed.push_back(sc.idle.back());
+                sc.idle.pop_back();
+                total_bytes -= sc.frame_bytes;
+            }
+        }
+        makeRoom(0, freed);
+    }
+    for (auto it = freed.begin(); it != freed.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+void NVFramePool::clear() {
+    std::vector<Entry*> freed;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        for (auto it = classes.begin(); it != classes.end(); ++it) {
+            SizeClass& sc = it->second;
+            freed.insert(freed.end(), sc.idle.begin(), sc.idle.end());
+            total_bytes -= sc.frame_bytes * sc.idle.size();
+            sc.idle.clear();
+        }
+    }
+    for (auto it = freed.begin(); it != freed.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+size_t NVFramePool::getBytes() {
+    std::unique_lock<std::mutex> lk(mutex);
+    return total_bytes;
+}
+
+
+PyObject* NVFramePool::getPyStats() {
+    PyObject* dic = PyDict_New();
+    PyObject* list = PyList_New(0);
+    PyObject* value;
+    std::unique_lock<std::mutex> lk(mutex);
+    value = PyLong_FromSize_t(total_bytes);             PyDict_SetItemString(dic, "bytes", value);         Py_DECREF(value);
+    value = PyLong_FromSize_t(peak_bytes);              PyDict_SetItemString(dic, "peak_bytes", value);    Py_DECREF(value);
+    value = PyLong_FromSize_t(max_bytes);               PyDict_SetItemString(dic, "max_bytes", value);     Py_DECREF(value);
+    value = PyLong_FromLong(max_idle);                  PyDict_SetItemString(dic, "max_idle", value);      Py_DECREF(value);
+    for (auto it = classes.begin(); it != classes.end(); ++it) {
+        const SizeClass& sc = it->second;
+        PyObject* cls = PyDict_New();
+        value = PyLong_FromLong(it->first.first);           PyDict_SetItemString(cls, "width", value);         Py_DECREF(value);
+        value = PyLong_FromLong(it->first.second);          PyDict_SetItemString(cls, "height", value);        Py_DECREF(value);
+        value = PyLong_FromSize_t(sc.frame_bytes);          PyDict_SetItemString(cls, "frame_bytes", value);   Py_DECREF(value);
+        value = PyLong_FromLong(sc.leased);                 PyDict_SetItemString(cls, "leased", value);        Py_DECREF(value);
+        value = PyLong_FromSize_t(sc.idle.size());          PyDict_SetItemString(cls, "idle", value);          Py_DECREF(value);
+        value = PyLong_FromLong(sc.high_water);             PyDict_SetItemString(cls, "high_water", value);    Py_DECREF(value);
+        value = PyLong_FromUnsignedLongLong(sc.leases);     PyDict_SetItemString(cls, "leases", value);        Py_DECREF(value);
+        value = PyLong_FromUnsignedLongLong(sc.refused);    PyDict_SetItemString(cls, "refused", value);       Py_DECREF(value);
+        PyList_Append(list, cls);
+        Py_DECREF(cls);
+    }
+    PyDict_SetItemString(dic, "classes", list);
+    Py_DECREF(list);
+    return dic;
+}
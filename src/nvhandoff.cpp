@@ -0,0 +1,182 @@
+/*
+ * nvhandoff.cpp : Passes decoded frames downstream by reference
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvhandoff.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Passes decoded frames downstream by reference
+ */
+
+#include "nvhandoff.h"
+
+
+NVSerialFilter::NVSerialFilter(const char* name, FrameFilter* next) : FrameFilter(name, next) {
+}
+
+
+NVSerialFilter::~NVSerialFilter() {
+}
+
+
+void NVSerialFilter::go(Frame* frame) {
+}
+
+
+void NVSerialFilter::run(Frame* frame) {
+    std::unique_lock<std::mutex> lk(mutex);
+    FrameFilter::run(frame);
+}
+
+
+NVHandoffFilter::NVHandoffFilter(const char* name, int max_frames, FrameFilter* next) : FrameFilter(name, next),
+    max_frames(std::max(1, max_frames)), copy(false), dropped(0) {
+}
+
+
+NVHandoffFilter::~NVHandoffFilter() {
+    clear();
+}
+
+
+void NVHandoffFilter::go(Frame* frame) {
+    if (frame->getFrameType() != FrameType::avbitmapframe) {
+        return;
+    }
+    AVBitmapFrame* bitmap = static_cast<AVBitmapFrame*>(frame);
+    std::shared_ptr<AVBitmapFrame> f;
+    NVPooledFrame* pooled = dynamic_cast<NVPooledFrame*>(bitmap);
+    if (pooled && !copy) {
+        f = pooled->share();
+        if (f && pooled->stats) { // this runs in the thread writing the decoder's stats
+            const BitmapPars& bmpars = f->bmpars;
+            NVSlotStats::inc(pooled->stats->handoff_frames);
+            NVSlotStats::inc(pooled->stats->copy_bytes_saved,
+                (uint64_t)bmpars.y_width * bmpars.y_height + (uint64_t)(bmpars.u_width + bmpars.v_width) * bmpars.u_height);
+        }
+    }
+    if (!f) {
+        f = NVFramePool::instance().copy(bitmap);
+    }
+    if (!f) {
+        dropped++;
+        return;
+    }
+    std::shared_ptr<AVBitmapFrame> oldest; // released outside the mutex
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        if (queue.size() >= max_frames) {
+            oldest = queue.front();
+            queue.pop_front();
+            dropped++;
+        }
+        queue.push_back(f);
+    }
+    condition.notify_one();
+}
+
+
+std::shared_ptr<AVBitmapFrame> NVHandoffFilter::read(long timeout_ms) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (queue.empty() && timeout_ms > 0) {
+        condition.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this]() { return !queue.empty(); });
+    }
+    if (queue.empty()) {
+        return std::shared_ptr<AVBitmapFrame>();
+    }
+    std::shared_ptr<AVBitmapFrame> f = queue.front();
+    queue.pop_front();
+    return f;
+}
+
+
+static void setItem(PyObject* dic, const char* key, PyObject* value) {
+    // PyDict_SetItemString does not steal the reference
+    PyDict_SetItemString(dic, key, value);
+    Py_DECREF(value);
+}
+
+
+// rows of a plane, without the padding
+static PyObject* planeBytes(const uint8_t* payload, int width, int height, int linesize) {
+    PyObject* bytes = PyBytes_FromStringAndSize(NULL, (Py_ssize_t)width * height);
+    if (!bytes) {
+        return NULL;
+    }
+    char* dst = PyBytes_AS_STRING(bytes);
+    for (int i = 0; i < height; i++) {
+        memcpy(dst + (size_t)i * width, payload + (size_t)i * linesize, width);
+    }
+    return bytes;
+}
+
+
+PyObject* NVHandoffFilter::readFrame(long timeout_ms) {
+    std::shared_ptr<AVBitmapFrame> f;
+    Py_BEGIN_ALLOW_THREADS // the decoding threads may need the GIL while we wait
+    f = read(timeout_ms);
+    Py_END_ALLOW_THREADS
+    if (!f) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    const BitmapPars& bmpars = f->bmpars;
+    PyObject* y = planeBytes(f->y_payload, bmpars.y_width, bmpars.y_height, bmpars.y_linesize);
+    PyObject* u = planeBytes(f->u_payload, bmpars.u_width, bmpars.u_height, bmpars.u_linesize);
+    PyObject* v = planeBytes(f->v_payload, bmpars.v_width, bmpars.v_height, bmpars.v_linesize);
+    PyObject* dic = PyDict_New();
+    if (!y || !u || !v || !dic) { // out of memory: the python error is set
+        Py_XDECREF(y);
+        Py_XDECREF(u);
+        Py_XDECREF(v);
+        Py_XDECREF(dic);
+        return NULL;
+    }
+    setItem(dic, "y",           y);
+    setItem(dic, "u",           u);
+    setItem(dic, "v",           v);
+    setItem(dic, "width",       PyLong_FromLong(bmpars.width));
+    setItem(dic, "height",      PyLong_FromLong(bmpars.height));
+    setItem(dic, "mstimestamp", PyLong_FromLong(f->mstimestamp));
+    setItem(dic, "n_slot",      PyLong_FromLong(f->n_slot));
+    return dic;
+}
+
+void NVHandoffFilter::setCopy(bool copy) {
+    this->copy = copy;
+}
+
+
+size_t NVHandoffFilter::size() {
+    std::unique_lock<std::mutex> lk(mutex);
+    return queue.size();
+}
+
+
+uint64_t NVHandoffFilter::getDropped() {
+    return dropped;
+}
+
+
+void NVHandoffFilter::clear() {
+    std::deque<std::shared_ptr<AVBitmapFrame>> frames;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        frames.swap(queue);
+    }
+}
@@ -0,0 +1,375 @@
+/*
+ * nvindex.cpp : Keyframe index & thumbnails of recordings
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvindex.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Keyframe index & thumbnails of recordings
+ */
+
+#include "nvindex.h"
+#include "nvdecoder.h"
+#include "nvdevices.h"
+#include "nvfile.h"
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char     index_magic[4] = {'N', 'V', 'K', 'I'};
+static const uint32_t index_version = 1;
+
+
+NVKeyframeIndexer::NVKeyframeIndexer(const char* name, int thumb_width, int thumb_height, int gpu_index) :
+    name(name), decoder(NULL) {
+    init(thumb_width, thumb_height);
+    factory = [this, gpu_index]() {
+        NVDecoder* decoder = new NVDecoder(AV_CODEC_ID_H264, gpu_index, 5, this);
+        decoder->setStats(this->slot_stats);
+        decoder->setResize(this->thumb_width, this->thumb_height);
+        this->stats.decoders_created++;
+        return decoder;
+    };
+}
+
+
+NVKeyframeIndexer::NVKeyframeIndexer(const char* name, std::function<Decoder*()> factory, int thumb_width, int thumb_height) :
+    name(name), factory(factory), decoder(NULL) {
+    init(thumb_width, thumb_height);
+}
+
+
+void NVKeyframeIndexer::init(int thumb_width, int thumb_height) {
+    this->thumb_width = std::max(2, thumb_width) & ~1;
+    this->thumb_height = std::max(2, thumb_height) & ~1;
+    size_t thumb_bytes = (size_t)this->thumb_width * this->thumb_height * 3 / 2;
+    record_bytes = (sizeof(NVIndexEntry) + thumb_bytes + 7) & ~(size_t)7; // entries stay aligned
+    record.resize(record_bytes);
+    slot_stats = stats.newSlot();
+    entries = 0;
+    key_ts = std::numeric_limits<long>::min();
+    has_sps = false;
+    packets = 0;
+    skipped_packets = 0;
+    keyframes = 0;
+    thumbnails = 0;
+}
+
+
+NVKeyframeIndexer::~NVKeyframeIndexer() {
+    if (file.is_open()) {
+        end();
+    }
+    if (decoder) {
+        delete decoder;
+    }
+    NVDeviceRegistry::instance().forget(this);
+}
+
+
+bool NVKeyframeIndexer::ready() {
+    if (decoder && decoder->isOk()) {
+        return true;
+    }
+    if (decoder) {
+        decoderlogger.log(LogLevel::normal) << "NVKeyframeIndexer: " << name << ": decoder failed, creating a new one" << std::endl;
+        delete decoder;
+    }
+    decoder = factory();
+    return (decoder && decoder->isOk());
+}
+
+
+void NVKeyframeIndexer::scale(AVBitmapFrame* f, uint8_t* dst) {
+    const BitmapPars& bm = f->bmpars;
+    const uint8_t* planes[3] = {f->y_payload, f->u_payload, f->v_payload};
+    const int src_w[3] = {bm.y_width, bm.u_width, bm.v_width};
+    const int src_h[3] = {bm.y_height, bm.u_height, bm.v_height};
+    const int linesize[3] = {bm.y_linesize, bm.u_linesize, bm.v_linesize};
+    for (int p = 0; p < 3; p++) {
+        int w = (p == 0) ? thumb_width : thumb_width / 2;
+        int h = (p == 0) ? thumb_height : thumb_height / 2;
+        for (int y = 0; y < h; y++) {
+            const uint8_t* row = planes[p] + (size_t)(y * src_h[p] / h) * linesize[p];
+            for (int x = 0; x < w; x++) {
+                *dst++ = row[x * src_w[p] / w];
+            }
+        }
+    }
+}
+
+
+void NVKeyframeIndexer::write(NVIndexEntry entry, AVBitmapFrame* f) {
+    std::fill(record.begin(), record.end(), 0);
+    if (f) {
+        entry.flags |= nv_index_thumbnail;
+        scale(f, record.data() + sizeof(NVIndexEntry));
+        thumbnails++;
+    }
+    memcpy(record.data(), &entry, sizeof(NVIndexEntry));
+    file.write((const char*)record.data(), record.size());
+    entries++;
+}
+
+
+void NVKeyframeIndexer::decode(BasicFrame* f) {
+    if (!ready()) {
+        return;
+    }
+    decoder->input(f);
+    if (!decoder->pull()) {
+        return;
+    }
+    Frame* out = decoder->output();
+    if (out && out->getFrameType() == FrameType::avbitmapframe) {
+        // keyframes come out in order: the ones before this picture were not decoded
+        while (!pending.empty() && pending.front().mstimestamp < out->mstimestamp) {
+            write(pending.front(), NULL);
+            pending.pop_front();
+        }
+        if (!pending.empty() && pending.front().mstimestamp == out->mstimestamp) {
+            write(pending.front(), static_cast<AVBitmapFrame*>(out));
+            pending.pop_front();
+        }
+    }
+    decoder->releaseOutput();
+}
+
+
+bool NVKeyframeIndexer::begin(const char* index_filename) {
+    if (file.is_open()) {
+        end();
+    }
+    file.open(index_filename, std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+        decoderlogger.log(LogLevel::normal) << "NVKeyframeIndexer: " << name << ": can't write " << index_filename << std::endl;
+        return false;
+    }
+    NVIndexHeader header = {}; // written again at the end, with the number of entries
+    file.write((const char*)&header, sizeof(header));
+    pending.clear();
+    entries = 0;
+    key_ts = std::numeric_limits<long>::min();
+    has_sps = false;
+    if (decoder) {
+        decoder->flush();
+    }
+    return file.good();
+}
+
+
+void NVKeyframeIndexer::addPacket(BasicFrame* f, uint64_t offset) {
+    if (!file.is_open() || f->codec_id != AV_CODEC_ID_H264) {
+        return;
+    }
+    packets++;
+    unsigned slice_type = f->h264_pars.slice_type;
+    if (slice_type == H264SliceType::sps) {
+        sps.copyFrom(f);
+        has_sps = true;
+    }
+    else if (slice_type == H264SliceType::i) {
+        if (f->mstimestamp != key_ts) { // a new keyframe, not another slice of the previous one
+            NVIndexEntry entry = {};
+            entry.mstimestamp = f->mstimestamp;
+            entry.offset = offset;
+            pending.push_back(entry);
+            key_ts = f->mstimestamp;
+            keyframes++;
+        }
+    }
+    else if (slice_type != H264SliceType::pps) {
+        skipped_packets++;
+        return;
+    }
+    decode(f);
+}
+
+
+bool NVKeyframeIndexer::end() {
+    if (!file.is_open()) {
+        return false;
+    }
+    if (has_sps && !pending.empty()) {
+        // the parser finishes a picture when the next access unit starts
+        decode(&sps);
+    }
+    while (!pending.empty()) {
+        write(pending.front(), NULL);
+        pending.pop_front();
+    }
+    NVIndexHeader header = {};
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.version = index_version;
+    header.entries = entries;
+    header.thumb_width = thumb_width;
+    header.thumb_height = thumb_height;
+    header.record_bytes = (uint32_t)record_bytes;
+    file.seekp(0);
+    file.write((const char*)&header, sizeof(header));
+    bool ok = file.good();
+    file.close();
+    decoderlogger.log(LogLevel::debug) << "NVKeyframeIndexer: " << name << ": " << entries << " keyframes, "
+        << thumbnails << " thumbnails" << std::endl;
+    return ok;
+}
+
+
+bool NVKeyframeIndexer::build(const char* filename, const char* index_filename) {
+    NVFileReader reader(filename);
+    if (!reader.isOk() || !begin(index_filename)) {
+        return false;
+    }
+    BasicFrame f;
+    while (reader.read(f)) {
+        addPacket(&f, reader.getOffset());
+    }
+    return end();
+}
+
+
+PyObject* NVKeyframeIndexer::getStats() {
+    PyObject* dic = stats.getStats();
+    PyObject* value;
+    value = PyLong_FromUnsignedLongLong(packets);           PyDict_SetItemString(dic, "packets", value);           Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(skipped_packets);   PyDict_SetItemString(dic, "skipped_packets", value);   Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(keyframes);         PyDict_SetItemString(dic, "keyframes", value);         Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(thumbnails);        PyDict_SetItemString(dic, "thumbnails", value);        Py_DECREF(value);
+    return dic;
+}
+
+
+NVKeyframeIndex::NVKeyframeIndex() : map(NULL), map_bytes(0), header(NULL) {
+}
+
+
+NVKeyframeIndex::~NVKeyframeIndex() {
+    close();
+}
+
+
+bool NVKeyframeIndex::open(const char* filename) {
+    close();
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NVIndexHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping stays
+    if (p == MAP_FAILED) {
+        return false;
+    }
+    map = (uint8_t*)p;
+    map_bytes = st.st_size;
+    header = (const NVIndexHeader*)map;
+    if (memcmp(header->magic, index_magic, sizeof(index_magic)) != 0 || header->version != index_version ||
+            header->record_bytes < sizeof(NVIndexEntry) + (size_t)header->thumb_width * header->thumb_height * 3 / 2 ||
+            header->entries > (map_bytes - sizeof(NVIndexHeader)) / header->record_bytes) {
+        decoderlogger.log(LogLevel::normal) << "NVKeyframeIndex: open: " << filename << " is not a keyframe index" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void NVKeyframeIndex::close() {
+    if (map) {
+        munmap(map, map_bytes);
+    }
+    map = NULL;
+    map_bytes = 0;
+    header = NULL;
+}
+
+
+const NVIndexEntry* NVKeyframeIndex::entry(long i) {
+    if (!header || i < 0 || (uint64_t)i >= header->entries) {
+        return NULL;
+    }
+    return (const NVIndexEntry*)(map + sizeof(NVIndexHeader) + (size_t)i * header->record_bytes);
+}
+
+
+long NVKeyframeIndex::size() {
+    return header ? (long)header->entries : 0;
+}
+
+
+long NVKeyframeIndex::find(long mstimestamp) {
+    // entries are in timestamp order
+    long lo = 0, hi = size();
+    while (lo < hi) {
+        long mid = lo + (hi - lo) / 2;
+        if (entry(mid)->mstimestamp <= mstimestamp) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+
+long NVKeyframeIndex::getTimestamp(long i) {
+    const NVIndexEntry* e = entry(i);
+    return e ? (long)e->mstimestamp : -1;
+}
+
+
+unsigned long long NVKeyframeIndex::getOffset(long i) {
+    const NVIndexEntry* e = entry(i);
+    return e ? e->offset : 0;
+}
+
+
+int NVKeyframeIndex::getThumbnailWidth() {
+    return header ? (int)header->thumb_width : 0;
+}
+
+
+int NVKeyframeIndex::getThumbnailHeight() {
+    return header ? (int)header->thumb_height : 0;
+}
+
+
+const uint8_t* NVKeyframeIndex::getThumbnailData(long i) {
+    const NVIndexEntry* e = entry(i);
+    if (!e || !(e->flags & nv_index_thumbnail)) {
+        return NULL;
+    }
+    return (const uint8_t*)e + sizeof(NVIndexEntry);
+}
+
+
+PyObject* NVKeyframeIndex::getThumbnail(long i) {
+    const uint8_t* data = getThumbnailData(i);
+    if (!data) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    return PyBytes_FromStringAndSize((const char*)data, (Py_ssize_t)header->thumb_width * header->thumb_height * 3 / 2);
+}
@@ -0,0 +1,401 @@
+/*
+ * nvload.cpp : Synthetic camera load from recorded clips
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvload.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Synthetic camera load from recorded clips
+ */
+
+#include "nvload.h"
+#include "nvthread.h"
+#include "nvfile.h"
+#include <queue>
+
+// slots start at most this much apart
+static const long max_start_delay_ms = 2000;
+// after feeding, frames are waited for at most this long
+static const long max_drain_ms = 2000;
+
+
+/** An NVThread as a load target */
+class NVThreadLoadTarget : public NVLoadTarget {
+
+public:
+    NVThreadLoadTarget(int n_slot, FrameFilter& outfilter, int gpu_index) :
+        thread(("load" + std::to_string(n_slot)).c_str(), outfilter, gpu_index) {
+        thread.startCall();
+        thread.decodingOnCall();
+    }
+    virtual ~NVThreadLoadTarget() {
+        thread.stopCall();
+    }
+
+public:
+    NVThread thread;
+
+public:
+    virtual FrameFilter& getFrameFilter() {
+        return thread.getFrameFilter();
+    }
+};
+
+
+/** Counts the frames fed in the measured window & their latency.  Frames come from all decoders at once */
+class NVLoadGenerator::Meter : public FrameFilter {
+
+public:
+    Meter(const std::vector<long>& shifts, long from_ms, long until_ms) : FrameFilter("meter"),
+        shifts(shifts), from_ms(from_ms), until_ms(until_ms), frames(0), latency_ms(0), max_latency_ms(0) {}
+
+public:
+    const std::vector<long>&    shifts;     ///< by slot number
+    long                        from_ms, until_ms;
+    std::atomic<uint64_t>       frames, latency_ms, max_latency_ms;
+
+protected:
+    void go(Frame* frame) {
+        if (frame->getFrameType() != FrameType::avbitmapframe) {
+            return;
+        }
+        long fed_ms = frame->mstimestamp - ((frame->n_slot < shifts.size()) ? shifts[frame->n_slot] : 0);
+        if (fed_ms < from_ms || fed_ms >= until_ms) {
+            return;
+        }
+        uint64_t ms = (uint64_t)std::max(0L, NVmsNow() - fed_ms);
+        frames++;
+        latency_ms += ms;
+        uint64_t peak = max_latency_ms.load();
+        while (ms > peak && !max_latency_ms.compare_exchange_weak(peak, ms)) {
+        }
+    }
+};
+
+
+NVLoadGenerator::Clip::~Clip() {
+    for (auto it = packets.begin(); it != packets.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+NVLoadGenerator::NVLoadGenerator(const char* name, int gpu_index) : name(name) {
+    init();
+    factory = [gpu_index](int n_slot, FrameFilter& outfilter) {
+        return new NVThreadLoadTarget(n_slot, outfilter, gpu_index);
+    };
+}
+
+
+NVLoadGenerator::NVLoadGenerator(const char* name, std::function<NVLoadTarget*(int n_slot, FrameFilter& outfilter)> factory) :
+    name(name), factory(factory) {
+    init();
+}
+
+
+void NVLoadGenerator::init() {
+    random.seed(std::random_device()());
+    max_shift_ms = 0;
+    max_latency_ms = 500;
+    max_drop_ratio = 0.01;
+    max_slots = -1;
+    running = false;
+}
+
+
+NVLoadGenerator::~NVLoadGenerator() {
+    stop();
+}
+
+
+int NVLoadGenerator::newClip() {
+    clips.push_back(std::unique_ptr<Clip>(new Clip()));
+    clips.back()->n_pictures = 0;
+    clips.back()->last_slice = -1;
+    clips.back()->duration_ms = 0;
+    return (int)clips.size() - 1;
+}
+
+
+void NVLoadGenerator::addPacket(int clip, BasicFrame* in) {
+    if (clip < 0 || clip >= (int)clips.size() || in->codec_id != AV_CODEC_ID_H264) {
+        return;
+    }
+    Clip& c = *clips[clip];
+    unsigned slice_type = in->h264_pars.slice_type;
+    if (c.packets.empty() && slice_type != H264SliceType::sps) {
+        return;
+    }
+    BasicFrame* f = new BasicFrame();
+    f->copyFrom(in);
+    long t = c.packets.empty() ? 0 : std::max(c.times.back(), in->mstimestamp - c.packets[0]->mstimestamp);
+    bool slice = (slice_type == H264SliceType::i || slice_type == H264SliceType::pb);
+    // a picture may be in many slices: the first one starts it
+    bool picture = slice && in->mstimestamp != c.last_slice;
+    if (slice) {
+        c.last_slice = in->mstimestamp;
+    }
+    if (picture) {
+        c.n_pictures++;
+    }
+    if (slice_type == H264SliceType::sps) {
+        c.starts.push_back(c.packets.size());
+    }
+    c.pictures.push_back(picture);
+    c.times.push_back(t);
+    c.packets.push_back(f);
+    // loops on with one frame interval after the last picture
+    long n = c.n_pictures;
+    c.duration_ms = (n > 1) ? t + t / (n - 1) : t + 40;
+}
+
+
+bool NVLoadGenerator::addClip(const char* filename) {
+    NVFileReader reader(filename);
+    if (!reader.isOk()) {
+        return false;
+    }
+    int clip = newClip();
+    BasicFrame f;
+    while (reader.read(f)) {
+        addPacket(clip, &f);
+    }
+    Clip& c = *clips[clip];
+    if (c.starts.empty() || c.n_pictures < 2) {
+        decoderlogger.log(LogLevel::normal) << "NVLoadGenerator: " << name << ": addClip: nothing to play in " << filename << std::endl;
+        clips.pop_back();
+        return false;
+    }
+    decoderlogger.log(LogLevel::debug) << "NVLoadGenerator: " << name << ": addClip: " << c.packets.size() << " packets, "
+        << c.duration_ms << " ms" << std::endl;
+    return true;
+}
+
+
+void NVLoadGenerator::setSeed(unsigned int seed) {
+    random.seed(seed);
+}
+
+
+void NVLoadGenerator::setTimestampShift(long max_shift_ms) {
+    this->max_shift_ms = std::max(0L, max_shift_ms);
+}
+
+
+void NVLoadGenerator::setThresholds(double max_latency_ms, double max_drop_ratio) {
+    this->max_latency_ms = max_latency_ms;
+    this->max_drop_ratio = max_drop_ratio;
+}
+
+
+void NVLoadGenerator::schedule(Slot& slot) {
+    const Clip& c = *slot.clip;
+    slot.pos++;
+    if (slot.pos >= c.packets.size()) {
+        slot.pos = 0;
+        slot.loop_ms += c.duration_ms;
+    }
+    slot.rel_ms = c.times[slot.pos] + slot.loop_ms - slot.start_ms;
+}
+
+
+NVLoadResult NVLoadGenerator::measure(int n_slots, long duration_ms, long warmup_ms) {
+    NVLoadResult result = {};
+    result.n_slots = n_slots;
+    std::vector<Clip*> playable;
+    for (auto it = clips.begin(); it != clips.end(); ++it) {
+        if (!(*it)->starts.empty()) {
+            playable.push_back(it->get());
+        }
+    }
+    if (playable.empty() || n_slots <= 0) {
+        return result;
+    }
+    NVClock::time_point t0 = NVClock::now();
+    long wall0 = NVmsNow();
+    long from_ms = wall0 + warmup_ms;
+    long until_ms = from_ms + duration_ms;
+    std::vector<long> shifts(n_slots + 1, 0);
+    std::vector<Slot> slots(n_slots);
+    for (int i = 0; i < n_slots; i++) {
+        Slot& slot = slots[i];
+        slot.n_slot = i + 1;
+        slot.clip = playable[i % playable.size()];
+        slot.pos = slot.clip->starts[std::uniform_int_distribution<size_t>(0, slot.clip->starts.size() - 1)(random)];
+        slot.start_ms = slot.clip->times[slot.pos];
+        slot.loop_ms = 0;
+        slot.rel_ms = 0;
+        long gop_ms = std::min(max_start_delay_ms, slot.clip->duration_ms / (long)slot.clip->starts.size());
+        slot.start_time = t0 + std::chrono::milliseconds(std::uniform_int_distribution<long>(0, std::max(0L, gop_ms - 1))(random));
+        slot.shift_ms = max_shift_ms ? std::uniform_int_distribution<long>(-max_shift_ms, max_shift_ms)(random) : 0;
+        shifts[slot.n_slot] = slot.shift_ms;
+        slot.target = NULL;
+    }
+
+    Meter meter(shifts, from_ms, until_ms);
+    SetupFrame setup;
+    setup.sub_type = SetupFrameType::stream_init;
+    setup.media_type = MediaType::video;
+    setup.codec_id = AV_CODEC_ID_H264;
+    setup.subsession_index = 0;
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        it->target = factory(it->n_slot, meter);
+        setup.n_slot = it->n_slot;
+        setup.mstimestamp = wall0;
+        it->target->getFrameFilter().run(&setup);
+    }
+
+    // earliest packet first
+    auto later = [](const Slot* a, const Slot* b) {
+        return a->start_time + std::chrono::milliseconds(a->rel_ms) > b->start_time + std::chrono::milliseconds(b->rel_ms);
+    };
+    std::priority_queue<Slot*, std::vector<Slot*>, decltype(later)> queue(later);
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        queue.push(&(*it));
+    }
+    NVClock::time_point until = t0 + std::chrono::milliseconds(until_ms - wall0);
+    uint64_t fed = 0;
+    while (running) {
+        Slot* slot = queue.top();
+        NVClock::time_point due = slot->start_time + std::chrono::milliseconds(slot->rel_ms);
+        if (due >= until) {
+            break;
+        }
+        {// PROTECTED
+            std::unique_lock<std::mutex> lk(mutex);
+            condition.wait_until(lk, due, [this]() { return !running; });
+        }
+        if (!running) {
+            break;
+        }
+        queue.pop();
+        long fed_ms = wall0 + std::chrono::duration_cast<std::chrono::milliseconds>(due - t0).count();
+        BasicFrame* f = slot->clip->packets[slot->pos];
+        f->n_slot = slot->n_slot;
+        f->mstimestamp = fed_ms + slot->shift_ms;
+        if (slot->clip->pictures[slot->pos] && fed_ms >= from_ms) {
+            fed++;
+        }
+        slot->target->getFrameFilter().run(f);
+        schedule(*slot);
+        queue.push(slot);
+    }
+    // the last pictures are still being decoded
+    NVClock::time_point drain = NVClock::now() + std::chrono::milliseconds(std::max(max_drain_ms, (long)(2 * max_latency_ms)));
+    while (running && meter.frames < fed && NVClock::now() < drain) {
+        std::unique_lock<std::mutex> lk(mutex);
+        condition.wait_for(lk, std::chrono::milliseconds(10), [this]() { return !running; });
+    }
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        delete it->target;
+    }
+
+    uint64_t frames = meter.frames;
+    double seconds = std::max(1L, duration_ms) / 1000.;
+    result.input_fps = fed / seconds;
+    result.output_fps = frames / seconds;
+    result.drop_ratio = fed ? 1. - std::min(1., (double)frames / fed) : 1.;
+    result.mean_latency_ms = frames ? (double)meter.latency_ms / frames : 0;
+    result.max_latency_ms = (double)meter.max_latency_ms;
+    result.ok = running && frames > 0 && result.mean_latency_ms <= max_latency_ms && result.drop_ratio <= max_drop_ratio;
+    decoderlogger.log(LogLevel::debug) << "NVLoadGenerator: " << name << ": " << n_slots << " slots: input " << result.input_fps
+        << " fps, output " << result.output_fps << " fps, latency " << result.mean_latency_ms << " ms, drops "
+        << result.drop_ratio << (result.ok ? ": ok" : ": over") << std::endl;
+    return result;
+}
+
+
+bool NVLoadGenerator::run(int n_slots, long duration_ms, long warmup_ms) {
+    bool ok;
+    Py_BEGIN_ALLOW_THREADS // stop is called from another python thread
+    ok = runLoad(n_slots, duration_ms, warmup_ms);
+    Py_END_ALLOW_THREADS
+    return ok;
+}
+
+
+int NVLoadGenerator::sweep(int n_start, int n_step, int n_max, long step_ms, long warmup_ms) {
+    int n;
+    Py_BEGIN_ALLOW_THREADS
+    n = sweepLoad(n_start, n_step, n_max, step_ms, warmup_ms);
+    Py_END_ALLOW_THREADS
+    return n;
+}
+
+
+bool NVLoadGenerator::runLoad(int n_slots, long duration_ms, long warmup_ms) {
+    running = true;
+    NVLoadResult result = measure(n_slots, duration_ms, warmup_ms);
+    running = false;
+    results.push_back(result);
+    return result.ok;
+}
+
+
+int NVLoadGenerator::sweepLoad(int n_start, int n_step, int n_max, long step_ms, long warmup_ms) {
+    results.clear();
+    max_slots = 0;
+    running = true;
+    for (int n = std::max(1, n_start); n <= n_max && running; n += std::max(1, n_step)) {
+        NVLoadResult result = measure(n, step_ms, warmup_ms);
+        results.push_back(result);
+        if (!result.ok) {
+            break;
+        }
+        max_slots = n;
+    }
+    running = false;
+    decoderlogger.log(LogLevel::debug) << "NVLoadGenerator: " << name << ": sweep: " << max_slots << " slots at most" << std::endl;
+    return max_slots;
+}
+
+
+void NVLoadGenerator::stop() {
+    std::unique_lock<std::mutex> lk(mutex);
+    running = false;
+    condition.notify_all();
+}
+
+
+std::vector<NVLoadResult> NVLoadGenerator::getResults() {
+    return results;
+}
+
+
+PyObject* NVLoadGenerator::getStats() {
+    PyObject* dic = PyDict_New();
+    PyObject* list = PyList_New(0);
+    PyObject* value;
+    value = PyLong_FromLong(max_slots);                     PyDict_SetItemString(dic, "max_slots", value);         Py_DECREF(value);
+    for (auto it = results.begin(); it != results.end(); ++it) {
+        PyObject* run = PyDict_New();
+        value = PyLong_FromLong(it->n_slots);                   PyDict_SetItemString(run, "n_slots", value);           Py_DECREF(value);
+        value = PyFloat_FromDouble(it->input_fps);              PyDict_SetItemString(run, "input_fps", value);         Py_DECREF(value);
+        value = PyFloat_FromDouble(it->output_fps);             PyDict_SetItemString(run, "output_fps", value);        Py_DECREF(value);
+        value = PyFloat_FromDouble(it->drop_ratio);             PyDict_SetItemString(run, "drop_ratio", value);        Py_DECREF(value);
+        value = PyFloat_FromDouble(it->mean_latency_ms);        PyDict_SetItemString(run, "mean_latency_ms", value);   Py_DECREF(value);
+        value = PyFloat_FromDouble(it->max_latency_ms);         PyDict_SetItemString(run, "max_latency_ms", value);    Py_DECREF(value);
+        value = PyBool_FromLong(it->ok);                        PyDict_SetItemString(run, "ok", value);                Py_DECREF(value);
+        PyList_Append(list, run);
+        Py_DECREF(run);
+    }
+    PyDict_SetItemString(dic, "runs", list);
+    Py_DECREF(list);
+    return dic;
+}
@@ -0,0 +1,337 @@
+/*
+ * nvmultithread.cpp : Cuda accelerated decoder thread serving many slots
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvmultithread.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Cuda accelerated decoder thread serving many slots
+ */
+
+#include "nvmultithread.h"
+#include "nvdecoder.h"
+#include "nvdevices.h"
+#include "nvpool.h"
+
+static const int default_quantum = 4;
+// fifo frames read per scheduling round, so that a burst can't stall decoding
+static const int max_read = 256;
+
+
+NVMultiThread::NVMultiThread(const char* name, FrameFilter& outfilter, int gpu_index, FrameFifoContext fifo_ctx) :
+    name(name), outfilter(outfilter), gpu_index(gpu_index),
+    infifo((std::string(name) + "_fifo").c_str(), fifo_ctx), infilter((std::string(name) + "_infilter").c_str(), &infifo),
+    running(false), decoding(false), quantum(default_quantum), max_queue(std::max(fifo_ctx.n_basic, 10)),
+    parameter_sets(std::make_shared<NVParameterCache>()), settings_version(0), settings_applied(0) {
+}
+
+
+NVMultiThread::~NVMultiThread() {
+    stopCall();
+    for (auto it = stock.begin(); it != stock.end(); ++it) {
+        delete *it;
+    }
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        NVDeviceRegistry::instance().forget(&(it->second));
+    }
+}
+
+
+FifoFrameFilter& NVMultiThread::getFrameFilter() {
+    return infilter;
+}
+
+
+void NVMultiThread::startCall() {
+    if (running) {
+        return;
+    }
+    running = true;
+    thread = std::thread(&NVMultiThread::run, this);
+}
+
+
+void NVMultiThread::stopCall() {
+    if (!running) {
+        return;
+    }
+    running = false;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+
+void NVMultiThread::decodingOnCall() {
+    decoding = true;
+}
+
+
+void NVMultiThread::decodingOffCall() {
+    decoding = false;
+}
+
+
+void NVMultiThread::setQuantum(int packets) {
+    quantum = std::max(1, packets);
+}
+
+
+PyObject* NVMultiThread::getStats() {
+    return stats.getStats();
+}
+
+
+void NVMultiThread::setParameterSets(SlotNumber n_slot, PyObject* parameter_sets) {
+    this->parameter_sets->setPy(n_slot, parameter_sets);
+}
+
+
+void NVMultiThread::setMaxLatency(SlotNumber n_slot, long max_latency_ms) {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(settings_mutex);
+        settings[n_slot].max_latency = std::max(0L, max_latency_ms);
+    }
+    settings_version++;
+}
+
+
+void NVMultiThread::setOutputSuspended(SlotNumber n_slot, bool suspended) {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(settings_mutex);
+        settings[n_slot].suspended = suspended;
+    }
+    settings_version++;
+}
+
+
+void NVMultiThread::applySettings() {
+    settings_applied = settings_version;
+    std::unique_lock<std::mutex> lk(settings_mutex);
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        auto found = settings.find(it->first);
+        it->second.settings = (found == settings.end()) ? SlotSettings() : found->second;
+    }
+}
+
+
+CUstream NVMultiThread::getStream(int gpu) {
+    auto it = streams.find(gpu);
+    if (it != streams.end()) {
+        return it->second.stream;
+    }
+    GpuStream gs = {0, NULL, 0};
+    if (cuDeviceGet(&gs.device, gpu) == CUDA_SUCCESS && cuDevicePrimaryCtxRetain(&gs.context, gs.device) == CUDA_SUCCESS) {
+        if (cuCtxPushCurrent(gs.context) == CUDA_SUCCESS) {
+            if (cuStreamCreate(&gs.stream, CU_STREAM_NON_BLOCKING) != CUDA_SUCCESS) {
+                gs.stream = 0;
+            }
+            cuCtxPopCurrent(NULL);
+        }
+    }
+    else {
+        gs.context = NULL;
+    }
+    decoderlogger.log(LogLevel::debug) << "NVMultiThread: " << name << " : download stream for GPU " << gpu << std::endl;
+    streams[gpu] = gs;
+    return gs.stream;
+}
+
+
+void NVMultiThread::releaseStreams() {
+    for (auto it = streams.begin(); it != streams.end(); ++it) {
+        GpuStream& gs = it->second;
+        if (!gs.context) {
+            continue;
+        }
+        if (gs.stream && cuCtxPushCurrent(gs.context) == CUDA_SUCCESS) {
+            cuStreamDestroy(gs.stream);
+            cuCtxPopCurrent(NULL);
+        }
+        cuDevicePrimaryCtxRelease(gs.device);
+    }
+    streams.clear();
+}
+
+
+void NVMultiThread::close(Slot& slot) {
+    for (auto it = slot.queue.begin(); it != slot.queue.end(); ++it) {
+        stock.push_back(*it);
+    }
+    slot.queue.clear();
+    slot.overflow = false;
+    if (slot.stats) {
+        slot.stats->submit_queue.store(0, std::memory_order_relaxed);
+    }
+    if (slot.decoder) {
+        delete slot.decoder;
+        slot.decoder = NULL;
+    }
+}
+
+
+void NVMultiThread::setup(int n_slot, AVCodecID codec_id) {
+    Slot& slot = slots[n_slot];
+    slot.n_slot = n_slot;
+    close(slot);
+    if (codec_id != AV_CODEC_ID_H264) {
+        decoderlogger.log(LogLevel::normal) << "NVMultiThread: " << name << " : slot " << n_slot << " : codec not supported" << std::endl;
+        return;
+    }
+    slot.stats = stats.newSlot();
+    settings_applied = 0; // the new slot gets its settings at the next round
+    slot.gop = std::make_shared<NVGopCache>(); // a new stream: nothing of the previous one is to be primed
+    std::shared_ptr<NVSlotStats> slot_stats = slot.stats;
+    const void* owner = &slot;
+    NVFallbackDecoder* wrapper = new NVFallbackDecoder(
+        [this, owner, slot_stats, codec_id]() {
+            NVDecoder* decoder = static_cast<NVDecoder*>(NVDecoderPool::instance().lease(codec_id, this->gpu_index, 0, 0, true, owner)); // NVDecoders only
+            if (!decoder) {
+                decoder = new NVDecoder(codec_id, this->gpu_index, 5, owner, true); // gpu_index, n_buffer, owner, shared_context
+                this->stats.decoders_created++;
+            }
+            decoder->setStats(slot_stats);
+            decoder->setStream(this->getStream(decoder->getGpuIndex())); // leased in the primary context, so it can't fail
+            return decoder;
+        },
+        [this, codec_id]() {
+            this->stats.decoders_fallback++;
+            return new VideoDecoder(codec_id);
+        },
+        slot_stats);
+    wrapper->setDisposer([](Decoder* decoder) { NVDecoderPool::instance().giveBack(decoder); });
+    wrapper->setGopCache(slot.gop);
+    wrapper->setStandby([this]() { return !this->decoding; });
+    Slot* s = &slot; // map nodes are stable
+    wrapper->setMaxLatency([s]() { return s->settings.max_latency; });
+    wrapper->setSuspended([s]() { return s->settings.suspended; });
+    wrapper->setParameterCache(parameter_sets);
+    slot.decoder = wrapper;
+}
+
+
+void NVMultiThread::dispatch(Frame* f) {
+    if (f->getFrameType() == FrameType::setupframe) {
+        SetupFrame* setupframe = static_cast<SetupFrame*>(f);
+        if (setupframe->sub_type == SetupFrameType::stream_init && setupframe->media_type == MediaType::video) {
+            setup(setupframe->n_slot, setupframe->codec_id);
+        }
+        return;
+    }
+    // while not decoding, the decoders only cache the packets
+    if (f->getFrameType() != FrameType::basicframe) {
+        return;
+    }
+    BasicFrame* basicframe = static_cast<BasicFrame*>(f);
+    if (basicframe->media_type != MediaType::video) {
+        return;
+    }
+    auto it = slots.find(basicframe->n_slot);
+    if (it == slots.end() || !it->second.decoder) {
+        return;
+    }
+    Slot& slot = it->second;
+    // a packet after the gap would refer to pictures that were dropped: start over at a keyframe
+    unsigned slice_type = basicframe->h264_pars.slice_type;
+    if (slot.overflow && (slice_type == H264SliceType::sps || slice_type == H264SliceType::i) && slot.queue.size() < max_queue) {
+        slot.overflow = false;
+    }
+    if (!slot.overflow && slot.queue.size() >= max_queue) {
+        decoderlogger.log(LogLevel::debug) << "NVMultiThread: " << name << " : slot " << slot.n_slot << " : queue full, dropping up to the next keyframe" << std::endl;
+        slot.overflow = true;
+        NVSlotStats::inc(slot.stats->overflows);
+    }
+    if (slot.overflow) {
+        NVSlotStats::inc(slot.stats->overflow_packets);
+        return;
+    }
+    BasicFrame* copy;
+    if (stock.empty()) {
+        copy = new BasicFrame();
+    }
+    else {
+        copy = stock.back();
+        stock.pop_back();
+    }
+    copy->copyFrom(basicframe);
+    slot.queue.push_back(copy);
+    slot.stats->submit_queue.store(slot.queue.size(), std::memory_order_relaxed);
+}
+
+
+int NVMultiThread::serve() {
+    if (settings_applied != settings_version) {
+        applySettings();
+    }
+    int n = 0;
+    int q = quantum;
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        Slot& slot = it->second;
+        for (int i = 0; i < q && !slot.queue.empty(); i++) {
+            BasicFrame* f = slot.queue.front();
+            slot.queue.pop_front();
+            slot.decoder->input(f);
+            if (slot.decoder->pull()) {
+                Frame* out = slot.decoder->output();
+                if (out) {
+                    outfilter.run(out);
+                }
+                slot.decoder->releaseOutput();
+            }
+            stock.push_back(f);
+            n++;
+        }
+        if (slot.stats) {
+            slot.stats->submit_queue.store(slot.queue.size(), std::memory_order_relaxed);
+        }
+    }
+    return n;
+}
+
+
+void NVMultiThread::run() {
+    decoderlogger.log(LogLevel::debug) << "NVMultiThread: " << name << " : starting" << std::endl;
+    bool pending = false;
+    while (running) {
+        // don't wait for new packets while there's work to do
+        Frame* f = infifo.read(pending ? 1 : 100);
+        int n_read = 0;
+        while (f) {
+            dispatch(f);
+            infifo.recycle(f);
+            if (++n_read >= max_read) {
+                break;
+            }
+            f = infifo.read(1);
+        }
+        serve();
+        pending = false;
+        for (auto it = slots.begin(); it != slots.end(); ++it) {
+            if (!it->second.queue.empty()) {
+                pending = true;
+                break;
+            }
+        }
+    }
+    // decoders go to the pool, so they must be gone before their streams
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        close(it->second);
+    }
+    releaseStreams();
+    decoderlogger.log(LogLevel::debug) << "NVMultiThread: " << name << " : exit" << std::endl;
+}
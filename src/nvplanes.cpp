@@ -0,0 +1,173 @@
+/*
+ * nvplanes.cpp : Aligned plane memory for decoded frames
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvplanes.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Aligned plane memory for decoded frames
+ */
+
+#include "nvplanes.h"
+#include <sys/mman.h>
+
+static const size_t huge_page_size = 2 * 1024 * 1024;
+
+std::atomic<bool> NVFramePlanes::huge_pages(false);
+
+
+static size_t alignUp(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+
+NVFramePlanes::NVFramePlanes() : data(NULL), size(0), mapped(false), width(0), height(0) {
+}
+
+
+NVFramePlanes::~NVFramePlanes() {
+    release();
+}
+
+
+void NVFramePlanes::setHugePages(bool enable) {
+    huge_pages = enable;
+}
+
+
+bool NVFramePlanes::getHugePages() {
+    return huge_pages;
+}
+
+
+int NVFramePlanes::linesize(int width) {
+    return (int)alignUp(std::max(width, 1), plane_align);
+}
+
+
+size_t NVFramePlanes::bytes(int width, int height) {
+    return (size_t)linesize(width) * height + 2 * (size_t)linesize((width + 1) / 2) * ((height + 1) / 2);
+}
+
+
+bool NVFramePlanes::allocate(size_t size) {
+    release();
+    if (huge_pages && size >= huge_page_size) {
+        size_t mapsize = alignUp(size, huge_page_size);
+        void* p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            #ifdef MADV_HUGEPAGE
+            madvise(p, mapsize, MADV_HUGEPAGE); // only a hint: fine if the kernel says no
+            #endif
+            data = (uint8_t*)p;
+            this->size = mapsize;
+            mapped = true;
+            return true;
+        }
+        decoderlogger.log(LogLevel::debug) << "NVFramePlanes: allocate: mmap failed, using normal pages" << std::endl;
+    }
+    void* p = NULL;
+    if (posix_memalign(&p, plane_align, size) != 0) {
+        decoderlogger.log(LogLevel::fatal) << "NVFramePlanes: allocate: out of memory" << std::endl;
+        return false;
+    }
+    data = (uint8_t*)p;
+    this->size = size;
+    mapped = false;
+    return true;
+}
+
+
+void NVFramePlanes::release() {
+    if (!data) {
+        return;
+    }
+    if (mapped) {
+        munmap(data, size);
+    }
+    else {
+        free(data);
+    }
+    data = NULL;
+    size = 0;
+    mapped = false;
+    width = 0;
+    height = 0;
+}
+
+
+bool NVFramePlanes::reserve(AVBitmapFrame* f, int width, int height) {
+    int chroma_width = (width + 1) / 2;
+    int chroma_height = (height + 1) / 2;
+    int y_linesize = linesize(width);
+    int uv_linesize = linesize(chroma_width);
+    // plane sizes are multiples of plane_align, so each plane starts aligned
+    size_t y_size = (size_t)y_linesize * height;
+    size_t uv_size = (size_t)uv_linesize * chroma_height;
+
+    if (!data || this->width != width || this->height != height) {
+        if (!allocate(y_size + 2 * uv_size)) {
+            return false;
+        }
+        this->width = width;
+        this->height = height;
+    }
+
+    f->y_payload = data;
+    f->u_payload = data + y_size;
+    f->v_payload = data + y_size + uv_size;
+
+    BitmapPars& bmpars = f->bmpars;
+    bmpars.width = width;
+    bmpars.height = height;
+    bmpars.y_width = width;
+    bmpars.y_height = height;
+    bmpars.u_width = chroma_width;
+    bmpars.u_height = chroma_height;
+    bmpars.v_width = chroma_width;
+    bmpars.v_height = chroma_height;
+    bmpars.y_linesize = y_linesize;
+    bmpars.u_linesize = uv_linesize;
+    bmpars.v_linesize = uv_linesize;
+    bmpars.y_size = (int)y_size;
+    bmpars.u_size = (int)uv_size;
+    bmpars.v_size = (int)uv_size;
+
+    // no buffer references: the planes are not the AVFrame's to free
+    AVFrame* av_frame = f->av_frame;
+    av_frame->data[0] = f->y_payload;
+    av_frame->data[1] = f->u_payload;
+    av_frame->data[2] = f->v_payload;
+    av_frame->linesize[0] = y_linesize;
+    av_frame->linesize[1] = uv_linesize;
+    av_frame->linesize[2] = uv_linesize;
+    av_frame->width = width;
+    av_frame->height = height;
+    av_frame->format = AV_PIX_FMT_YUV420P;
+    return true;
+}
+
+
+bool NVFramePlanes::isHuge() {
+    return mapped;
+}
+
+
+size_t NVFramePlanes::getSize() {
+    return size;
+}
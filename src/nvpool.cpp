@@ -0,0 +1,179 @@
+/*
+ * nvpool.cpp : Process-wide pool of idle NVDEC decoder sessions
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvpool.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide pool of idle NVDEC decoder sessions
+ */
+
+#include "nvpool.h"
+#include "nvframepool.h"
+
+static const int default_max_idle = 4;
+static const long default_max_idle_ms = 60000;
+
+
+NVDecoderPool::NVDecoderPool(NVDeviceRegistry* registry) : registry(registry), max_idle(default_max_idle), max_idle_ms(default_max_idle_ms),
+    hits(0), misses(0), evictions(0) {
+}
+
+
+NVDecoderPool::~NVDecoderPool() {
+    clear();
+}
+
+
+NVDecoderPool& NVDecoderPool::instance() {
+    // pooled decoders release their sessions & frames at exit: the registry & the frame pool must outlive the pool
+    NVDeviceRegistry::instance();
+    NVFramePool::instance();
+    static NVDecoderPool pool;
+    return pool;
+}
+
+
+void NVDecoderPool::evict(std::vector<Decoder*>& evicted) {
+    NVClock::time_point now = NVClock::now();
+    while (!idle.empty()) {
+        const Entry& e = idle.front();
+        long age_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - e.parked).count();
+        if (idle.size() <= max_idle && age_ms < max_idle_ms) {
+            break;
+        }
+        evicted.push_back(e.decoder);
+        idle.pop_front();
+        evictions++;
+    }
+}
+
+
+Decoder* NVDecoderPool::lease(AVCodecID codec_id, int gpu_index, unsigned max_width, unsigned max_height, bool shared_context, const void* owner) {
+    if (gpu_index < 0) {
+        gpu_index = (registry ? *registry : NVDeviceRegistry::instance()).place(owner);
+    }
+    std::vector<Decoder*> evicted;
+    Decoder* decoder = NULL;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        evict(evicted);
+        // newest first: its memory is most likely still warm
+        for (auto it = idle.rbegin(); it != idle.rend(); ++it) {
+            const NVSessionKey& k = it->key;
+            // NVDecoder outputs 8 bit 4:2:0 only
+            if (k.gpu_index == gpu_index && k.codec_id == codec_id &&
+                k.chroma_format == cudaVideoChromaFormat_420 && k.bit_depth_minus8 == 0 &&
+                k.max_width >= max_width && k.max_height >= max_height && k.shared_context == shared_context) {
+                decoder = it->decoder;
+                idle.erase(std::next(it).base());
+                break;
+            }
+        }
+        if (decoder) {
+            hits++;
+        }
+        else {
+            misses++;
+        }
+    }
+    for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+        delete *it;
+    }
+    if (decoder) {
+        decoderlogger.log(LogLevel::debug) << "NVDecoderPool: lease: reusing a decoder on GPU " << gpu_index << std::endl;
+        dynamic_cast<NVPooledSession*>(decoder)->reuse(owner);
+    }
+    return decoder;
+}
+
+
+void NVDecoderPool::giveBack(Decoder* decoder) {
+    NVPooledSession* session = dynamic_cast<NVPooledSession*>(decoder);
+    NVSessionKey key;
+    bool keep = (session && session->getSessionKey(key));
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        keep = keep && (max_idle > 0);
+    }
+    // cuda calls outside the mutex
+    if (!keep || !session->park(this)) {
+        delete decoder;
+        return;
+    }
+    std::vector<Decoder*> evicted;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        Entry e;
+        e.key = key;
+        e.decoder = decoder;
+        e.parked = NVClock::now();
+        idle.push_back(e);
+        evict(evicted);
+    }
+    for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+void NVDecoderPool::configure(int max_idle, long max_idle_ms) {
+    std::vector<Decoder*> evicted;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        this->max_idle = std::max(0, max_idle);
+        this->max_idle_ms = max_idle_ms;
+        evict(evicted);
+    }
+    for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+void NVDecoderPool::clear() {
+    std::deque<Entry> entries;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        entries.swap(idle);
+    }
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        delete it->decoder;
+    }
+}
+
+
+PyObject* NVDecoderPool::getPyStats() {
+    std::vector<Decoder*> evicted;
+    PyObject* dic = PyDict_New();
+    PyObject* value;
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        evict(evicted);
+        value = PyLong_FromSize_t(idle.size());             PyDict_SetItemString(dic, "idle", value);          Py_DECREF(value);
+        value = PyLong_FromUnsignedLongLong(hits);          PyDict_SetItemString(dic, "hits", value);          Py_DECREF(value);
+        value = PyLong_FromUnsignedLongLong(misses);        PyDict_SetItemString(dic, "misses", value);        Py_DECREF(value);
+        value = PyLong_FromUnsignedLongLong(evictions);     PyDict_SetItemString(dic, "evictions", value);     Py_DECREF(value);
+        value = PyLong_FromLong(max_idle);                  PyDict_SetItemString(dic, "max_idle", value);      Py_DECREF(value);
+        value = PyLong_FromLong(max_idle_ms);               PyDict_SetItemString(dic, "max_idle_ms", value);   Py_DECREF(value);
+    }
+    for (auto it = evicted.begin(); it != evicted.end(); ++it) {
+        delete *it;
+    }
+    return dic;
+}
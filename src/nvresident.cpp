@@ -0,0 +1,241 @@
+/*
+ * nvresident.cpp : Decoded pictures kept on the GPU until asked for
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvresident.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Decoded pictures kept on the GPU until asked for
+ */
+
+#include "nvresident.h"
+#include "nvconvert.h"
+
+
+NVResidentFrames::NVResidentFrames(int n_frames) : next(0), context(NULL), n_frames(std::max(0, n_frames)),
+    fetched(0), misses(0), fetch_bytes(0) {
+}
+
+
+NVResidentFrames::~NVResidentFrames() {
+    // the decoders have released their memory by now
+}
+
+
+bool NVResidentFrames::enabled() {
+    return (n_frames > 0);
+}
+
+
+void NVResidentFrames::configure(int n_frames) {
+    this->n_frames = std::max(0, n_frames);
+    if (this->n_frames == 0) {
+        std::deque<std::shared_ptr<AVBitmapFrame>> frames; // back to the pool outside the mutex
+        std::unique_lock<std::mutex> lk(mutex);
+        frames.swap(host_frames);
+    }
+}
+
+
+void NVResidentFrames::freeAll() {
+    NVDriver* driver = NVDriver::get();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (it->ptr) {
+            driver->freeDevice(it->ptr);
+        }
+    }
+    entries.clear();
+    next = 0;
+}
+
+
+bool NVResidentFrames::store(CUcontext context, CUdeviceptr src, unsigned src_pitch, unsigned width, unsigned height, unsigned surface_height,
+    long mstimestamp, SlotNumber n_slot, int subsession_index, CUstream stream) {
+    NVDriver* driver = NVDriver::get();
+    unsigned chroma_height = height / 2;
+    std::unique_lock<std::mutex> lk(mutex);
+    if (context != this->context || entries.size() != (size_t)n_frames.load()) {
+        freeAll(); // a decoder with another context releases its memory before going, so this is ours or none
+        this->context = context;
+        entries.resize(n_frames);
+    }
+    if (entries.empty()) {
+        return false;
+    }
+    Entry& e = entries[next];
+    if (e.alloc_width != width || e.alloc_height != height + chroma_height) {
+        if (e.ptr) {
+            driver->freeDevice(e.ptr);
+            e = Entry();
+        }
+        if (!driver->allocPitch(width, height + chroma_height, e.ptr, e.pitch)) {
+            decoderlogger.log(LogLevel::fatal) << "NVResidentFrames: store: out of device memory" << std::endl;
+            e = Entry();
+            return false;
+        }
+        e.alloc_width = width;
+        e.alloc_height = height + chroma_height;
+    }
+    // luma & chroma rows, packed one after another
+    CUDA_MEMCPY2D m = { 0 };
+    m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    m.srcDevice = src;
+    m.srcPitch = src_pitch;
+    m.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    m.dstDevice = e.ptr;
+    m.dstPitch = e.pitch;
+    m.WidthInBytes = width;
+    m.Height = height;
+    bool ok = driver->copy2D(m, stream);
+    m.srcDevice = src + (CUdeviceptr)src_pitch * surface_height;
+    m.dstDevice = e.ptr + (CUdeviceptr)e.pitch * height;
+    m.Height = chroma_height;
+    ok = ok && driver->copy2D(m, stream);
+    // the surface is unmapped right after this
+    ok = driver->synchronize(stream) && ok;
+    e.valid = ok;
+    e.width = width;
+    e.height = height;
+    e.mstimestamp = mstimestamp;
+    e.n_slot = n_slot;
+    e.subsession_index = subsession_index;
+    next = (next + 1) % entries.size();
+    return ok;
+}
+
+
+bool NVResidentFrames::keep(AVBitmapFrame* frame) {
+    int n = n_frames.load();
+    if (n <= 0) {
+        return false;
+    }
+    std::shared_ptr<AVBitmapFrame> f = NVFramePool::instance().copy(frame);
+    if (!f) {
+        return false;
+    }
+    std::deque<std::shared_ptr<AVBitmapFrame>> oldest; // back to the pool outside the mutex
+    std::unique_lock<std::mutex> lk(mutex);
+    host_frames.push_back(f);
+    while (host_frames.size() > (size_t)n) {
+        oldest.push_back(host_frames.front());
+        host_frames.pop_front();
+    }
+    return true;
+}
+
+
+// is ts closer to the wanted timestamp than best.  0: the newest
+static bool closer(long ts, long best, long mstimestamp) {
+    if (mstimestamp == 0) {
+        return ts > best;
+    }
+    return std::abs(ts - mstimestamp) < std::abs(best - mstimestamp);
+}
+
+
+std::shared_ptr<AVBitmapFrame> NVResidentFrames::fetch(long mstimestamp) {
+    NVDriver* driver = NVDriver::get();
+    std::unique_lock<std::mutex> lk(mutex);
+    Entry* e = NULL;
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        if (!it->valid) {
+            continue;
+        }
+        if (!e || closer(it->mstimestamp, e->mstimestamp, mstimestamp)) {
+            e = &(*it);
+        }
+    }
+    std::shared_ptr<AVBitmapFrame> host;
+    for (auto it = host_frames.begin(); it != host_frames.end(); ++it) {
+        if (!host || closer((*it)->mstimestamp, host->mstimestamp, mstimestamp)) {
+            host = *it;
+        }
+    }
+    if (host && (!e || closer(host->mstimestamp, e->mstimestamp, mstimestamp))) { // no download needed
+        fetched++;
+        return host;
+    }
+    std::shared_ptr<AVBitmapFrame> f;
+    if (e) {
+        f = NVFramePool::instance().lease(e->width, e->height);
+    }
+    if (!f) {
+        misses++;
+        return f;
+    }
+    unsigned chroma_height = e->height / 2;
+    staging.resize((size_t)e->width * (e->height + chroma_height));
+    CUDA_MEMCPY2D m = { 0 };
+    m.srcMemoryType = CU_MEMORYTYPE_DEVICE;
+    m.srcDevice = e->ptr;
+    m.srcPitch = e->pitch;
+    m.dstMemoryType = CU_MEMORYTYPE_HOST;
+    m.dstHost = staging.data();
+    m.dstPitch = e->width;
+    m.WidthInBytes = e->width;
+    m.Height = e->height + chroma_height;
+    bool ok = driver->pushContext(context);
+    if (ok) {
+        ok = driver->copy2D(m, 0) && driver->synchronize(0);
+        driver->popContext();
+    }
+    if (!ok) {
+        decoderlogger.log(LogLevel::fatal) << "NVResidentFrames: fetch: copy failed" << std::endl;
+        misses++;
+        return std::shared_ptr<AVBitmapFrame>();
+    }
+    const uint8_t* luma = staging.data();
+    const uint8_t* chroma = luma + (size_t)e->width * e->height;
+    NVCopyRows(luma, e->width, f->y_payload, f->bmpars.y_linesize, e->width, 0, e->height);
+    NVDeinterleave(chroma, e->width, f->u_payload, f->bmpars.u_linesize, f->v_payload, f->bmpars.v_linesize,
+        e->width / 2, chroma_height);
+    f->mstimestamp = e->mstimestamp;
+    f->n_slot = e->n_slot;
+    f->subsession_index = e->subsession_index;
+    fetched++;
+    fetch_bytes += staging.size();
+    return f;
+}
+
+
+void NVResidentFrames::release(CUcontext context) {
+    std::unique_lock<std::mutex> lk(mutex);
+    if (context != this->context || entries.empty()) {
+        return;
+    }
+    NVDriver* driver = NVDriver::get();
+    if (driver->pushContext(context)) {
+        freeAll();
+        driver->popContext();
+    }
+    else {
+        entries.clear(); // the memory went with the context
+        next = 0;
+    }
+    this->context = NULL;
+}
+
+
+int NVResidentFrames::size() {
+    std::unique_lock<std::mutex> lk(mutex);
+    int n = host_frames.size();
+    for (auto it = entries.begin(); it != entries.end(); ++it) {
+        n += it->valid ? 1 : 0;
+    }
+    return n;
+}
@@ -0,0 +1,386 @@
+/*
+ * nvreverse.cpp : Plays recordings backwards
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvreverse.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Plays recordings backwards
+ */
+
+#include "nvreverse.h"
+#include "nvdecoder.h"
+#include "nvfile.h"
+#include "nvframepool.h"
+#include "nvdevices.h"
+#include <limits>
+
+// a longer wait is a gap in the recording: the pace starts over
+static const long max_pace_wait_ms = 1000;
+
+
+NVReversePlayer::NVReversePlayer(const char* name, FrameFilter& outfilter, int gpu_index, int max_frames) :
+    name(name), outfilter(outfilter), decoder(NULL) {
+    init(max_frames);
+    factory = [this, gpu_index]() {
+        NVDecoder* decoder = new NVDecoder(AV_CODEC_ID_H264, gpu_index, nv_max_held_pictures + 2, this); // the ring holds one less
+        decoder->setStats(this->slot_stats);
+        this->stats.decoders_created++;
+        return decoder;
+    };
+}
+
+
+NVReversePlayer::NVReversePlayer(const char* name, FrameFilter& outfilter, std::function<Decoder*()> factory, int max_frames) :
+    name(name), outfilter(outfilter), factory(factory), decoder(NULL) {
+    init(max_frames);
+}
+
+
+void NVReversePlayer::init(int max_frames) {
+    chunk_frames = (size_t)std::max(1, max_frames / 3);
+    slot_stats = stats.newSlot();
+    last_sps = -1;
+    last_pps = -1;
+    running = false;
+    playing = false;
+    held = 0;
+    gop_passes = 0;
+    decoded_frames = 0;
+    redecoded_frames = 0;
+    played_frames = 0;
+    peak_frames = 0;
+}
+
+
+NVReversePlayer::~NVReversePlayer() {
+    stop();
+    if (decoder) {
+        delete decoder;
+    }
+    NVDeviceRegistry::instance().forget(this);
+    for (auto it = packets.begin(); it != packets.end(); ++it) {
+        delete *it;
+    }
+}
+
+
+void NVReversePlayer::addPacket(BasicFrame* in) {
+    if (in->codec_id != AV_CODEC_ID_H264) {
+        return;
+    }
+    unsigned slice_type = in->h264_pars.slice_type;
+    bool parameters = (slice_type == H264SliceType::sps || slice_type == H264SliceType::pps);
+    if (gops.empty() && !parameters && slice_type != H264SliceType::i) { // nothing to decode it from
+        return;
+    }
+    long index = (long)packets.size();
+    BasicFrame* f = new BasicFrame();
+    f->copyFrom(in);
+    packets.push_back(f);
+    if (slice_type == H264SliceType::sps) {
+        last_sps = index;
+    }
+    else if (slice_type == H264SliceType::pps) {
+        last_pps = index;
+    }
+    else if (slice_type == H264SliceType::i && !(!gops.empty() && gops.back().end == (size_t)index &&
+            packets[index - 1]->h264_pars.slice_type == H264SliceType::i && packets[index - 1]->mstimestamp == f->mstimestamp)) {
+        // a new keyframe, not another slice of the previous one
+        Gop gop;
+        gop.begin = index;
+        gop.end = index + 1;
+        gop.sps = last_sps;
+        gop.pps = last_pps;
+        gop.mstimestamp = f->mstimestamp;
+        gops.push_back(gop);
+        return;
+    }
+    if (!gops.empty()) {
+        gops.back().end = index + 1;
+    }
+}
+
+
+bool NVReversePlayer::open(const char* filename) {
+    stop();
+    // the previous recording, if any
+    for (auto it = packets.begin(); it != packets.end(); ++it) {
+        delete *it;
+    }
+    packets.clear();
+    gops.clear();
+    last_sps = -1;
+    last_pps = -1;
+    NVFileReader reader(filename);
+    if (!reader.isOk()) {
+        return false;
+    }
+    BasicFrame f;
+    while (reader.read(f)) {
+        addPacket(&f);
+    }
+    decoderlogger.log(LogLevel::debug) << "NVReversePlayer: open: " << packets.size() << " packets in " << gops.size() << " GOPs" << std::endl;
+    return !gops.empty();
+}
+
+
+bool NVReversePlayer::ready() {
+    if (decoder && decoder->isOk()) {
+        return true;
+    }
+    if (decoder) {
+        decoderlogger.log(LogLevel::normal) << "NVReversePlayer: " << name << ": decoder failed, creating a new one" << std::endl;
+        delete decoder;
+    }
+    decoder = factory();
+    return (decoder && decoder->isOk());
+}
+
+
+void NVReversePlayer::hold(long n) {
+    long now = (held += n);
+    long peak = peak_frames.load();
+    while (now > peak && !peak_frames.compare_exchange_weak(peak, now)) {
+    }
+}
+
+
+bool NVReversePlayer::collect(Frame* out, long to_ms, size_t n, size_t lo, bool window, std::deque<std::shared_ptr<AVBitmapFrame>>& kept) {
+    if (!out || out->getFrameType() != FrameType::avbitmapframe || out->mstimestamp > to_ms) {
+        return false;
+    }
+    decoded_frames++;
+    if (n < lo) {
+        redecoded_frames++;
+        return true;
+    }
+    // pooled output is kept by reference, other output copied into a pooled frame
+    AVBitmapFrame* bitmap = static_cast<AVBitmapFrame*>(out);
+    NVPooledFrame* pooled = dynamic_cast<NVPooledFrame*>(bitmap);
+    std::shared_ptr<AVBitmapFrame> f = pooled ? pooled->share() : nullptr;
+    if (!f) {
+        f = NVFramePool::instance().copy(bitmap);
+    }
+    if (f && window && kept.size() >= chunk_frames) { // slide the window
+        kept.pop_front();
+        hold(-1);
+        redecoded_frames++;
+    }
+    if (f) {
+        kept.push_back(f);
+        hold(1);
+    }
+    return true;
+}
+
+
+size_t NVReversePlayer::decodeGop(const Gop& gop, long to_ms, size_t lo, size_t hi, std::deque<std::shared_ptr<AVBitmapFrame>>& kept) {
+    bool window = (hi == SIZE_MAX);
+    size_t n = 0;
+    gop_passes++;
+    decoder->flush();
+    // each pass is a stream of its own: parameter sets, the GOP & the end of stream
+    BasicFrame* sps = (gop.sps >= 0) ? packets[gop.sps] : NULL;
+    BasicFrame* pps = (gop.pps >= 0) ? packets[gop.pps] : NULL;
+    for (BasicFrame* f : {sps, pps}) {
+        if (f) {
+            decoder->input(f);
+            if (decoder->pull()) {
+                decoder->releaseOutput();
+            }
+        }
+    }
+    for (size_t i = gop.begin; i < gop.end && n < hi && running; i++) {
+        decoder->input(packets[i]);
+        if (decoder->pull()) {
+            n += collect(decoder->output(), to_ms, n, lo, window, kept) ? 1 : 0;
+            decoder->releaseOutput();
+        }
+    }
+    // end of stream: the parser gives out the pictures it holds back for display, all at once.  Also after a pass that
+    // stopped early, so that the next one starts over with an empty parser
+    BasicFrame end;
+    end.n_slot = packets[gop.begin]->n_slot;
+    decoder->input(&end);
+    for (int i = 0; i <= nv_max_held_pictures && decoder->pull(); i++) {
+        if (n < hi && running) {
+            n += collect(decoder->output(), to_ms, n, lo, window, kept) ? 1 : 0;
+        }
+        decoder->releaseOutput();
+    }
+    return n;
+}
+
+
+bool NVReversePlayer::push(Chunk& chunk) {
+    std::unique_lock<std::mutex> lk(mutex);
+    // one chunk waits while another is played
+    condition.wait(lk, [this]() { return chunks.empty() || !running; });
+    if (!running) {
+        return false;
+    }
+    chunks.push_back(Chunk());
+    chunks.back().swap(chunk);
+    condition.notify_all();
+    return true;
+}
+
+
+void NVReversePlayer::decodeLoop(size_t gop_index, long to_ms) {
+    for (size_t g = gop_index + 1; g-- > 0 && running; ) {
+        if (!ready()) {
+            decoderlogger.log(LogLevel::fatal) << "NVReversePlayer: " << name << ": no decoder" << std::endl;
+            break;
+        }
+        // the last chunk of the GOP first, then the ones before
+        std::deque<std::shared_ptr<AVBitmapFrame>> kept;
+        size_t n = decodeGop(gops[g], to_ms, 0, SIZE_MAX, kept);
+        size_t lo = n - std::min(n, kept.size());
+        while (running) {
+            Chunk chunk(kept.begin(), kept.end());
+            kept.clear();
+            if (!chunk.empty() && !push(chunk)) {
+                hold(-(long)chunk.size());
+                break;
+            }
+            if (lo == 0 || !ready()) {
+                break;
+            }
+            size_t hi = lo;
+            lo = (hi > chunk_frames) ? hi - chunk_frames : 0;
+            decodeGop(gops[g], to_ms, lo, hi, kept);
+        }
+        hold(-(long)kept.size());
+    }
+    Chunk end;
+    std::unique_lock<std::mutex> lk(mutex);
+    chunks.push_back(end);
+    condition.notify_all();
+}
+
+
+void NVReversePlayer::emitLoop(double speed) {
+    bool paced = false;
+    long pace_ts = 0;
+    NVClock::time_point pace_time;
+    while (running) {
+        Chunk chunk;
+        {// PROTECTED
+            std::unique_lock<std::mutex> lk(mutex);
+            condition.wait(lk, [this]() { return !chunks.empty() || !running; });
+            if (!running) {
+                break;
+            }
+            chunk.swap(chunks.front());
+            chunks.pop_front();
+            condition.notify_all(); // room for the next chunk
+        }
+        if (chunk.empty()) { // the end
+            break;
+        }
+        for (auto it = chunk.rbegin(); it != chunk.rend(); ++it) {
+            if (!running) {
+                break;
+            }
+            long ts = (*it)->mstimestamp;
+            if (speed > 0) {
+                long ahead_ms = paced ? (long)((pace_ts - ts) / speed) - (long)(NVusSince(pace_time) / 1000) : 0;
+                if (!paced || ahead_ms > max_pace_wait_ms || ts > pace_ts) {
+                    paced = true;
+                    pace_ts = ts;
+                    pace_time = NVClock::now();
+                }
+                else if (ahead_ms > 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(ahead_ms));
+                }
+            }
+            outfilter.run(it->get());
+            played_frames++;
+        }
+        hold(-(long)chunk.size());
+    }
+    playing = false;
+}
+
+
+void NVReversePlayer::play(long mstimestamp, double speed) {
+    stop();
+    if (gops.empty()) {
+        return;
+    }
+    size_t g = gops.size() - 1;
+    long to_ms = std::numeric_limits<long>::max();
+    if (mstimestamp > 0) {
+        while (g > 0 && gops[g].mstimestamp > mstimestamp) {
+            g--;
+        }
+        to_ms = mstimestamp;
+    }
+    running = true;
+    playing = true;
+    decode_thread = std::thread(&NVReversePlayer::decodeLoop, this, g, to_ms);
+    emit_thread = std::thread(&NVReversePlayer::emitLoop, this, speed);
+}
+
+
+void NVReversePlayer::stop() {
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        running = false;
+        condition.notify_all();
+    }
+    if (decode_thread.joinable()) {
+        decode_thread.join();
+    }
+    if (emit_thread.joinable()) {
+        emit_thread.join();
+    }
+    std::deque<Chunk> left;
+    {// PROTECTED
+        std::unique_lock<std::mutex> lk(mutex);
+        left.swap(chunks);
+    }
+    for (auto it = left.begin(); it != left.end(); ++it) {
+        hold(-(long)it->size());
+    }
+    playing = false;
+}
+
+
+bool NVReversePlayer::isPlaying() {
+    return playing;
+}
+
+
+size_t NVReversePlayer::getGops() {
+    return gops.size();
+}
+
+
+PyObject* NVReversePlayer::getStats() {
+    PyObject* dic = stats.getStats();
+    PyObject* value;
+    value = PyLong_FromUnsignedLongLong(gop_passes);        PyDict_SetItemString(dic, "gop_passes", value);        Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(decoded_frames);    PyDict_SetItemString(dic, "decoded_frames", value);    Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(redecoded_frames);  PyDict_SetItemString(dic, "redecoded_frames", value);  Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(played_frames);     PyDict_SetItemString(dic, "played_frames", value);     Py_DECREF(value);
+    value = PyLong_FromLong(held);                          PyDict_SetItemString(dic, "held_frames", value);       Py_DECREF(value);
+    value = PyLong_FromLong(peak_frames);                   PyDict_SetItemString(dic, "peak_frames", value);       Py_DECREF(value);
+    return dic;
+}
@@ -0,0 +1,271 @@
+/*
+ * nvstats.cpp : Runtime statistics for the cuda accelerated decoders
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvstats.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Runtime statistics for the cuda accelerated decoders
+ */
+
+#include "nvstats.h"
+
+
+NVSlotSnapshot::NVSlotSnapshot() : n_slot(-1),
+    input_packets(0), input_bytes(0), decoded_pictures(0), emitted_frames(0), dropped_frames(0),
+    decode_errors(0), decode_concealed(0), bytes_downloaded(0), fallback_switches(0), gpu_recoveries(0), first_frame_us(0),
+    submit_queue(0), completion_queue(0), handoff_frames(0), copy_bytes_saved(0),
+    gop_joins(0), join_packets(0), join_us(0),
+    catchups(0), catchup_packets(0), catchup_recovered_us(0), latency_us(0), skipped_frames(0), resident_frames(0),
+    scrub_packets(0), pace_drops(0), overflows(0), overflow_packets(0),
+    parse_count(0), parse_us(0), parse_max_us(0),
+    copy_count(0), copy_us(0), copy_max_us(0),
+    convert_count(0), convert_us(0), convert_max_us(0) {
+}
+
+
+void NVSlotSnapshot::add(const NVSlotStats& stats) {
+    n_slot              = stats.n_slot.load(std::memory_order_relaxed);
+    input_packets       += stats.input_packets.load(std::memory_order_relaxed);
+    input_bytes         += stats.input_bytes.load(std::memory_order_relaxed);
+    decoded_pictures    += stats.decoded_pictures.load(std::memory_order_relaxed);
+    emitted_frames      += stats.emitted_frames.load(std::memory_order_relaxed);
+    dropped_frames      += stats.dropped_frames.load(std::memory_order_relaxed);
+    decode_errors       += stats.decode_errors.load(std::memory_order_relaxed);
+    decode_concealed    += stats.decode_concealed.load(std::memory_order_relaxed);
+    bytes_downloaded    += stats.bytes_downloaded.load(std::memory_order_relaxed);
+    fallback_switches   += stats.fallback_switches.load(std::memory_order_relaxed);
+    gpu_recoveries      += stats.gpu_recoveries.load(std::memory_order_relaxed);
+    uint64_t first_us   = stats.first_frame_us.load(std::memory_order_relaxed);
+    if (first_us > 0) { // latest decoder wins
+        first_frame_us  = first_us;
+    }
+    submit_queue        += stats.submit_queue.load(std::memory_order_relaxed);
+    completion_queue    += stats.completion_queue.load(std::memory_order_relaxed);
+    handoff_frames      += stats.handoff_frames.load(std::memory_order_relaxed);
+    copy_bytes_saved    += stats.copy_bytes_saved.load(std::memory_order_relaxed);
+    gop_joins           += stats.gop_joins.load(std::memory_order_relaxed);
+    join_packets        += stats.join_packets.load(std::memory_order_relaxed);
+    uint64_t j_us       = stats.join_us.load(std::memory_order_relaxed);
+    if (j_us > 0) {
+        join_us         = j_us;
+    }
+    catchups            += stats.catchups.load(std::memory_order_relaxed);
+    catchup_packets     += stats.catchup_packets.load(std::memory_order_relaxed);
+    catchup_recovered_us += stats.catchup_recovered_us.load(std::memory_order_relaxed);
+    latency_us          = std::max(latency_us, stats.latency_us.load(std::memory_order_relaxed));
+    skipped_frames      += stats.skipped_frames.load(std::memory_order_relaxed);
+    resident_frames     += stats.resident_frames.load(std::memory_order_relaxed);
+    scrub_packets       += stats.scrub_packets.load(std::memory_order_relaxed);
+    pace_drops          += stats.pace_drops.load(std::memory_order_relaxed);
+    overflows           += stats.overflows.load(std::memory_order_relaxed);
+    overflow_packets    += stats.overflow_packets.load(std::memory_order_relaxed);
+    parse_count         += stats.parse_time.count.load(std::memory_order_relaxed);
+    parse_us            += stats.parse_time.total_us.load(std::memory_order_relaxed);
+    parse_max_us        = std::max(parse_max_us, stats.parse_time.max_us.load(std::memory_order_relaxed));
+    copy_count          += stats.copy_time.count.load(std::memory_order_relaxed);
+    copy_us             += stats.copy_time.total_us.load(std::memory_order_relaxed);
+    copy_max_us         = std::max(copy_max_us, stats.copy_time.max_us.load(std::memory_order_relaxed));
+    convert_count       += stats.convert_time.count.load(std::memory_order_relaxed);
+    convert_us          += stats.convert_time.total_us.load(std::memory_order_relaxed);
+    convert_max_us      = std::max(convert_max_us, stats.convert_time.max_us.load(std::memory_order_relaxed));
+}
+
+
+void NVSlotSnapshot::add(const NVSlotSnapshot& other) {
+    n_slot              = other.n_slot;
+    input_packets       += other.input_packets;
+    input_bytes         += other.input_bytes;
+    decoded_pictures    += other.decoded_pictures;
+    emitted_frames      += other.emitted_frames;
+    dropped_frames      += other.dropped_frames;
+    decode_errors       += other.decode_errors;
+    decode_concealed    += other.decode_concealed;
+    bytes_downloaded    += other.bytes_downloaded;
+    fallback_switches   += other.fallback_switches;
+    gpu_recoveries      += other.gpu_recoveries;
+    first_frame_us      = std::max(first_frame_us, other.first_frame_us);
+    submit_queue        += other.submit_queue;
+    completion_queue    += other.completion_queue;
+    handoff_frames      += other.handoff_frames;
+    copy_bytes_saved    += other.copy_bytes_saved;
+    gop_joins           += other.gop_joins;
+    join_packets        += other.join_packets;
+    join_us             = std::max(join_us, other.join_us);
+    catchups            += other.catchups;
+    catchup_packets     += other.catchup_packets;
+    catchup_recovered_us += other.catchup_recovered_us;
+    latency_us          = std::max(latency_us, other.latency_us);
+    skipped_frames      += other.skipped_frames;
+    resident_frames     += other.resident_frames;
+    scrub_packets       += other.scrub_packets;
+    pace_drops          += other.pace_drops;
+    overflows           += other.overflows;
+    overflow_packets    += other.overflow_packets;
+    parse_count         += other.parse_count;
+    parse_us            += other.parse_us;
+    parse_max_us        = std::max(parse_max_us, other.parse_max_us);
+    copy_count          += other.copy_count;
+    copy_us             += other.copy_us;
+    copy_max_us         = std::max(copy_max_us, other.copy_max_us);
+    convert_count       += other.convert_count;
+    convert_us          += other.convert_us;
+    convert_max_us      = std::max(convert_max_us, other.convert_max_us);
+}
+
+
+static void setItem(PyObject* dic, const char* key, PyObject* value) {
+    // PyDict_SetItemString does not steal the reference
+    PyDict_SetItemString(dic, key, value);
+    Py_DECREF(value);
+}
+
+
+static double rate(uint64_t now, uint64_t before, double dt) {
+    if (dt <= 0 || now < before) {
+        return 0.;
+    }
+    return (now - before) / dt;
+}
+
+
+static double average(uint64_t total, uint64_t count) {
+    if (count == 0) {
+        return 0.;
+    }
+    return (double)total / count;
+}
+
+
+static PyObject* snapshotToDict(const NVSlotSnapshot& s, const NVSlotSnapshot& prev, double dt) {
+    PyObject* dic = PyDict_New();
+    setItem(dic, "input_packets",       PyLong_FromUnsignedLongLong(s.input_packets));
+    setItem(dic, "input_bytes",         PyLong_FromUnsignedLongLong(s.input_bytes));
+    setItem(dic, "decoded_pictures",    PyLong_FromUnsignedLongLong(s.decoded_pictures));
+    setItem(dic, "emitted_frames",      PyLong_FromUnsignedLongLong(s.emitted_frames));
+    setItem(dic, "dropped_frames",      PyLong_FromUnsignedLongLong(s.dropped_frames));
+    setItem(dic, "skipped_frames",      PyLong_FromUnsignedLongLong(s.skipped_frames));
+    setItem(dic, "resident_frames",     PyLong_FromUnsignedLongLong(s.resident_frames));
+    setItem(dic, "decode_errors",       PyLong_FromUnsignedLongLong(s.decode_errors));
+    setItem(dic, "decode_concealed",    PyLong_FromUnsignedLongLong(s.decode_concealed));
+    setItem(dic, "bytes_downloaded",    PyLong_FromUnsignedLongLong(s.bytes_downloaded));
+    setItem(dic, "fallback_switches",   PyLong_FromUnsignedLongLong(s.fallback_switches));
+    setItem(dic, "gpu_recoveries",      PyLong_FromUnsignedLongLong(s.gpu_recoveries));
+    setItem(dic, "first_frame_ms",      PyFloat_FromDouble(s.first_frame_us / 1000.));
+    setItem(dic, "handoff_frames",      PyLong_FromUnsignedLongLong(s.handoff_frames));
+    setItem(dic, "copy_bytes_saved",    PyLong_FromUnsignedLongLong(s.copy_bytes_saved));
+    setItem(dic, "gop_joins",           PyLong_FromUnsignedLongLong(s.gop_joins));
+    setItem(dic, "join_packets",        PyLong_FromUnsignedLongLong(s.join_packets));
+    setItem(dic, "join_ms",             PyFloat_FromDouble(s.join_us / 1000.));
+    setItem(dic, "catchups",            PyLong_FromUnsignedLongLong(s.catchups));
+    setItem(dic, "catchup_packets",     PyLong_FromUnsignedLongLong(s.catchup_packets));
+    setItem(dic, "catchup_recovered_ms", PyFloat_FromDouble(s.catchup_recovered_us / 1000.));
+    setItem(dic, "latency_ms",          PyFloat_FromDouble(s.latency_us / 1000.));
+    setItem(dic, "scrub_packets",       PyLong_FromUnsignedLongLong(s.scrub_packets));
+    setItem(dic, "pace_drops",          PyLong_FromUnsignedLongLong(s.pace_drops));
+    setItem(dic, "overflows",           PyLong_FromUnsignedLongLong(s.overflows));
+    setItem(dic, "overflow_packets",    PyLong_FromUnsignedLongLong(s.overflow_packets));
+    // current queue depths of the pipeline stages
+    setItem(dic, "submit_queue",        PyLong_FromUnsignedLongLong(s.submit_queue));
+    setItem(dic, "completion_queue",    PyLong_FromUnsignedLongLong(s.completion_queue));
+    // rates over the interval since the previous getStats call
+    setItem(dic, "input_pps",           PyFloat_FromDouble(rate(s.input_packets, prev.input_packets, dt)));
+    setItem(dic, "decode_fps",          PyFloat_FromDouble(rate(s.decoded_pictures, prev.decoded_pictures, dt)));
+    setItem(dic, "output_fps",          PyFloat_FromDouble(rate(s.emitted_frames, prev.emitted_frames, dt)));
+    setItem(dic, "drop_rate",           PyFloat_FromDouble(rate(s.dropped_frames, prev.dropped_frames, dt)));
+    setItem(dic, "input_bps",           PyFloat_FromDouble(rate(s.input_bytes, prev.input_bytes, dt)));
+    setItem(dic, "download_bps",        PyFloat_FromDouble(rate(s.bytes_downloaded, prev.bytes_downloaded, dt)));
+    setItem(dic, "copy_saved_bps",      PyFloat_FromDouble(rate(s.copy_bytes_saved, prev.copy_bytes_saved, dt)));
+    // stage times in microseconds
+    setItem(dic, "parse_us_avg",        PyFloat_FromDouble(average(s.parse_us, s.parse_count)));
+    setItem(dic, "parse_us_max",        PyLong_FromUnsignedLongLong(s.parse_max_us));
+    setItem(dic, "copy_us_avg",         PyFloat_FromDouble(average(s.copy_us, s.copy_count)));
+    setItem(dic, "copy_us_max",         PyLong_FromUnsignedLongLong(s.copy_max_us));
+    setItem(dic, "convert_us_avg",      PyFloat_FromDouble(average(s.convert_us, s.convert_count)));
+    setItem(dic, "convert_us_max",      PyLong_FromUnsignedLongLong(s.convert_max_us));
+    return dic;
+}
+
+
+NVStatsRegistry::NVStatsRegistry() : previous_time(NVClock::now()), decoders_created(0), decoders_fallback(0) {
+}
+
+
+NVStatsRegistry::~NVStatsRegistry() {
+}
+
+
+std::shared_ptr<NVSlotStats> NVStatsRegistry::newSlot() {
+    std::unique_lock<std::mutex> lk(mutex);
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    slots.push_back(stats);
+    return stats;
+}
+
+
+PyObject* NVStatsRegistry::getStats() {
+    std::unique_lock<std::mutex> lk(mutex);
+    NVClock::time_point now = NVClock::now();
+    double dt = std::chrono::duration<double>(now - previous_time).count();
+
+    // fold stats of deleted decoders into the per-slot totals
+    for (auto it = slots.begin(); it != slots.end();) {
+        if (it->use_count() == 1) {
+            // only the counters: the gauges of a closed stream mean nothing anymore
+            (*it)->submit_queue = 0;
+            (*it)->completion_queue = 0;
+            (*it)->latency_us = 0;
+            retired[(*it)->n_slot.load()].add(**it);
+            it = slots.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    std::map<int, NVSlotSnapshot> current = retired;
+    for (auto it = slots.begin(); it != slots.end(); ++it) {
+        current[(*it)->n_slot.load()].add(**it);
+    }
+
+    PyObject* pyslots = PyDict_New();
+    NVSlotSnapshot total, total_prev;
+    for (auto it = current.begin(); it != current.end(); ++it) {
+        NVSlotSnapshot& prev = previous[it->first]; // zero if not seen before
+        total.add(it->second);
+        total_prev.add(prev);
+        if (it->first < 0) {
+            continue; // decoders that have not received any packets yet
+        }
+        PyObject* key = PyLong_FromLong(it->first);
+        PyObject* value = snapshotToDict(it->second, prev, dt);
+        PyDict_SetItem(pyslots, key, value);
+        Py_DECREF(key);
+        Py_DECREF(value);
+    }
+
+    PyObject* dic = snapshotToDict(total, total_prev, dt);
+    setItem(dic, "interval",            PyFloat_FromDouble(dt));
+    setItem(dic, "decoders_created",    PyLong_FromUnsignedLongLong(decoders_created.load()));
+    setItem(dic, "decoders_fallback",   PyLong_FromUnsignedLongLong(decoders_fallback.load()));
+    setItem(dic, "slots",               pyslots);
+
+    previous = current;
+    previous_time = now;
+    return dic;
+}
@@ -26,6 +26,13 @@
 
 #include "nvthread.h"
 #include "nvdecoder.h"
+#include "nvdevices.h"
+#include "nvfallback.h"
+#include "nvpool.h"
+#include "nvworkers.h"
+#include "nvplanes.h"
+#include "nvframepool.h"
+#include "nvconvert.h"
 
 
 bool NVcuInit() {
@@ -60,26 +67,194 @@ PyObject* NVgetDevices() {
 }
 
 
+PyObject* NVgetDeviceLoads() {
+    return NVDeviceRegistry::instance().getPyLoads();
+}
+
+
+void NVsetAdmission(double max_utilisation, double mbps_per_engine) {
+    NVDeviceRegistry::instance().setAdmission(max_utilisation, mbps_per_engine);
+}
+
+
+
+void NVsetDecoderPool(int max_idle, long max_idle_ms) {
+    NVDecoderPool::instance().configure(max_idle, max_idle_ms);
+}
+
+
+PyObject* NVgetDecoderPool() {
+    return NVDecoderPool::instance().getPyStats();
+}
+
+
+void NVsetFramePool(long max_mb, int max_idle) {
+    NVFramePool::instance().configure((size_t)std::max(0L, max_mb) * 1024 * 1024, max_idle);
+}
+
+
+PyObject* NVgetFramePool() {
+    return NVFramePool::instance().getPyStats();
+}
+
+
+void NVsetConversionWorkers(int n_workers) {
+    NVWorkerPool::instance().configure(n_workers);
+}
+
+
+void NVsetHugePages(bool enable) {
+    NVFramePlanes::setHugePages(enable);
+}
+
+
+void NVsetStreamingStores(bool enable) {
+    NVConvertStreaming(enable);
+}
+
+
 
 NVThread::NVThread(const char* name, FrameFilter& outfilter, int gpu_index, FrameFifoContext fifo_ctx) 
-    : DecoderThread(name, outfilter, fifo_ctx), gpu_index(gpu_index) 
+    : NVThreadOutput(outfilter), DecoderThread(name, serial_outfilter, fifo_ctx), gpu_index(gpu_index), max_width(0), max_height(0), completion_workers(0),
+    parameter_sets(std::make_shared<NVParameterCache>()), decoding(false), gop_join(true),
+    gop_cache(std::make_shared<NVGopCache>()), max_latency(0), suspended(false),
+    resident(std::make_shared<NVResidentFrames>()), speed(0)
     {
+    feed(); // signals wait for the thread to run
     }
 
 NVThread::~NVThread() {
+    NVDeviceRegistry::instance().forget(this);
+}
+
+PyObject* NVThread::getStats() {
+    PyObject* dic = stats.getStats();
+    PyObject* value;
+    value = PyLong_FromUnsignedLongLong(resident->fetched);       PyDict_SetItemString(dic, "fetched_frames", value);  Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(resident->misses);        PyDict_SetItemString(dic, "fetch_misses", value);    Py_DECREF(value);
+    value = PyLong_FromUnsignedLongLong(resident->fetch_bytes);   PyDict_SetItemString(dic, "fetch_bytes", value);     Py_DECREF(value);
+    return dic;
+}
+
+void NVThread::setMaxDecodeSize(unsigned width, unsigned height) {
+    max_width = width;
+    max_height = height;
+}
+
+void NVThread::setParameterSets(SlotNumber n_slot, PyObject* parameter_sets) {
+    this->parameter_sets->setPy(n_slot, parameter_sets);
+}
+
+void NVThread::setCompletionWorkers(int n_workers) {
+    completion_workers = std::max(0, n_workers);
+}
+
+void NVThread::feed() {
+    // DecoderThread passes no packets to its decoders while off: the video decoder needs them for caching
+    if (decoding || gop_join) {
+        DecoderThread::decodingOnCall();
+    }
+    else {
+        DecoderThread::decodingOffCall();
+    }
+}
+
+void NVThread::decodingOnCall() {
+    decoding = true;
+    feed();
+}
+
+void NVThread::decodingOffCall() {
+    decoding = false;
+    feed();
+}
+
+void NVThread::setGopJoin(bool enable) {
+    gop_join = enable;
+    feed();
+}
+
+void NVThread::setMaxLatency(long max_latency_ms) {
+    max_latency = std::max(0L, max_latency_ms);
+}
+
+void NVThread::setOutputSuspended(bool suspended) {
+    this->suspended = suspended;
+}
+
+void NVThread::setResidentFrames(int n_frames) {
+    resident->configure(n_frames);
+}
+
+void NVThread::setPlaybackSpeed(double speed) {
+    this->speed = std::max(0., speed);
+}
+
+std::shared_ptr<AVBitmapFrame> NVThread::fetch(long mstimestamp) {
+    return resident->fetch(mstimestamp);
+}
+
+bool NVThread::fetchFrame(long mstimestamp, FrameFilter& filter) {
+    std::shared_ptr<AVBitmapFrame> f = fetch(mstimestamp);
+    if (!f) {
+        return false;
+    }
+    filter.run(f.get());
+    return true;
 }
 
 Decoder* NVThread::chooseAudioDecoder(AVCodecID codec_id) {
-    DecoderThread::chooseAudioDecoder(codec_id);
+    Decoder* decoder = DecoderThread::chooseAudioDecoder(codec_id);
+    if (!decoder) {
+        return NULL;
+    }
+    // packets keep coming while video is cached: nothing's decoded until decodingOnCall
+    return new NVStandbyDecoder(decoder, [this]() { return !this->decoding; });
 }
 
 Decoder* NVThread::chooseVideoDecoder(AVCodecID codec_id) {
     //TODO: try to get NVDecoder, if it's not possible, default
     //to AVDecoder
     switch (codec_id) { // switch: video codecs
-        case AV_CODEC_ID_H264:
-            return new NVDecoder(AV_CODEC_ID_H264, gpu_index, 5); // gpu_index, n_buffer
+        case AV_CODEC_ID_H264: {
+            std::shared_ptr<NVSlotStats> slot_stats = stats.newSlot();
+            // if admission control refuses the session or the decoder fails, continue with fallbackVideoDecoder
+            // & retry the GPU every now and then
+            NVFallbackDecoder* wrapper = new NVFallbackDecoder(
+                [this, slot_stats]() {
+                    // a session left over from a previous connection, if there's one
+                    NVDecoder* decoder = static_cast<NVDecoder*>(NVDecoderPool::instance().lease(AV_CODEC_ID_H264, this->gpu_index, this->max_width, this->max_height, false, this)); // NVDecoders only
+                    if (!decoder) {
+                        decoder = new NVDecoder(AV_CODEC_ID_H264, this->gpu_index, 5, this); // gpu_index, n_buffer, owner
+                        decoder->setMaxSize(this->max_width, this->max_height);
+                        this->stats.decoders_created++;
+                    }
+                    decoder->setStats(slot_stats);
+                    decoder->setCompletionWorkers(this->completion_workers, &this->outfilter);
+                    decoder->setResidentFrames(this->resident);
+                    return decoder;
+                },
+                [this, codec_id]() {
+                    // counted here: libValkka calls fallbackVideoDecoder for the other codecs too
+                    this->stats.decoders_fallback++;
+                    return this->fallbackVideoDecoder(codec_id);
+                },
+                slot_stats);
+            wrapper->setDisposer([](Decoder* decoder) { NVDecoderPool::instance().giveBack(decoder); });
+            // a new stream: packets & parameter sets of the previous one are not to be primed
+            gop_cache = std::make_shared<NVGopCache>();
+            // join at the cached GOP whenever decoding is switched on
+            wrapper->setGopCache(gop_cache);
+            wrapper->setStandby([this]() { return this->gop_join && !this->decoding; });
+            wrapper->setMaxLatency([this]() { return this->max_latency.load(); });
+            wrapper->setSuspended([this]() { return this->suspended.load(); });
+            wrapper->setPlaybackSpeed([this]() { return this->speed.load(); });
+            wrapper->setResidentFrames(resident); // for the pictures decoded on the CPU
+            // pre-warm with known parameter sets
+            wrapper->setParameterCache(parameter_sets);
+            return wrapper;
             break;
+        }
         default:
             return NULL;
             break;        
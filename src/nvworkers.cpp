@@ -0,0 +1,175 @@
+/*
+ * nvworkers.cpp : Process-wide pool of worker threads for splitting frame conversions
+ *
+ * Authors: Xiao Xoxin <xiaoxoxin@gmail.com>
+ *
+ * This file is part of the Valkka Nvidia cuda bridge.
+ *
+ * (c) Copyright 2021 Xiao Xoxin
+ *
+ *            DO WHAT THE FUCK YOU WANT TO PUBLIC LICENSE
+ *   TERMS AND CONDITIONS FOR COPYING, DISTRIBUTION AND MODIFICATION
+ *
+ *  0. You just DO WHAT THE FUCK YOU WANT TO.
+ *
+ */
+
+/**
+ *  @file    nvworkers.cpp
+ *  @author  Xiao Xoxin
+ *  @date    2021
+ *  @version 1.0.0
+ *
+ *  @brief   Process-wide pool of worker threads for splitting frame conversions
+ */
+
+#include "nvworkers.h"
+
+// smaller bands cost more in scheduling than they gain
+static const size_t min_band_bytes = 256 * 1024;
+
+
+NVWorkerPool::NVWorkerPool() : pending(0), next_queue(0), running(false) {
+}
+
+
+NVWorkerPool::~NVWorkerPool() {
+    stop();
+}
+
+
+NVWorkerPool& NVWorkerPool::instance() {
+    static NVWorkerPool pool;
+    return pool;
+}
+
+
+void NVWorkerPool::stop() {
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        running = false;
+    }
+    condition.notify_all();
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+    threads.clear();
+    queues.clear();
+}
+
+
+void NVWorkerPool::configure(int n_workers) {
+    std::unique_lock<std::shared_timed_mutex> config_lk(config_mutex); // no runs in progress
+    stop();
+    n_workers = std::max(0, n_workers);
+    running = true;
+    for (int i = 0; i < n_workers; i++) {
+        queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+    for (int i = 0; i < n_workers; i++) {
+        threads.push_back(std::thread(&NVWorkerPool::loop, this, i));
+    }
+    decoderlogger.log(LogLevel::debug) << "NVWorkerPool: " << n_workers << " workers" << std::endl;
+}
+
+
+int NVWorkerPool::getWorkers() {
+    std::shared_lock<std::shared_timed_mutex> config_lk(config_mutex);
+    return threads.size();
+}
+
+
+int NVWorkerPool::bands(int rows, size_t row_bytes) {
+    std::shared_lock<std::shared_timed_mutex> config_lk(config_mutex);
+    size_t by_size = (rows * row_bytes) / min_band_bytes;
+    int n = std::min<size_t>(by_size, threads.size() + 1);
+    return std::max(1, std::min(n, rows));
+}
+
+
+bool NVWorkerPool::take(int index, Task& task) {
+    int n = queues.size();
+    if (index >= 0) { // own queue: newest first, it's most likely in the cache
+        Queue& q = *queues[index];
+        std::unique_lock<std::mutex> lk(q.mutex);
+        if (!q.tasks.empty()) {
+            task = q.tasks.back();
+            q.tasks.pop_back();
+            pending--;
+            return true;
+        }
+    }
+    for (int i = 1; i <= n; i++) { // steal the oldest from the others
+        int victim = (std::max(index, 0) + i) % n;
+        if (victim == index) {
+            continue;
+        }
+        Queue& q = *queues[victim];
+        std::unique_lock<std::mutex> lk(q.mutex);
+        if (!q.tasks.empty()) {
+            task = q.tasks.front();
+            q.tasks.pop_front();
+            pending--;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+void NVWorkerPool::execute(Task& task) {
+    (*task.fn)(task.band);
+    task.remaining->fetch_sub(1, std::memory_order_release);
+}
+
+
+void NVWorkerPool::loop(int index) {
+    Task task;
+    while (true) {
+        if (take(index, task)) {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lk(mutex);
+        condition.wait(lk, [this]() { return pending.load() > 0 || !running; });
+        if (!running) {
+            break;
+        }
+    }
+}
+
+
+void NVWorkerPool::run(int n_bands, const std::function<void(int)>& fn) {
+    std::shared_lock<std::shared_timed_mutex> config_lk(config_mutex);
+    int n = queues.size();
+    if (n == 0 || n_bands <= 1) {
+        for (int band = 0; band < n_bands; band++) {
+            fn(band);
+        }
+        return;
+    }
+    std::atomic<int> remaining(n_bands - 1);
+    unsigned start = next_queue.fetch_add(1);
+    for (int band = 1; band < n_bands; band++) { // band 0 is for this thread
+        Task task = {&fn, band, &remaining};
+        Queue& q = *queues[(start + band) % n];
+        std::unique_lock<std::mutex> lk(q.mutex);
+        q.tasks.push_back(task);
+        pending++;
+    }
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+    }
+    condition.notify_all();
+    fn(0);
+    // help out until this run is done.  Tasks of other runs are fine, too
+    Task task;
+    while (remaining.load(std::memory_order_acquire) > 0) {
+        if (take(-1, task)) {
+            execute(task);
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+}
@@ -47,6 +47,17 @@ int SemaRingBuffer::read() {
     return prev_read;
 }
 
+int SemaRingBuffer::peek() {
+    if (sema_count <= 0) {
+        return -1;
+    }
+    int ind = prev_read + 1;
+    if (ind >= (n_max-1)) {
+        ind=0;
+    }
+    return ind;
+}
+
 int SemaRingBuffer::getIndex() {
     return prev_write;
 }
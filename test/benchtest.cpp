@@ -0,0 +1,1051 @@
+/*
+ * benchtest.cpp :
+ *
+* Copyright 2018 Valkka Security Ltd. and Sampsa Riikonen.
+ *
+ * Authors: Sampsa Riikonen <sampsa.riikonen@iki.fi>
+ *
+ * This file is part of Valkka cpp examples
+ *
+ * Valkka cpp examples is free software: you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/**
+ *  @file    benchtest.cpp
+ *  @author  Sampsa Riikonen
+ *  @date    2018
+ *  @version 1.0.0
+ *
+ *  @brief   benchmarks of the nvidia decoding pipeline.  Require a GPU & test streams
+ *
+ */
+
+#include "framefifo.h"
+#include "framefilter.h"
+#include "livethread.h"
+#include "logging.h"
+#include "avdep.h"
+
+#include "nvthread.h"
+#include "nvmultithread.h"
+#include "nvconvert.h"
+#include "nvworkers.h"
+#include "nvplanes.h"
+#include "nvreverse.h"
+#include "nvbatch.h"
+#include "nvindex.h"
+#include "nvcapture.h"
+#include "nvload.h"
+#include "test_import.h"
+#include "nvfile.h"
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <unistd.h>
+#include <fstream>
+#include <random>
+
+using namespace std::chrono_literals;
+using std::this_thread::sleep_for;
+
+const char *stream_1 = std::getenv("VALKKA_TEST_RTSP_1");
+const char *stream_2 = std::getenv("VALKKA_TEST_RTSP_2");
+const char *stream_sdp = std::getenv("VALKKA_TEST_SDP");
+const char *file_1 = std::getenv("VALKKA_TEST_FILE_1");
+
+
+/** Measures the time from reset to the first decoded frame */
+class FirstFrameFilter : public FrameFilter
+{
+public:
+    FirstFrameFilter(const char *name, FrameFilter *next = NULL) : FrameFilter(name, next), got(false) {}
+
+protected:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::chrono::steady_clock::time_point t0;
+    bool got;
+    double ms;
+
+protected:
+    void go(Frame *frame)
+    {
+        if (frame->getFrameType() != FrameType::avbitmapframe)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lk(mutex);
+        if (!got)
+        {
+            ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            got = true;
+            condition.notify_all();
+        }
+    }
+
+public:
+    void reset()
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        t0 = std::chrono::steady_clock::now();
+        got = false;
+    }
+
+    /** Milliseconds to the first frame or -1 if there was none within the timeout */
+    double wait(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        if (!condition.wait_for(lk, timeout, [this] { return got; }))
+        {
+            return -1;
+        }
+        return ms;
+    }
+};
+
+
+/** Counts decoded frames */
+class CountingFrameFilter : public FrameFilter
+{
+public:
+    CountingFrameFilter(const char *name, FrameFilter *next = NULL) : FrameFilter(name, next), count(0) {}
+
+public:
+    std::atomic<long> count;
+
+protected:
+    void go(Frame *frame)
+    {
+        if (frame->getFrameType() == FrameType::avbitmapframe)
+        {
+            count++;
+        }
+    }
+};
+
+
+/** Frames & their timestamps as they come out, for the achieved playback speed */
+class PlaybackFrameFilter : public FrameFilter
+{
+public:
+    PlaybackFrameFilter(const char *name, FrameFilter *next = NULL) : FrameFilter(name, next), count(0) {}
+
+protected:
+    std::mutex mutex;
+    long count;
+    long first_ts, last_ts;
+    std::chrono::steady_clock::time_point first_time, last_time;
+
+protected:
+    void go(Frame *frame)
+    {
+        if (frame->getFrameType() != FrameType::avbitmapframe)
+        {
+            return;
+        }
+        std::unique_lock<std::mutex> lk(mutex);
+        last_ts = frame->mstimestamp;
+        last_time = std::chrono::steady_clock::now();
+        if (count == 0)
+        {
+            first_ts = last_ts;
+            first_time = last_time;
+        }
+        count++;
+    }
+
+public:
+    /** Stream time played per wall time, output fps & frames */
+    void result(double &speed, double &fps, long &frames)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        double wall_ms = std::chrono::duration<double, std::milli>(last_time - first_time).count();
+        speed = (count > 1 && wall_ms > 0) ? (last_ts - first_ts) / wall_ms : 0;
+        fps = (count > 1 && wall_ms > 0) ? (count - 1) * 1000. / wall_ms : 0;
+        frames = count;
+    }
+};
+
+
+/** Feeds the H264 packets of a local file into a filter, split into NAL units as LiveThread does */
+class FileFeeder
+{
+public:
+    FileFeeder(const char *path, int n_slot) : reader(path, n_slot), n_slot(n_slot) {}
+
+protected:
+    NVFileReader reader;
+    int n_slot;
+
+public:
+    /** Feed at a speed
+    *
+    * @param filter    Gets the setup frame & the packets
+    * @param speed     Times real time.  0: as fast as possible
+    * @param max_ms    Stop after this much wall time
+    * @param ts0       Added to the packet timestamps
+    * @return stream time fed, in ms
+    */
+    long feed(FrameFilter &filter, double speed, long max_ms, long ts0)
+    {
+        SetupFrame setup;
+        setup.sub_type = SetupFrameType::stream_init;
+        setup.media_type = MediaType::video;
+        setup.codec_id = AV_CODEC_ID_H264;
+        setup.n_slot = n_slot;
+        setup.subsession_index = 0;
+        filter.run(&setup);
+
+        BasicFrame f;
+        long pts0 = -1, pts = 0;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        while (reader.read(f))
+        {
+            pts = f.mstimestamp;
+            if (pts0 < 0)
+            {
+                pts0 = pts;
+            }
+            double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+            if (wall_ms > max_ms)
+            {
+                break;
+            }
+            if (speed > 0 && (pts - pts0) / speed > wall_ms)
+            {
+                sleep_for(std::chrono::microseconds((long)(((pts - pts0) / speed - wall_ms) * 1000)));
+            }
+            f.mstimestamp = ts0 + pts - pts0;
+            filter.run(&f);
+        }
+        return (pts0 < 0) ? 0 : pts - pts0;
+    }
+};
+
+
+/** Process resource usage: cpu time, context switches & threads */
+struct Usage
+{
+    double wall_s, cpu_s;
+    long context_switches;
+    int threads;
+
+    static Usage now()
+    {
+        Usage u;
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        u.wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        u.cpu_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+        u.context_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+        u.threads = 0;
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 8, "Threads:") == 0)
+            {
+                u.threads = atoi(line.c_str() + 8);
+            }
+        }
+        return u;
+    }
+};
+
+
+static void report(const char *name, const char *what, const Usage &u0, const Usage &u1, long frames)
+{
+    double wall = u1.wall_s - u0.wall_s;
+    double cpu = u1.cpu_s - u0.cpu_s;
+    double fps = frames / wall;
+    double cores = cpu / wall;
+    std::cout << name << what << ": threads " << u1.threads
+              << ", context switches/s " << (u1.context_switches - u0.context_switches) / wall
+              << ", fps " << fps
+              << ", cores " << cores
+              << ", fps per core " << (cores > 0 ? fps / cores : 0) << std::endl;
+}
+
+
+/** Last level cache misses of the calling thread, from the hardware perf counters */
+class LLCMisses
+{
+public:
+    LLCMisses()
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0); // this thread, any cpu
+    }
+    ~LLCMisses()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+protected:
+    int fd;
+
+public:
+    bool ok() { return fd >= 0; } ///< Not e.g. in containers or virtual machines
+    long long read()
+    {
+        long long n = 0;
+        if (fd < 0 || ::read(fd, &n, sizeof(n)) != sizeof(n))
+        {
+            return -1;
+        }
+        return n;
+    }
+};
+
+
+void test_1()
+{
+    const char *name = "@TEST: benchtest: test 1: ";
+    std::cout << name << "** @@Time to first frame: cold start vs. parameter sets cached from the previous session **" << std::endl;
+
+    if (!stream_1)
+    {
+        std::cout << name << "ERROR: missing test stream 1: set environment variable VALKKA_TEST_RTSP_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test rtsp stream 1: " << stream_1 << std::endl;
+
+    NVcuInit();
+
+    // (LiveThread:livethread) --> {FifoFrameFilter:in_filter} -->> (NVThread:nvthread) --> {FirstFrameFilter:first}
+    FirstFrameFilter first("first");
+    NVThread nvthread("nvthread", first);
+    FifoFrameFilter &in_filter = nvthread.getFrameFilter();
+    LiveThread livethread("live");
+
+    livethread.startCall();
+    nvthread.startCall();
+    nvthread.decodingOnCall();
+
+    LiveConnectionContext ctx = LiveConnectionContext(
+        LiveConnectionType::rtsp,
+        std::string(stream_1),
+        2,
+        &in_filter);
+
+    const char *rounds[] = {"cold", "warm"};
+    for (int i = 0; i < 2; i++)
+    {
+        first.reset();
+        livethread.registerStreamCall(ctx);
+        livethread.playStreamCall(ctx);
+        double ms = first.wait(20s);
+        std::cout << name << rounds[i] << ": time to first frame: " << ms << " ms" << std::endl;
+        livethread.stopStreamCall(ctx);
+        livethread.deregisterStreamCall(ctx);
+        sleep_for(1s);
+    }
+
+    livethread.stopCall();
+    nvthread.stopCall();
+}
+
+void test_2()
+{
+    const char *name = "@TEST: benchtest: test 2: ";
+    std::cout << name << "** @@N streams: N NVThreads vs. one NVMultiThread **" << std::endl;
+
+    if (!stream_1)
+    {
+        std::cout << name << "ERROR: missing test stream 1: set environment variable VALKKA_TEST_RTSP_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test rtsp stream 1: " << stream_1 << std::endl;
+    const char *n_env = std::getenv("VALKKA_TEST_N_STREAMS");
+    int n = n_env ? atoi(n_env) : 16;
+    std::cout << name << "** streams: " << n << " (set with VALKKA_TEST_N_STREAMS)" << std::endl;
+
+    NVcuInit();
+    LiveThread livethread("live");
+    livethread.startCall();
+
+    for (int mode = 0; mode < 2; mode++)
+    {
+        CountingFrameFilter counter("counter");
+        std::vector<NVThread *> nvthreads;
+        NVMultiThread *multithread = NULL;
+        std::vector<LiveConnectionContext> ctxs;
+
+        if (mode == 0)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                NVThread *t = new NVThread(("nvthread" + std::to_string(i)).c_str(), counter);
+                t->startCall();
+                t->decodingOnCall();
+                nvthreads.push_back(t);
+                ctxs.push_back(LiveConnectionContext(LiveConnectionType::rtsp, std::string(stream_1), i + 1, &t->getFrameFilter()));
+            }
+        }
+        else
+        {
+            FrameFifoContext fifo_ctx;
+            fifo_ctx.n_basic = 20 * n;
+            multithread = new NVMultiThread("multithread", counter, 0, fifo_ctx);
+            multithread->startCall();
+            multithread->decodingOnCall();
+            for (int i = 0; i < n; i++)
+            {
+                ctxs.push_back(LiveConnectionContext(LiveConnectionType::rtsp, std::string(stream_1), i + 1, &multithread->getFrameFilter()));
+            }
+        }
+        for (auto it = ctxs.begin(); it != ctxs.end(); ++it)
+        {
+            livethread.registerStreamCall(*it);
+            livethread.playStreamCall(*it);
+        }
+
+        sleep_for(5s); // warm up
+        Usage u0 = Usage::now();
+        long f0 = counter.count;
+        sleep_for(20s);
+        report(name, (mode == 0) ? "NVThreads" : "NVMultiThread", u0, Usage::now(), counter.count - f0);
+
+        for (auto it = ctxs.begin(); it != ctxs.end(); ++it)
+        {
+            livethread.stopStreamCall(*it);
+            livethread.deregisterStreamCall(*it);
+        }
+        sleep_for(1s);
+        for (auto it = nvthreads.begin(); it != nvthreads.end(); ++it)
+        {
+            (*it)->stopCall();
+            delete *it;
+        }
+        if (multithread)
+        {
+            multithread->stopCall();
+            delete multithread;
+        }
+    }
+    livethread.stopCall();
+}
+
+void test_3()
+{
+    const char *name = "@TEST: benchtest: test 3: ";
+    std::cout << name << "** @@Speedup of the row-parallel chroma conversion.  No GPU required **" << std::endl;
+
+    const int sizes[][2] = {{1920, 1080}, {3840, 2160}, {7680, 4320}};
+    const int n_threads[] = {1, 2, 4, 8, 12, 16};
+    const int rounds = 50;
+    for (auto size : sizes)
+    {
+        int width = size[0] / 2, height = size[1] / 2; // chroma
+        unsigned pitch = (size[0] + 255) & ~255;       // as from cuvidMapVideoFrame
+        std::vector<uint8_t> src(pitch * height, 128), u(width * height), v(width * height);
+        double single_ms = 0;
+        for (int n : n_threads)
+        {
+            NVWorkerPool::instance().configure(n - 1); // the calling thread is one of them
+            NVDeinterleave(src.data(), pitch, u.data(), width, v.data(), width, width, height); // warm up
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; i++)
+            {
+                NVDeinterleave(src.data(), pitch, u.data(), width, v.data(), width, width, height);
+            }
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count() / rounds;
+            if (n == 1)
+            {
+                single_ms = ms;
+            }
+            std::cout << name << size[0] << "x" << size[1] << ": threads " << n
+                      << ", bands " << NVWorkerPool::instance().bands(height, width * 2)
+                      << ", ms per frame " << ms
+                      << ", speedup " << single_ms / ms << std::endl;
+        }
+    }
+    NVWorkerPool::instance().configure(0);
+}
+
+void test_4()
+{
+    const char *name = "@TEST: benchtest: test 4: ";
+    std::cout << name << "** @@Host side conversion into packed vs. aligned & padded planes.  No GPU required **" << std::endl;
+
+    const int sizes[][2] = {{1918, 1080}, {3840, 2160}};
+    const int rounds = 100;
+    NVWorkerPool::instance().configure(0);
+    for (auto size : sizes)
+    {
+        int width = size[0], height = size[1];
+        unsigned pitch = (width + 255) & ~255; // as from cuvidMapVideoFrame
+        std::vector<uint8_t> staging(pitch * (height + height / 2), 128);
+        // packed: rows back to back, planes at odd addresses
+        int cw = width / 2, ch = height / 2;
+        std::vector<uint8_t> packed(width * height + 2 * cw * ch + 3);
+        for (int mode = 0; mode < 3; mode++)
+        {
+            AVBitmapFrame frame;
+            NVFramePlanes planes;
+            uint8_t *y, *u, *v;
+            int y_linesize, uv_linesize;
+            if (mode == 0)
+            {
+                y = packed.data() + 1;
+                u = y + width * height + 1;
+                v = u + cw * ch + 1;
+                y_linesize = width;
+                uv_linesize = cw;
+            }
+            else
+            {
+                NVFramePlanes::setHugePages(mode == 2);
+                planes.reserve(&frame, width, height);
+                y = frame.y_payload;
+                u = frame.u_payload;
+                v = frame.v_payload;
+                y_linesize = frame.bmpars.y_linesize;
+                uv_linesize = frame.bmpars.u_linesize;
+            }
+            double ms = 0;
+            for (int i = -1; i < rounds; i++) // -1: warm up
+            {
+                std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+                for (int r = 0; r < height; r++)
+                {
+                    memcpy(y + (size_t)r * y_linesize, staging.data() + (size_t)r * pitch, width);
+                }
+                NVDeinterleave(staging.data() + (size_t)pitch * height, pitch, u, uv_linesize, v, uv_linesize, cw, ch);
+                if (i >= 0)
+                {
+                    ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+                }
+            }
+            const char *modes[] = {"packed", "aligned", "aligned, huge pages"};
+            std::cout << name << width << "x" << height << ": " << modes[mode]
+                      << (mode == 2 && !planes.isHuge() ? " (not available)" : "")
+                      << ", ms per frame " << ms / rounds << std::endl;
+        }
+    }
+    NVFramePlanes::setHugePages(false);
+}
+
+void test_5()
+{
+    const char *name = "@TEST: benchtest: test 5: ";
+    std::cout << name << "** @@Cache misses of a co-running workload, with & without streaming stores.  No GPU required **" << std::endl;
+
+    const int width = 1920, height = 1080, n_frames = 32; // e.g. 32 cameras
+    const size_t working_set = 8 * 1024 * 1024;           // of the co-running workload
+    const std::chrono::seconds duration(3);
+    unsigned pitch = (width + 255) & ~255;
+    std::vector<uint8_t> staging(pitch * (height + height / 2), 128);
+    std::vector<AVBitmapFrame> frames(n_frames);
+    std::vector<NVFramePlanes> planes(n_frames);
+    for (int i = 0; i < n_frames; i++)
+    {
+        planes[i].reserve(&frames[i], width, height);
+    }
+    // pointer chase through the working set in random order, a cache line at a time
+    size_t n_lines = working_set / 64;
+    std::vector<size_t> order(n_lines);
+    for (size_t i = 0; i < n_lines; i++)
+    {
+        order[i] = i;
+    }
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937(1));
+    std::vector<size_t> chase(n_lines * 8);
+    for (size_t i = 0; i < n_lines; i++)
+    {
+        chase[order[i] * 8] = order[(i + 1) % n_lines] * 8;
+    }
+
+    for (int streaming = 0; streaming < 2; streaming++)
+    {
+        NVConvertStreaming(streaming);
+        std::atomic<bool> done(false);
+        long long misses = -1;
+        uint64_t accesses = 0;
+        double workload_ns = 0;
+        std::thread workload([&]() {
+            LLCMisses counter;
+            long long m0 = counter.read();
+            std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+            size_t pos = 0;
+            while (!done)
+            {
+                for (int i = 0; i < 1000; i++)
+                {
+                    pos = chase[pos];
+                }
+                accesses += 1000;
+            }
+            workload_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count() / accesses;
+            if (counter.ok())
+            {
+                misses = counter.read() - m0;
+            }
+            volatile size_t sink = pos; // keep the chase
+            (void)sink;
+        });
+        int n = 0;
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        while (std::chrono::steady_clock::now() - t0 < duration)
+        {
+            AVBitmapFrame &f = frames[n % n_frames];
+            NVCopyRows(staging.data(), pitch, f.y_payload, f.bmpars.y_linesize, width, 0, height, streaming);
+            NVDeinterleave(staging.data() + (size_t)pitch * height, pitch, f.u_payload, f.bmpars.u_linesize,
+                           f.v_payload, f.bmpars.v_linesize, width / 2, height / 2, streaming);
+            n++;
+        }
+        double fps = n / std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        done = true;
+        workload.join();
+        std::cout << name << (streaming ? "streaming stores" : "normal stores")
+                  << ": frames per second " << fps
+                  << ", workload ns per access " << workload_ns;
+        if (misses >= 0)
+        {
+            std::cout << ", workload LLC misses per 1000 accesses " << 1000.0 * misses / accesses;
+        }
+        else
+        {
+            std::cout << ", LLC misses: no perf counters (see /proc/sys/kernel/perf_event_paranoid)";
+        }
+        std::cout << std::endl;
+    }
+    NVConvertStreaming(false);
+}
+
+void test_6()
+{
+    const char *name = "@TEST: benchtest: test 6: ";
+    std::cout << name << "** @@Time to first frame at decodingOnCall: next keyframe vs. joining at the cached GOP **" << std::endl;
+
+    if (!stream_1)
+    {
+        std::cout << name << "ERROR: missing test stream 1: set environment variable VALKKA_TEST_RTSP_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test rtsp stream 1: " << stream_1 << std::endl;
+
+    NVcuInit();
+
+    // (LiveThread:livethread) --> {FifoFrameFilter:in_filter} -->> (NVThread:nvthread) --> {FirstFrameFilter:first}
+    FirstFrameFilter first("first");
+    NVThread nvthread("nvthread", first);
+    FifoFrameFilter &in_filter = nvthread.getFrameFilter();
+    LiveThread livethread("live");
+
+    livethread.startCall();
+    nvthread.startCall();
+    nvthread.decodingOnCall();
+
+    LiveConnectionContext ctx = LiveConnectionContext(
+        LiveConnectionType::rtsp,
+        std::string(stream_1),
+        2,
+        &in_filter);
+    livethread.registerStreamCall(ctx);
+    livethread.playStreamCall(ctx);
+    first.reset();
+    first.wait(20s);
+
+    // switch decoding on at random points of the GOP
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> off_ms(500, 3000);
+    const int rounds = 10;
+    const char *modes[] = {"next keyframe", "cached GOP"};
+    for (int mode = 0; mode < 2; mode++)
+    {
+        nvthread.setGopJoin(mode == 1);
+        double total = 0, worst = 0;
+        int missed = 0;
+        for (int i = 0; i < rounds; i++)
+        {
+            nvthread.decodingOffCall();
+            sleep_for(std::chrono::milliseconds(off_ms(random)));
+            first.reset();
+            nvthread.decodingOnCall();
+            double ms = first.wait(20s);
+            if (ms < 0)
+            {
+                missed++;
+                continue;
+            }
+            total += ms;
+            worst = std::max(worst, ms);
+        }
+        std::cout << name << modes[mode] << ": time to first frame: avg " << total / std::max(1, rounds - missed)
+                  << " ms, max " << worst << " ms, no frame in " << missed << " rounds" << std::endl;
+    }
+
+    livethread.stopStreamCall(ctx);
+    livethread.deregisterStreamCall(ctx);
+    livethread.stopCall();
+    nvthread.stopCall();
+}
+
+void test_7()
+{
+    const char *name = "@TEST: benchtest: test 7: ";
+    std::cout << name << "** @@Scrubbing recorded footage: all pictures vs. speed-aware decoding **" << std::endl;
+
+    if (!file_1)
+    {
+        std::cout << name << "ERROR: missing test file 1: set environment variable VALKKA_TEST_FILE_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test file 1: " << file_1 << std::endl;
+
+    NVcuInit();
+    const double speeds[] = {1, 4, 8, 16, 32};
+    const char *modes[] = {"all pictures", "speed-aware"};
+    for (double speed : speeds)
+    {
+        for (int mode = 0; mode < 2; mode++)
+        {
+            // (FileFeeder) --> {FifoFrameFilter:in_filter} -->> (NVThread:nvthread) --> {PlaybackFrameFilter:playback}
+            PlaybackFrameFilter playback("playback");
+            FrameFifoContext fifo_ctx;
+            fifo_ctx.n_basic = 200;
+            NVThread nvthread("nvthread", playback, 0, fifo_ctx);
+            nvthread.setPlaybackSpeed(mode == 1 ? speed : 0);
+            nvthread.startCall();
+            nvthread.decodingOnCall();
+
+            // the file is read at the playback speed, as a player would
+            FileFeeder feeder(file_1, 1);
+            long fed_ms = feeder.feed(nvthread.getFrameFilter(), speed, 10000, NVmsNow());
+            sleep_for(1s);
+            nvthread.stopCall();
+
+            double achieved, fps;
+            long frames;
+            playback.result(achieved, fps, frames);
+            std::cout << name << speed << "x, " << modes[mode] << ": achieved speed " << achieved << "x, output fps " << fps
+                      << ", frames " << frames << " of " << fed_ms / 1000. << " s" << std::endl;
+        }
+    }
+}
+
+void test_8()
+{
+    const char *name = "@TEST: benchtest: test 8: ";
+    std::cout << name << "** @@Reverse playback throughput vs. memory bound **" << std::endl;
+
+    if (!file_1)
+    {
+        std::cout << name << "ERROR: missing test file 1: set environment variable VALKKA_TEST_FILE_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test file 1: " << file_1 << std::endl;
+
+    NVcuInit();
+    const int bounds[] = {15, 30, 60, 120, 240};
+    for (int max_frames : bounds)
+    {
+        CountingFrameFilter counter("counter");
+        NVReversePlayer player("player", counter, 0, max_frames);
+        if (!player.open(file_1))
+        {
+            std::cout << name << "ERROR: could not read " << file_1 << std::endl;
+            exit(2);
+        }
+        Usage u0 = Usage::now();
+        player.play(0, 0); // as fast as possible
+        while (player.isPlaying())
+        {
+            sleep_for(10ms);
+        }
+        Usage u1 = Usage::now();
+        std::string what = "max " + std::to_string(max_frames) + " frames";
+        report(name, what.c_str(), u0, u1, counter.count);
+        std::cout << name << what << ": GOPs " << player.getGops() << ", decode passes " << player.gop_passes
+                  << ", decoded " << player.decoded_frames << ", redecoded " << player.redecoded_frames
+                  << ", played " << player.played_frames << ", peak frames held " << player.peak_frames << std::endl;
+    }
+}
+
+void test_9()
+{
+    const char *name = "@TEST: benchtest: test 9: ";
+    std::cout << name << "** @@Offline decoding of a list of files: one session vs. all sessions **" << std::endl;
+
+    if (!file_1)
+    {
+        std::cout << name << "ERROR: missing test file 1: set environment variable VALKKA_TEST_FILE_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test file 1: " << file_1 << std::endl;
+    const char *n_files_env = std::getenv("VALKKA_TEST_N_FILES");
+    int n_files = n_files_env ? std::max(1, atoi(n_files_env)) : 16;
+
+    NVcuInit();
+    const int sessions[] = {1, 0}; // 0: two per NVDEC engine
+    for (int n_sessions : sessions)
+    {
+        CountingFrameFilter counter("counter");
+        NVBatchDecoder batch("batch", counter, n_sessions);
+        for (int i = 0; i < n_files; i++)
+        {
+            batch.addFile(file_1);
+        }
+        Usage u0 = Usage::now();
+        batch.startCall();
+        while (!batch.waitAll(100))
+        {
+        }
+        Usage u1 = Usage::now();
+        batch.stopCall();
+        std::string what = std::to_string(n_files) + " files, " + (n_sessions > 0 ? std::to_string(n_sessions) : std::string("default")) + " sessions";
+        report(name, what.c_str(), u0, u1, counter.count);
+    }
+}
+
+void test_10()
+{
+    const char *name = "@TEST: benchtest: test 10: ";
+    std::cout << name << "** @@Keyframe index vs. demuxing & decoding all pictures **" << std::endl;
+
+    if (!file_1)
+    {
+        std::cout << name << "ERROR: missing test file 1: set environment variable VALKKA_TEST_FILE_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test file 1: " << file_1 << std::endl;
+
+    NVcuInit();
+    Usage u0 = Usage::now();
+    NVFileReader reader(file_1);
+    BasicFrame f;
+    long packets = 0;
+    while (reader.read(f))
+    {
+        packets++;
+    }
+    Usage u1 = Usage::now();
+    std::cout << name << "demux only: " << packets << " packets in " << u1.wall_s - u0.wall_s << " s" << std::endl;
+
+    const char *index_file = "/tmp/benchtest_10.idx";
+    NVKeyframeIndexer indexer("indexer", 160, 90, 0);
+    u0 = Usage::now();
+    bool ok = indexer.build(file_1, index_file);
+    u1 = Usage::now();
+    NVKeyframeIndex index;
+    ok = ok && index.open(index_file);
+    std::cout << name << "index: " << (ok ? index.size() : 0) << " keyframes in " << u1.wall_s - u0.wall_s << " s, "
+              << indexer.thumbnails << " thumbnails, " << indexer.skipped_packets << " packets not decoded" << std::endl;
+    index.close();
+    unlink(index_file);
+
+    CountingFrameFilter counter("counter");
+    NVBatchDecoder batch("batch", counter, 1, 0);
+    batch.addFile(file_1);
+    u0 = Usage::now();
+    batch.startCall();
+    while (!batch.waitAll(100))
+    {
+    }
+    u1 = Usage::now();
+    batch.stopCall();
+    std::cout << name << "all pictures: " << counter.count << " frames in " << u1.wall_s - u0.wall_s << " s" << std::endl;
+}
+
+void test_11()
+{
+    const char *name = "@TEST: benchtest: test 11: ";
+    std::cout << name << "** @@Replay of a captured stream, fanned out to N slots **" << std::endl;
+
+    // an earlier capture is replayed as such, for repeatable runs
+    const char *capture_env = std::getenv("VALKKA_TEST_CAPTURE");
+    std::string capture_file = capture_env ? capture_env : "/tmp/benchtest_11.cap";
+    if (access(capture_file.c_str(), R_OK) != 0)
+    {
+        if (!stream_1)
+        {
+            std::cout << name << "ERROR: missing test stream 1: set environment variable VALKKA_TEST_RTSP_1" << std::endl;
+            exit(2);
+        }
+        std::cout << name << "** capturing 20 s of " << stream_1 << " into " << capture_file << std::endl;
+        // (LiveThread:livethread) --> {NVCaptureFrameFilter:capture}
+        NVCaptureFrameFilter capture("capture", capture_file.c_str());
+        LiveThread livethread("live");
+        livethread.startCall();
+        LiveConnectionContext ctx = LiveConnectionContext(LiveConnectionType::rtsp, std::string(stream_1), 1, &capture);
+        livethread.registerStreamCall(ctx);
+        livethread.playStreamCall(ctx);
+        sleep_for(20s);
+        livethread.stopStreamCall(ctx);
+        livethread.deregisterStreamCall(ctx);
+        livethread.stopCall();
+        capture.close();
+        std::cout << name << "captured " << capture.getRecords() << " packets, " << capture.getBytes() << " bytes" << std::endl;
+    }
+    std::cout << name << "** capture: " << capture_file << " (set with VALKKA_TEST_CAPTURE)" << std::endl;
+
+    NVcuInit();
+    const int copies[] = {1, 4, 16, 32};
+    for (int n : copies)
+    {
+        // (NVCaptureReplay:replay) --> {FifoFrameFilter:in_filter} -->> (NVMultiThread:multithread) --> {CountingFrameFilter:counter}
+        CountingFrameFilter counter("counter");
+        FrameFifoContext fifo_ctx;
+        fifo_ctx.n_basic = 20 * n;
+        NVMultiThread multithread("multithread", counter, 0, fifo_ctx);
+        multithread.startCall();
+        multithread.decodingOnCall();
+        NVCaptureReplay replay("replay", multithread.getFrameFilter());
+        if (!replay.open(capture_file.c_str()))
+        {
+            std::cout << name << "ERROR: could not read " << capture_file << std::endl;
+            exit(2);
+        }
+        Usage u0 = Usage::now();
+        replay.play(1, n);
+        while (replay.isPlaying())
+        {
+            sleep_for(100ms);
+        }
+        Usage u1 = Usage::now();
+        multithread.stopCall();
+        std::string what = std::to_string(n) + " slots";
+        report(name, what.c_str(), u0, u1, counter.count);
+        std::cout << name << what << ": packets written " << replay.frames << ", replay late by " << replay.late_us / 1000. << " ms" << std::endl;
+    }
+}
+
+void test_12()
+{
+    const char *name = "@TEST: benchtest: test 12: ";
+    std::cout << name << "** @@Sustainable number of cameras, with synthetic load from a clip **" << std::endl;
+
+    if (!file_1)
+    {
+        std::cout << name << "ERROR: missing test file 1: set environment variable VALKKA_TEST_FILE_1" << std::endl;
+        exit(2);
+    }
+    std::cout << name << "** test file 1: " << file_1 << std::endl;
+    const char *n_env = std::getenv("VALKKA_TEST_N_STREAMS");
+    int n_max = n_env ? atoi(n_env) : 256;
+    std::cout << name << "** slots at most: " << n_max << " (set with VALKKA_TEST_N_STREAMS)" << std::endl;
+
+    NVcuInit();
+    // (NVLoadGenerator:generator) --> {FifoFrameFilter:in_filter} -->> (NVThread:slot 1..N) --> {Meter}
+    NVLoadGenerator generator("generator", 0);
+    if (!generator.addClip(file_1))
+    {
+        std::cout << name << "ERROR: could not read " << file_1 << std::endl;
+        exit(2);
+    }
+    // a transcoded variant of the same scene, e.g. at another resolution
+    const char *file_2 = std::getenv("VALKKA_TEST_FILE_2");
+    if (file_2 && generator.addClip(file_2))
+    {
+        std::cout << name << "** test file 2: " << file_2 << std::endl;
+    }
+    generator.setSeed(1);
+    generator.setTimestampShift(1000);
+    Usage u0 = Usage::now();
+    int max_slots = generator.sweepLoad(4, 4, n_max, 10000, 2000);
+    Usage u1 = Usage::now();
+    long frames = 0;
+    for (auto r : generator.getResults())
+    {
+        std::cout << name << r.n_slots << " slots: input " << r.input_fps << " fps, output " << r.output_fps << " fps, latency "
+                  << r.mean_latency_ms << " ms (max " << r.max_latency_ms << "), drops " << r.drop_ratio << (r.ok ? "" : " : over") << std::endl;
+        frames += (long)(r.output_fps * 10);
+    }
+    report(name, "sweep", u0, u1, frames);
+    std::cout << name << "sustainable: " << max_slots << " slots" << std::endl;
+}
+
+int main(int argc, char **argcv)
+{
+    if (argc < 2)
+    {
+        std::cout << argcv[0] << " needs an integer argument.  Second interger argument (optional) is verbosity" << std::endl;
+    }
+    else
+    {
+
+        if (argc > 2)
+        { // choose verbosity
+            switch (atoi(argcv[2]))
+            {
+            case (0): // shut up
+                ffmpeg_av_log_set_level(0);
+                fatal_log_all();
+                break;
+            case (1): // normal
+                break;
+            case (2): // more verbose
+                ffmpeg_av_log_set_level(100);
+                debug_log_all();
+                break;
+            case (3): // extremely verbose
+                ffmpeg_av_log_set_level(100);
+                crazy_log_all();
+                break;
+            default:
+                std::cout << "Unknown verbosity level " << atoi(argcv[2]) << std::endl;
+                exit(1);
+                break;
+            }
+        }
+
+        switch (atoi(argcv[1]))
+        { // choose test
+        case (1):
+            test_1();
+            break;
+        case (2):
+            test_2();
+            break;
+        case (3):
+            test_3();
+            break;
+        case (4):
+            test_4();
+            break;
+        case (5):
+            test_5();
+            break;
+        case (6):
+            test_6();
+            break;
+        case (7):
+            test_7();
+            break;
+        case (8):
+            test_8();
+            break;
+        case (9):
+            test_9();
+            break;
+        case (10):
+            test_10();
+            break;
+        case (11):
+            test_11();
+            break;
+        case (12):
+            test_12();
+            break;
+        default:
+            std::cout << "No such test " << argcv[1] << " for " << argcv[0] << std::endl;
+        }
+    }
+}
@@ -0,0 +1,2624 @@
+/*
+ * simtest.cpp :
+ *
+* Copyright 2018 Valkka Security Ltd. and Sampsa Riikonen.
+ *
+ * Authors: Sampsa Riikonen <sampsa.riikonen@iki.fi>
+ *
+ * This file is part of Valkka cpp examples
+ *
+ * Valkka cpp examples is free software: you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ */
+
+/**
+ *  @file    simtest.cpp
+ *  @author  Sampsa Riikonen
+ *  @date    2018
+ *  @version 1.0.0
+ *
+ *  @brief   resource management tests against a simulated set of devices.  No GPU required
+ *
+ */
+
+#include "framefifo.h"
+#include "framefilter.h"
+#include "logging.h"
+#include "avdep.h"
+
+#include "nvdriver.h"
+#include "nvdevices.h"
+#include "nvfallback.h"
+#include "nvqueue.h"
+#include "nvconvert.h"
+#include "nvplanes.h"
+#include "nvframepool.h"
+#include "nvhandoff.h"
+#include "nvresident.h"
+#include "nvreverse.h"
+#include "nvindex.h"
+#include "nvcapture.h"
+#include "nvload.h"
+#include "nvpool.h"
+#include "nvfile.h"
+#include "nvbatch.h"
+#include "test_import.h"
+
+using namespace std::chrono_literals;
+using std::this_thread::sleep_for;
+
+
+/** A stand-in for the cuda driver: a configurable set of devices */
+class SimDriver : public NVDriver
+{
+public:
+    SimDriver(int n_devices, size_t total_bytes, int n_engines = 1) : totals(n_devices, total_bytes), available(n_devices, total_bytes), engines(n_devices, n_engines) {}
+
+public:
+    std::vector<size_t> totals;
+    std::vector<size_t> available; ///< free memory
+    std::vector<int> engines;
+
+public:
+    virtual int getDeviceCount() { return totals.size(); }
+    virtual size_t getTotalMemory(int gpu_index) { return totals[gpu_index]; }
+    virtual bool getFreeMemory(int gpu_index, size_t &free_bytes)
+    {
+        free_bytes = available[gpu_index];
+        return true;
+    }
+    virtual bool getDecoderCaps(int gpu_index, CUVIDDECODECAPS &caps)
+    {
+        caps.bIsSupported = 1;
+        caps.nNumNVDECs = engines[gpu_index];
+        caps.nMaxWidth = 8192;
+        caps.nMaxHeight = 8192;
+        caps.nMaxMBCount = (8192 / 16) * (8192 / 16);
+        return true;
+    }
+};
+
+
+/** A stand-in for device memory: "device" pointers are host memory */
+class SimMemoryDriver : public SimDriver
+{
+public:
+    SimMemoryDriver() : SimDriver(1, 8 * 1024 * 1024 * 1024ULL), allocated(0), freed(0), copies(0), contexts(0) {}
+
+public:
+    int allocated, freed, copies, contexts;
+
+public:
+    virtual bool pushContext(CUcontext context)
+    {
+        contexts++;
+        return true;
+    }
+    virtual void popContext() { contexts--; }
+    virtual bool allocPitch(size_t width_bytes, size_t height, CUdeviceptr &ptr, size_t &pitch)
+    {
+        pitch = (width_bytes + 255) / 256 * 256;
+        ptr = (CUdeviceptr)malloc(pitch * height);
+        allocated++;
+        return true;
+    }
+    virtual void freeDevice(CUdeviceptr ptr)
+    {
+        free((void *)ptr);
+        freed++;
+    }
+    virtual bool copy2D(const CUDA_MEMCPY2D &m, CUstream stream)
+    {
+        const uint8_t *src = (m.srcMemoryType == CU_MEMORYTYPE_DEVICE) ? (const uint8_t *)m.srcDevice : (const uint8_t *)m.srcHost;
+        uint8_t *dst = (m.dstMemoryType == CU_MEMORYTYPE_DEVICE) ? (uint8_t *)m.dstDevice : (uint8_t *)m.dstHost;
+        for (size_t i = 0; i < m.Height; i++)
+        {
+            memcpy(dst + i * m.dstPitch, src + i * m.srcPitch, m.WidthInBytes);
+        }
+        copies++;
+        return true;
+    }
+    virtual bool synchronize(CUstream stream) { return true; }
+};
+
+
+/** Faults injected into SimDecoders */
+struct SimFaults
+{
+    bool fail_next = false; ///< the next pull fails, as with a cuda error
+    bool refuse = false;    ///< new decoders are not ok, as with a refused session
+    bool no_skip = false;   ///< skipOutput is ignored: older pictures of a burst come out anyway
+    int created = 0;
+    int destroyed = 0;
+    int decoded = 0;
+    int skipped = 0; ///< decoded without output
+    int emitted = 0; ///< outputs released
+    int discarded = 0; ///< outputs released without passing them on
+    long decode_ms = 0; ///< time each picture takes
+};
+
+
+/** A stand-in decoder: "decodes" slices once it has seen the parameter sets & a keyframe */
+class SimDecoder : public Decoder, public NVOutputSkipper
+{
+public:
+    SimDecoder(SimFaults &faults) : Decoder(), faults(faults), ok(!faults.refuse), sps(false), pps(false), key(false), skip(false) { faults.created++; }
+    virtual ~SimDecoder() { faults.destroyed++; }
+
+public:
+    SimFaults &faults;
+    BasicFrame out_frame;
+    bool ok, sps, pps, key, skip;
+
+public:
+    virtual void skipOutput(bool skip) { this->skip = skip && !faults.no_skip; }
+    virtual void discardOutput() { faults.discarded++; }
+    virtual void releaseOutput() { faults.emitted++; }
+    virtual Frame *output() { return &out_frame; }
+    virtual void flush() {}
+    virtual bool isOk() { return ok; }
+    virtual bool pull()
+    {
+        if (!ok)
+        {
+            return false;
+        }
+        if (faults.fail_next)
+        {
+            faults.fail_next = false;
+            ok = false;
+            return false;
+        }
+        switch (in_frame.h264_pars.slice_type)
+        {
+        case H264SliceType::sps:
+            sps = true;
+            return false;
+        case H264SliceType::pps:
+            pps = true;
+            return false;
+        case H264SliceType::i:
+            key = (sps && pps);
+            break;
+        }
+        if (!key)
+        {
+            return false;
+        }
+        faults.decoded++;
+        if (faults.decode_ms > 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(faults.decode_ms));
+        }
+        if (skip)
+        {
+            faults.skipped++;
+            return false;
+        }
+        out_frame.copyFrom(&in_frame);
+        return true;
+    }
+};
+
+
+/** A stand-in decoder with pooled picture output: a picture per slice, once it has seen a keyframe */
+class SimPictureDecoder : public Decoder
+{
+public:
+    SimPictureDecoder() : Decoder(), key(false) {}
+
+public:
+    std::shared_ptr<AVBitmapFrame> out;
+    bool key;
+
+public:
+    virtual Frame *output() { return out.get(); }
+    virtual void flush() { out.reset(); }
+    virtual bool isOk() { return true; }
+    virtual void releaseOutput() { out.reset(); }
+    virtual bool pull()
+    {
+        unsigned slice_type = in_frame.h264_pars.slice_type;
+        if (slice_type == H264SliceType::sps || slice_type == H264SliceType::pps)
+        {
+            return false;
+        }
+        key = key || (slice_type == H264SliceType::i);
+        if (!key)
+        {
+            return false;
+        }
+        out = NVFramePool::instance().lease(16, 16);
+        out->mstimestamp = in_frame.mstimestamp;
+        return true;
+    }
+};
+
+
+/** Finishes a picture when the next access unit starts, as the cuvid parser.  Luma is the timestamp / 40 */
+class SimParserDecoder : public Decoder
+{
+public:
+    SimParserDecoder() : Decoder(), ts(-1), broken(-1) {}
+
+public:
+    std::shared_ptr<AVBitmapFrame> out;
+    long ts;                ///< of the picture being decoded.  -1: none
+    long broken;            ///< timestamp of a picture that fails to decode
+
+public:
+    virtual Frame *output() { return out.get(); }
+    virtual void flush() { out.reset(); } // as NVDecoder: the parser keeps the picture it's decoding
+    virtual bool isOk() { return true; }
+    virtual void releaseOutput() { out.reset(); }
+    virtual bool pull()
+    {
+        unsigned slice_type = in_frame.h264_pars.slice_type;
+        bool parameters = (slice_type == H264SliceType::sps || slice_type == H264SliceType::pps);
+        bool end = in_frame.payload.empty(); // as NVDecoder: end of stream
+        bool done = false;
+        if (ts >= 0 && (end || parameters || in_frame.mstimestamp != ts))
+        {
+            if (ts != broken)
+            {
+                out = NVFramePool::instance().lease(64, 32);
+                memset(out->y_payload, (int)(ts / 40), (size_t)out->bmpars.y_linesize * out->bmpars.y_height);
+                out->mstimestamp = ts;
+                out->n_slot = in_frame.n_slot; // as NVDecoder: of the packet that finished the picture
+                done = true;
+            }
+            ts = -1;
+        }
+        if (!parameters && !end)
+        {
+            ts = in_frame.mstimestamp;
+        }
+        return done;
+    }
+};
+
+
+/** As SimParserDecoder, holding back pictures for display: the end of stream gives out all of them at once */
+class SimDelayDecoder : public SimParserDecoder
+{
+public:
+    SimDelayDecoder(size_t delay) : SimParserDecoder(), delay(delay) {}
+    size_t delay;
+    std::deque<std::shared_ptr<AVBitmapFrame>> held, ready;
+
+public:
+    virtual Frame *output() { return ready.empty() ? NULL : ready.front().get(); }
+    virtual void flush() { ready.clear(); }
+    virtual void releaseOutput()
+    {
+        if (!ready.empty())
+        {
+            ready.pop_front();
+        }
+    }
+    virtual bool pull()
+    {
+        if (SimParserDecoder::pull())
+        {
+            held.push_back(out);
+            out.reset();
+        }
+        size_t keep = in_frame.payload.empty() ? 0 : delay;
+        while (held.size() > keep)
+        {
+            ready.push_back(held.front());
+            held.pop_front();
+        }
+        return !ready.empty();
+    }
+};
+
+
+/** Collects frame timestamps */
+class TimestampFrameFilter : public FrameFilter
+{
+public:
+    TimestampFrameFilter() : FrameFilter("timestamps") {}
+    std::mutex mutex;
+    std::vector<long> timestamps;
+
+protected:
+    void go(Frame *frame)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        timestamps.push_back(frame->mstimestamp);
+    }
+};
+
+
+/** Keeps copies of the frames */
+class CollectingFrameFilter : public FrameFilter
+{
+public:
+    CollectingFrameFilter() : FrameFilter("collecting"), setups(0) {}
+    std::mutex mutex;
+    std::vector<BasicFrame> frames;
+    std::vector<NVClock::time_point> times;
+    long setups;
+
+protected:
+    void go(Frame *frame)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        if (frame->getFrameType() == FrameType::setupframe)
+        {
+            setups++;
+        }
+        else if (frame->getFrameType() == FrameType::basicframe)
+        {
+            frames.push_back(*static_cast<BasicFrame *>(frame));
+            times.push_back(NVClock::now());
+        }
+    }
+};
+
+
+/** A GPU of fixed capacity shared by the slots: each picture takes decode_ms, a full queue drops */
+class SimEngine
+{
+public:
+    SimEngine(long decode_ms, size_t max_queue) : decode_ms(decode_ms), max_queue(max_queue), running(true), decoded(0), dropped(0), current(NULL)
+    {
+        thread = std::thread(&SimEngine::loop, this);
+    }
+    ~SimEngine()
+    {
+        {
+            std::unique_lock<std::mutex> lk(mutex);
+            running = false;
+            condition.notify_all();
+        }
+        thread.join();
+    }
+
+public:
+    struct Item
+    {
+        FrameFilter *outfilter;
+        int n_slot;
+        long mstimestamp;
+    };
+    long decode_ms;
+    size_t max_queue;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<Item> queue;
+    bool running;
+    long decoded, dropped;
+    FrameFilter *current; ///< being written to
+
+public:
+    /** Drop the queued pictures of an outfilter that's going away, e.g. after a run was stopped */
+    void forget(FrameFilter *outfilter)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        queue.erase(std::remove_if(queue.begin(), queue.end(), [outfilter](const Item &item) { return item.outfilter == outfilter; }), queue.end());
+        condition.wait(lk, [this, outfilter]() { return current != outfilter; });
+    }
+    void submit(FrameFilter *outfilter, int n_slot, long mstimestamp)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        if (queue.size() >= max_queue)
+        {
+            dropped++;
+            return;
+        }
+        queue.push_back(Item{outfilter, n_slot, mstimestamp});
+        condition.notify_all();
+    }
+    void loop()
+    {
+        AVBitmapFrame out;
+        while (true)
+        {
+            Item item;
+            {
+                std::unique_lock<std::mutex> lk(mutex);
+                condition.wait(lk, [this]() { return !queue.empty() || !running; });
+                if (!running)
+                {
+                    break;
+                }
+                item = queue.front();
+                queue.pop_front();
+                current = item.outfilter;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(decode_ms));
+            out.n_slot = item.n_slot;
+            out.mstimestamp = item.mstimestamp;
+            item.outfilter->run(&out);
+            std::unique_lock<std::mutex> lk(mutex);
+            decoded++;
+            current = NULL;
+            condition.notify_all();
+        }
+    }
+};
+
+
+/** A slot's decoder on SimEngine.  When deleted, leaves the first packet's payload & the latest timestamp to seen */
+class SimLoadTarget : public NVLoadTarget, public FrameFilter
+{
+public:
+    SimLoadTarget(SimEngine &engine, FrameFilter &outfilter, std::vector<std::pair<int, long>> &seen) : FrameFilter("simload"), engine(engine), outfilter(outfilter), seen(seen), first(-1), last_ts(-1) {}
+    virtual ~SimLoadTarget()
+    {
+        engine.forget(&outfilter);
+        seen.push_back(std::make_pair(first, last_ts));
+    }
+
+public:
+    SimEngine &engine;
+    FrameFilter &outfilter;
+    std::vector<std::pair<int, long>> &seen;
+    int first;
+    long last_ts;
+
+public:
+    virtual FrameFilter &getFrameFilter() { return *this; }
+
+protected:
+    void go(Frame *frame)
+    {
+        if (frame->getFrameType() != FrameType::basicframe)
+        {
+            return;
+        }
+        BasicFrame *f = static_cast<BasicFrame *>(frame);
+        if (first < 0)
+        {
+            first = f->payload.back();
+        }
+        unsigned slice_type = f->h264_pars.slice_type;
+        if ((slice_type == H264SliceType::i || slice_type == H264SliceType::pb) && f->mstimestamp != last_ts)
+        {
+            last_ts = f->mstimestamp;
+            engine.submit(&outfilter, f->n_slot, f->mstimestamp);
+        }
+    }
+};
+
+
+static int failures = 0;
+
+static void check(bool ok, const char *name, const char *what)
+{
+    std::cout << name << (ok ? "OK   : " : "FAIL : ") << what << std::endl;
+    if (!ok)
+    {
+        failures++;
+    }
+}
+
+static const size_t GB = 1024 * 1024 * 1024;
+
+
+/** A stand-in for the DMA engine of a GPU: copies queued bands one after another, each taking a while
+ *
+ * Time is simulated: now is the time of the thread using the engine, in microseconds
+ */
+class SimCopyEngine
+{
+public:
+    SimCopyEngine(int n_bands, long band_us) : band_us(band_us), done_us(n_bands, -1), now(0), engine_free(0) {}
+
+private:
+    long band_us;
+    std::vector<long> done_us; ///< when the copy of a band is done.  -1: not queued
+
+public:
+    long now;
+    long engine_free; ///< when the engine is done with the queued copies
+
+public:
+    bool copy(int band) // as cuMemcpy2DAsync & cuEventRecord
+    {
+        engine_free = std::max(engine_free, now) + band_us;
+        done_us[band] = engine_free;
+        return true;
+    }
+    bool wait(int band) // as cuEventSynchronize
+    {
+        if (done_us[band] < 0)
+        {
+            return false;
+        }
+        now = std::max(now, done_us[band]);
+        return true;
+    }
+    void work(long us) // the thread is busy, e.g. converting
+    {
+        now += us;
+    }
+};
+
+
+void test_1()
+{
+    const char *name = "@TEST: simtest: test 1: ";
+    std::cout << name << "** @@Automatic placement of streams over four simulated GPUs **" << std::endl;
+
+    SimDriver driver(4, 8 * GB);
+    NVDeviceRegistry registry(&driver);
+    double mbps_1080p = NVMacroblockRate(1920, 1088, 25, 1);
+    double mbps_4k = NVMacroblockRate(3840, 2160, 25, 1);
+
+    std::vector<long> ids;
+    int owners[10];
+    // two 4K streams and eight 1080p streams
+    for (int i = 0; i < 10; i++)
+    {
+        long id;
+        int gpu = registry.acquire(&owners[i], -1, id);
+        registry.update(id, i < 2 ? mbps_4k : mbps_1080p);
+        ids.push_back(id);
+        std::cout << name << "stream " << i << " placed on GPU " << gpu << std::endl;
+    }
+
+    std::vector<NVDeviceLoad> loads = registry.getLoads();
+    double lo = loads[0].mbps, hi = loads[0].mbps;
+    int sessions = 0;
+    for (auto it = loads.begin(); it != loads.end(); ++it)
+    {
+        std::cout << name << "GPU " << it->gpu_index << " : " << it->sessions << " sessions, " << it->mbps << " macroblocks/s" << std::endl;
+        lo = std::min(lo, it->mbps);
+        hi = std::max(hi, it->mbps);
+        sessions += it->sessions;
+    }
+    check(sessions == 10, name, "all sessions registered");
+    check(hi - lo <= mbps_4k, name, "load spread within one 4K stream");
+
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+    {
+        registry.release(*it);
+    }
+    loads = registry.getLoads();
+    for (auto it = loads.begin(); it != loads.end(); ++it)
+    {
+        check(it->sessions == 0 && it->mbps == 0, name, "device empty after release");
+    }
+}
+
+
+void test_2()
+{
+    const char *name = "@TEST: simtest: test 2: ";
+    std::cout << name << "** @@Rebalancing at reconnect and memory pressure **" << std::endl;
+
+    SimDriver driver(2, 8 * GB);
+    NVDeviceRegistry registry(&driver);
+    double mbps_1080p = NVMacroblockRate(1920, 1088, 25, 1);
+    int owner_a, owner_b, owner_c;
+    long id_a, id_b, id_c;
+
+    int gpu_a = registry.acquire(&owner_a, -1, id_a);
+    registry.update(id_a, mbps_1080p);
+    int gpu_b = registry.acquire(&owner_b, -1, id_b);
+    registry.update(id_b, mbps_1080p);
+    check(gpu_a != gpu_b, name, "two streams on two different GPUs");
+
+    // a fixed-index stream lands on b's GPU
+    int gpu_c = registry.acquire(&owner_c, gpu_b, id_c);
+    registry.update(id_c, mbps_1080p);
+    check(gpu_c == gpu_b, name, "explicit gpu index is respected");
+
+    // b reconnects: its previous load is known & it moves to the less loaded device
+    registry.release(id_b);
+    registry.release(id_a);
+    int gpu_b2 = registry.acquire(&owner_b, -1, id_b);
+    check(gpu_b2 == gpu_a, name, "reconnecting stream moves away from the busier GPU");
+    check(registry.getLoads()[gpu_b2].mbps == mbps_1080p, name, "reconnecting stream is placed with its previous load");
+
+    // memory pressure: the empty device is full
+    registry.release(id_b);
+    registry.updateMemory(gpu_a, 100 * 1024 * 1024);
+    long id_d;
+    int owner_d;
+    int gpu_d = registry.acquire(&owner_d, -1, id_d);
+    check(gpu_d == gpu_c, name, "device without free memory is avoided");
+    registry.release(id_d);
+
+    // the memory of a closed session is free again
+    registry.acquire(&owner_d, gpu_a, id_d);
+    registry.release(id_d);
+    check(registry.getLoads()[gpu_a].free_bytes == 8 * GB, name, "free memory refreshed when a session closes");
+    gpu_d = registry.acquire(&owner_d, -1, id_d);
+    check(gpu_d == gpu_a, name, "device with memory again is used");
+    registry.release(id_d);
+    registry.release(id_c);
+
+    // the driver is asked without the mutex: other streams are placed meanwhile
+    struct BusyDriver : public SimDriver
+    {
+        BusyDriver() : SimDriver(1, 8 * GB), registry(NULL), placed(-1) {}
+        NVDeviceRegistry *registry;
+        int placed;
+        virtual bool getFreeMemory(int gpu_index, size_t &free_bytes)
+        {
+            placed = registry ? registry->place(this) : -1;
+            return SimDriver::getFreeMemory(gpu_index, free_bytes);
+        }
+    };
+    BusyDriver busy;
+    NVDeviceRegistry busy_registry(&busy);
+    busy.registry = &busy_registry;
+    busy_registry.acquire(&owner_d, -1, id_d);
+    busy_registry.release(id_d);
+    check(busy.placed == 0, name, "free memory queried outside the registry lock");
+}
+
+
+void test_3()
+{
+    const char *name = "@TEST: simtest: test 3: ";
+    std::cout << name << "** @@Admission control against simulated decoder caps **" << std::endl;
+
+    // GPU 0 has one NVDEC engine, GPU 1 has two
+    SimDriver driver(2, 8 * GB);
+    driver.engines[1] = 2;
+    NVDeviceRegistry registry(&driver);
+    double mbps_per_engine = 1000000;
+    registry.setAdmission(0.5, mbps_per_engine);
+    double mbps_1080p = NVMacroblockRate(1920, 1088, 25, 1); // 204000
+
+    std::vector<NVDeviceLoad> loads = registry.getLoads();
+    check(loads[0].budget == mbps_per_engine && loads[1].budget == 2 * mbps_per_engine, name, "budget from the number of engines");
+
+    // GPU 0 takes two 1080p streams at 50% utilisation
+    std::vector<long> ids;
+    int owner;
+    int admitted = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        long id;
+        registry.acquire(&owner, 0, id);
+        ids.push_back(id);
+        if (registry.admit(id, mbps_1080p))
+        {
+            admitted++;
+        }
+    }
+    loads = registry.getLoads();
+    check(admitted == 2, name, "two sessions admitted to GPU 0");
+    check(loads[0].refused == 2 && loads[0].admitted == 2, name, "decisions counted");
+    check(loads[0].mbps == 2 * mbps_1080p, name, "refused sessions do not load the device");
+
+    // automatic placement goes for the GPU with two engines
+    long id;
+    int gpu = registry.acquire(&owner, -1, id);
+    check(gpu == 1, name, "placement by utilisation of the budget");
+    check(registry.admit(id, mbps_1080p), name, "admitted to GPU 1");
+    ids.push_back(id);
+
+    // the load of the new session decides between a small idle device & a big busy one
+    std::vector<NVDeviceLoad> two = {NVDeviceLoad(0, 8 * GB), NVDeviceLoad(1, 8 * GB)};
+    two[0].budget = 1000000;
+    two[0].mbps = 500000;
+    two[1].budget = 2000000;
+    two[1].mbps = 1200000;
+    check(NVDeviceRegistry::choose(two, 0) == 0 && NVDeviceRegistry::choose(two, 600000) == 1, name, "placement by the load of the new session");
+
+    // admission control disabled
+    registry.setAdmission(0, mbps_per_engine);
+    registry.acquire(&owner, 0, id);
+    check(registry.admit(id, mbps_1080p), name, "no admission control");
+    ids.push_back(id);
+
+    for (auto it = ids.begin(); it != ids.end(); ++it)
+    {
+        registry.release(*it);
+    }
+}
+
+
+void test_4()
+{
+    const char *name = "@TEST: simtest: test 4: ";
+    std::cout << name << "** @@GPU failure mid-stream, CPU fallback & recovery **" << std::endl;
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    NVFallbackDecoder decoder(
+        [&gpu]() { return new SimDecoder(gpu); },
+        [&cpu]() { return new SimDecoder(cpu); },
+        stats, 500, 0); // retry at every keyframe
+    int disposed = 0;
+    decoder.setDisposer([&disposed](Decoder *d) { disposed++; delete d; });
+
+    std::vector<long> expected, emitted;
+    BasicFrame f;
+    long t = 0;
+    for (int n_gop = 0; n_gop < 4; n_gop++)
+    {
+        for (int i = 0; i < 7; i++)
+        {
+            f.h264_pars.slice_type = (i == 0) ? H264SliceType::sps : (i == 1) ? H264SliceType::pps : (i == 2) ? H264SliceType::i : H264SliceType::pb;
+            f.mstimestamp = t++;
+            if (i >= 2)
+            {
+                expected.push_back(f.mstimestamp);
+            }
+            if (n_gop == 1 && i == 4)
+            { // GPU breaks down
+                gpu.fail_next = true;
+                gpu.refuse = true;
+            }
+            if (n_gop == 3 && i == 0)
+            { // GPU is back
+                gpu.refuse = false;
+            }
+            decoder.input(&f);
+            if (decoder.pull())
+            {
+                emitted.push_back(decoder.output()->mstimestamp);
+                decoder.releaseOutput();
+            }
+        }
+        if (n_gop == 2)
+        {
+            check(!decoder.onGPU(), name, "on CPU while the GPU refuses");
+        }
+    }
+    check(emitted == expected, name, "every slice emitted once & in order");
+    check(decoder.onGPU(), name, "back on GPU");
+    check(stats->fallback_switches == 1 && stats->gpu_recoveries == 1, name, "switches counted");
+    check(gpu.created == 3, name, "one failed retry");
+    check(gpu.destroyed == 2 && disposed == 0, name, "failed decoders deleted right away, not disposed");
+    check(cpu.decoded == 10, name, "CPU decoded from the keyframe before the failure to the recovery");
+}
+
+
+void test_5()
+{
+    const char *name = "@TEST: simtest: test 5: ";
+    std::cout << name << "** @@Pre-warming decoders with cached parameter sets **" << std::endl;
+
+    // sps with a 4-byte start code, pps with a 3-byte one
+    std::vector<uint8_t> ps = {0, 0, 0, 1, 0x67, 1, 2, 3, 0, 0, 1, 0x68, 4, 5};
+    std::vector<std::pair<size_t, size_t>> nals = NVParameterCache::split(ps);
+    check(nals.size() == 2 && nals[0] == std::make_pair((size_t)0, (size_t)8) && nals[1] == std::make_pair((size_t)8, (size_t)14),
+          name, "parameter sets split into NAL units");
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    std::shared_ptr<NVParameterCache> params = std::make_shared<NVParameterCache>();
+    params->set(3, ps);
+
+    BasicFrame f;
+    f.n_slot = 3;
+    f.h264_pars.slice_type = H264SliceType::i; // camera sends no parameter sets before the keyframe
+
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setParameterCache(params);
+        decoder.input(&f);
+        check(decoder.pull(), name, "first keyframe decoded with the cached parameter sets");
+        decoder.releaseOutput();
+        check(stats->first_frame_us > 0, name, "time to first frame measured");
+    }
+
+    // no cached parameter sets for the slot
+    params->clear(3);
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setParameterCache(params);
+        decoder.input(&f);
+        check(!decoder.pull(), name, "keyframe without parameter sets not decoded");
+        // parameter sets arrive in-band
+        f.h264_pars.slice_type = H264SliceType::sps;
+        f.payload.assign(ps.begin(), ps.begin() + 8);
+        decoder.input(&f);
+        decoder.pull();
+        f.h264_pars.slice_type = H264SliceType::pps;
+        f.payload.assign(ps.begin() + 8, ps.end());
+        decoder.input(&f);
+        decoder.pull();
+    }
+    std::vector<uint8_t> stored;
+    check(params->get(3, stored) && stored == ps, name, "parameter sets stored for the next session");
+}
+
+
+void test_6()
+{
+    const char *name = "@TEST: simtest: test 6: ";
+    std::cout << name << "** @@Queue between the submit & completion stages **" << std::endl;
+
+    NVBoundedQueue<int> queue(6);
+    check(queue.capacity() == 8, name, "capacity rounded up to a power of two");
+    int n = 0;
+    while (queue.push(n))
+    {
+        n++;
+    }
+    check(n == 8 && queue.size() == 8, name, "push fails when full");
+    int value;
+    bool ordered = true;
+    for (int i = 0; i < n; i++)
+    {
+        ordered = ordered && queue.pop(value) && value == i;
+    }
+    check(ordered, name, "popped in order");
+    check(!queue.pop(value) && queue.size() == 0, name, "pop fails when empty");
+
+    // one submitting thread, several completion workers
+    const int n_values = 20000;
+    const int n_workers = 3;
+    std::atomic<int> popped(0);
+    std::atomic<long> sum(0);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < n_workers; w++)
+    {
+        workers.push_back(std::thread([&]() {
+            int v;
+            while (popped.load() < n_values)
+            {
+                if (queue.pop(v))
+                {
+                    sum += v;
+                    popped++;
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }));
+    }
+    for (int i = 1; i <= n_values; i++)
+    {
+        while (!queue.push(i))
+        {
+            std::this_thread::yield();
+        }
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+    check(sum == (long)n_values * (n_values + 1) / 2, name, "every value popped exactly once");
+}
+
+
+void test_7()
+{
+    const char *name = "@TEST: simtest: test 7: ";
+    std::cout << name << "** @@Download of a frame overlapping with its conversion **" << std::endl;
+
+    const long copy_us = 40000, convert_us = 30000;
+    long us[2];
+    for (int n_bands : {1, 8})
+    {
+        SimCopyEngine engine(n_bands, copy_us / n_bands);
+        NVPipelineBands(n_bands,
+            [&engine](int band) { return engine.copy(band); },
+            [&engine](int band) { return engine.wait(band); },
+            [&engine, n_bands, convert_us](int band) { engine.work(convert_us / n_bands); });
+        us[n_bands > 1] = engine.now;
+        std::cout << name << n_bands << " bands: " << engine.now << " us" << std::endl;
+    }
+    // copy + convert = 70 ms, max(copy, convert) + one band of conversion = 43.75 ms
+    check(us[0] == 70000, name, "one band: copy & convert in sequence");
+    check(us[1] == 43750, name, "bands: max(copy, convert) + one band");
+
+    int copied = 0, converted = 0;
+    bool ok = NVPipelineBands(4,
+        [&copied](int band) { copied++; return band < 2; },
+        [](int band) { return true; },
+        [&converted](int band) { converted++; });
+    check(!ok && copied == 3 && converted == 0, name, "failed copy: queued bands waited for, nothing converted");
+}
+
+void test_8()
+{
+    const char *name = "@TEST: simtest: test 8: ";
+    std::cout << name << "** @@Aligned output planes & vectorized chroma conversion **" << std::endl;
+
+    AVBitmapFrame frame;
+    NVFramePlanes planes;
+    bool ok = planes.reserve(&frame, 1918, 1081);
+    check(ok, name, "reserved");
+    const int align = NVFramePlanes::plane_align;
+    check((uintptr_t)frame.y_payload % align == 0 && (uintptr_t)frame.u_payload % align == 0 && (uintptr_t)frame.v_payload % align == 0,
+          name, "planes aligned");
+    check(frame.bmpars.y_linesize == 1920 && frame.bmpars.u_linesize == 960 && frame.bmpars.u_height == 541,
+          name, "linesizes padded, odd sizes rounded up");
+    check(frame.av_frame->data[1] == frame.u_payload && frame.av_frame->linesize[2] == frame.bmpars.v_linesize,
+          name, "AVFrame points to the planes");
+    uint8_t *y = frame.y_payload;
+    planes.reserve(&frame, 1918, 1081);
+    check(frame.y_payload == y, name, "same size: block kept");
+
+    // vectorized rows against a plain loop, with & without padding
+    bool same = true;
+    for (int width = 1; width <= 70 && same; width++)
+    {
+        for (int padded = 0; padded < 2; padded++)
+        {
+            const int height = 3;
+            int linesize = padded ? NVFramePlanes::linesize(width) : width;
+            unsigned pitch = padded ? linesize * 2 : width * 2;
+            std::vector<uint8_t> src(pitch * height);
+            for (size_t i = 0; i < src.size(); i++)
+            {
+                src[i] = (uint8_t)(i * 7);
+            }
+            std::vector<uint8_t> u(linesize * height + 1), v(linesize * height + 1);
+            // + 1: unaligned rows
+            NVDeinterleaveRows(src.data(), pitch, u.data() + 1, linesize, v.data() + padded, linesize, width, 0, height);
+            for (int r = 0; r < height; r++)
+            {
+                for (int j = 0; j < width; j++)
+                {
+                    same = same && u[1 + r * linesize + j] == src[r * pitch + j * 2] && v[padded + r * linesize + j] == src[r * pitch + j * 2 + 1];
+                }
+            }
+        }
+    }
+    check(same, name, "vectorized conversion equals the reference");
+}
+
+
+void test_9()
+{
+    const char *name = "@TEST: simtest: test 9: ";
+    std::cout << name << "** @@Streaming stores write the same planes **" << std::endl;
+
+    const int width = 1918, height = 1080;
+    unsigned pitch = 2048;
+    std::vector<uint8_t> src(pitch * (height + height / 2));
+    for (size_t i = 0; i < src.size(); i++)
+    {
+        src[i] = (uint8_t)(i * 13);
+    }
+    AVBitmapFrame frames[2];
+    NVFramePlanes planes[2];
+    for (int streaming = 0; streaming < 2; streaming++)
+    {
+        AVBitmapFrame &f = frames[streaming];
+        planes[streaming].reserve(&f, width, height);
+        NVCopyRows(src.data(), pitch, f.y_payload, f.bmpars.y_linesize, width, 0, height, streaming);
+        NVDeinterleave(src.data() + (size_t)pitch * height, pitch, f.u_payload, f.bmpars.u_linesize,
+                       f.v_payload, f.bmpars.v_linesize, width / 2, height / 2, streaming);
+    }
+    bool same = true;
+    for (int r = 0; r < height; r++)
+    {
+        same = same && memcmp(frames[0].y_payload + r * frames[0].bmpars.y_linesize, frames[1].y_payload + r * frames[1].bmpars.y_linesize, width) == 0;
+        same = same && memcmp(frames[1].y_payload + r * frames[1].bmpars.y_linesize, src.data() + r * pitch, width) == 0;
+    }
+    for (int r = 0; r < height / 2; r++)
+    {
+        same = same && memcmp(frames[0].u_payload + r * frames[0].bmpars.u_linesize, frames[1].u_payload + r * frames[1].bmpars.u_linesize, width / 2) == 0;
+        same = same && memcmp(frames[0].v_payload + r * frames[0].bmpars.v_linesize, frames[1].v_payload + r * frames[1].bmpars.v_linesize, width / 2) == 0;
+    }
+    check(same, name, "streamed planes equal the normal ones");
+}
+
+
+void test_10()
+{
+    const char *name = "@TEST: simtest: test 10: ";
+    std::cout << name << "** @@Frame pool shared by the decoders **" << std::endl;
+
+    NVFramePool pool;
+    size_t hd = NVFramePlanes::bytes(1920, 1080), sd = NVFramePlanes::bytes(640, 360);
+    pool.configure(2 * hd + sd / 2, 1);
+
+    std::shared_ptr<AVBitmapFrame> a = pool.lease(1920, 1080);
+    AVBitmapFrame *first = a.get();
+    std::shared_ptr<AVBitmapFrame> b = a; // e.g. ring & completion worker
+    a.reset();
+    check(b && pool.getBytes() == hd, name, "lease alive while a reference is");
+    b.reset();
+    a = pool.lease(1920, 1080);
+    check(a.get() == first && pool.getBytes() == hd, name, "returned frame leased again");
+
+    std::shared_ptr<AVBitmapFrame> c = pool.lease(1920, 1080), d = pool.lease(1920, 1080);
+    check(c && !d, name, "cap refuses a lease");
+    c.reset();
+    std::shared_ptr<AVBitmapFrame> e = pool.lease(640, 360);
+    check(e && pool.getBytes() == hd + sd, name, "idle frame of another size freed for a lease");
+
+    pool.configure(0, 1);
+    c = pool.lease(1920, 1080);
+    d = pool.lease(1920, 1080);
+    c.reset();
+    d.reset();
+    check(pool.getBytes() == 2 * hd + sd, name, "idle frames beyond max_idle freed");
+    a.reset();
+    e.reset();
+    pool.clear();
+    check(pool.getBytes() == 0, name, "all memory back");
+}
+
+
+/** A number from a python dict, -1 if missing */
+static double pyNumber(PyObject *dic, const char *key)
+{
+    PyObject *value = PyDict_GetItemString(dic, key);
+    return value ? PyFloat_AsDouble(value) : -1;
+}
+
+
+void test_11()
+{
+    const char *name = "@TEST: simtest: test 11: ";
+    std::cout << name << "** @@Frames passed downstream by reference **" << std::endl;
+
+    NVFramePool &pool = NVFramePool::instance();
+    pool.clear();
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    NVHandoffFilter handoff("handoff", 2);
+
+    std::shared_ptr<AVBitmapFrame> lease = pool.lease(1920, 1080, stats);
+    lease->y_payload[0] = 42;
+    lease->mstimestamp = 1000;
+    handoff.run(lease.get());
+    AVBitmapFrame *decoded = lease.get();
+    lease.reset(); // NVDecoder::releaseOutput
+    std::shared_ptr<AVBitmapFrame> f = handoff.read();
+    check(f.get() == decoded && f->y_payload[0] == 42, name, "consumer gets the decoded frame itself");
+    check(stats->handoff_frames == 1 && stats->copy_bytes_saved == 1920 * 1080 * 3 / 2, name, "saved bytes counted");
+    size_t bytes = pool.getBytes();
+    f.reset();
+    check(pool.lease(1920, 1080).get() == decoded && pool.getBytes() == bytes, name, "frame back to the pool when the consumer drops it");
+
+    handoff.setCopy(true);
+    lease = pool.lease(1920, 1080, stats);
+    lease->y_payload[0] = 43;
+    handoff.run(lease.get());
+    f = handoff.read();
+    check(f && f.get() != lease.get() && f->y_payload[0] == 43 && stats->handoff_frames == 1, name, "copy path");
+    f.reset();
+    handoff.setCopy(false);
+
+    AVBitmapFrame other; // e.g. from the CPU decoder
+    NVFramePlanes planes;
+    planes.reserve(&other, 640, 360);
+    other.u_payload[0] = 44;
+    other.mstimestamp = 2000;
+    handoff.run(&other);
+    f = handoff.read();
+    check(f && f.get() != &other && f->u_payload[0] == 44 && f->mstimestamp == 2000, name, "other frames copied");
+    f.reset();
+
+    for (int i = 0; i < 3; i++)
+    {
+        handoff.run(lease.get());
+    }
+    check(handoff.size() == 2 && handoff.getDropped() == 1, name, "full queue drops the oldest");
+    handoff.clear();
+
+    // python consumers
+    if (!Py_IsInitialized())
+    {
+        Py_Initialize();
+    }
+    lease->y_payload[lease->bmpars.y_linesize] = 45; // first pixel of the second row
+    lease->v_payload[0] = 46;
+    lease->n_slot = 3;
+    handoff.run(lease.get());
+    lease.reset();
+    PyObject *dic = handoff.readFrame();
+    PyObject *y = dic ? PyDict_GetItemString(dic, "y") : NULL;
+    PyObject *v = dic ? PyDict_GetItemString(dic, "v") : NULL;
+    check(y && PyBytes_Size(y) == 1920 * 1080 && PyBytes_AsString(y)[1920] == 45, name, "python frame: y plane without padding");
+    check(v && PyBytes_Size(v) == 960 * 540 && PyBytes_AsString(v)[0] == 46, name, "python frame: chroma");
+    check(pyNumber(dic, "width") == 1920 && pyNumber(dic, "height") == 1080 && pyNumber(dic, "n_slot") == 3, name, "python frame: size & slot");
+    Py_XDECREF(dic);
+    dic = handoff.readFrame(1);
+    check(dic == Py_None, name, "python frame: None if there was none");
+    Py_DECREF(dic);
+    pool.clear();
+    check(pool.getBytes() == 0, name, "all frames back");
+}
+
+
+void test_12()
+{
+    const char *name = "@TEST: simtest: test 12: ";
+    std::cout << name << "** @@Joining a stream at the cached GOP **" << std::endl;
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    std::shared_ptr<NVGopCache> gop = std::make_shared<NVGopCache>();
+    bool decoding = false;
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    unsigned types[] = {H264SliceType::sps, H264SliceType::pps, H264SliceType::i, H264SliceType::pb, H264SliceType::pb};
+    std::vector<long> emitted;
+
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setGopCache(gop);
+        decoder.setStandby([&decoding]() { return !decoding; });
+        for (int i = 0; i < 5; i++)
+        {
+            f.h264_pars.slice_type = types[i];
+            f.mstimestamp = i;
+            decoder.input(&f);
+            check(!decoder.pull(), name, "no output while not decoding");
+        }
+        check(gpu.decoded == 0, name, "packets cached without decoding");
+
+        decoding = true; // e.g. decodingOnCall in the middle of a GOP
+        f.h264_pars.slice_type = H264SliceType::pb;
+        f.mstimestamp = 5;
+        decoder.input(&f);
+        if (decoder.pull())
+        {
+            emitted.push_back(decoder.output()->mstimestamp);
+            decoder.releaseOutput();
+        }
+        check(emitted == std::vector<long>({5}), name, "newest picture out at the first packet");
+        check(gpu.decoded == 4 && gpu.skipped == 3, name, "older pictures decoded without output");
+        check(stats->gop_joins == 1 && stats->join_packets == 6 && stats->join_us > 0, name, "join counted");
+    }
+
+    // the decoder is recreated, e.g. after a failure: its successor starts from the same cache
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setGopCache(gop);
+        f.mstimestamp = 6;
+        decoder.input(&f);
+        check(decoder.pull() && decoder.output()->mstimestamp == 6, name, "restarted decoder joins at the cached GOP");
+        decoder.releaseOutput();
+        check(stats->gop_joins == 2 && stats->join_packets == 6 + 7, name, "restart counted");
+    }
+
+    // a decoder that can't skip: the older pictures come out & are discarded, not counted as emitted
+    gpu.no_skip = true;
+    gpu.emitted = 0;
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setGopCache(gop);
+        f.mstimestamp = 7;
+        decoder.input(&f);
+        check(decoder.pull() && decoder.output()->mstimestamp == 7, name, "joined without skipping");
+        decoder.releaseOutput();
+        check(gpu.emitted == 1 && gpu.discarded == 5, name, "older pictures discarded");
+    }
+    gpu.no_skip = false;
+
+    // without a cache that outlives the decoder, the next keyframe is waited for
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        f.mstimestamp = 7;
+        decoder.input(&f);
+        check(!decoder.pull(), name, "fresh decoder waits for a keyframe");
+    }
+
+    // decodingOffCall & decodingOnCall again: the join is at the GOP cached meanwhile
+    gpu.decoded = gpu.skipped = 0;
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setGopCache(std::make_shared<NVGopCache>());
+        decoder.setStandby([&decoding]() { return !decoding; });
+        for (int i = 0; i < 2; i++)
+        {
+            decoding = false;
+            for (int j = 0; j < 5; j++)
+            {
+                f.h264_pars.slice_type = types[j];
+                f.mstimestamp = 10 * (i + 1) + j;
+                decoder.input(&f);
+                decoder.pull();
+            }
+            decoding = true;
+            f.h264_pars.slice_type = H264SliceType::pb;
+            f.mstimestamp = 10 * (i + 1) + 5;
+            decoder.input(&f);
+            check(decoder.pull() && decoder.output()->mstimestamp == f.mstimestamp, name, "joined at each decodingOnCall");
+            decoder.releaseOutput();
+        }
+        check(gpu.decoded == 8 && gpu.skipped == 6, name, "both GOPs decoded");
+    }
+
+    // other decoders of the thread, e.g. audio, drop the packets meanwhile
+    decoding = false;
+    SimFaults audio;
+    {
+        NVStandbyDecoder decoder(new SimDecoder(audio), [&decoding]() { return !decoding; });
+        bool got = false;
+        for (int i = 0; i < 6; i++)
+        {
+            decoding = (i >= 3);
+            f.h264_pars.slice_type = types[i % 3];
+            f.mstimestamp = 30 + i;
+            decoder.input(&f);
+            got = decoder.pull();
+            if (i == 2)
+            {
+                check(!got && audio.decoded == 0, name, "nothing decoded while decoding is off");
+            }
+        }
+        check(got && decoder.output()->mstimestamp == 35 && audio.decoded == 1, name, "decoded once on");
+        decoder.releaseOutput();
+    }
+}
+
+
+void test_13()
+{
+    const char *name = "@TEST: simtest: test 13: ";
+    std::cout << name << "** @@Catching up when packets fall behind **" << std::endl;
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    NVFallbackDecoder decoder(
+        [&gpu]() { return new SimDecoder(gpu); },
+        [&cpu]() { return new SimDecoder(cpu); },
+        stats);
+    decoder.setMaxLatency([]() { return 1000L; });
+
+    std::vector<long> emitted;
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    // packets this many ms behind the wall clock
+    auto feed = [&](unsigned slice_type, long behind, uint8_t nal) {
+        f.h264_pars.slice_type = slice_type;
+        f.payload = {0, 0, 0, 1, nal, 0};
+        f.mstimestamp = NVmsNow() - behind;
+        decoder.input(&f);
+        if (decoder.pull())
+        {
+            emitted.push_back(behind);
+            decoder.releaseOutput();
+        }
+    };
+    feed(H264SliceType::sps, 100, 0x67);
+    feed(H264SliceType::pps, 100, 0x68);
+    feed(H264SliceType::i, 100, 0x65);
+    feed(H264SliceType::pb, 100, 0x41);
+    feed(H264SliceType::pb, 100, 0x01); // non-reference, on time
+    check(emitted.size() == 3, name, "on time: everything decoded");
+
+    emitted.clear();
+    feed(H264SliceType::pb, 800, 0x41);
+    feed(H264SliceType::pb, 800, 0x01);
+    check(emitted == std::vector<long>({800}), name, "beyond half the max: non-reference picture skipped");
+
+    emitted.clear();
+    feed(H264SliceType::pb, 2100, 0x41);
+    feed(H264SliceType::pb, 1600, 0x41);
+    feed(H264SliceType::pb, 1200, 0x41);
+    feed(H264SliceType::i, 300, 0x65);
+    feed(H264SliceType::pb, 250, 0x41);
+    check(emitted == std::vector<long>({300, 250}), name, "beyond the max: dropped up to the keyframe");
+    check(stats->catchups == 1 && stats->catchup_packets == 4, name, "catch-up counted");
+    uint64_t recovered = stats->catchup_recovered_us;
+    check(recovered >= 1700000 && recovered <= 1900000, name, "recovered time");
+    check(stats->latency_us >= 100000 && stats->latency_us < 300000, name, "latency gauge");
+}
+
+
+void test_14()
+{
+    const char *name = "@TEST: simtest: test 14: ";
+    std::cout << name << "** @@Suspended output **" << std::endl;
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    bool suspended = false;
+    NVFallbackDecoder decoder(
+        [&gpu]() { return new SimDecoder(gpu); },
+        [&cpu]() { return new SimDecoder(cpu); },
+        stats, 500, -1); // no retries
+    decoder.setSuspended([&suspended]() { return suspended; });
+
+    int emitted = 0;
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    auto feed = [&](unsigned slice_type) {
+        f.h264_pars.slice_type = slice_type;
+        decoder.input(&f);
+        if (decoder.pull())
+        {
+            emitted++;
+            decoder.releaseOutput();
+        }
+    };
+    feed(H264SliceType::sps);
+    feed(H264SliceType::pps);
+    feed(H264SliceType::i);
+    feed(H264SliceType::pb);
+    check(emitted == 2, name, "output");
+
+    suspended = true;
+    for (int i = 0; i < 5; i++)
+    {
+        feed(H264SliceType::pb);
+    }
+    check(emitted == 2 && gpu.decoded == 7 && gpu.skipped == 5, name, "suspended: decoded without output");
+    check(stats->skipped_frames == 0, name, "counted by the decoder (NVDecoder), not here");
+
+    // switching to the CPU while suspended: the new decoder is suspended too
+    gpu.fail_next = true;
+    feed(H264SliceType::pb);
+    check(!decoder.onGPU() && emitted == 2 && cpu.decoded == 8 && cpu.skipped == 8, name, "suspended over a switch");
+
+    suspended = false;
+    feed(H264SliceType::pb);
+    check(emitted == 3, name, "output right away when resumed");
+}
+
+
+void test_15()
+{
+    const char *name = "@TEST: simtest: test 15: ";
+    std::cout << name << "** @@Decoded pictures kept on the GPU & fetched on demand **" << std::endl;
+
+    SimMemoryDriver driver;
+    NVDriver::set(&driver);
+    CUcontext context = (CUcontext)&driver;
+
+    // a mapped NV12 surface: 64 x 32 picture, pitch 128, chroma after 40 rows
+    const unsigned width = 64, height = 32, pitch = 128, surface_height = 40;
+    std::vector<uint8_t> surface(pitch * (surface_height + height / 2));
+
+    NVResidentFrames resident(3);
+    for (long ts = 100; ts <= 500; ts += 100)
+    {
+        std::fill(surface.begin(), surface.end(), 0);
+        for (unsigned i = 0; i < height; i++)
+        {
+            memset(&surface[i * pitch], (int)(ts / 100), width);
+        }
+        for (unsigned i = 0; i < height / 2; i++)
+        {
+            for (unsigned j = 0; j < width; j += 2)
+            {
+                surface[(surface_height + i) * pitch + j] = 10 + ts / 100;     // U
+                surface[(surface_height + i) * pitch + j + 1] = 20 + ts / 100; // V
+            }
+        }
+        check(resident.store(context, (CUdeviceptr)surface.data(), pitch, width, height, surface_height, ts, 3, 0, 0), name, "picture stored");
+    }
+    check(resident.size() == 3 && driver.allocated == 3, name, "ring of three device copies");
+    check(driver.copies == 10, name, "no host copies while storing");
+
+    std::shared_ptr<AVBitmapFrame> f = resident.fetch(0);
+    check(f && f->mstimestamp == 500 && f->n_slot == 3, name, "newest picture fetched");
+    check(f && f->y_payload[0] == 5 && f->y_payload[(height - 1) * f->bmpars.y_linesize + width - 1] == 5 &&
+              f->u_payload[0] == 15 && f->v_payload[(height / 2 - 1) * f->bmpars.v_linesize + width / 2 - 1] == 25,
+          name, "planes converted");
+    f = resident.fetch(220);
+    check(f && f->mstimestamp == 300, name, "closest picture fetched");
+    check(resident.fetched == 2 && resident.fetch_bytes == 2 * width * (height + height / 2), name, "fetches counted");
+    check(driver.contexts == 0, name, "context popped");
+    f.reset();
+
+    resident.release((CUcontext)&resident); // another decoder's context
+    check(resident.size() == 3, name, "memory of other contexts kept");
+    resident.release(context);
+    check(resident.size() == 0 && driver.freed == 3, name, "device memory freed with the decoder");
+    check(!resident.fetch(0) && resident.misses == 1, name, "nothing to fetch");
+
+    resident.configure(0);
+    check(!resident.enabled(), name, "off");
+
+    // decoding on the CPU: the pictures are kept on the host instead of passed on
+    SimFaults gpu;
+    gpu.refuse = true;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    std::shared_ptr<NVResidentFrames> host = std::make_shared<NVResidentFrames>(2);
+    int copies = driver.copies;
+    {
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            []() { return new SimPictureDecoder(); },
+            stats, 500, -1); // no retries
+        decoder.setResidentFrames(host);
+        BasicFrame p;
+        p.codec_id = AV_CODEC_ID_H264;
+        unsigned types[] = {H264SliceType::sps, H264SliceType::pps, H264SliceType::i, H264SliceType::pb, H264SliceType::pb};
+        int passed = 0;
+        for (int i = 0; i < 5; i++)
+        {
+            p.h264_pars.slice_type = types[i];
+            p.mstimestamp = 1000 + i * 40;
+            decoder.input(&p);
+            passed += decoder.pull() ? 1 : 0;
+        }
+        check(!decoder.onGPU() && passed == 0, name, "CPU pictures not passed on");
+        check(stats->resident_frames == 3 && host->size() == 2, name, "CPU pictures kept on the host");
+        f = host->fetch(0);
+        check(f && f->mstimestamp == 1160, name, "newest CPU picture fetched");
+        f = host->fetch(1100);
+        check(f && f->mstimestamp == 1120 && driver.copies == copies, name, "closest CPU picture fetched without copies");
+        f.reset();
+
+        host->configure(0);
+        check(host->size() == 0, name, "host pictures dropped when off");
+        p.mstimestamp = 1200;
+        decoder.input(&p);
+        check(decoder.pull(), name, "output passed on again when off");
+        decoder.releaseOutput();
+    }
+    NVFramePool::instance().clear();
+    NVDriver::set(NULL);
+}
+
+
+void test_16()
+{
+    const char *name = "@TEST: simtest: test 16: ";
+    std::cout << name << "** @@Playback speed: pacing & thinning out decoding **" << std::endl;
+
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    double speed = 1;
+    NVFallbackDecoder decoder(
+        [&gpu]() { return new SimDecoder(gpu); },
+        [&cpu]() { return new SimDecoder(cpu); },
+        stats, 500, -1); // no retries
+    decoder.setPlaybackSpeed([&speed]() { return speed; });
+    // simulated time: it passes as the packets are fed & decoded
+    NVClock::time_point now;
+    long decode_ms = 0;
+    double feed_speed = 0; // the speed the file is read at.  0: at the playback speed, as fast as possible without one
+    decoder.setPaceClock([&now]() { return now; });
+
+    // 25 fps, GOPs of 10: keyframe, then reference & non-reference pictures in turn
+    int emitted = 0;
+    long ts = 0;
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    auto feed = [&](unsigned slice_type, uint8_t nal) {
+        f.h264_pars.slice_type = slice_type;
+        f.payload = {0, 0, 0, 1, nal, 0};
+        f.mstimestamp = ts;
+        double read_speed = (feed_speed > 0) ? feed_speed : speed;
+        if (read_speed > 0 && slice_type != H264SliceType::sps && slice_type != H264SliceType::pps)
+        {
+            now += std::chrono::milliseconds((long)(40 / read_speed));
+        }
+        decoder.input(&f);
+        int decoded = gpu.decoded;
+        if (decoder.pull())
+        {
+            emitted++;
+            decoder.releaseOutput();
+        }
+        now += std::chrono::milliseconds(decode_ms * (gpu.decoded - decoded));
+    };
+    auto gops = [&](int n) {
+        for (int i = 0; i < n * 10; i++, ts += 40)
+        {
+            if (i % 10 == 0)
+            {
+                feed(H264SliceType::i, 0x65);
+            }
+            else
+            {
+                feed(H264SliceType::pb, (i % 2) ? 0x41 : 0x01);
+            }
+        }
+    };
+    auto elapsed_ms = [&now](NVClock::time_point t0) { return (long)std::chrono::duration_cast<std::chrono::milliseconds>(now - t0).count(); };
+    feed(H264SliceType::sps, 0x67);
+    feed(H264SliceType::pps, 0x68);
+
+    gops(1);
+    check(emitted == 10 && stats->pace_drops == 0, name, "1x: all pictures");
+
+    speed = 4;
+    emitted = 0;
+    gops(2);
+    check(emitted == 12 && stats->scrub_packets == 8, name, "4x: non-reference pictures skipped");
+
+    speed = 16;
+    emitted = 0;
+    gops(4);
+    check(emitted == 4, name, "16x: keyframes only");
+    check(stats->pace_drops == 0, name, "fed at the speed: nothing dropped");
+
+
+    // back to all pictures from the next keyframe on
+    speed = 1;
+    emitted = 0;
+    feed(H264SliceType::pb, 0x41);
+    check(emitted == 0, name, "slower: waits for a keyframe");
+    ts += 40;
+    gops(1);
+    check(emitted == 10, name, "slower: all pictures from the keyframe on");
+
+    // read twice as fast as played: every other picture is dropped, without waiting
+    feed_speed = 2;
+    emitted = 0;
+    int decoded = gpu.decoded, skipped = gpu.skipped;
+    NVClock::time_point t0 = now;
+    gops(1);
+    check(emitted == 5 && stats->pace_drops == 5, name, "too fast: every other picture passed on");
+    check(gpu.decoded - decoded == 6 && gpu.skipped - skipped == 1, name, "too fast: references decoded without output, others not at all");
+    check(elapsed_ms(t0) == 10 * 20, name, "too fast: no waiting");
+    feed_speed = 0;
+
+    // decoding can't keep up with 2x: it's thinned out
+    speed = 2;
+    decode_ms = 100;
+    uint64_t scrubbed = stats->scrub_packets;
+    gops(2);
+    check(stats->scrub_packets > scrubbed, name, "too slow for the speed: cheaper decoding");
+    decode_ms = 0;
+
+    // off in the middle of a GOP: all pictures, without pacing, from the next keyframe on
+    speed = 0;
+    emitted = 0;
+    scrubbed = stats->scrub_packets;
+    feed(H264SliceType::pb, 0x01);
+    ts += 40;
+    check(emitted == 0 && stats->scrub_packets == scrubbed + 1, name, "off: waits for a keyframe");
+    gops(1);
+    check(emitted == 10 && stats->pace_drops == 5, name, "off: all pictures, however fast");
+}
+
+
+void test_17()
+{
+    const char *name = "@TEST: simtest: test 17: ";
+    std::cout << name << "** @@Reverse playback in bounded chunks **" << std::endl;
+
+    // 3: as a stream with B-frames, the last pictures of a pass come out only at the end of stream
+    for (int delay : {0, 3})
+    {
+        TimestampFrameFilter out;
+        NVReversePlayer player("player", out, [delay]() { return delay ? new SimDelayDecoder(delay) : new SimParserDecoder(); }, 12); // chunks of 4 frames
+
+        // 3 GOPs of 10 pictures, 40 ms apart
+        BasicFrame f;
+        f.codec_id = AV_CODEC_ID_H264;
+        f.payload.assign(1, 0); // an empty packet would end the stream
+        f.mstimestamp = 0;
+        f.h264_pars.slice_type = H264SliceType::pb;
+        player.addPacket(&f); // before the first keyframe: dropped
+        for (int i = 0; i < 30; i++)
+        {
+            f.mstimestamp = 1000 + i * 40;
+            if (i % 10 == 0)
+            {
+                f.h264_pars.slice_type = H264SliceType::sps;
+                player.addPacket(&f);
+                f.h264_pars.slice_type = H264SliceType::pps;
+                player.addPacket(&f);
+                f.h264_pars.slice_type = H264SliceType::i;
+                player.addPacket(&f);
+                player.addPacket(&f); // another slice of the keyframe
+            }
+            else
+            {
+                f.h264_pars.slice_type = H264SliceType::pb;
+                player.addPacket(&f);
+            }
+        }
+        check(player.getGops() == 3, name, "GOPs indexed");
+
+        auto wait = [&]() {
+            for (int i = 0; i < 500 && player.isPlaying(); i++)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+            }
+        };
+        auto descending = [](long from, long to) {
+            std::vector<long> ts;
+            for (long t = from; t >= to; t -= 40)
+            {
+                ts.push_back(t);
+            }
+            return ts;
+        };
+
+        // pictures come out one access unit late at least: the last ones of each pass at the end of stream
+        player.play(0, 0);
+        wait();
+        check(!player.isPlaying() && out.timestamps == descending(1000 + 29 * 40, 1000), name, "all pictures backwards, each once");
+        check(player.peak_frames <= 12 && player.held == 0, name, "memory bounded");
+        check(player.gop_passes == 9 && player.played_frames == 30, name, "GOPs decoded in chunks");
+
+        out.timestamps.clear();
+        player.play(1000 + 15 * 40, 0);
+        wait();
+        check(out.timestamps == descending(1000 + 15 * 40, 1000), name, "backwards from a timestamp");
+
+        out.timestamps.clear();
+        NVClock::time_point t0 = NVClock::now();
+        player.play(0, 10);
+        wait();
+        uint64_t ms = NVusSince(t0) / 1000;
+        check(out.timestamps.size() == 30 && ms >= 100 && ms < 400, name, "paced at 10x");
+
+        player.play(0, 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        player.stop();
+        check(!player.isPlaying() && player.held == 0, name, "stopped: frames released");
+    }
+    NVFramePool::instance().clear();
+}
+
+
+void test_18()
+{
+    const char *name = "@TEST: simtest: test 18: ";
+    std::cout << name << "** @@Keyframe index with thumbnails **" << std::endl;
+
+    SimParserDecoder *decoder = new SimParserDecoder();
+    decoder->broken = 1400;
+    int created = 0;
+    NVKeyframeIndexer indexer("indexer", [&]() { created++; return decoder; }, 16, 8);
+    const char *index_file = "/tmp/simtest_18.idx";
+    check(indexer.begin(index_file), name, "index file started");
+
+    // 4 GOPs of 10 pictures, 40 ms apart, keyframes of two slices
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    f.payload.assign(1, 0); // an empty packet would end the stream
+    for (int i = 0; i < 40; i++)
+    {
+        f.mstimestamp = 1000 + i * 40;
+        uint64_t offset = 1000 * i;
+        if (i % 10 == 0)
+        {
+            f.h264_pars.slice_type = H264SliceType::sps;
+            indexer.addPacket(&f, offset);
+            f.h264_pars.slice_type = H264SliceType::pps;
+            indexer.addPacket(&f, offset);
+            f.h264_pars.slice_type = H264SliceType::i;
+            indexer.addPacket(&f, offset);
+            indexer.addPacket(&f, offset);
+        }
+        else
+        {
+            f.h264_pars.slice_type = H264SliceType::pb;
+            indexer.addPacket(&f, offset);
+        }
+    }
+    check(indexer.end(), name, "index file written");
+    check(created == 1 && indexer.keyframes == 4 && indexer.skipped_packets == 36, name, "only keyframes decoded");
+    check(indexer.thumbnails == 3, name, "last keyframe pushed out of the decoder");
+
+    NVKeyframeIndex index;
+    check(index.open(index_file) && index.size() == 4, name, "index mapped");
+    check(index.getThumbnailWidth() == 16 && index.getThumbnailHeight() == 8, name, "thumbnail size");
+    check(index.getTimestamp(2) == 1800 && index.getOffset(2) == 20000, name, "timestamp & offset");
+    check(index.find(999) == -1 && index.find(1000) == 0 && index.find(1799) == 1 && index.find(5000) == 3, name, "seek");
+    const uint8_t *thumb = index.getThumbnailData(2);
+    check(thumb && thumb[0] == 1800 / 40 && thumb[16 * 8 - 1] == 1800 / 40, name, "thumbnail scaled");
+    check(index.getThumbnailData(1) == NULL && index.getThumbnailData(3) != NULL, name, "undecodable keyframe has no thumbnail");
+
+    NVKeyframeIndex bad;
+    check(!bad.open("/tmp/simtest_18_missing.idx") && bad.size() == 0, name, "missing index");
+    index.close();
+    unlink(index_file);
+    NVFramePool::instance().clear();
+}
+
+void test_19()
+{
+    const char *name = "@TEST: simtest: test 19: ";
+    std::cout << name << "** @@Packet capture & replay **" << std::endl;
+
+    const char *capture_file = "/tmp/simtest_19.cap";
+    CollectingFrameFilter passed;
+    NVCaptureFrameFilter capture("capture", capture_file, &passed);
+    check(capture.isOk(), name, "capture file open");
+
+    // 2 cameras, 20 packets each, 5 ms apart
+    SetupFrame setup;
+    setup.sub_type = SetupFrameType::stream_init;
+    setup.media_type = MediaType::video;
+    setup.codec_id = AV_CODEC_ID_H264;
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    f.subsession_index = 0;
+    for (int slot = 1; slot <= 2; slot++)
+    {
+        setup.n_slot = slot;
+        capture.run(&setup);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        for (int slot = 1; slot <= 2; slot++)
+        {
+            f.n_slot = slot;
+            f.mstimestamp = NVmsNow() - 100; // from a camera 100 ms behind
+            f.payload.assign(3 + i + slot, (uint8_t)i); // odd & even lengths
+            f.payload[0] = 0;
+            f.payload[1] = 0;
+            f.payload[2] = 1;
+            f.fillH264Pars();
+            capture.run(&f);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    check(passed.frames.size() == 40 && passed.setups == 2, name, "frames go on to next");
+    check(capture.getRecords() == 42, name, "frames recorded");
+    capture.close();
+    capture.run(&f);
+    check(capture.getRecords() == 42, name, "nothing recorded after close");
+
+    CollectingFrameFilter out;
+    NVCaptureReplay replay("replay", out);
+    check(replay.open(capture_file) && replay.getRecords() == 42 && replay.getMaxSlot() == 2, name, "capture mapped");
+
+    auto wait = [&]() {
+        for (int i = 0; i < 500 && replay.isPlaying(); i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    };
+    replay.play(0, 3);
+    wait();
+    bool same = (out.frames.size() == 120 && out.setups == 6);
+    std::vector<int> per_slot(9, 0);
+    for (size_t i = 0; same && i < out.frames.size(); i++)
+    {
+        const BasicFrame &a = out.frames[i];
+        const BasicFrame &b = passed.frames[i / 3];
+        same = (a.n_slot == b.n_slot + (i % 3) * 3 && a.payload == b.payload && a.h264_pars.slice_type == b.h264_pars.slice_type);
+        per_slot[a.n_slot]++;
+    }
+    check(same, name, "fan-out to 3 copies");
+    check(per_slot[1] == 20 && per_slot[8] == 20 && per_slot[3] == 0 && per_slot[6] == 0, name, "slots of the copies");
+    long lag = NVmsNow() - out.frames[0].mstimestamp;
+    check(lag >= 90 && lag < 200 && out.frames[0].mstimestamp - passed.frames[0].mstimestamp == out.frames[2].mstimestamp - passed.frames[0].mstimestamp,
+          name, "timestamps shifted to now, keeping the lag");
+
+    out.frames.clear();
+    out.times.clear();
+    NVClock::time_point t0 = NVClock::now();
+    replay.play(1, 1);
+    wait();
+    long ms = (long)(std::chrono::duration_cast<std::chrono::milliseconds>(out.times.back() - t0).count());
+    check(out.frames.size() == 40 && ms >= 90 && ms < 300, name, "real time");
+
+    out.frames.clear();
+    out.times.clear();
+    t0 = NVClock::now();
+    replay.play(4, 1);
+    wait();
+    ms = (long)(std::chrono::duration_cast<std::chrono::milliseconds>(out.times.back() - t0).count());
+    check(out.frames.size() == 40 && ms >= 20 && ms < 90, name, "4x");
+
+    replay.close();
+    // a capture cut short in the middle of the last payload
+    struct stat st;
+    stat(capture_file, &st);
+    check(truncate(capture_file, st.st_size - 10) == 0 && replay.open(capture_file) && replay.getRecords() == 41, name, "cut short");
+    replay.close();
+    unlink(capture_file);
+}
+
+void test_20()
+{
+    const char *name = "@TEST: simtest: test 20: ";
+    std::cout << name << "** @@Synthetic camera load & sweep **" << std::endl;
+
+    SimEngine engine(2, 50); // at most 500 pictures per second
+    std::vector<std::pair<int, long>> seen; // of the targets deleted
+    NVLoadGenerator generator("generator", [&](int n_slot, FrameFilter &outfilter) {
+        return new SimLoadTarget(engine, outfilter, seen);
+    });
+    generator.setSeed(1);
+    generator.setThresholds(200, 0.01);
+
+    // 25 fps, GOPs of 10: 400 ms, 10 GOPs.  The last payload byte is the GOP
+    int clip = generator.newClip();
+    BasicFrame f;
+    f.codec_id = AV_CODEC_ID_H264;
+    f.mstimestamp = 0;
+    f.h264_pars.slice_type = H264SliceType::pb;
+    generator.addPacket(clip, &f); // before the first parameter set: dropped
+    for (int i = 0; i < 100; i++)
+    {
+        f.mstimestamp = 1000 + i * 40;
+        f.payload = {0, 0, 0, 1, (uint8_t)(i / 10)};
+        if (i % 10 == 0)
+        {
+            f.h264_pars.slice_type = H264SliceType::sps;
+            generator.addPacket(clip, &f);
+            f.h264_pars.slice_type = H264SliceType::pps;
+            generator.addPacket(clip, &f);
+            f.h264_pars.slice_type = H264SliceType::i;
+        }
+        else
+        {
+            f.h264_pars.slice_type = H264SliceType::pb;
+        }
+        generator.addPacket(clip, &f);
+    }
+
+    generator.setTimestampShift(5000);
+    check(generator.runLoad(8, 1000, 500), name, "8 slots: within the thresholds");
+    std::vector<NVLoadResult> results = generator.getResults();
+    check(results.size() == 1 && std::abs(results[0].input_fps - 200) < 20 && results[0].mean_latency_ms < 50, name, "8 slots: 25 fps each, latency without the shifts");
+    std::vector<int> gops;
+    bool shifted = false;
+    for (auto s : seen)
+    {
+        gops.push_back(s.first);
+        shifted = shifted || std::abs(s.second - NVmsNow()) > 100;
+    }
+    std::sort(gops.begin(), gops.end());
+    check(seen.size() == 8 && std::unique(gops.begin(), gops.end()) - gops.begin() > 2, name, "random phases");
+    check(shifted, name, "timestamps shifted");
+
+    generator.setTimestampShift(0);
+    int max_slots = generator.sweepLoad(4, 4, 40, 700, 500);
+    results = generator.getResults();
+    std::cout << name << "sweep: " << max_slots << " slots at most" << std::endl;
+    for (auto r : results)
+    {
+        std::cout << name << r.n_slots << " slots: input " << r.input_fps << " fps, output " << r.output_fps << " fps, latency "
+                  << r.mean_latency_ms << " ms (max " << r.max_latency_ms << "), drops " << r.drop_ratio << std::endl;
+    }
+    check(max_slots >= 12 && max_slots <= 20, name, "sweep stops at the engine's capacity");
+    check(!results.back().ok && results.size() == (size_t)max_slots / 4 + 1, name, "sweep ends at the first run over");
+
+    // from python: the GIL is released while running, so that another thread can stop the run
+    if (!Py_IsInitialized())
+    {
+        Py_Initialize();
+    }
+    std::thread stopper([&generator]() {
+        PyGILState_STATE gil = PyGILState_Ensure(); // as a python thread would
+        PyGILState_Release(gil);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        generator.stop();
+    });
+    NVClock::time_point t0 = NVClock::now();
+    check(!generator.run(4, 10000, 500), name, "stopped run is not ok");
+    stopper.join();
+    check(NVusSince(t0) < 3000000, name, "run stopped from another thread");
+}
+
+
+void test_21()
+{
+    const char *name = "@TEST: simtest: test 21: ";
+    std::cout << name << "** @@Decoder statistics folded per slot **" << std::endl;
+
+    if (!Py_IsInitialized())
+    {
+        Py_Initialize();
+    }
+    NVStatsRegistry registry;
+    SimFaults gpu, cpu;
+    gpu.refuse = true; // frames are counted by the wrapper on the CPU
+    BasicFrame f;
+    f.n_slot = 2;
+    f.payload.resize(1000);
+
+    // slot 2 gets a new decoder for each connection: the stats of the first one are retired
+    std::shared_ptr<NVSlotStats> live;
+    for (int connection = 0; connection < 2; connection++)
+    {
+        std::shared_ptr<NVSlotStats> stats = registry.newSlot();
+        stats->n_slot = 2;
+        live = stats;
+        NVFallbackDecoder decoder(
+            [&gpu]() { return new SimDecoder(gpu); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        for (int i = 0; i < 6; i++)
+        {
+            f.h264_pars.slice_type = (i == 0) ? H264SliceType::sps : (i == 1) ? H264SliceType::pps : (i == 2) ? H264SliceType::i : H264SliceType::pb;
+            f.mstimestamp = i;
+            decoder.input(&f);
+            if (decoder.pull())
+            {
+                decoder.releaseOutput();
+            }
+        }
+        stats->parse_time.add(100 * (connection + 1));
+        stats->submit_queue = 4; // gauges left behind when the first connection closes
+        stats->completion_queue = 3;
+    }
+    live->latency_us = 1000;
+    live->submit_queue = 0;
+    live->completion_queue = 2;
+    // a decoder that has not seen any packets
+    std::shared_ptr<NVSlotStats> waiting = registry.newSlot();
+    registry.decoders_created += 3;
+
+    PyObject *dic = registry.getStats();
+    PyObject *slots = PyDict_GetItemString(dic, "slots");
+    PyObject *key = PyLong_FromLong(2);
+    PyObject *slot = slots ? PyDict_GetItem(slots, key) : NULL;
+    Py_DECREF(key);
+    check(slot && PyDict_Size(slots) == 1, name, "one slot, the decoder without packets left out");
+    check(slot && pyNumber(slot, "input_packets") == 12 && pyNumber(slot, "input_bytes") == 12000, name, "retired & live decoders summed");
+    check(slot && pyNumber(slot, "emitted_frames") == 8, name, "frames of both connections");
+    check(slot && pyNumber(slot, "first_frame_ms") > 0, name, "time to first frame");
+    check(slot && pyNumber(slot, "parse_us_avg") == 150 && pyNumber(slot, "parse_us_max") == 200, name, "stage times averaged & max");
+    check(slot && pyNumber(slot, "latency_ms") == 1 && pyNumber(slot, "completion_queue") == 2 && pyNumber(slot, "submit_queue") == 0, name, "gauges of the live decoder only");
+    check(pyNumber(dic, "emitted_frames") == 8 && pyNumber(dic, "decoders_created") == 3, name, "totals");
+    check(pyNumber(dic, "output_fps") > 0, name, "rate over the first interval");
+    Py_DECREF(dic);
+
+    dic = registry.getStats();
+    check(pyNumber(dic, "emitted_frames") == 8 && pyNumber(dic, "output_fps") == 0, name, "no new frames: zero rate");
+    Py_DECREF(dic);
+}
+
+/** A SimDecoder with an NVDEC session that NVDecoderPool can park */
+class SimPooledDecoder : public SimDecoder, public NVPooledSession
+{
+public:
+    SimPooledDecoder(SimFaults &faults, int gpu_index, unsigned max_width, unsigned max_height) : SimDecoder(faults), owner(NULL), parked(false)
+    {
+        key.gpu_index = gpu_index;
+        key.codec_id = AV_CODEC_ID_H264;
+        key.chroma_format = cudaVideoChromaFormat_420;
+        key.bit_depth_minus8 = 0;
+        key.max_width = max_width;
+        key.max_height = max_height;
+        key.shared_context = false;
+    }
+
+public:
+    NVSessionKey key;
+    const void *owner;
+    bool parked;
+
+public:
+    virtual bool getSessionKey(NVSessionKey &key)
+    {
+        key = this->key;
+        return ok;
+    }
+    virtual bool park(const void *holder)
+    {
+        parked = true;
+        return true;
+    }
+    virtual void reuse(const void *owner)
+    {
+        this->owner = owner;
+        parked = false;
+    }
+};
+
+
+void test_22()
+{
+    const char *name = "@TEST: simtest: test 22: ";
+    std::cout << name << "** @@Pooling decoder sessions over reconnects **" << std::endl;
+
+    if (!Py_IsInitialized())
+    {
+        Py_Initialize();
+    }
+    SimDriver driver(2, 8 * GB);
+    NVDeviceRegistry registry(&driver);
+    NVDecoderPool pool(&registry);
+    pool.configure(2, 60000);
+    SimFaults faults;
+    int camera_a, camera_b;
+
+    SimPooledDecoder *decoder = new SimPooledDecoder(faults, 1, 1920, 1088);
+    pool.giveBack(decoder);
+    check(decoder->parked && faults.destroyed == 0, name, "healthy session parked");
+    check(pool.lease(AV_CODEC_ID_HEVC, 1, 0, 0, false, &camera_a) == NULL, name, "other codec: no match");
+    check(pool.lease(AV_CODEC_ID_H264, 0, 0, 0, false, &camera_a) == NULL, name, "other GPU: no match");
+    check(pool.lease(AV_CODEC_ID_H264, 1, 3840, 2160, false, &camera_a) == NULL, name, "larger max size: no match");
+    Decoder *leased = pool.lease(AV_CODEC_ID_H264, 1, 1280, 720, false, &camera_a);
+    check(leased == decoder && decoder->owner == &camera_a && !decoder->parked, name, "smaller max size: reused by the new owner");
+    pool.giveBack(leased);
+    check(pool.lease(AV_CODEC_ID_H264, 1, 0, 0, true, &camera_a) == NULL, name, "other kind of context: no match");
+    leased = pool.lease(AV_CODEC_ID_H264, 1, 0, 0, false, &camera_a);
+
+    // gpu_index -1: the GPU that the registry would choose
+    long id;
+    registry.acquire(&camera_b, 0, id);
+    registry.update(id, NVMacroblockRate(1920, 1088, 25, 1));
+    pool.giveBack(leased);
+    check(pool.lease(AV_CODEC_ID_H264, -1, 0, 0, false, &camera_b) == decoder, name, "automatic placement picks the session on the idle GPU");
+    registry.release(id);
+
+    decoder->ok = false;
+    pool.giveBack(decoder);
+    check(faults.destroyed == 1, name, "failed session deleted");
+
+    for (int i = 0; i < 3; i++)
+    {
+        pool.giveBack(new SimPooledDecoder(faults, 0, 1920, 1088));
+    }
+    check(faults.destroyed == 2, name, "oldest session evicted beyond max_idle");
+    PyObject *dic = pool.getPyStats();
+    check(pyNumber(dic, "idle") == 2 && pyNumber(dic, "hits") == 3 && pyNumber(dic, "misses") == 4 && pyNumber(dic, "evictions") == 1,
+          name, "counters");
+    Py_DECREF(dic);
+
+    pool.configure(0, 60000);
+    check(faults.destroyed == 4, name, "disabled pool deletes the idle sessions");
+    pool.giveBack(new SimPooledDecoder(faults, 0, 1920, 1088));
+    check(faults.destroyed == 5, name, "disabled pool deletes what is given back");
+}
+
+
+/** Counts the frames & the writes that overlapped, as a filter that is not thread safe would break */
+class OverlapFrameFilter : public FrameFilter
+{
+public:
+    OverlapFrameFilter() : FrameFilter("overlap"), inside(0), overlaps(0), frames(0), setups(0) {}
+    std::atomic<int> inside, overlaps;
+    std::atomic<long> frames, setups;
+
+protected:
+    void go(Frame *frame)
+    {
+        if (inside.fetch_add(1) > 0)
+        {
+            overlaps++;
+        }
+        if (frame->getFrameType() == FrameType::setupframe)
+        {
+            setups++;
+        }
+        else
+        {
+            frames++;
+        }
+        std::this_thread::yield();
+        inside--;
+    }
+};
+
+
+/** Passes its frames on from a worker thread, as NVDecoder with completion workers: pull never returns a frame */
+class SimAsyncDecoder : public SimDecoder, public NVOutputNotifier
+{
+public:
+    SimAsyncDecoder(SimFaults &faults, FrameFilter &outfilter) : SimDecoder(faults), outfilter(outfilter) {}
+
+public:
+    FrameFilter &outfilter;
+    std::function<void()> on_emit;
+
+public:
+    virtual void setOnEmit(std::function<void()> on_emit) { this->on_emit = on_emit; }
+    virtual bool pull()
+    {
+        if (!SimDecoder::pull())
+        {
+            return false;
+        }
+        std::thread worker([this]() {
+            outfilter.run(&out_frame);
+            faults.emitted++;
+            if (on_emit)
+            {
+                on_emit();
+            }
+        });
+        worker.join();
+        return false;
+    }
+};
+
+
+/** A decoder with completion workers, as NVDecoder: the parser queues the pictures & the workers map the surfaces of the
+ * current cuvid decoder, download them & pass them on in order.  The payload size is the coded width: a new width destroys
+ * the cuvid decoder & creates a new one, once the workers are done with it.  An empty packet ends the stream
+ */
+class SimPipelinedDecoder : public Decoder
+{
+public:
+    SimPipelinedDecoder(FrameFilter &outfilter, int n_workers) : outfilter(outfilter), queue(8), width(0), generation(0), stale_maps(0), running(true)
+    {
+        for (int i = 0; i < n_workers; i++)
+        {
+            workers.push_back(std::thread(&SimPipelinedDecoder::work, this));
+        }
+    }
+    virtual ~SimPipelinedDecoder()
+    {
+        running = false;
+        order.stop();
+        for (auto it = workers.begin(); it != workers.end(); ++it)
+        {
+            it->join();
+        }
+    }
+
+public:
+    struct Picture
+    {
+        int generation;
+        unsigned width;
+        long mstimestamp;
+        uint64_t sequence;
+    };
+    FrameFilter &outfilter;
+    NVBoundedQueue<Picture> queue;
+    NVEmitOrder order;
+    unsigned width;
+    std::atomic<int> generation;    ///< of the cuvid decoder
+    std::atomic<int> stale_maps;    ///< surfaces mapped from a destroyed decoder
+    std::atomic<bool> running;
+    std::vector<std::thread> workers;
+
+public:
+    virtual Frame *output() { return NULL; }
+    virtual void flush() {}
+    virtual bool isOk() { return true; }
+    virtual void releaseOutput() {}
+    virtual bool pull()
+    {
+        if (in_frame.payload.empty())
+        {
+            order.drain();
+            return false;
+        }
+        if (in_frame.payload.size() != width) // sequenceCallback
+        {
+            order.drain();
+            generation++;
+            width = in_frame.payload.size();
+        }
+        Picture pic = {generation.load(), width, in_frame.mstimestamp, order.next()};
+        while (!queue.push(pic))
+        {
+            sleep_for(std::chrono::microseconds(100));
+        }
+        order.submit();
+        return false;
+    }
+
+private:
+    void work()
+    {
+        Picture pic;
+        while (running)
+        {
+            if (!queue.pop(pic))
+            {
+                sleep_for(std::chrono::microseconds(100));
+                continue;
+            }
+            // mapped & downloaded
+            for (int i = 0; i < 3; i++)
+            {
+                if (pic.generation != generation)
+                {
+                    stale_maps++;
+                }
+                sleep_for(std::chrono::microseconds(300));
+            }
+            std::shared_ptr<AVBitmapFrame> f = NVFramePool::instance().lease(pic.width, 16);
+            f->mstimestamp = pic.mstimestamp;
+            std::unique_lock<std::mutex> lk = order.turn(pic.sequence);
+            if (!running)
+            {
+                break;
+            }
+            outfilter.run(f.get());
+            order.done(lk);
+        }
+    }
+};
+
+
+/** Collects the width & timestamp of the frames */
+class SizeFrameFilter : public FrameFilter
+{
+public:
+    SizeFrameFilter() : FrameFilter("sizes") {}
+    std::vector<std::pair<int, long>> frames;
+
+protected:
+    void go(Frame *frame)
+    {
+        frames.push_back(std::make_pair(static_cast<AVBitmapFrame *>(frame)->bmpars.width, frame->mstimestamp));
+    }
+};
+
+
+void test_23()
+{
+    const char *name = "@TEST: simtest: test 23: ";
+    std::cout << name << "** @@Completion workers & the decoding thread sharing the outfilter **" << std::endl;
+
+    OverlapFrameFilter sink;
+    NVSerialFilter serial("serial", &sink);
+    SetupFrame setup;
+    setup.sub_type = SetupFrameType::stream_init;
+    BasicFrame audio;
+    audio.media_type = MediaType::audio;
+
+    // three workers write video frames while the decoding thread writes setup & audio frames
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 3; i++)
+    {
+        workers.push_back(std::thread([&serial]() {
+            BasicFrame video;
+            video.media_type = MediaType::video;
+            for (int n = 0; n < 500; n++)
+            {
+                serial.run(&video);
+            }
+        }));
+    }
+    for (int n = 0; n < 100; n++)
+    {
+        serial.run(&setup);
+        serial.run(&audio);
+    }
+    for (auto it = workers.begin(); it != workers.end(); ++it)
+    {
+        it->join();
+    }
+    check(sink.overlaps == 0, name, "writes serialized");
+    check(sink.frames == 3 * 500 + 100 && sink.setups == 100, name, "all frames passed on");
+
+    // frames passed on by the decoder's own threads are timed as the ones from releaseOutput
+    SimFaults gpu, cpu;
+    std::shared_ptr<NVSlotStats> stats = std::make_shared<NVSlotStats>();
+    std::shared_ptr<NVGopCache> gop = std::make_shared<NVGopCache>();
+    bool decoding = true;
+    std::atomic<bool> streaming(true);
+    std::thread audio_thread([&serial, &audio, &streaming]() {
+        while (streaming)
+        {
+            serial.run(&audio);
+            std::this_thread::yield();
+        }
+    });
+    {
+        NVFallbackDecoder decoder(
+            [&gpu, &serial]() { return new SimAsyncDecoder(gpu, serial); },
+            [&cpu]() { return new SimDecoder(cpu); },
+            stats);
+        decoder.setGopCache(gop);
+        decoder.setStandby([&decoding]() { return !decoding; });
+        BasicFrame f;
+        f.codec_id = AV_CODEC_ID_H264;
+        unsigned types[] = {H264SliceType::sps, H264SliceType::pps, H264SliceType::i, H264SliceType::pb};
+        for (int i = 0; i < 4; i++)
+        {
+            f.h264_pars.slice_type = types[i];
+            f.mstimestamp = i;
+            decoder.input(&f);
+            check(!decoder.pull(), name, "no output from pull");
+        }
+        check(gpu.emitted == 2 && stats->first_frame_us > 0, name, "first frame timed");
+        check(stats->join_us == 0, name, "no join yet");
+
+        decoding = false;
+        for (int i = 4; i < 6; i++)
+        {
+            f.mstimestamp = i;
+            decoder.input(&f);
+            decoder.pull();
+        }
+        decoding = true;
+        f.mstimestamp = 6;
+        decoder.input(&f);
+        decoder.pull();
+        check(gpu.emitted == 3 && gpu.skipped > 0, name, "newest picture of the join passed on");
+        check(stats->gop_joins == 1 && stats->join_us > 0, name, "join timed");
+    }
+    streaming = false;
+    audio_thread.join();
+    check(sink.overlaps == 0, name, "writes serialized with the decoder");
+
+    // the resolution changes under two completion workers
+    SizeFrameFilter sizes;
+    std::vector<std::pair<int, long>> expected;
+    {
+        SimPipelinedDecoder decoder(sizes, 2);
+        BasicFrame f;
+        for (int i = 0; i < 60; i++)
+        {
+            int width = (i < 20) ? 64 : (i < 40) ? 128 : 96;
+            f.payload.assign(width, 0);
+            f.mstimestamp = i;
+            decoder.input(&f);
+            decoder.pull();
+            expected.push_back(std::make_pair(width, (long)i));
+        }
+        f.payload.clear(); // end of stream: all pictures out
+        decoder.input(&f);
+        decoder.pull();
+        check(decoder.generation == 3 && decoder.stale_maps == 0, name, "new size: the workers were done with the old decoder");
+        check(sizes.frames == expected, name, "new size: all pictures in order, each at its size");
+    }
+    NVFramePool::instance().clear();
+}
+
+/** A "file" of one GOP: sps, pps & pictures 40 ms apart.  The number of pictures is the file name */
+class SimPacketReader : public NVPacketReader
+{
+public:
+    SimPacketReader(const char *filename, int n_slot) : n_slot(n_slot), pictures(atoi(filename)), next(0) {}
+    int n_slot, pictures, next;
+
+public:
+    virtual bool isOk() { return pictures > 0; }
+    virtual bool read(BasicFrame &f)
+    {
+        if (next >= pictures + 2)
+        {
+            return false;
+        }
+        unsigned types[] = {H264SliceType::sps, H264SliceType::pps, H264SliceType::i};
+        f.payload.assign(1, 0);
+        f.codec_id = AV_CODEC_ID_H264;
+        f.n_slot = n_slot;
+        f.h264_pars.slice_type = (next < 3) ? types[next] : (unsigned)H264SliceType::pb;
+        f.mstimestamp = 1000 + std::max(0, next - 2) * 40;
+        next++;
+        return true;
+    }
+};
+
+
+/** Collects the slot & timestamp of the frames */
+class SlotFrameFilter : public FrameFilter
+{
+public:
+    SlotFrameFilter() : FrameFilter("slots") {}
+    std::mutex mutex;
+    std::vector<std::pair<int, long>> frames;
+
+protected:
+    void go(Frame *frame)
+    {
+        std::unique_lock<std::mutex> lk(mutex);
+        frames.push_back(std::make_pair((int)frame->n_slot, frame->mstimestamp));
+    }
+};
+
+
+void test_24()
+{
+    const char *name = "@TEST: simtest: test 24: ";
+    std::cout << name << "** @@Batch decoding of files **" << std::endl;
+
+    if (!Py_IsInitialized())
+    {
+        Py_Initialize();
+    }
+    for (int run = 0; run < 4; run++)
+    {
+        int n_sessions = 1 + run % 2;
+        int delay = (run < 2) ? 0 : 2; // as a stream with B-frames: the last pictures come out at the end of the file
+        SlotFrameFilter out;
+        NVBatchDecoder batch("batch", out, [delay]() { return delay ? new SimDelayDecoder(delay) : new SimParserDecoder(); },
+                             [](const char *filename, int n_slot) { return new SimPacketReader(filename, n_slot); }, n_sessions);
+        const char *files[] = {"5", "3", "missing", "4"};
+        for (int i = 0; i < 4; i++)
+        {
+            check(batch.addFile(files[i]) == i + 1, name, "slot of the file");
+        }
+        batch.startCall();
+        check(batch.wait(2000), name, "all files done");
+
+        std::vector<std::pair<int, long>> expected;
+        for (int n_slot : {1, 2, 4})
+        {
+            for (int i = 0; i < atoi(files[n_slot - 1]); i++)
+            {
+                expected.push_back(std::make_pair(n_slot, 1000L + i * 40));
+            }
+        }
+        std::vector<std::pair<int, long>> frames = out.frames;
+        if (n_sessions > 1)
+        {
+            std::stable_sort(frames.begin(), frames.end(), [](const std::pair<int, long> &a, const std::pair<int, long> &b) { return a.first < b.first; });
+        }
+        check(frames == expected, name, (n_sessions > 1) ? "sessions: each picture once, with the slot of its file" : "each picture once, with the slot of its file");
+
+        PyObject *dic = batch.getStats();
+        check(pyNumber(dic, "files_done") == 3 && pyNumber(dic, "files_failed") == 1 && pyNumber(dic, "files_queued") == 0, name, "files counted");
+        check(pyNumber(dic, "sessions") == n_sessions, name, "sessions");
+        Py_DECREF(dic);
+        batch.stopCall();
+    }
+    NVFramePool::instance().clear();
+}
+
+void test_25()
+{
+    const char *name = "@TEST: simtest: test 25: ";
+    std::cout << name << "** @@Size changes reconfigure or recreate the decoder & pooled sessions are readmitted **" << std::endl;
+
+    CUVIDDECODECAPS caps;
+    memset(&caps, 0, sizeof(caps));
+    caps.nMaxWidth = 4096;
+    caps.nMaxHeight = 4096;
+    caps.nMaxMBCount = (4096 / 16) * (2304 / 16);
+
+    // setMaxSize(1920, 1088), first sequence 720p
+    unsigned max_width = 1920, max_height = 1088;
+    NVDecoderMaxSize(caps, 1280, 720, max_width, max_height);
+    check(max_width == 1920 && max_height == 1088, name, "created with the max size");
+    check(NVReconfigurable(1920, 1088, max_width, max_height) && NVReconfigurable(640, 360, max_width, max_height), name, "within the max size: reconfigured");
+    check(!NVReconfigurable(2560, 1440, max_width, max_height) && !NVReconfigurable(1088, 1920, max_width, max_height), name, "beyond the max size: recreated");
+
+    // no max size: the decoder grows with the stream
+    max_width = max_height = 0;
+    NVDecoderMaxSize(caps, 1280, 720, max_width, max_height);
+    check(max_width == 1280 && max_height == 720 && !NVReconfigurable(1920, 1088, max_width, max_height), name, "no max size: a larger sequence recreates");
+    NVDecoderMaxSize(caps, 1920, 1088, max_width, max_height);
+    check(max_width == 1920 && max_height == 1088, name, "recreated at the new size");
+
+    // a max size within the caps' width & height, but not their macroblock count
+    max_width = max_height = 4096;
+    NVDecoderMaxSize(caps, 1920, 1088, max_width, max_height);
+    check(max_width == 1920 && max_height == 1088, name, "max size beyond the macroblock count: the sequence's size");
+    max_width = 8192;
+    max_height = 1088;
+    NVDecoderMaxSize(caps, 1920, 1088, max_width, max_height);
+    check(max_width == 4096 && max_height == 1088, name, "max size beyond the caps: clamped");
+
+    // room for one 1080p stream
+    SimDriver driver(1, 8 * GB);
+    NVDeviceRegistry registry(&driver);
+    registry.setAdmission(0.9, 250000);
+    double mbps = NVMacroblockRate(1920, 1088, 25, 1);
+    long id_a, id_b;
+    int owner_a, owner_b, pool;
+    registry.acquire(&owner_a, -1, id_a);
+    check(registry.admit(id_a, mbps), name, "first session admitted");
+    registry.reassign(id_a, &pool); // parked
+    check(registry.getLoads()[0].mbps == 0, name, "parked session does not load the device");
+    registry.acquire(&owner_b, -1, id_b);
+    check(registry.admit(id_b, mbps), name, "another stream takes the capacity");
+    registry.reassign(id_a, &owner_a); // leased by a new stream
+    check(!registry.admit(id_a, mbps) && registry.getLoads()[0].mbps == mbps, name, "pooled session readmitted: refused at capacity");
+    registry.release(id_b);
+    check(registry.admit(id_a, mbps) && registry.getLoads()[0].mbps == mbps, name, "pooled session readmitted once there's capacity");
+    registry.release(id_a);
+}
+
+int main(int argc, char **argcv)
+{
+    if (argc < 2)
+    {
+        std::cout << argcv[0] << " needs an integer argument.  Second interger argument (optional) is verbosity" << std::endl;
+    }
+    else
+    {
+
+        if (argc > 2)
+        { // choose verbosity
+            switch (atoi(argcv[2]))
+            {
+            case (0): // shut up
+                ffmpeg_av_log_set_level(0);
+                fatal_log_all();
+                break;
+            case (1): // normal
+                break;
+            case (2): // more verbose
+                ffmpeg_av_log_set_level(100);
+                debug_log_all();
+                break;
+            case (3): // extremely verbose
+                ffmpeg_av_log_set_level(100);
+                crazy_log_all();
+                break;
+            default:
+                std::cout << "Unknown verbosity level " << atoi(argcv[2]) << std::endl;
+                exit(1);
+                break;
+            }
+        }
+
+        switch (atoi(argcv[1]))
+        { // choose test
+        case (1):
+            test_1();
+            break;
+        case (2):
+            test_2();
+            break;
+        case (3):
+            test_3();
+            break;
+        case (4):
+            test_4();
+            break;
+        case (5):
+            test_5();
+            break;
+        case (6):
+            test_6();
+            break;
+        case (7):
+            test_7();
+            break;
+        case (8):
+            test_8();
+            break;
+        case (9):
+            test_9();
+            break;
+        case (10):
+            test_10();
+            break;
+        case (11):
+            test_11();
+            break;
+        case (12):
+            test_12();
+            break;
+        case (13):
+            test_13();
+            break;
+        case (14):
+            test_14();
+            break;
+        case (15):
+            test_15();
+            break;
+        case (16):
+            test_16();
+            break;
+        case (17):
+            test_17();
+            break;
+        case (18):
+            test_18();
+            break;
+        case (19):
+            test_19();
+            break;
+        case (20):
+            test_20();
+            break;
+        case (21):
+            test_21();
+            break;
+        case (22):
+            test_22();
+            break;
+        case (23):
+            test_23();
+            break;
+        case (24):
+            test_24();
+            break;
+        case (25):
+            test_25();
+            break;
+        default:
+            std::cout << "No such test " << argcv[1] << " for " << argcv[0] << std::endl;
+        }
+    }
+    return (failures > 0);
+}